@@ -0,0 +1,38 @@
+/**
+ * @file Benchmark.h
+ * @brief On-target Serializer Benchmark for ESP32 Power Monitor
+ *
+ * Compares the allocation-free telemetry serializer with the previous
+ * ArduinoJson + String path on the same inputs:
+ * - Message size in bytes (and whether both outputs are identical)
+ * - CPU cycles per message (average and best case)
+ * - Heap operations per message (malloc/calloc/realloc/free), counted for
+ *   the calling task only; needs the esp32dev_bench environment, which
+ *   wraps the allocator at link time
+ *
+ * A second part prints the bytes per MQTT PUBLISH of the telemetry topics
+ * as 3.1.1 and as MQTT 5 (first message of a connection, which sets up
+ * the topic alias, and every later one), plus the bytes per message
+ * actually sent since boot.
+ *
+ * Run with the "bench [N]" serial command. Nothing is published.
+ */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/**
+ * @brief Run the telemetry serializer benchmark and print the results
+ * @param iterations Messages serialized per path and message kind
+ */
+void runTelemetryBenchmark(uint32_t iterations);
+
+/**
+ * @brief Print the bytes per PUBLISH under MQTT 3.1.1 and MQTT 5
+ */
+void runPublishSizeBenchmark();
+
+#endif // BENCHMARK_H
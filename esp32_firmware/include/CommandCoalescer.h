@@ -0,0 +1,100 @@
+/**
+ * @file CommandCoalescer.h
+ * @brief Inbound Command Coalescing for ESP32 Power Monitor
+ *
+ * A dashboard slider sends dozens of sim/set messages per second. Applying
+ * each one rewrites the LEDC duty and triggers a status publish, although
+ * only the last value matters:
+ * - The first command of a channel is applied at once
+ * - Commands arriving within COMMAND_COALESCE_MS of the last applied one
+ *   only replace the pending value; it is applied when the window ends
+ * - So a drag costs at most one output update per window and channel, and
+ *   the final position is always applied
+ *
+ * Switch commands are not coalesced: they are not continuous, and OFF must
+ * never wait.
+ */
+
+#ifndef COMMAND_COALESCER_H
+#define COMMAND_COALESCER_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/**
+ * @enum SimulatorUnit
+ * @brief How a simulator level is expressed
+ */
+enum SimulatorUnit : uint8_t {
+    SIM_UNIT_PERCENT,           // 0-100
+    SIM_UNIT_PERMILLE,          // 0-1000
+    SIM_UNIT_DUTY               // Raw LEDC duty
+};
+
+/**
+ * @struct CoalescerStats
+ * @brief Command counters since boot
+ */
+struct CoalescerStats {
+    uint32_t received;          // Commands submitted
+    uint32_t applied;           // Commands written to the output
+    uint32_t coalesced;         // Commands replaced by a newer one before being applied
+};
+
+/**
+ * @class CommandCoalescer
+ * @brief Latest-wins simulator commands per channel
+ */
+class CommandCoalescer {
+public:
+    CommandCoalescer();
+
+    /**
+     * @brief Set a simulator level, now or when the channel's window ends
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param unit Unit of value
+     * @param value Level
+     * @param now millis()
+     * @return true if applied now, false if deferred to the end of the window
+     */
+    bool submitSimulator(uint8_t channel, SimulatorUnit unit, uint32_t value, uint32_t now);
+
+    /**
+     * @brief Apply pending commands whose window has ended (call in loop)
+     * @param now millis()
+     */
+    void loop(uint32_t now);
+
+    /**
+     * @brief Drop a pending command, e.g. when a fade or regulation takes over
+     * @param channel Channel number
+     */
+    void cancel(uint8_t channel);
+
+    /**
+     * @brief Get command counters
+     */
+    CoalescerStats getStats() { return _stats; }
+
+private:
+    /**
+     * @struct Slot
+     * @brief Pending command of one channel
+     */
+    struct Slot {
+        bool pending;
+        SimulatorUnit unit;
+        uint32_t value;
+        uint32_t lastApplied;   // millis() of the last applied command
+    };
+
+    Slot _slots[NUM_CHANNELS];
+    CoalescerStats _stats;
+
+    void apply(uint8_t channel, SimulatorUnit unit, uint32_t value, uint32_t now);
+};
+
+// Global instance
+extern CommandCoalescer commandCoalescer;
+
+#endif // COMMAND_COALESCER_H
@@ -0,0 +1,117 @@
+/**
+ * @file CommandRpc.h
+ * @brief Command Responses with Correlation IDs for ESP32 Power Monitor
+ *
+ * Control topics stay fire-and-forget unless a JSON command carries an
+ * "id" (string or integer). Such a command is answered on .../response
+ * with the same id, the result, the state after handling and the handling
+ * latency, so the backend can confirm an action in milliseconds instead of
+ * waiting for the next status publish.
+ *
+ * Flow for one inbound message (all in the MQTT callback):
+ * - received() stamps the arrival time
+ * - the handler parses the payload and calls open(); failure paths call
+ *   reply() with the reason
+ * - finish() answers RPC_OK if the handler did not reply itself
+ *
+ * Plain-text payloads ("ON", "42") have no id and never get a response.
+ */
+
+#ifndef COMMAND_RPC_H
+#define COMMAND_RPC_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config.h"
+
+/**
+ * @enum RpcResult
+ * @brief Outcome reported in a response
+ */
+enum RpcResult : uint8_t {
+    RPC_OK,                     // Applied; "state" shows the result
+    RPC_ACCEPTED,               // Queued, applied within COMMAND_COALESCE_MS (sim/set bursts)
+    RPC_REJECTED,               // Valid, but refused by the channel (fault, disabled)
+    RPC_INVALID,                // Malformed or out of range, nothing changed
+    RPC_UNKNOWN,                // Unknown command
+    RPC_RESULT_COUNT
+};
+
+/**
+ * @brief Get the name of a result ("ok", "accepted", ...)
+ */
+const char* rpcResultName(RpcResult result);
+
+/**
+ * @struct RpcStats
+ * @brief Response counters since boot
+ */
+struct RpcStats {
+    uint32_t requests;                  // Commands that carried an id
+    uint32_t results[RPC_RESULT_COUNT]; // Responses per result
+    uint32_t badIds;                    // Ids too long or not a string/integer (no response)
+    uint32_t failed;                    // Responses that could not be queued
+    uint32_t lastUs;                    // Handling latency of the last command (receive -> reply)
+    uint32_t averageUs;                 // Mean handling latency
+    uint32_t maxUs;                     // Highest handling latency
+};
+
+/**
+ * @class CommandRpc
+ * @brief Correlates one inbound command with its response
+ */
+class CommandRpc {
+public:
+    CommandRpc();
+
+    /**
+     * @brief Mark the arrival of an inbound message (before parsing)
+     */
+    void received();
+
+    /**
+     * @brief Start a response if the command carries an id
+     * @param doc Parsed payload
+     * @param command Command name echoed in the response
+     * @param channel Channel the command acts on, 0 for all channels
+     * @return true if a response will be sent
+     */
+    bool open(JsonVariantConst doc, const char* command, uint8_t channel = 0);
+
+    /**
+     * @brief Check whether the current command expects a response
+     */
+    bool isOpen() const { return _open; }
+
+    /**
+     * @brief Send the response of the current command (no-op if none is open)
+     * @param result Outcome
+     * @param error Optional error type (as on .../error)
+     * @param message Optional human-readable reason
+     */
+    void reply(RpcResult result, const char* error = nullptr, const char* message = nullptr);
+
+    /**
+     * @brief Answer RPC_OK if the handler did not reply (call after dispatch)
+     */
+    void finish();
+
+    /**
+     * @brief Get response counters
+     */
+    RpcStats getStats() const { return _stats; }
+
+private:
+    bool _open;
+    char _id[RPC_ID_MAX_LENGTH + 1];    // Serialized id, echoed verbatim
+    char _command[24];
+    uint8_t _channel;
+    int64_t _receivedUs;
+
+    RpcStats _stats;
+};
+
+// Global instance
+extern CommandRpc commandRpc;
+
+#endif // COMMAND_RPC_H
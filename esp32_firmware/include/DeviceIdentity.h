@@ -0,0 +1,160 @@
+/**
+ * @file DeviceIdentity.h
+ * @brief Runtime Device Identity and MQTT Topic Table for ESP32 Power Monitor
+ *
+ * One firmware image serves every device:
+ * - The device ID is chosen at boot: provisioned in NVS, else DEVICE_ID,
+ *   else derived from the factory MAC (see config.h)
+ * - Every topic the device publishes or subscribes to is built once from it
+ *   into a single static arena; callers refer to topics by handle
+ *   (DeviceTopic, or channelTopic() for per-channel topics) and get a
+ *   pointer into the arena, so publishing never formats or allocates
+ *
+ * A new ID stored with setId() takes effect after a restart: topics and the
+ * MQTT client ID are never rebuilt while running.
+ */
+
+#ifndef DEVICE_IDENTITY_H
+#define DEVICE_IDENTITY_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/**
+ * @enum DeviceTopic
+ * @brief Device-wide topics (devices/<id><suffix>)
+ */
+enum DeviceTopic : uint8_t {
+    TOPIC_TELEMETRY,            // MQTT_TOPIC_TELEMETRY
+    TOPIC_TELEMETRY_BIN,
+    TOPIC_TELEMETRY_BATCH,
+    TOPIC_TELEMETRY_REPLAY,
+    TOPIC_STATUS,               // Also the last will topic
+    TOPIC_CHANNEL_STATUS,
+    TOPIC_ERROR,
+    TOPIC_POWER,
+    TOPIC_HEARTBEAT,
+    TOPIC_HEARTBEAT_LINK,
+    TOPIC_HEARTBEAT_COMMANDS,
+    TOPIC_EVENTS,
+    TOPIC_SCHEDULE,
+    TOPIC_RESPONSE,
+    TOPIC_SHADOW,
+    TOPIC_SHADOW_DELTA,
+    TOPIC_CONTROL,              // Subscribed
+    TOPIC_SWITCH_SET,           // Subscribed
+    TOPIC_SHADOW_DESIRED,       // Subscribed
+    TOPIC_SHADOW_GET,           // Subscribed
+    DEVICE_TOPIC_COUNT
+};
+
+/**
+ * @enum ChannelTopic
+ * @brief Per-channel topics (devices/<id>/chN<suffix>)
+ */
+enum ChannelTopic : uint8_t {
+    CH_TOPIC_TELEMETRY,         // MQTT_CH_TELEMETRY
+    CH_TOPIC_TELEMETRY_BIN,
+    CH_TOPIC_STATUS,
+    CH_TOPIC_PWM,
+    CH_TOPIC_REGULATION,
+    CH_TOPIC_SWITCH_SET,        // Subscribed
+    CH_TOPIC_SIM_SET,           // Subscribed
+    CHANNEL_TOPIC_COUNT
+};
+
+// Topic handle: a DeviceTopic, or channelTopic(channel, kind)
+typedef uint16_t TopicHandle;
+
+#define TOPIC_HANDLE_COUNT  (DEVICE_TOPIC_COUNT + NUM_CHANNELS * CHANNEL_TOPIC_COUNT)
+
+/**
+ * @brief Get the handle of a per-channel topic
+ * @param channel Channel number (1..NUM_CHANNELS)
+ * @param kind Topic of the channel
+ */
+inline TopicHandle channelTopic(uint8_t channel, ChannelTopic kind) {
+    return DEVICE_TOPIC_COUNT + (channel - 1) * CHANNEL_TOPIC_COUNT + kind;
+}
+
+/**
+ * @enum DeviceIdSource
+ * @brief Where the device ID came from
+ */
+enum DeviceIdSource : uint8_t {
+    DEVICE_ID_FROM_NVS,         // Provisioned
+    DEVICE_ID_FROM_CONFIG,      // DEVICE_ID
+    DEVICE_ID_FROM_MAC          // DEVICE_ID_PREFIX + MAC
+};
+
+/**
+ * @brief Get the name of an ID source ("nvs", "config", "mac")
+ */
+const char* deviceIdSourceName(DeviceIdSource source);
+
+/**
+ * @class DeviceIdentity
+ * @brief Device ID and prebuilt topic strings
+ */
+class DeviceIdentity {
+public:
+    DeviceIdentity();
+
+    /**
+     * @brief Choose the device ID and build all topics (call once, early in setup())
+     */
+    void begin();
+
+    /**
+     * @brief Get the device ID (also the MQTT client ID)
+     */
+    const char* id() const { return _id; }
+
+    /**
+     * @brief Get where the device ID came from
+     */
+    DeviceIdSource getSource() const { return _source; }
+
+    /**
+     * @brief Get the topic prefix of this device ("devices/<id>")
+     */
+    const char* baseTopic() const { return _base; }
+
+    /**
+     * @brief Get a topic
+     * @param handle DeviceTopic or channelTopic()
+     * @return NUL-terminated topic, valid for the lifetime of the program
+     */
+    const char* topic(TopicHandle handle) const;
+
+    /**
+     * @brief Get the arena bytes used by the ID and topics
+     */
+    size_t arenaUsed() const { return _used; }
+
+    /**
+     * @brief Store a device ID in NVS (used from the next boot on)
+     * @param id New ID, nullptr or "" to erase the stored one
+     * @return false if the ID is invalid or could not be stored
+     */
+    bool setId(const char* id);
+
+    /**
+     * @brief Check that an ID can be used in topics and as client ID
+     */
+    static bool isValidId(const char* id);
+
+private:
+    const char* _id;
+    const char* _base;
+    DeviceIdSource _source;
+    uint16_t _offsets[TOPIC_HANDLE_COUNT];
+    size_t _used;
+
+    const char* append(const char* a, const char* b = "", const char* c = "");
+};
+
+// Global instance
+extern DeviceIdentity deviceIdentity;
+
+#endif // DEVICE_IDENTITY_H
@@ -0,0 +1,149 @@
+/**
+ * @file DeviceShadow.h
+ * @brief Versioned Device Shadow for ESP32 Power Monitor
+ *
+ * One document holds the channel state:
+ * - reported: what the outputs are doing (switch, simulator %, fault),
+ *   written by the device
+ * - desired: what the backend asked for on .../shadow/desired and the
+ *   device could not apply yet (e.g. ON while the channel is faulted)
+ *
+ * Every change gets the next version and is published as a delta on
+ * .../shadow/delta (only the changed fields). The full document is
+ * published retained on .../shadow when the broker connection comes up,
+ * on .../shadow/get, and at most every SHADOW_SNAPSHOT_INTERVAL while it
+ * changes, so nothing is republished while the state is stable. A
+ * subscriber that sees a version gap asks for the full document.
+ *
+ * Desired updates carry the backend's own version. The backend publishes
+ * them retained, so one sent while the device was offline arrives on
+ * reconnect; the last applied version and its pending fields are kept in
+ * NVS, so a repeated or older version is ignored also after a reboot. A
+ * newer desired version replaces all pending fields. Pending fields are retried on reconnect and whenever the
+ * reported state changes, and leave the document once reported matches.
+ *
+ * Versions only increase, also across reboots: blocks of
+ * SHADOW_VERSION_RESERVE are reserved in NVS, so versions skip ahead after
+ * a reboot instead of being reused.
+ */
+
+#ifndef DEVICE_SHADOW_H
+#define DEVICE_SHADOW_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config.h"
+#include "LoadController.h"
+#include "CommandRpc.h"
+
+/**
+ * @struct ShadowStats
+ * @brief Shadow versions and counters since boot
+ */
+struct ShadowStats {
+    uint32_t version;           // Current document version
+    uint32_t desiredVersion;    // Last desired version accepted from the backend
+    uint16_t pendingMask;       // Channels with desired fields not applied yet
+    uint32_t deltas;            // Deltas published
+    uint32_t documents;         // Full documents published
+    uint32_t desiredUpdates;    // Desired updates accepted
+    uint32_t staleDesired;      // Desired updates ignored (version not newer)
+};
+
+/**
+ * @class DeviceShadow
+ * @brief Reported/desired channel state with versioned deltas
+ */
+class DeviceShadow {
+public:
+    DeviceShadow();
+
+    /**
+     * @brief Load the version counters and pending desired fields from NVS (call once in setup())
+     */
+    void begin();
+
+    /**
+     * @brief A broker session started: retry pending fields, publish the full document
+     */
+    void onConnected();
+
+    /**
+     * @brief Publish a delta if the reported state changed (call when state changed)
+     */
+    void update();
+
+    /**
+     * @brief Refresh the retained document if it is out of date (call in loop)
+     * @param now millis()
+     */
+    void loop(uint32_t now);
+
+    /**
+     * @brief Apply a desired update from the backend
+     *
+     *   {"version": 7, "ch1": {"switch": true, "simulator": 40}, "ch2": {"switch": false}}
+     *
+     * @param doc Parsed payload
+     * @return RPC_OK if applied (or stale, nothing to do), RPC_REJECTED if
+     *         fields stay pending, RPC_INVALID if malformed
+     */
+    RpcResult applyDesired(JsonVariantConst doc);
+
+    /**
+     * @brief Publish the full document now (retained)
+     */
+    void publishDocument();
+
+    /**
+     * @brief Get versions and counters
+     */
+    ShadowStats getStats() const;
+
+private:
+    /**
+     * @struct Reported
+     * @brief Reported state of one channel
+     */
+    struct Reported {
+        bool switchOn;
+        uint8_t simulator;          // %
+        FaultCode fault;
+    };
+
+    /**
+     * @struct Desired
+     * @brief Pending desired fields of one channel
+     */
+    struct Desired {
+        uint8_t fields;             // SHADOW_FIELD_* bits still to apply
+        bool switchOn;
+        uint8_t simulator;
+    };
+
+    Reported _reported[NUM_CHANNELS];   // As last published
+    Desired _desired[NUM_CHANNELS];
+    bool _reportedValid;                // _reported holds a published state
+    bool _published;                    // The full document was published in this session
+    bool _desiredChanged;               // Pending fields changed since the last publish
+
+    uint32_t _version;
+    uint32_t _versionLimit;             // First version not reserved in NVS yet
+    uint32_t _desiredVersion;
+    uint32_t _documentVersion;          // Version of the last full document
+    uint32_t _lastDocument;             // millis() of the last full document
+
+    ShadowStats _stats;
+
+    bool reconcile();
+    void readReported(Reported reported[]) const;
+    void nextVersion();
+    void saveVersions();
+    void saveDesired();
+    void addDesired(JsonObject parent) const;
+};
+
+// Global instance
+extern DeviceShadow deviceShadow;
+
+#endif // DEVICE_SHADOW_H
@@ -0,0 +1,126 @@
+/**
+ * @file EventLog.h
+ * @brief Persistent Event Log for ESP32 Power Monitor
+ *
+ * Append-only ring of fixed-size records in the "eventlog" flash partition:
+ * - Faults, trips, fault clears, reboots and configuration changes
+ * - Survives reboots and broker outages
+ * - Each record written once into erased flash (FlashRing); a sector is
+ *   erased only when the ring wraps into it (one erase per 256 records)
+ * - Random access by sequence number for paging over MQTT
+ */
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "FlashRing.h"
+
+/**
+ * @enum EventType
+ * @brief Kind of logged event
+ */
+enum EventType : uint8_t {
+    EVENT_REBOOT = 1,       // code = esp_reset_reason_t
+    EVENT_TRIP,             // code = FaultCode, value = measured value
+    EVENT_WARNING,          // code = FaultCode, value = measured value
+    EVENT_FAULT_CLEAR,      // code = FaultCode that was cleared
+    EVENT_CONFIG,           // code = ConfigItem, value = new value
+    EVENT_SHED,             // code = SafetyEventType, value = total power (W)
+    EVENT_TYPE_COUNT
+};
+
+/**
+ * @enum ConfigItem
+ * @brief Configuration setting recorded by EVENT_CONFIG
+ */
+enum ConfigItem : uint8_t {
+    CONFIG_ITEM_NONE = 0,
+    CONFIG_ITEM_SCHEDULE,   // value = number of rules on the channel
+    CONFIG_ITEM_RESTORE_POLICY, // value = RestorePolicy
+    CONFIG_ITEM_POWER_BUDGET,   // channel 0: value = budget (W); channel N: value = priority
+    CONFIG_ITEM_TELEMETRY_FORMAT, // value = TelemetryFormat
+    CONFIG_ITEM_TELEMETRY_BATCH,  // value = samples per message, 0 = batching off
+    CONFIG_ITEM_COUNT
+};
+
+/**
+ * @struct EventRecord
+ * @brief One log record as stored in flash (16 bytes)
+ */
+struct EventRecord {
+    uint32_t seq;           // Sequence number (slot = seq % capacity)
+    uint32_t timestamp;     // millis() when logged
+    float value;            // Associated value
+    uint8_t type;           // EventType
+    uint8_t channel;        // Channel number (0 = system)
+    uint8_t code;           // Type-specific code
+    uint8_t crc;            // CRC-8 of the preceding 15 bytes
+};
+
+static_assert(sizeof(EventRecord) == 16, "EventRecord must be 16 bytes");
+
+/**
+ * @brief Get the name of an event type (e.g. "TRIP")
+ */
+const char* eventTypeName(uint8_t type);
+
+/**
+ * @class EventLog
+ * @brief Flash-backed ring buffer of EventRecords
+ */
+class EventLog {
+public:
+    /**
+     * @brief Constructor
+     */
+    EventLog();
+
+    /**
+     * @brief Locate the partition and recover the write position
+     * @return true if the log is usable
+     */
+    bool begin();
+
+    /**
+     * @brief Append a record
+     * @param type Event type
+     * @param channel Channel number (0 = system)
+     * @param code Type-specific code
+     * @param value Associated value
+     * @return true if written
+     */
+    bool append(EventType type, uint8_t channel, uint8_t code, float value = 0);
+
+    /**
+     * @brief Read a record by sequence number
+     * @param seq Sequence number
+     * @param record Destination for the record
+     * @return true if the record exists and is intact
+     */
+    bool read(uint32_t seq, EventRecord& record);
+
+    /**
+     * @brief Sequence number of the oldest record still stored
+     */
+    uint32_t getOldestSeq() { return _ring.getOldestSeq(); }
+
+    /**
+     * @brief Sequence number the next record will get
+     */
+    uint32_t getNextSeq() { return _ring.getNextSeq(); }
+
+    /**
+     * @brief Number of record slots in the partition
+     */
+    uint32_t getCapacity() { return _ring.getCapacity(); }
+
+private:
+    FlashRing _ring;
+};
+
+// Global instance
+extern EventLog eventLog;
+
+#endif // EVENT_LOG_H
@@ -0,0 +1,111 @@
+/**
+ * @file FlashRing.h
+ * @brief Append-only Flash Record Ring for ESP32 Power Monitor
+ *
+ * Fixed-size records in a data partition, shared by the event log and the
+ * telemetry store:
+ * - Every record starts with a uint32_t sequence number (slot = seq %
+ *   capacity) and carries a CRC-8 of the bytes before its crc field
+ * - Each record written once into erased flash; records never straddle a
+ *   sector and a sector is erased only when the ring wraps into it
+ * - begin() recovers the write position from the first slot of every
+ *   sector and skips slots left half-written by a power loss
+ */
+
+#ifndef FLASH_RING_H
+#define FLASH_RING_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include "config.h"
+
+#define FLASH_RING_MAX_RECORD   64      // Largest record size (bytes)
+
+/**
+ * @class FlashRing
+ * @brief Sequence-numbered, CRC-checked record ring in flash
+ */
+class FlashRing {
+public:
+    /**
+     * @brief Constructor
+     * @param name Name used in log messages (e.g. "Event log")
+     * @param recordSize Size of one record (at most FLASH_RING_MAX_RECORD)
+     * @param crcOffset Offset of the CRC-8 byte; it covers the bytes before it
+     * @param sectorSize Flash erase unit
+     */
+    FlashRing(const char* name, size_t recordSize, size_t crcOffset, uint32_t sectorSize);
+
+    /**
+     * @brief Take over a partition and recover the write position
+     * @param partition Partition (formatted if it holds no valid record)
+     * @return true if the ring is usable
+     */
+    bool begin(const esp_partition_t* partition);
+
+    /**
+     * @brief Append a record, erasing the next sector when entering it
+     * @param record Record; its sequence number and CRC are filled in here
+     * @return true if written (the sequence number is used up either way)
+     */
+    bool append(void* record);
+
+    /**
+     * @brief Read a record by sequence number
+     * @param seq Sequence number
+     * @param record Destination (recordSize bytes)
+     * @return true if the record is still stored and intact
+     */
+    bool read(uint32_t seq, void* record);
+
+    /**
+     * @brief Overwrite bytes of a stored record in place
+     *
+     * Flash only clears bits without an erase, so this is meant for flag
+     * bytes outside the CRC (e.g. 0xFF -> 0x00).
+     */
+    bool write(uint32_t seq, size_t offset, const void* data, size_t length);
+
+    /**
+     * @brief Whether begin() found the partition usable
+     */
+    bool isOpen() { return _partition != nullptr; }
+
+    /**
+     * @brief Sequence number of the oldest record still stored
+     */
+    uint32_t getOldestSeq() { return _oldestSeq; }
+
+    /**
+     * @brief Sequence number the next record will get
+     */
+    uint32_t getNextSeq() { return _nextSeq; }
+
+    /**
+     * @brief Number of record slots in the partition
+     */
+    uint32_t getCapacity() { return _capacity; }
+
+    /**
+     * @brief Compute CRC-8/MAXIM
+     */
+    static uint8_t crc8(const uint8_t* data, size_t length);
+
+private:
+    const char* _name;
+    const esp_partition_t* _partition;
+    size_t _recordSize;
+    size_t _crcOffset;
+    uint32_t _sectorSize;
+    uint32_t _recordsPerSector;
+    uint32_t _capacity;
+    uint32_t _nextSeq;
+    uint32_t _oldestSeq;
+
+    uint32_t slotAddress(uint32_t slot);
+    bool readSlot(uint32_t slot, void* record);
+    bool isValid(const void* record, uint32_t slot);
+    bool isErased(uint32_t slot);
+};
+
+#endif // FLASH_RING_H
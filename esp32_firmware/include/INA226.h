@@ -66,8 +66,25 @@
 #define INA226_MODE_SHUNT_BUS_CONT  0x0007
 
 // Default Configuration
+// Mask/Enable register bits
+#define INA226_MASK_CVRF            0x0008  // Conversion ready (cleared by reading Mask/Enable)
+
 #define INA226_DEFAULT_CONFIG       (INA226_AVG_16 | INA226_VBUS_1100US | INA226_VSHUNT_1100US | INA226_MODE_SHUNT_BUS_CONT)
 
+// Fixed register scale (datasheet); current/power scale depends on calibration
+#define INA226_BUS_VOLTAGE_LSB      0.00125 // V per bus voltage count
+#define INA226_POWER_LSB_FACTOR     25      // Power LSB = 25 * Current LSB
+
+/**
+ * @struct INA226Raw
+ * @brief Result registers as read from the device
+ */
+struct INA226Raw {
+    uint16_t busVoltage;    // x INA226_BUS_VOLTAGE_LSB = V
+    int16_t current;        // x Current LSB = A (0 if not calibrated)
+    uint16_t power;         // x Power LSB = W (0 if not calibrated)
+};
+
 /**
  * @class INA226
  * @brief Class for interfacing with INA226 power monitor
@@ -185,6 +202,31 @@ public:
      * @return true if read successful
      */
     bool readAll(float *voltage, float *current, float *power);
+
+    /**
+     * @brief Read all values and keep the raw register contents
+     * @param voltage Pointer to store bus voltage (V)
+     * @param current Pointer to store current (A)
+     * @param power Pointer to store power (W)
+     * @param raw Receives the registers the values were computed from
+     * @return true if read successful
+     */
+    bool readAll(float *voltage, float *current, float *power, INA226Raw *raw);
+
+    /**
+     * @brief Current register LSB (A per count, 0 if not calibrated)
+     */
+    float getCurrentLSB() { return _currentLSB; }
+
+    /**
+     * @brief Check for a completed conversion since the last call
+     *
+     * Reads the Mask/Enable register, which clears the flag: only one
+     * caller should poll it.
+     *
+     * @return true if new results are available
+     */
+    bool conversionReady();
     
 private:
     uint8_t _address;
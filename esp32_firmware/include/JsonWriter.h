@@ -0,0 +1,106 @@
+/**
+ * @file JsonWriter.h
+ * @brief Allocation-free JSON Writer for ESP32 Power Monitor
+ *
+ * Appends a flat or nested JSON object straight into a caller-owned buffer:
+ * - No heap allocation, no intermediate document or String temporaries
+ * - Numbers written as fixed-point from integer arithmetic (no printf/dtoa)
+ * - Overflow is sticky: finish() returns 0 instead of a truncated message
+ *
+ * Meant for the hot, fixed-format messages (telemetry); everything else
+ * keeps using ArduinoJson.
+ */
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <Arduino.h>
+
+/**
+ * @class JsonWriter
+ * @brief Streams JSON members into a fixed buffer
+ */
+class JsonWriter {
+public:
+    /**
+     * @brief Start writing at the beginning of a buffer
+     * @param buffer Destination (also receives the terminating NUL)
+     * @param size Size of destination
+     */
+    JsonWriter(char* buffer, size_t size);
+
+    /**
+     * @brief Open an object (top level or array element when key is nullptr)
+     */
+    JsonWriter& beginObject(const char* key = nullptr);
+
+    /**
+     * @brief Close the innermost object
+     */
+    JsonWriter& endObject();
+
+    /**
+     * @brief Open an array member (nested array when key is nullptr)
+     */
+    JsonWriter& beginArray(const char* key);
+
+    /**
+     * @brief Close the innermost array
+     */
+    JsonWriter& endArray();
+
+    /**
+     * @brief Add an unsigned integer member (array element when key is nullptr)
+     */
+    JsonWriter& add(const char* key, uint32_t value);
+
+    /**
+     * @brief Add a 64-bit unsigned integer member (e.g. Unix microseconds)
+     */
+    JsonWriter& addUInt64(const char* key, uint64_t value);
+
+    /**
+     * @brief Add a string member (value must not need escaping)
+     */
+    JsonWriter& add(const char* key, const char* value);
+
+    /**
+     * @brief Add a number with a fixed number of decimals
+     *
+     * Rounds half away from zero like String(value, decimals). Values that
+     * do not fit 32 bits once scaled, and NaN/inf, are written as null.
+     *
+     * @param key Member name (nullptr inside an array)
+     * @param value Value
+     * @param decimals Digits after the decimal point (0-6)
+     */
+    JsonWriter& addFixed(const char* key, float value, uint8_t decimals);
+
+    /**
+     * @brief Round a value for an ArduinoJson document
+     *
+     * Same rounding as addFixed(), done in double so ArduinoJson prints at
+     * most `decimals` digits without a String(value, decimals) temporary.
+     */
+    static double fixed(float value, uint8_t decimals);
+
+    /**
+     * @brief Terminate the buffer
+     * @return Length of the message, 0 if it did not fit
+     */
+    size_t finish();
+
+private:
+    char* _buffer;
+    size_t _size;
+    size_t _length;
+    bool _overflow;
+    bool _needComma;
+
+    void putChar(char c);
+    void putRaw(const char* text);
+    void putKey(const char* key);
+    void putUInt(uint32_t value, uint8_t minDigits = 1);
+};
+
+#endif // JSON_WRITER_H
@@ -1,30 +1,126 @@
 /**
  * @file LoadController.h
  * @brief Load Control Module for ESP32 Power Monitor
- * 
- * Manages MOSFET control for both channels including:
+ *
+ * Manages MOSFET control for all channels including:
  * - Main switch control (ON/OFF)
  * - Fault simulator control (PWM)
  * - Safety protection
+ *
+ * Channel state lives in a fixed-capacity array indexed by channel number,
+ * so every access is O(1) and nothing is allocated after begin().
+ *
+ * Simulator levels are kept in permille and LEDC counts; frequency and
+ * resolution of each simulator can be changed at runtime.
+ *
+ * Switch, simulator, PWM and fault state is mirrored into RTC memory on
+ * every change (and into NVS once it settles), so begin() can bring the
+ * outputs back within the first milliseconds after a reset.
+ *
+ * Simulator fades run on the LEDC hardware fade unit: a linear fade costs
+ * no CPU until its completion interrupt, shaped curves are chained from
+ * FADE_CURVE_SEGMENTS linear hardware segments.
+ *
+ * All public methods are thread-safe: the protection task may shut a
+ * channel down while loop() is handling commands.
  */
 
 #ifndef LOAD_CONTROLLER_H
 #define LOAD_CONTROLLER_H
 
 #include <Arduino.h>
+#include <driver/ledc.h>
 #include "config.h"
 
+static_assert(NUM_CHANNELS >= 1 && NUM_CHANNELS <= MAX_CHANNELS,
+              "NUM_CHANNELS must be between 1 and MAX_CHANNELS");
+
+/**
+ * @enum FaultCode
+ * @brief Reason a channel was shut down
+ */
+enum FaultCode : uint8_t {
+    FAULT_NONE = 0,         // No fault
+    FAULT_OVERCURRENT,      // Current above OVERCURRENT_THRESHOLD
+    FAULT_OVERVOLTAGE,      // Voltage above OVERVOLTAGE_THRESHOLD
+    FAULT_UNDERVOLTAGE,     // Voltage below UNDERVOLTAGE_THRESHOLD
+    FAULT_MANUAL,           // Shutdown requested by operator
+    FAULT_CODE_COUNT
+};
+
+/**
+ * @brief Get the static message for a fault code
+ * @param code Fault code
+ * @return Message string (never nullptr)
+ */
+const char* faultCodeMessage(FaultCode code);
+
+/**
+ * @brief Get the unit of the value attached to a fault code
+ * @param code Fault code
+ * @return Unit string ("A", "V" or "")
+ */
+const char* faultCodeUnit(FaultCode code);
+
+/**
+ * @enum FadeCurve
+ * @brief Shape of a simulator fade
+ */
+enum FadeCurve : uint8_t {
+    FADE_LINEAR = 0,        // Constant rate (single hardware fade)
+    FADE_EASE_IN,           // Slow start (quadratic)
+    FADE_EASE_OUT,          // Slow finish (quadratic)
+    FADE_EASE_IN_OUT,       // Slow start and finish (smoothstep)
+    FADE_CURVE_COUNT
+};
+
+/**
+ * @brief Parse a curve name ("linear", "ease_in", "ease_out", "ease_in_out")
+ * @param name Curve name (nullptr = linear)
+ * @param curve Receives the curve
+ * @return true if the name is known
+ */
+bool parseFadeCurve(const char* name, FadeCurve& curve);
+
+/**
+ * @enum RestorePolicy
+ * @brief Output state applied by begin()
+ */
+enum RestorePolicy : uint8_t {
+    RESTORE_LAST = 0,       // State before the reset (RTC memory, else NVS)
+    RESTORE_ALL_OFF,        // All switches OFF
+    RESTORE_DEFAULT,        // Per-channel default switch state
+    RESTORE_POLICY_COUNT
+};
+
+/**
+ * @brief Get the name of a restore policy ("last", "off", "default")
+ */
+const char* restorePolicyName(RestorePolicy policy);
+
+/**
+ * @brief Parse a restore policy name
+ * @param name Policy name
+ * @param policy Receives the policy
+ * @return true if the name is known
+ */
+bool parseRestorePolicy(const char* name, RestorePolicy& policy);
+
 /**
  * @struct ChannelState
- * @brief Structure to hold channel state information
+ * @brief Compact per-channel state record
  */
 struct ChannelState {
+    uint32_t lastFaultTime; // Timestamp of last fault
+    uint32_t simDuty;       // Simulator duty in LEDC counts (0..2^pwmResolution)
+    uint32_t pwmFrequency;  // Simulator PWM frequency (Hz)
+    float faultValue;       // Measured value that raised the fault
+    uint16_t simPermille;   // Simulator level (0-1000)
+    uint8_t simValue;       // Simulator level (0-100%, rounded)
+    uint8_t pwmResolution;  // Simulator PWM resolution (bits)
+    FaultCode faultCode;    // FAULT_NONE if no fault
     bool mainSwitch;        // Main switch state (ON/OFF)
-    uint8_t simValue;       // Simulator PWM value (0-100%)
-    uint8_t simPWM;         // Actual PWM value (0-255)
-    bool fault;             // Fault flag
-    String faultReason;     // Fault reason
-    unsigned long lastFaultTime; // Timestamp of last fault
+    bool fading;            // Simulator fade in progress (simValue = start value)
 };
 
 /**
@@ -37,146 +133,377 @@ public:
      * @brief Constructor
      */
     LoadController();
-    
+
     /**
      * @brief Initialize the load controller
      */
     void begin();
-    
+
     /**
      * @brief Set main switch state for a channel
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @param state Switch state (true = ON, false = OFF)
      * @return true if successful
      */
     bool setSwitch(uint8_t channel, bool state);
-    
+
+    /**
+     * @brief Set main switches of several channels at the same instant
+     *
+     * All channels are validated first; if any is disabled or (when turned
+     * ON) faulted, nothing is changed. Otherwise all outputs are driven by
+     * one GPIO set/clear register write, so the edges land together.
+     *
+     * @param mask Channels to change (bit N-1 = channel N)
+     * @param states New states for the channels in mask (bit set = ON)
+     * @param rejected Optional: receives the channels that failed validation
+     * @return true if all channels were switched
+     */
+    bool setSwitches(uint16_t mask, uint16_t states, uint16_t* rejected = nullptr);
+
     /**
      * @brief Get main switch state for a channel
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @return Switch state
      */
     bool getSwitchState(uint8_t channel);
-    
+
     /**
      * @brief Toggle main switch for a channel
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @return New switch state
      */
     bool toggleSwitch(uint8_t channel);
-    
+
     /**
      * @brief Set simulator value for a channel (0-100%)
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @param value Percentage value (0-100)
      * @return true if successful
      */
     bool setSimulator(uint8_t channel, uint8_t value);
-    
+
     /**
      * @brief Get simulator value for a channel
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @return Simulator percentage value (0-100)
      */
     uint8_t getSimulatorValue(uint8_t channel);
-    
+
+    /**
+     * @brief Set simulator level with 0.1% steps
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param permille Level (0-1000)
+     * @return true if successful
+     */
+    bool setSimulatorPermille(uint8_t channel, uint16_t permille);
+
+    /**
+     * @brief Set simulator duty in raw LEDC counts
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param duty Duty (0..2^resolution, 2^resolution = always on)
+     * @return true if successful
+     */
+    bool setSimulatorDuty(uint8_t channel, uint32_t duty);
+
+    /**
+     * @brief Set simulator duty from a control loop
+     *
+     * Like setSimulatorDuty(), but without logging and without marking the
+     * channel changed, so it can run at the sensor rate; the level shows up
+     * on chN/regulation and in the status sent with the next state change.
+     *
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param duty Duty (0..2^resolution)
+     * @return true if successful
+     */
+    bool driveSimulatorDuty(uint8_t channel, uint32_t duty);
+
+    /**
+     * @brief Change simulator PWM frequency and resolution
+     *
+     * The duty is rescaled so the output level is kept, and the new timer
+     * settings and duty are loaded while the timer is paused, so no runt
+     * pulse is produced.
+     *
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param frequency PWM frequency (Hz)
+     * @param resolution Duty resolution in bits (0 = highest possible)
+     * @return true if applied
+     */
+    bool setPWMConfig(uint8_t channel, uint32_t frequency, uint8_t resolution = 0);
+
+    /**
+     * @brief Highest duty resolution LEDC supports at a frequency
+     * @param frequency PWM frequency (Hz)
+     * @return Resolution in bits (0 if the frequency is out of range)
+     */
+    static uint8_t maxPWMResolution(uint32_t frequency);
+
+    /**
+     * @brief Fade simulator to a new value on the LEDC hardware
+     *
+     * Returns immediately. When the fade ends the new value is stored and
+     * the channel is marked changed, so the next status update reports it.
+     * setSimulator() cancels a running fade.
+     *
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param value Target percentage (0-100)
+     * @param durationMs Fade time (ms, up to FADE_MAX_DURATION)
+     * @param curve Fade shape
+     * @return true if the fade was started
+     */
+    bool fadeSimulator(uint8_t channel, uint8_t value, uint32_t durationMs,
+                       FadeCurve curve = FADE_LINEAR);
+
+    /**
+     * @brief Check if a simulator fade is running
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @return true while fading
+     */
+    bool isFading(uint8_t channel);
+
+    /**
+     * @brief Handle fade completions signalled by the LEDC interrupt
+     *
+     * Starts the next segment of shaped fades and finalizes finished ones.
+     * Call from loop(); does nothing when no fade ended.
+     */
+    void loop();
+
     /**
      * @brief Emergency shutdown for a channel
-     * @param channel Channel number (1 or 2)
-     * @param reason Reason for shutdown
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param code Reason for shutdown
+     * @param value Measured value that caused the shutdown
      */
-    void emergencyShutdown(uint8_t channel, const char* reason);
-    
+    void emergencyShutdown(uint8_t channel, FaultCode code, float value = 0);
+
     /**
      * @brief Emergency shutdown for all channels
-     * @param reason Reason for shutdown
+     * @param code Reason for shutdown
+     * @param value Measured value that caused the shutdown
      */
-    void emergencyShutdownAll(const char* reason);
-    
+    void emergencyShutdownAll(FaultCode code, float value = 0);
+
     /**
      * @brief Clear fault for a channel
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      */
     void clearFault(uint8_t channel);
-    
+
     /**
      * @brief Check if channel has fault
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @return true if fault present
      */
     bool hasFault(uint8_t channel);
-    
+
+    /**
+     * @brief Get fault code for a channel
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @return Fault code (FAULT_NONE if no fault or invalid channel)
+     */
+    FaultCode getFaultCode(uint8_t channel);
+
     /**
      * @brief Get fault reason for a channel
-     * @param channel Channel number (1 or 2)
-     * @return Fault reason string
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @return Static fault message
      */
-    String getFaultReason(uint8_t channel);
-    
+    const char* getFaultReason(uint8_t channel);
+
     /**
-     * @brief Get channel state
-     * @param channel Channel number (1 or 2)
-     * @return Pointer to channel state (nullptr if invalid channel)
+     * @brief Format fault reason with its value (e.g. "Overcurrent: 3.62A")
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param buffer Destination buffer
+     * @param size Size of destination buffer
+     * @return Number of characters written
      */
-    ChannelState* getChannelState(uint8_t channel);
-    
+    size_t formatFaultReason(uint8_t channel, char* buffer, size_t size);
+
+    /**
+     * @brief Get a consistent copy of a channel state
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param state Destination for the state
+     * @return true if channel is valid
+     */
+    bool getChannelState(uint8_t channel, ChannelState& state);
+
     /**
      * @brief Enable or disable a channel
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @param enabled Enable state
      */
     void setChannelEnabled(uint8_t channel, bool enabled);
-    
+
+    /**
+     * @brief Check if a channel is enabled
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @return true if enabled
+     */
+    bool isChannelEnabled(uint8_t channel);
+
     /**
      * @brief Check if channel state changed since last check
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @return true if state changed
      */
     bool hasStateChanged(uint8_t channel);
-    
+
     /**
      * @brief Clear state changed flag
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      */
     void clearStateChanged(uint8_t channel);
-    
+
+    /**
+     * @brief Get changed flags of all channels (bit N-1 = channel N)
+     * @return Bitmask of changed channels
+     */
+    uint16_t getChangedMask();
+
+    /**
+     * @brief Set what begin() does with the outputs after a reset (stored in NVS)
+     * @param policy Restore policy
+     * @param defaultMask RESTORE_DEFAULT: channels switched ON (bit N-1 = channel N)
+     * @return true if stored
+     */
+    bool setRestorePolicy(RestorePolicy policy, uint16_t defaultMask);
+
+    /**
+     * @brief Get the active restore policy
+     */
+    RestorePolicy getRestorePolicy() { return _restorePolicy; }
+
+    /**
+     * @brief Get the default switch mask used by RESTORE_DEFAULT
+     */
+    uint16_t getDefaultMask() { return _defaultMask; }
+
+    /**
+     * @brief Where the boot state came from ("rtc", "nvs" or "none")
+     */
+    const char* getRestoreSource() { return _restoreSource; }
+
+    /**
+     * @brief Check if a channel number is valid
+     * @param channel Channel number
+     * @return true if 1 <= channel <= NUM_CHANNELS
+     */
+    static bool isValidChannel(uint8_t channel) {
+        return channel >= 1 && channel <= NUM_CHANNELS;
+    }
+
+    /**
+     * @brief Bitmask with one bit per existing channel
+     */
+    static uint16_t allChannelsMask() {
+        return (uint16_t)((1UL << NUM_CHANNELS) - 1);
+    }
+
 private:
-    ChannelState _channel1;
-    ChannelState _channel2;
-    bool _channel1Enabled;
-    bool _channel2Enabled;
-    bool _channel1Changed;
-    bool _channel2Changed;
-    
     /**
-     * @brief Get pin for main switch
+     * @brief Progress of a running fade
+     */
+    struct FadeState {
+        uint32_t startDuty;     // Duty when the fade started
+        uint32_t targetDuty;    // Final duty
+        uint16_t targetPermille;// Final level
+        uint16_t segmentMs;     // Duration of each segment
+        uint8_t segment;        // Segments started so far
+        uint8_t segments;       // Total segments
+        FadeCurve curve;
+    };
+
+    ChannelState _channels[NUM_CHANNELS];
+    FadeState _fades[NUM_CHANNELS];
+    volatile uint16_t _fadeDoneMask;    // Set from the LEDC ISR
+    uint16_t _enabledMask;
+    uint16_t _changedMask;
+    uint16_t _defaultMask;
+    RestorePolicy _restorePolicy;
+    const char* _restoreSource;
+    bool _statePending;             // RTC mirror newer than NVS copy
+    uint32_t _stateChangedAt;
+    SemaphoreHandle_t _mutex;
+    StaticSemaphore_t _mutexBuffer;
+
+    /**
+     * @brief Acquire the state mutex (recursive)
+     */
+    void lock();
+
+    /**
+     * @brief Release the state mutex
+     */
+    void unlock();
+
+    /**
+     * @brief Mark channel as changed (caller holds the lock)
      */
-    uint8_t getMainSwitchPin(uint8_t channel);
-    
+    void markChanged(uint8_t channel);
+
     /**
-     * @brief Get pin for simulator
+     * @brief Load saved state according to the restore policy
      */
-    uint8_t getSimulatorPin(uint8_t channel);
-    
+    void restoreState();
+
     /**
-     * @brief Get PWM channel for simulator
+     * @brief Mirror the state into RTC memory (caller holds the lock)
      */
-    uint8_t getPWMChannel(uint8_t channel);
-    
+    void saveState();
+
+    /**
+     * @brief Write the mirrored state to NVS
+     */
+    void flushState();
+
     /**
      * @brief Apply main switch state to hardware
      */
     void applyMainSwitch(uint8_t channel);
-    
+
     /**
      * @brief Apply simulator PWM to hardware
      */
     void applySimulator(uint8_t channel);
-    
+
+    /**
+     * @brief Start the next hardware segment of a fade (caller holds the lock)
+     * @return false if the hardware refused the fade
+     */
+    bool startFadeSegment(uint8_t channel);
+
+    /**
+     * @brief Stop a running fade, keeping the current duty (caller holds the lock)
+     */
+    void stopFade(uint8_t channel);
+
+    /**
+     * @brief LEDC fade-end interrupt callback
+     */
+    static bool onFadeEnd(const ledc_cb_param_t* param, void* arg);
+
+    /**
+     * @brief Duty at the end of segment 'segment' of a fade
+     */
+    static uint32_t fadeDuty(const FadeState& fade, uint8_t segment);
+
+    /**
+     * @brief Store a new simulator level and apply it (caller holds the lock)
+     */
+    void storeSimulator(uint8_t channel, uint16_t permille, uint32_t duty);
+
+    /**
+     * @brief Convert permille to duty counts at a resolution
+     */
+    static uint32_t permilleToDuty(uint16_t permille, uint8_t resolution);
+
     /**
-     * @brief Convert percentage to PWM value
+     * @brief Convert duty counts at a resolution to permille
      */
-    uint8_t percentToPWM(uint8_t percent);
+    static uint16_t dutyToPermille(uint32_t duty, uint8_t resolution);
 };
 
 // Global instance
@@ -7,6 +7,20 @@
  * - Topic subscriptions
  * - Message publishing
  * - Message callbacks
+ *
+ * Telemetry is written with JsonWriter into one reused transmit buffer:
+ * no heap allocation or String temporaries on the per-second path. It can
+ * also (or instead) be sent as a packed binary record of the raw sensor
+ * registers, see TelemetryPacket.h.
+ *
+ * Publishes are queued by priority class and sent from loop() within a
+ * byte budget (PublishQueue.h), so an error is never stuck behind telemetry.
+ *
+ * The broker connection (MqttClient.h) is non-blocking: connecting,
+ * reconnecting with backoff and sending never stall the main loop.
+ *
+ * Topics are addressed by handle (DeviceIdentity.h); the strings are built
+ * once at boot from the device ID.
  */
 
 #ifndef MQTT_MANAGER_H
@@ -14,12 +28,41 @@
 
 #include <Arduino.h>
 #include <WiFi.h>
-#include <PubSubClient.h>
 #include <ArduinoJson.h>
 #include "config.h"
+#include "MqttClient.h"
+#include "DeviceIdentity.h"
+#include "INA226.h"
+#include "TelemetryPacket.h"
+#include "TelemetryBatcher.h"
+#include "PublishQueue.h"
+#include "TelemetryStore.h"
+
+/**
+ * @enum TelemetryFormat
+ * @brief Encodings published every telemetry interval (bit set)
+ */
+enum TelemetryFormat : uint8_t {
+    TELEMETRY_FORMAT_JSON = 1,      // .../telemetry
+    TELEMETRY_FORMAT_BINARY = 2,    // .../telemetry/bin
+    TELEMETRY_FORMAT_BOTH = 3
+};
+
+/**
+ * @brief Get the name of a telemetry format ("json", "binary", "both")
+ */
+const char* telemetryFormatName(TelemetryFormat format);
+
+/**
+ * @brief Parse a telemetry format name
+ * @param name Format name
+ * @param format Destination for the format
+ * @return true if the name is known
+ */
+bool parseTelemetryFormat(const char* name, TelemetryFormat& format);
 
 // Callback function type for received messages
-typedef void (*MQTTMessageCallback)(const char* topic, const char* payload);
+typedef void (*MQTTMessageCallback)(const char* topic, const char* payload, size_t length);
 
 /**
  * @class MQTTManager
@@ -34,14 +77,14 @@ public:
     
     /**
      * @brief Initialize MQTT manager
-     * @param wifiClient Reference to WiFiClient
      * @return true if initialization successful
      */
-    bool begin(WiFiClient& wifiClient);
+    bool begin();
     
     /**
-     * @brief Connect to MQTT broker
-     * @return true if connected
+     * @brief Start connecting to the MQTT broker (returns at once,
+     *        loop() completes the connection)
+     * @return true if already connected
      */
     bool connect();
     
@@ -75,57 +118,205 @@ public:
     bool subscribe(const char* topic);
     
     /**
-     * @brief Publish message to topic
-     * @param topic Topic to publish to
+     * @brief Queue a message for publishing
+     *
+     * Sent from loop() in priority order. Only critical messages (error,
+     * power) are accepted while disconnected; they go out after reconnecting.
+     *
+     * @param topic Topic to publish to (DeviceTopic or channelTopic())
      * @param payload Message payload
      * @param retained Whether to retain message
-     * @return true if publish successful
+     * @return true if queued
      */
-    bool publish(const char* topic, const char* payload, bool retained = false);
+    bool publish(TopicHandle topic, const char* payload, bool retained = false);
+    
+    /**
+     * @brief Publish a payload of known length (no strlen)
+     * @param topic Topic to publish to (DeviceTopic or channelTopic())
+     * @param payload Message payload
+     * @param length Payload length in bytes
+     * @param retained Whether to retain message
+     * @return true if queued
+     */
+    bool publish(TopicHandle topic, const char* payload, size_t length, bool retained);
     
     /**
      * @brief Publish JSON document to topic
-     * @param topic Topic to publish to
+     * @param topic Topic to publish to (DeviceTopic or channelTopic())
      * @param doc JSON document
      * @param retained Whether to retain message
      * @return true if publish successful
      */
-    bool publishJson(const char* topic, JsonDocument& doc, bool retained = false);
+    bool publishJson(TopicHandle topic, JsonDocument& doc, bool retained = false);
+    
+    /**
+     * @brief Write the telemetry message of one channel
+     * @param buffer Destination buffer
+     * @param size Size of destination buffer
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param voltage Bus voltage (V)
+     * @param current Load current (A)
+     * @param power Load power (W)
+     * @param timestamp millis() of the message
+     * @param timeUs Unix time of the sample (us), 0 = not synced (omitted)
+     * @return Message length, 0 if it did not fit
+     */
+    static size_t formatTelemetry(char* buffer, size_t size, uint8_t channel, float voltage,
+                                  float current, float power, uint32_t timestamp, uint64_t timeUs);
+    
+    /**
+     * @brief Write the combined telemetry message of all channels
+     * @param buffer Destination buffer
+     * @param size Size of destination buffer
+     * @param voltage Per-channel voltages (index 0 = Channel 1)
+     * @param current Per-channel currents
+     * @param power Per-channel powers
+     * @param count Number of channels
+     * @param timestamp millis() of the message
+     * @param timeUs Unix time of the samples (us), 0 = not synced (omitted)
+     * @return Message length, 0 if it did not fit
+     */
+    static size_t formatAllTelemetry(char* buffer, size_t size, const float voltage[],
+                                     const float current[], const float power[],
+                                     uint8_t count, uint32_t timestamp, uint64_t timeUs);
     
     /**
      * @brief Publish telemetry data for a channel
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @param voltage Bus voltage (V)
      * @param current Load current (A)
      * @param power Load power (W)
+     * @param timeUs Unix time of the sample (us), 0 = not synced
      * @return true if publish successful
      */
-    bool publishTelemetry(uint8_t channel, float voltage, float current, float power);
+    bool publishTelemetry(uint8_t channel, float voltage, float current, float power,
+                          uint64_t timeUs);
     
     /**
      * @brief Publish combined telemetry for all channels
-     * @param voltage1 Channel 1 voltage
-     * @param current1 Channel 1 current
-     * @param power1 Channel 1 power
-     * @param voltage2 Channel 2 voltage
-     * @param current2 Channel 2 current
-     * @param power2 Channel 2 power
+     * @param voltage Per-channel voltages (index 0 = Channel 1)
+     * @param current Per-channel currents
+     * @param power Per-channel powers
+     * @param count Number of channels
+     * @param timeUs Unix time of the samples (us), 0 = not synced
+     * @return true if publish successful
+     */
+    bool publishAllTelemetry(const float voltage[], const float current[],
+                             const float power[], uint8_t count, uint64_t timeUs);
+    
+    /**
+     * @brief Write a binary telemetry message (TelemetryPacket.h)
+     * @param buffer Destination buffer
+     * @param size Size of destination buffer
+     * @param firstChannel Channel number of raw[0]
+     * @param raw Per-channel result registers
+     * @param valid Per-channel sensor present flags
+     * @param count Number of channels
+     * @param currentLSB A per current count
+     * @param timestamp millis() of the message
+     * @param timeUs Unix time of the samples (us), 0 = not synced (no time record)
+     * @return Message length, 0 if it did not fit
+     */
+    static size_t formatTelemetryBinary(uint8_t* buffer, size_t size, uint8_t firstChannel,
+                                        const INA226Raw raw[], const bool valid[], uint8_t count,
+                                        float currentLSB, uint32_t timestamp, uint64_t timeUs);
+    
+    /**
+     * @brief Publish binary telemetry of one channel on chN/telemetry/bin
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param raw Result registers
+     * @param valid Sensor present
+     * @param currentLSB A per current count
+     * @param timeUs Unix time of the sample (us), 0 = not synced
+     * @return true if publish successful
+     */
+    bool publishTelemetryBinary(uint8_t channel, const INA226Raw& raw, bool valid, float currentLSB,
+                                uint64_t timeUs);
+    
+    /**
+     * @brief Publish binary telemetry of all channels on telemetry/bin
+     * @param raw Per-channel result registers (index 0 = Channel 1)
+     * @param valid Per-channel sensor present flags
+     * @param count Number of channels
+     * @param currentLSB A per current count
+     * @param timeUs Unix time of the samples (us), 0 = not synced
      * @return true if publish successful
      */
-    bool publishAllTelemetry(float voltage1, float current1, float power1,
-                             float voltage2, float current2, float power2);
+    bool publishAllTelemetryBinary(const INA226Raw raw[], const bool valid[], uint8_t count,
+                                   float currentLSB, uint64_t timeUs);
+    
+    /**
+     * @brief Publish the buffered samples on telemetry/batch
+     *
+     * Sends one message when the batch fits the transmit buffer, otherwise
+     * splits it into as few self-contained messages as needed.
+     *
+     * @param batcher Samples to publish (left unchanged)
+     * @return true if every message was published
+     */
+    bool publishTelemetryBatch(const TelemetryBatcher& batcher);
+    
+    /**
+     * @brief Publish buffered samples on telemetry/replay
+     *
+     * Sends one message with as many of the samples as fit.
+     *
+     * @param samples Oldest waiting samples
+     * @param count Number of samples
+     * @param remaining Samples waiting after these
+     * @return Number of samples published (0 on failure)
+     */
+    uint8_t publishTelemetryReplay(const StoredSample samples[], uint8_t count, uint32_t remaining);
+    
+    /**
+     * @brief Select the telemetry encodings (stored in NVS)
+     * @param format Encodings to publish
+     * @return true if valid
+     */
+    bool setTelemetryFormat(TelemetryFormat format);
+    
+    /**
+     * @brief Get the selected telemetry encodings
+     */
+    TelemetryFormat getTelemetryFormat() { return _telemetryFormat; }
     
     /**
      * @brief Publish channel status
-     * @param channel Channel number (1 or 2)
+     * @param channel Channel number (1..NUM_CHANNELS)
      * @param switchState Main switch state
      * @param simValue Simulator PWM value (0-100)
+     * @param fading Simulator fade in progress
+     * @return true if publish successful
+     */
+    bool publishChannelStatus(uint8_t channel, bool switchState, uint8_t simValue,
+                              bool fading = false);
+    
+    /**
+     * @brief Publish simulator PWM settings of a channel
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param frequency PWM frequency (Hz)
+     * @param resolution Duty resolution (bits)
+     * @param duty Duty in LEDC counts
+     * @param permille Simulator level (0-1000)
+     * @return true if publish successful
+     */
+    bool publishPWMConfig(uint8_t channel, uint32_t frequency, uint8_t resolution,
+                          uint32_t duty, uint16_t permille);
+    
+    /**
+     * @brief Publish status of all channels in one message
+     * @param switchState Per-channel switch states (index 0 = Channel 1)
+     * @param simValue Per-channel simulator values (0-100)
+     * @param count Number of channels
+     * @param changedMask Channels that changed since the last update
+     * @param fadingMask Channels with a simulator fade in progress
      * @return true if publish successful
      */
-    bool publishChannelStatus(uint8_t channel, bool switchState, uint8_t simValue);
+    bool publishAllStatus(const bool switchState[], const uint8_t simValue[],
+                          uint8_t count, uint16_t changedMask, uint16_t fadingMask = 0);
     
     /**
-     * @brief Publish device status (online/offline)
+     * @brief Publish device status (online/offline, time sync quality)
      * @param online Whether device is online
      * @return true if publish successful
      */
@@ -142,12 +333,43 @@ public:
     bool publishError(uint8_t channel, const char* errorType, const char* message, float value = 0);
     
     /**
-     * @brief Publish heartbeat message
+     * @brief Publish a load shedding action
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param action "dim", "off" or "restore"
+     * @param level Simulator level after the action (permille)
+     * @param totalPower Total power when the action was taken (W)
+     * @param budget Power budget (W)
+     * @return true if publish successful
+     */
+    bool publishPowerEvent(uint8_t channel, const char* action, uint16_t level,
+                           float totalPower, float budget);
+    
+    /**
+     * @brief Publish one heartbeat section
+     * @param section TOPIC_HEARTBEAT, TOPIC_HEARTBEAT_LINK or TOPIC_HEARTBEAT_COMMANDS
      * @param uptime System uptime in seconds
      * @param freeHeap Free heap memory
+     * @param doc Message with the caller's members; the common fields are
+     *            added here (filled in place, no copy of the nested stats)
      * @return true if publish successful
      */
-    bool publishHeartbeat(unsigned long uptime, uint32_t freeHeap);
+    bool publishHeartbeat(DeviceTopic section, unsigned long uptime, uint32_t freeHeap,
+                          JsonDocument& doc);
+    
+    /**
+     * @brief Publish the device shadow (see DeviceShadow)
+     * @param doc Document or delta; device_id and timestamps are added here
+     * @param full true for the full document (retained), false for a delta
+     * @return true if publish successful
+     */
+    bool publishShadow(JsonDocument& doc, bool full);
+    
+    /**
+     * @brief Publish a command response (see CommandRpc)
+     * @param doc Response; device_id and timestamps are added here
+     * @return true if publish successful
+     */
+    bool publishResponse(JsonDocument& doc);
     
     /**
      * @brief Subscribe to all control topics
@@ -161,16 +383,58 @@ public:
      */
     const char* getLastError();
     
+    /**
+     * @brief Get the outbound queue counters of a priority class
+     */
+    PublishClassStats getPublishStats(PublishPriority priority) { return _queue.getStats(priority); }
+    
+    /**
+     * @brief Get the bytes the publish budget currently allows
+     */
+    int32_t getPublishTokens() { return _queue.getTokens(); }
+    
+    /**
+     * @brief Get the connection state counters of the client
+     */
+    MqttClientStats getClientStats();
+
+    /**
+     * @brief MQTT 5 properties a message of this rule is published with
+     *        (expiry, payload format, content type)
+     */
+    static MqttPublishProperties publishProperties(const PublishRule& rule);
+    
+    /**
+     * @brief Get the connection state of the client
+     */
+    MqttState getClientState() { return _client.getState(); }
+    
+#if MQTT_USE_TLS
+    /**
+     * @brief Get TLS handshake counters (full vs resumed)
+     */
+    TlsStats getTlsStats() const { return _client.getTlsStats(); }
+#endif
+    
 private:
-    PubSubClient* _mqttClient;
+    MqttClient _client;
     MQTTMessageCallback _userCallback;
     char _lastError[128];
-    unsigned long _lastReconnectAttempt;
+    bool _online;                       // Session seen as established by loop()
+    char _txBuffer[MQTT_BUFFER_SIZE];   // Reused by the telemetry publishers
+    TelemetryFormat _telemetryFormat;
+    PublishQueue _queue;                // Every publish goes through here
     
     /**
      * @brief Internal callback for MQTT messages
      */
-    static void mqttCallback(char* topic, byte* payload, unsigned int length);
+    static void mqttCallback(const char* topic, const char* payload, size_t length);
+    
+    /**
+     * @brief Write one queued message to the client
+     */
+    static PublishSendResult sendQueued(const char* topic, const uint8_t* payload, size_t length,
+                                        bool retained, const PublishRule& rule);
     
     /**
      * @brief Set last error message
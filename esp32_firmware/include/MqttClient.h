@@ -0,0 +1,360 @@
+/**
+ * @file MqttClient.h
+ * @brief Non-blocking MQTT 5 / 3.1.1 Client for ESP32 Power Monitor
+ *
+ * Replaces PubSubClient, whose connect() blocks through DNS, TCP and
+ * CONNACK. Everything here is driven from loop() and never waits on the
+ * network:
+ * - Connection state machine: backoff -> DNS -> TCP -> CONNACK -> connected
+ * - Asynchronous DNS (lwIP callback) with a cached address, reused when
+ *   the resolver fails
+ * - Non-blocking socket connect, send and receive (partial writes are kept
+ *   in a transmit buffer, packets are reassembled incrementally)
+ * - Exponential reconnect backoff with jitter, so devices of one site do
+ *   not retry in lockstep after a broker outage
+ * - Keepalive (PINGREQ) and dead-connection detection
+ * - QoS 1 publish: a bounded window of unacknowledged messages is kept and
+ *   resent with DUP after a reconnect; ack round-trip times are measured
+ * - Optional TLS (MQTT_USE_TLS): non-blocking handshake between TCP connect
+ *   and CONNECT, resuming the last session where the broker allows it
+ * - MQTT 5 (MQTT_PROTOCOL_V5) with fallback to 3.1.1, see below
+ *
+ * Supports what the firmware uses: QoS 0/1 publish, QoS 0/1 receive,
+ * subscribe, last will, username/password.
+ *
+ * MQTT 5: the first attempt offers protocol level 5. A broker that refuses
+ * it (CONNACK "unacceptable protocol version") gets 3.1.1 for the rest of
+ * the boot; a handshake that ends without any CONNACK switches the level
+ * for the next attempt, and the level that last worked is kept. Under 5:
+ * - QoS 0 topics get a topic alias on their first publish of a connection
+ *   and are sent with an empty topic after that (up to the broker's Topic
+ *   Alias Maximum). QoS 1 messages keep the full topic: their copies may be
+ *   resent on a later connection, where the aliases start over
+ * - Publish properties: message expiry, payload format and content type
+ *   (MqttPublishProperties)
+ * - The broker's Receive Maximum and Maximum Packet Size are respected;
+ *   its Server Keep Alive replaces ours, and publishes are downgraded to
+ *   its Maximum QoS and lose the retain flag if Retain Available is 0
+ * Encoded PUBLISH bytes are counted against what 3.1.1 would have needed
+ * for the same messages (MqttClientStats::publishBytesV311).
+ */
+
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "TlsTransport.h"
+
+struct ip_addr;
+
+/**
+ * @enum MqttState
+ * @brief Connection state
+ */
+enum MqttState : uint8_t {
+    MQTT_STATE_IDLE,            // Not started / disconnected on request
+    MQTT_STATE_BACKOFF,         // Waiting before the next attempt
+    MQTT_STATE_RESOLVING,       // DNS lookup in progress
+    MQTT_STATE_CONNECTING,      // TCP connect in progress
+    MQTT_STATE_TLS,             // TLS handshake in progress (MQTT_USE_TLS)
+    MQTT_STATE_HANDSHAKE,       // CONNECT sent, waiting for CONNACK
+    MQTT_STATE_CONNECTED
+};
+
+/**
+ * @brief Get the name of a connection state (e.g. "backoff")
+ */
+const char* mqttStateName(MqttState state);
+
+/**
+ * @enum MqttSendResult
+ * @brief Outcome of handing a message to the client
+ */
+enum MqttSendResult : uint8_t {
+    MQTT_SEND_OK,               // Queued in the transmit buffer
+    MQTT_SEND_BUSY,             // Transmit buffer or QoS 1 window full, try again later
+    MQTT_SEND_FAILED            // Not connected or message too large
+};
+
+/**
+ * @struct MqttPublishProperties
+ * @brief MQTT 5 properties of one publish (not sent under 3.1.1)
+ */
+struct MqttPublishProperties {
+    uint32_t expiry;            // Message Expiry Interval (s), 0 = none
+    const char* contentType;    // Content Type, nullptr = none
+    bool utf8;                  // Payload Format Indicator: payload is UTF-8 text
+};
+
+/**
+ * @struct MqttClientStats
+ * @brief Connection counters
+ */
+struct MqttClientStats {
+    uint32_t attempts;          // Connection attempts since boot
+    uint32_t connects;          // Successful connections since boot
+    uint32_t dnsCacheHits;      // Attempts that reused the cached address
+    uint32_t backoffMs;         // Delay before the current/next attempt
+    int16_t lastError;          // Last failure (MQTT_ERR_*, CONNACK return/reason code)
+    uint16_t txQueued;          // Bytes waiting in the transmit buffer
+    uint8_t inFlight;           // QoS 1 messages waiting for PUBACK
+    uint32_t acked;             // QoS 1 messages acknowledged
+    uint32_t resent;            // QoS 1 messages resent after a reconnect
+    uint32_t expired;           // QoS 1 messages given up after MQTT_INFLIGHT_RESENDS
+    uint16_t rttLast;           // PUBACK round trip of the last message (ms)
+    uint16_t rttAverage;        // Smoothed PUBACK round trip (ms)
+    uint16_t rttMax;            // Worst PUBACK round trip (ms)
+    uint32_t refused;           // QoS 1 messages the broker acknowledged with an error (MQTT 5)
+    uint8_t protocol;           // Level of the current/last session: 5 or 4 (3.1.1)
+    uint8_t aliases;            // Topic aliases assigned in this session
+    uint16_t aliasMax;          // Topic aliases the broker allows (MQTT 5), 0 = none
+    uint32_t published;         // PUBLISH packets sent (first transmissions)
+    uint32_t publishBytes;      // Their encoded size
+    uint32_t publishBytesV311;  // Their size had they been encoded as 3.1.1
+};
+
+// Failure codes reported in MqttClientStats::lastError (CONNACK codes: 1-5 under
+// 3.1.1, reason codes 0x80 and up under MQTT 5)
+#define MQTT_ERR_NONE           0
+#define MQTT_ERR_DNS            -1
+#define MQTT_ERR_SOCKET         -2
+#define MQTT_ERR_CONNECT        -3
+#define MQTT_ERR_TIMEOUT        -4
+#define MQTT_ERR_PROTOCOL       -5
+#define MQTT_ERR_CLOSED         -6
+#define MQTT_ERR_KEEPALIVE      -7
+#define MQTT_ERR_ACK_TIMEOUT    -8
+#define MQTT_ERR_TLS            -9      // Handshake failed, see TlsStats::lastError
+
+// Receive callback: payload is NUL-terminated
+typedef void (*MqttMessageCallback)(const char* topic, const char* payload, size_t length);
+
+/**
+ * @class MqttClient
+ * @brief Single broker connection, polled from loop()
+ */
+class MqttClient {
+public:
+    MqttClient();
+
+    /**
+     * @brief Set broker address (host name or dotted IPv4)
+     */
+    void setServer(const char* host, uint16_t port);
+
+    /**
+     * @brief Set client identity, credentials (nullptr = none) and keepalive
+     */
+    void setIdentity(const char* clientId, const char* username, const char* password,
+                     uint16_t keepAlive);
+
+    /**
+     * @brief Set the last will message
+     */
+    void setWill(const char* topic, const char* message, uint8_t qos, bool retain);
+
+    /**
+     * @brief Set the receive callback
+     */
+    void setCallback(MqttMessageCallback callback) { _callback = callback; }
+
+    /**
+     * @brief Start connecting (no-op if already connecting or connected)
+     * @param now millis()
+     */
+    void start(uint32_t now);
+
+    /**
+     * @brief Advance the state machine, send and receive; never blocks
+     * @param now millis()
+     * @param networkUp Whether WiFi has an address (attempts wait otherwise)
+     */
+    void loop(uint32_t now, bool networkUp);
+
+    /**
+     * @brief Check whether the session is established
+     */
+    bool connected() const { return _state == MQTT_STATE_CONNECTED; }
+
+    /**
+     * @brief Get the connection state
+     */
+    MqttState getState() const { return _state; }
+
+    /**
+     * @brief Queue a publish
+     * @param topic Topic
+     * @param payload Message body
+     * @param length Body length
+     * @param retained Retain flag (dropped if the broker has no retain)
+     * @param qos 0 (fire and forget) or 1 (kept until the broker acknowledges
+     *            it), at most the broker's Maximum QoS
+     * @param properties MQTT 5 properties (nullptr = none; ignored under 3.1.1)
+     * @return MQTT_SEND_OK, MQTT_SEND_BUSY (buffer or window full) or MQTT_SEND_FAILED
+     */
+    MqttSendResult publish(const char* topic, const uint8_t* payload, size_t length, bool retained,
+                           uint8_t qos = 0, const MqttPublishProperties* properties = nullptr);
+
+    /**
+     * @brief Queue a subscription
+     * @param topic Topic filter
+     * @param qos Maximum QoS (0 or 1)
+     * @return true if queued
+     */
+    bool subscribe(const char* topic, uint8_t qos = 0);
+
+    /**
+     * @brief Send DISCONNECT (best effort) and close; stays idle until start()
+     */
+    void disconnect();
+
+    /**
+     * @brief Get connection counters
+     */
+    MqttClientStats getStats();
+
+    /**
+     * @brief Encoded size of a PUBLISH packet
+     * @param topicLength Topic length
+     * @param length Payload length
+     * @param qos 0 or 1
+     * @param protocol 4 (3.1.1) or 5
+     * @param properties MQTT 5 properties (nullptr = none)
+     * @param alias MQTT 5 topic alias (0 = none)
+     * @param aliasKnown The broker already has the alias: topic is sent empty
+     * @return Bytes on the wire, fixed header included
+     */
+    static size_t publishSize(size_t topicLength, size_t length, uint8_t qos, uint8_t protocol,
+                              const MqttPublishProperties* properties, uint16_t alias, bool aliasKnown);
+
+#if MQTT_USE_TLS
+    /**
+     * @brief Get TLS handshake counters
+     */
+    TlsStats getTlsStats() const { return _tls.getStats(); }
+#endif
+
+private:
+    // Configuration
+    const char* _host;
+    uint16_t _port;
+    const char* _clientId;
+    const char* _username;
+    const char* _password;
+    uint16_t _keepAlive;
+    const char* _willTopic;
+    const char* _willMessage;
+    uint8_t _willQos;
+    bool _willRetain;
+    MqttMessageCallback _callback;
+
+    // Connection
+    MqttState _state;
+    int _socket;
+    uint32_t _now;              // millis() passed to the last loop()
+    uint32_t _stateSince;       // millis() the current state was entered
+    uint32_t _backoff;          // Current backoff ceiling (ms)
+    uint32_t _retryAt;          // millis() of the next attempt (BACKOFF)
+    uint32_t _lastTx;           // millis() of the last packet sent
+    uint32_t _lastRx;           // millis() of the last packet received
+    bool _pingOutstanding;
+    uint16_t _nextPacketId;
+
+    // Protocol level (MQTT 5 or 3.1.1) and what the broker allows
+    uint8_t _protocol;          // Level offered by the current/next attempt
+    bool _v5Refused;            // Broker refused MQTT 5: 3.1.1 until reboot
+    uint8_t _inFlightLimit;     // QoS 1 window: MQTT_INFLIGHT_MAX or the broker's Receive Maximum
+    uint32_t _maxPacket;        // Broker's Maximum Packet Size, 0 = no limit
+    uint16_t _sessionKeepAlive; // Keep-alive in use (s): _keepAlive or the broker's Server Keep Alive
+    uint8_t _maxQos;            // Broker's Maximum QoS (0 or 1); publish() downgrades to it
+    bool _retainAvailable;      // Broker stores retained messages; publish() clears retain if not
+
+    // DNS (the lwIP callback runs in the TCP/IP task)
+    uint32_t _address;          // IPv4, network byte order, 0 = none
+    uint32_t _addressTime;      // millis() it was resolved
+    bool _refreshAddress;       // Connect failed: resolve again before reusing it
+    volatile bool _dnsDone;
+    volatile uint32_t _dnsResult;
+
+#if MQTT_USE_TLS
+    TlsTransport _tls;
+#endif
+
+    // Transmit buffer: packets not yet accepted by the socket
+    uint8_t _tx[MQTT_TX_BUFFER_SIZE];
+    size_t _txLength;
+
+    // Receive state: fixed header, remaining length, body
+    uint8_t _rx[MQTT_BUFFER_SIZE + 1];   // +1 for the payload NUL
+    uint8_t _rxHeader;
+    uint32_t _rxRemaining;      // Body length of the current packet
+    uint32_t _rxReceived;       // Body bytes received so far
+    uint8_t _rxLengthBytes;     // Remaining-length bytes read (0 = expecting header)
+    uint8_t _rxStage;           // 0 = header, 1 = length, 2 = body
+
+    /**
+     * @struct InFlight
+     * @brief One QoS 1 publish waiting for its PUBACK
+     */
+    struct InFlight {
+        uint16_t packetId;
+        uint16_t length;        // Encoded packet length in _inFlightData
+        uint32_t sentAt;        // millis() of the last (re)send
+        uint8_t resends;
+        uint8_t protocol;       // Level the packet was encoded for
+    };
+
+    // QoS 1 window, oldest first; packets stored back to back in the same order
+    InFlight _inFlight[MQTT_INFLIGHT_MAX];
+    uint8_t _inFlightCount;
+    uint8_t _inFlightData[MQTT_INFLIGHT_BYTES];
+    uint16_t _inFlightUsed;
+    uint32_t _rttSmoothed;      // ms << 3
+
+    /**
+     * @struct TopicAlias
+     * @brief Topic the broker knows by alias (index + 1) in this session
+     */
+    struct TopicAlias {
+        uint32_t hash;
+        uint16_t offset;        // Topic string in _aliasTopics
+        uint16_t length;
+    };
+
+    TopicAlias _aliases[MQTT_TOPIC_ALIAS_MAX];
+    uint8_t _aliasCount;
+    uint8_t _aliasLimit;        // min(MQTT_TOPIC_ALIAS_MAX, broker's Topic Alias Maximum)
+    char _aliasTopics[MQTT_TOPIC_ALIAS_BYTES];
+    uint16_t _aliasTopicsUsed;
+
+    MqttClientStats _stats;
+
+    void enterState(MqttState state);
+    void fail(int16_t error);
+    void beginResolve();
+    void finishResolve();
+    void beginConnect();
+    void pollConnect();
+    void beginSession();
+    void pollTls();
+    void sendConnect();
+    void closeSocket();
+    bool readConnack(uint32_t length);
+    uint16_t findAlias(const char* topic, size_t topicLength, uint32_t hash, bool& known);
+
+    ssize_t transportSend(const uint8_t* data, size_t length);
+    ssize_t transportReceive(uint8_t* buffer, size_t size);
+    uint8_t* reservePacket(uint8_t header, size_t remaining);
+    bool flushTx();
+    bool receive();
+    void handlePacket();
+    void acknowledge(uint16_t packetId);
+    void resendInFlight();
+    uint16_t nextPacketId();
+
+    static void dnsFound(const char* name, const struct ip_addr* address, void* arg);
+    static size_t encodeLength(uint8_t* out, size_t length);
+};
+
+#endif // MQTT_CLIENT_H
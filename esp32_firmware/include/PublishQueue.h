@@ -0,0 +1,182 @@
+/**
+ * @file PublishQueue.h
+ * @brief Outbound Publish Scheduler for ESP32 Power Monitor
+ *
+ * Every MQTT publish is queued here and sent from MQTTManager::loop():
+ * - Three priority classes: errors before status before telemetry
+ * - One byte ring per class, so a telemetry backlog never takes the room
+ *   of an error message
+ * - Per-topic rules: minimum interval between two messages of a topic and
+ *   "latest wins" for state topics (a queued message is replaced by a newer
+ *   one instead of both being sent)
+ * - Faults and status go out at QoS 1 (acknowledged), telemetry at QoS 0
+ * - MQTT 5 per topic: telemetry expires at the broker after
+ *   MQTT_TELEMETRY_EXPIRY, payloads are tagged JSON or binary
+ * - Token-bucket byte budget for status and telemetry; critical messages
+ *   are never held back by it, but still consume tokens
+ * - Queue depth and drop counters per class
+ */
+
+#ifndef PUBLISH_QUEUE_H
+#define PUBLISH_QUEUE_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/**
+ * @enum PublishPriority
+ * @brief Priority class of a topic (lower value is sent first)
+ */
+enum PublishPriority : uint8_t {
+    PUBLISH_CRITICAL = 0,       // error, power (shedding)
+    PUBLISH_STATUS,             // status, heartbeat, replies to commands
+    PUBLISH_TELEMETRY,          // telemetry (JSON, binary, batch)
+    PUBLISH_PRIORITY_COUNT
+};
+
+/**
+ * @brief Get the name of a priority class ("critical", "status", "telemetry")
+ */
+const char* publishPriorityName(PublishPriority priority);
+
+/**
+ * @struct PublishRule
+ * @brief How messages of a topic are scheduled
+ */
+struct PublishRule {
+    const char* suffix;         // Topic ending this rule applies to
+    PublishPriority priority;   // Class the message is queued in
+    uint16_t minInterval;       // Minimum time between two sends of one topic (ms)
+    bool latestOnly;            // A newer message replaces a queued one
+    uint8_t qos;                // MQTT QoS the message is published with
+    uint16_t expiry;            // MQTT 5 message expiry (s), 0 = kept until delivered
+    bool binary;                // Payload is not JSON (MQTT 5 content type)
+};
+
+/**
+ * @struct PublishClassStats
+ * @brief Counters of one priority class
+ */
+struct PublishClassStats {
+    uint16_t depth;             // Messages waiting
+    uint16_t bytes;             // Ring bytes in use
+    uint16_t capacity;          // Ring size (bytes)
+    uint32_t sent;              // Messages handed to the client
+    uint32_t droppedFull;       // Rejected because the ring was full
+    uint32_t superseded;        // Replaced by a newer message of the same topic
+    uint32_t droppedStale;      // Older than the class maximum age when due
+    uint32_t failed;            // Client refused the message
+};
+
+/**
+ * @enum PublishSendResult
+ * @brief What the client did with a message
+ */
+enum PublishSendResult : uint8_t {
+    PUBLISH_SENT,               // Accepted
+    PUBLISH_BUSY,               // No room right now: keep it queued
+    PUBLISH_FAILED              // Refused (not connected)
+};
+
+/**
+ * @brief Sends one message to the client, with QoS and properties from its rule
+ */
+typedef PublishSendResult (*PublishSendFn)(const char* topic, const uint8_t* payload, size_t length,
+                                           bool retained, const PublishRule& rule);
+
+/**
+ * @class PublishQueue
+ * @brief Priority queues with rate limits and a byte budget
+ */
+class PublishQueue {
+public:
+    PublishQueue();
+
+    /**
+     * @brief Queue a message
+     * @param topic Full topic
+     * @param payload Message body
+     * @param length Body length
+     * @param retained Retain flag
+     * @param now millis()
+     * @return true if queued
+     */
+    bool enqueue(const char* topic, const uint8_t* payload, size_t length, bool retained, uint32_t now);
+
+    /**
+     * @brief Send queued messages in priority order
+     * @param now millis()
+     * @param send Function that writes one message to the client
+     * @param ignoreBudget Send everything that is due (used before disconnecting)
+     * @return Number of messages sent
+     */
+    uint8_t drain(uint32_t now, PublishSendFn send, bool ignoreBudget = false);
+
+    /**
+     * @brief Drop all queued messages of all classes
+     */
+    void clear();
+
+    /**
+     * @brief Get the counters of a class
+     */
+    PublishClassStats getStats(PublishPriority priority);
+
+    /**
+     * @brief Bytes the budget currently allows (negative after critical bursts)
+     */
+    int32_t getTokens() { return _tokens; }
+
+    /**
+     * @brief Find the rule for a topic
+     */
+    static const PublishRule& ruleFor(const char* topic);
+
+private:
+    struct RecordHeader;
+
+    /**
+     * @struct Ring
+     * @brief Variable-length records of one class, FIFO
+     */
+    struct Ring {
+        uint8_t* data;
+        uint16_t capacity;
+        uint16_t head;          // Offset of the oldest record
+        uint16_t tail;          // Offset the next record is written at
+        uint16_t used;          // Bytes in use, including wrap padding
+        PublishClassStats stats;
+    };
+
+    /**
+     * @struct TopicClock
+     * @brief Last send time of a topic (rate limiting)
+     */
+    struct TopicClock {
+        uint32_t hash;
+        uint32_t lastSent;
+    };
+
+    Ring _rings[PUBLISH_PRIORITY_COUNT];
+    uint32_t _criticalData[PUBLISH_QUEUE_CRITICAL_BYTES / 4];
+    uint32_t _statusData[PUBLISH_QUEUE_STATUS_BYTES / 4];
+    uint32_t _telemetryData[PUBLISH_QUEUE_TELEMETRY_BYTES / 4];
+    TopicClock _clocks[PUBLISH_TOPIC_SLOTS];
+    int32_t _tokens;
+    uint32_t _lastRefill;
+
+    static uint32_t hashTopic(const char* topic);
+
+    bool append(Ring& ring, const char* topic, size_t topicLength, const uint8_t* payload,
+                size_t length, bool retained, uint32_t hash, uint32_t now);
+    bool nextRecord(const Ring& ring, uint16_t& pos, uint16_t& remaining, uint16_t& offset,
+                    RecordHeader& header);
+    void kill(Ring& ring, uint16_t offset, RecordHeader& header);
+    void supersede(Ring& ring, const char* topic, uint32_t hash);
+    void trimHead(Ring& ring);
+    void refill(uint32_t now);
+    bool rateLimited(uint32_t hash, uint16_t minInterval, uint32_t now);
+    void markSent(uint32_t hash, uint32_t now);
+};
+
+#endif // PUBLISH_QUEUE_H
@@ -0,0 +1,185 @@
+/**
+ * @file Regulator.h
+ * @brief Closed-loop Current / Power Regulation for ESP32 Power Monitor
+ *
+ * Holds a channel at a constant current or constant power by driving its
+ * simulator duty from the INA226 measurement:
+ * - PID run by the protection task on every new sensor conversion
+ * - Derivative on the measurement, low-pass filtered (no setpoint kick)
+ * - Anti-windup: the integrator stops while the output is saturated or
+ *   slew limited in the direction of the error
+ * - Output slew rate limit
+ * - Tracking error (instant and RMS) and settling time for tuning
+ *
+ * Regulation pauses while the main switch is OFF or the channel is
+ * faulted and resumes bumplessly from the current duty.
+ */
+
+#ifndef REGULATOR_H
+#define REGULATOR_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/**
+ * @enum RegulationMode
+ * @brief Quantity held at the setpoint
+ */
+enum RegulationMode : uint8_t {
+    REGULATION_OFF = 0,     // Open loop: simulator duty set directly
+    REGULATION_CURRENT,     // Constant current (A)
+    REGULATION_POWER,       // Constant power (W)
+    REGULATION_MODE_COUNT
+};
+
+/**
+ * @brief Get the name of a regulation mode ("off", "current", "power")
+ */
+const char* regulationModeName(RegulationMode mode);
+
+/**
+ * @brief Parse a regulation mode name
+ * @param name Mode name
+ * @param mode Destination for the mode
+ * @return true if the name is known
+ */
+bool parseRegulationMode(const char* name, RegulationMode& mode);
+
+/**
+ * @struct RegulatorGains
+ * @brief PID tuning of one channel
+ */
+struct RegulatorGains {
+    float kp;               // Output per unit of error
+    float ki;               // Output per unit of error * second
+    float kd;               // Output per unit/second of measurement change
+    float maxSlew;          // Max output change per second (full scale = 1)
+};
+
+/**
+ * @struct RegulatorStatus
+ * @brief Snapshot of one control loop
+ */
+struct RegulatorStatus {
+    RegulationMode mode;
+    bool active;            // Loop running (switch ON, no fault, sensor valid)
+    bool settled;           // Error inside the settling band for REG_SETTLE_HOLD
+    float setpoint;         // A or W
+    float measured;         // Latest measurement (A or W)
+    float error;            // setpoint - measured
+    float errorRms;         // Moving RMS of the error
+    float overshoot;        // Largest overshoot since the last setpoint change
+    uint16_t output;        // Simulator level (permille)
+    uint32_t settlingMs;    // Setpoint change to settled, 0 = not settled yet
+    uint32_t samples;       // Loop iterations since the last setpoint change
+    RegulatorGains gains;
+};
+
+/**
+ * @class Regulator
+ * @brief Per-channel PID from the sensor samples to the simulator duty
+ */
+class Regulator {
+public:
+    /**
+     * @brief Constructor
+     */
+    Regulator();
+
+    /**
+     * @brief Start regulating a channel (or change its setpoint)
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param mode Quantity to hold; REGULATION_OFF stops
+     * @param setpoint Target in A or W
+     * @param gains PID tuning, nullptr = keep (mode change: mode defaults)
+     * @return true if accepted
+     */
+    bool start(uint8_t channel, RegulationMode mode, float setpoint,
+               const RegulatorGains* gains = nullptr);
+
+    /**
+     * @brief Stop regulating a channel; the simulator keeps its last duty
+     * @param channel Channel number (1..NUM_CHANNELS)
+     */
+    void stop(uint8_t channel);
+
+    /**
+     * @brief Get the regulation mode of a channel
+     */
+    RegulationMode getMode(uint8_t channel);
+
+    /**
+     * @brief Get a consistent snapshot of a control loop
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param status Destination for the snapshot
+     * @return true if channel is valid
+     */
+    bool getStatus(uint8_t channel, RegulatorStatus& status);
+
+    /**
+     * @brief Default gains of a mode (from config.h)
+     */
+    static RegulatorGains defaultGains(RegulationMode mode);
+
+    /**
+     * @brief Run one loop iteration per channel with a new sample
+     *
+     * Called by the protection task after sampling.
+     *
+     * @param freshMask Bit N-1 set = channel N has a new conversion
+     */
+    void update(uint16_t freshMask);
+
+private:
+    /**
+     * @brief Settings (written by loop(), read by the task)
+     */
+    struct LoopConfig {
+        RegulationMode mode;
+        float setpoint;
+        RegulatorGains gains;
+        uint32_t generation;    // Bumped on every start(), restarts the metrics
+    };
+
+    /**
+     * @brief Controller state (owned by the task)
+     */
+    struct LoopState {
+        uint32_t generation;
+        bool active;
+        float integral;         // Integral term, in output units
+        float output;           // Last output (0-1)
+        float lastMeasured;
+        float dFiltered;        // Filtered measurement rate (units/s)
+        int64_t lastSampleUs;   // Time of the last iteration
+    };
+
+    LoopConfig _config[NUM_CHANNELS];
+    LoopState _state[NUM_CHANNELS];
+    RegulatorStatus _status[NUM_CHANNELS];
+    int64_t _changedUs[NUM_CHANNELS];       // Setpoint change time
+    int64_t _inBandSinceUs[NUM_CHANNELS];   // 0 = error outside the band
+    float _stepDirection[NUM_CHANNELS];     // Sign of the step, for overshoot
+    float _errorMeanSquare[NUM_CHANNELS];
+    portMUX_TYPE _lock;
+
+    /**
+     * @brief Run the PID of one channel
+     */
+    void step(uint8_t channel, const LoopConfig& config, int64_t nowUs);
+
+    /**
+     * @brief Update tracking error and settling metrics
+     */
+    void updateMetrics(uint8_t channel, float setpoint, float measured, int64_t nowUs);
+
+    /**
+     * @brief Mark a loop paused in its status
+     */
+    void setInactive(uint8_t channel);
+};
+
+// Global instance
+extern Regulator regulator;
+
+#endif // REGULATOR_H
@@ -0,0 +1,248 @@
+/**
+ * @file SafetyMonitor.h
+ * @brief Fixed-rate Protection Module for ESP32 Power Monitor
+ *
+ * Samples the INA226 sensors and enforces the safety limits from a
+ * dedicated top-priority FreeRTOS task:
+ * - Guaranteed sampling rate independent of loop() and network calls
+ * - Overcurrent / overvoltage shutdown, undervoltage warning
+ * - Device-level power budget with priority-based load shedding
+ * - Closed-loop current / power regulation on every new conversion
+ * - Deadline monitoring (missed periods, wake-up latency)
+ * - Events queued for publication from loop()
+ */
+
+#ifndef SAFETY_MONITOR_H
+#define SAFETY_MONITOR_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "INA226.h"
+#include "Regulator.h"
+
+/**
+ * @struct SensorData
+ * @brief Latest sample of one channel
+ */
+struct SensorData {
+    float voltage;              // Bus voltage (V)
+    float current;              // Load current (A)
+    float power;                // Load power (W)
+    INA226Raw raw;              // Registers the values came from (binary telemetry)
+    bool valid;                 // Sensor present and initialized
+    unsigned long lastReadTime; // millis() of the sample
+    int64_t readTimeUs;         // esp_timer_get_time() of the sample (see TimeBase.h)
+};
+
+/**
+ * @enum SafetyEventType
+ * @brief Kind of event raised by the protection task
+ */
+enum SafetyEventType : uint8_t {
+    SAFETY_EVENT_OVERCURRENT,
+    SAFETY_EVENT_OVERVOLTAGE,
+    SAFETY_EVENT_UNDERVOLTAGE,
+    SAFETY_EVENT_SHED_DIM,      // Simulator dimmed to meet the power budget
+    SAFETY_EVENT_SHED_OFF,      // Channel switched off to meet the power budget
+    SAFETY_EVENT_SHED_RESTORE   // Shed channel given back its previous state
+};
+
+/**
+ * @struct SafetyEvent
+ * @brief Event raised by the protection task, published later by loop()
+ */
+struct SafetyEvent {
+    uint8_t channel;            // Channel number (1..NUM_CHANNELS)
+    SafetyEventType type;       // Event kind
+    float value;                // Measured value (shedding: total power in W)
+    uint16_t level;             // Shedding: simulator level after the action (permille)
+    unsigned long timestamp;    // millis() when raised
+};
+
+/**
+ * @struct SafetyStats
+ * @brief Timing statistics of the protection task
+ */
+struct SafetyStats {
+    uint32_t cycles;            // Completed sampling periods
+    uint32_t missedDeadlines;   // Periods skipped because a cycle started late
+    uint32_t maxLatencyUs;      // Worst wake-up latency (us)
+    uint32_t maxExecUs;         // Worst execution time of one cycle (us)
+    uint32_t droppedEvents;     // Events lost because the queue was full
+};
+
+/**
+ * @struct PowerBudgetStatus
+ * @brief Snapshot of the power budget controller
+ */
+struct PowerBudgetStatus {
+    float budget;               // Budget (W), 0 = disabled
+    float hysteresis;           // Restore below budget * (1 - hysteresis)
+    float totalPower;           // Sum of all switched-on channels (W)
+    uint16_t shedMask;          // Channels currently dimmed or switched off
+    uint8_t priority[NUM_CHANNELS];     // Higher = shed later
+    uint16_t minPermille[NUM_CHANNELS]; // Lowest simulator level when dimming
+};
+
+/**
+ * @class SafetyMonitor
+ * @brief Runs sensor sampling and protection at a guaranteed rate
+ */
+class SafetyMonitor {
+public:
+    /**
+     * @brief Constructor
+     */
+    SafetyMonitor();
+
+    /**
+     * @brief Start the protection task
+     * @param sensors Array of NUM_CHANNELS sensor pointers (index 0 = channel 1)
+     * @return true if the task was started
+     */
+    bool begin(INA226* sensors[]);
+
+    /**
+     * @brief Get a consistent copy of the latest sample of a channel
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param data Destination for the sample
+     * @return true if channel is valid
+     */
+    bool getSensorData(uint8_t channel, SensorData& data);
+
+    /**
+     * @brief Fetch the next pending event (non-blocking)
+     * @param event Destination for the event
+     * @return true if an event was returned
+     */
+    bool pollEvent(SafetyEvent& event);
+
+    /**
+     * @brief Get a copy of the timing statistics
+     */
+    SafetyStats getStats();
+
+    /**
+     * @brief Override the measured current of a channel (fault injection)
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param current Injected current in Amps, NAN to stop injecting
+     */
+    void injectCurrent(uint8_t channel, float current);
+
+    /**
+     * @brief Set the device power budget (stored in NVS)
+     * @param watts Budget in Watts, 0 disables shedding
+     * @param hysteresis Fraction below the budget required before restoring
+     */
+    void setPowerBudget(float watts, float hysteresis = POWER_BUDGET_HYSTERESIS);
+
+    /**
+     * @brief Set shedding parameters of a channel (stored in NVS)
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param priority Higher priority channels are shed last
+     * @param minPermille Lowest simulator level before the channel is switched off
+     * @return true if channel is valid
+     */
+    bool setChannelBudget(uint8_t channel, uint8_t priority, uint16_t minPermille);
+
+    /**
+     * @brief Get the state of the power budget controller
+     */
+    PowerBudgetStatus getBudgetStatus();
+
+    /**
+     * @brief Take exclusive access to the I2C bus (e.g. for a bus scan)
+     */
+    void lockBus();
+
+    /**
+     * @brief Release the I2C bus
+     */
+    void unlockBus();
+
+private:
+    /**
+     * @brief Budget settings (written by loop(), read by the task)
+     */
+    struct PowerBudget {
+        float watts;
+        float hysteresis;
+        uint8_t priority[NUM_CHANNELS];
+        uint16_t minPermille[NUM_CHANNELS];
+    };
+
+    /**
+     * @brief What shedding took from a channel, so it can be given back
+     */
+    struct ShedState {
+        float shedPower;            // Estimated power removed (W)
+        float unmeasured;           // Part of shedPower the sensor has not seen yet (W)
+        uint8_t settleSamples;      // Fresh samples left until unmeasured is cleared
+        uint16_t restorePermille;   // Simulator level before shedding
+        uint16_t shedPermille;      // Simulator level shedding left (changed = taken over)
+        RegulationMode regulation;  // Control loop stopped by dimming, restarted on restore
+        float setpoint;
+        RegulatorGains gains;
+        bool dimmed;
+        bool off;
+    };
+
+    INA226* _sensors[NUM_CHANNELS];
+    SensorData _data[NUM_CHANNELS];
+    float _injectedCurrent[NUM_CHANNELS];
+    bool _overcurrentDetected[NUM_CHANNELS];
+    unsigned long _overcurrentStartTime[NUM_CHANNELS];
+    unsigned long _lastUndervoltageWarning[NUM_CHANNELS];
+    SafetyStats _stats;
+    PowerBudget _budget;
+    ShedState _shed[NUM_CHANNELS];
+    float _totalPower;
+    unsigned long _budgetOkSince;   // 0 = total not below the restore level
+    portMUX_TYPE _lock;
+    SemaphoreHandle_t _busMutex;
+    QueueHandle_t _events;
+    TaskHandle_t _task;
+
+    /**
+     * @brief FreeRTOS task entry point
+     */
+    static void taskEntry(void* arg);
+
+    /**
+     * @brief Task body: fixed-rate sampling loop
+     */
+    void run();
+
+    /**
+     * @brief Read sensors with a completed conversion into the sample buffer
+     * @return Bit N-1 set = channel N got a new sample
+     */
+    uint16_t sampleSensors();
+
+    /**
+     * @brief Check limits and shut down channels if needed
+     */
+    void checkLimits();
+
+    /**
+     * @brief Dim or switch off low-priority channels when over budget,
+     *        restore them with hysteresis
+     * @param fresh Bitmask of channels sampled in this cycle (sampleSensors())
+     */
+    void enforceBudget(uint16_t fresh);
+
+    /**
+     * @brief Load budget settings from NVS
+     */
+    void loadBudget();
+
+    /**
+     * @brief Queue an event for publication
+     */
+    void raiseEvent(uint8_t channel, SafetyEventType type, float value, uint16_t level = 0);
+};
+
+// Global instance
+extern SafetyMonitor safetyMonitor;
+
+#endif // SAFETY_MONITOR_H
@@ -0,0 +1,156 @@
+/**
+ * @file ScheduleManager.h
+ * @brief On-device Switching Schedules for ESP32 Power Monitor
+ *
+ * Per-channel table of switching rules evaluated locally:
+ * - Daily, weekly and one-shot rules with optional simulator level
+ * - Stored in NVS, so schedules keep running without the backend
+ * - Evaluated by a next-event timer: rules are only looked at when the
+ *   earliest pending event is due, never scanned on every loop()
+ * - Actions go through LoadController with its usual fault checks
+ */
+
+#ifndef SCHEDULE_MANAGER_H
+#define SCHEDULE_MANAGER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <time.h>
+#include "config.h"
+
+/**
+ * @enum ScheduleRuleType
+ * @brief When a rule fires
+ */
+enum ScheduleRuleType : uint8_t {
+    SCHEDULE_DAILY = 1,     // Every day at minuteOfDay
+    SCHEDULE_WEEKLY,        // On the weekdays in 'days' at minuteOfDay
+    SCHEDULE_ONCE           // Once at an absolute epoch time
+};
+
+// Value of ScheduleRule::switchState / simValue meaning "leave unchanged"
+#define SCHEDULE_UNCHANGED  0xFF
+
+/**
+ * @struct ScheduleRule
+ * @brief One switching rule (8 bytes, stored as-is in NVS)
+ */
+struct ScheduleRule {
+    uint32_t at;            // DAILY/WEEKLY: minute of day (0-1439), ONCE: epoch seconds
+    uint8_t type;           // ScheduleRuleType
+    uint8_t days;           // WEEKLY: bit 0 = Sunday ... bit 6 = Saturday
+    uint8_t switchState;    // 0 = OFF, 1 = ON, SCHEDULE_UNCHANGED
+    uint8_t simValue;       // 0-100, SCHEDULE_UNCHANGED
+};
+
+static_assert(sizeof(ScheduleRule) == 8, "ScheduleRule must be 8 bytes");
+
+/**
+ * @class ScheduleManager
+ * @brief Stores and executes per-channel switching schedules
+ */
+class ScheduleManager {
+public:
+    /**
+     * @brief Constructor
+     */
+    ScheduleManager();
+
+    /**
+     * @brief Load schedules from NVS
+     */
+    void begin();
+
+    /**
+     * @brief Fire due rules (call in loop, cheap when nothing is due)
+     */
+    void loop();
+
+    /**
+     * @brief Replace the schedule of a channel and persist it
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param rules Array of rules
+     * @param count Number of rules (0..SCHEDULE_MAX_RULES)
+     * @return true if stored
+     */
+    bool setRules(uint8_t channel, const ScheduleRule* rules, uint8_t count);
+
+    /**
+     * @brief Replace the schedule of a channel from a JSON rule array
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param rules JSON array of rule objects
+     * @return true if all rules were valid and stored (a "once" rule in the
+     *         past is invalid)
+     */
+    bool setRulesFromJson(uint8_t channel, JsonArrayConst rules);
+
+    /**
+     * @brief Write the schedule of a channel into a JSON array
+     * @param channel Channel number (1..NUM_CHANNELS)
+     * @param rules Destination array
+     */
+    void rulesToJson(uint8_t channel, JsonArray rules);
+
+    /**
+     * @brief Get the number of rules of a channel
+     */
+    uint8_t getRuleCount(uint8_t channel);
+
+    /**
+     * @brief Epoch time of the next pending event (0 if none)
+     */
+    time_t getNextEventTime() { return _nextEventAt; }
+
+    /**
+     * @brief Check if the wall clock has been set (SNTP)
+     */
+    static bool isTimeValid(time_t now);
+
+private:
+    ScheduleRule _rules[NUM_CHANNELS][SCHEDULE_MAX_RULES];
+    time_t _nextFire[NUM_CHANNELS][SCHEDULE_MAX_RULES];
+    uint8_t _ruleCount[NUM_CHANNELS];
+    time_t _nextEventAt;
+    time_t _lastCheck;
+
+    /**
+     * @brief Recompute next fire times of all rules after 'now', dropping
+     *        "once" rules whose time has passed
+     */
+    void recompute(time_t now);
+
+    /**
+     * @brief Update _nextEventAt from the per-rule fire times
+     */
+    void updateNextEvent();
+
+    /**
+     * @brief Next time strictly after 'after' at which a rule fires (0 = never)
+     */
+    static time_t computeNextFire(const ScheduleRule& rule, time_t after);
+
+    /**
+     * @brief Apply a rule's action to a channel
+     */
+    void fire(uint8_t channel, const ScheduleRule& rule);
+
+    /**
+     * @brief Remove a rule from a channel's table
+     */
+    void removeRule(uint8_t channel, uint8_t index);
+
+    /**
+     * @brief Persist a channel's table to NVS
+     */
+    void save(uint8_t channel);
+
+    /**
+     * @brief Parse one JSON rule object
+     */
+    static bool parseRule(JsonObjectConst obj, ScheduleRule& rule);
+};
+
+// Global instance
+extern ScheduleManager scheduleManager;
+
+#endif // SCHEDULE_MANAGER_H
@@ -0,0 +1,130 @@
+/**
+ * @file TelemetryBatcher.h
+ * @brief Batched Multi-sample Telemetry for ESP32 Power Monitor
+ *
+ * Collects samples of all channels at a higher rate than TELEMETRY_INTERVAL
+ * and publishes them together on .../telemetry/batch:
+ * - One base timestamp per message (uptime and, once synced, Unix time),
+ *   per-sample offsets in ms
+ * - Batch size (samples per message) and maximum latency are configurable
+ * - 10 Hz data costs one message per second instead of ten
+ *
+ * Samples carry the time of the sensor conversion, not of loop(), so a
+ * blocked loop() shows up as a gap rather than as shifted values.
+ * Configuration is stored in NVS.
+ */
+
+#ifndef TELEMETRY_BATCHER_H
+#define TELEMETRY_BATCHER_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/**
+ * @struct TelemetryBatchConfig
+ * @brief Batch mode settings
+ */
+struct TelemetryBatchConfig {
+    bool enabled;               // Collect and publish batches
+    uint8_t size;               // Samples per message (1..TELEMETRY_BATCH_MAX_SAMPLES)
+    uint16_t sampleInterval;    // Time between samples (ms)
+    uint16_t maxLatency;        // Publish a partial batch after this long (ms)
+};
+
+/**
+ * @class TelemetryBatcher
+ * @brief Buffers samples until a batch is due
+ */
+class TelemetryBatcher {
+public:
+    TelemetryBatcher();
+
+    /**
+     * @brief Load the configuration from NVS
+     */
+    void begin();
+
+    /**
+     * @brief Change the configuration (stored in NVS, drops buffered samples)
+     * @param config New settings
+     * @return true if the settings are within limits
+     */
+    bool configure(const TelemetryBatchConfig& config);
+
+    /**
+     * @brief Get the configuration
+     */
+    TelemetryBatchConfig getConfig() { return _config; }
+
+    /**
+     * @brief Check whether the next sample should be taken
+     * @param now millis()
+     * @return true if enabled and the sample interval has passed
+     */
+    bool sampleDue(uint32_t now);
+
+    /**
+     * @brief Append a sample of all channels
+     *
+     * A sample with the same timestamp as the previous one (no new
+     * conversion) is skipped.
+     *
+     * @param timestamp millis() of the conversion
+     * @param voltage Per-channel voltage (V)
+     * @param current Per-channel current (A)
+     * @param power Per-channel power (W)
+     * @param valid Per-channel sensor present flags
+     */
+    void addSample(uint32_t timestamp, const float voltage[], const float current[],
+                   const float power[], const bool valid[]);
+
+    /**
+     * @brief Check whether the buffered samples should be published
+     * @param now millis()
+     * @return true if the batch is full or its oldest sample reached maxLatency
+     */
+    bool batchDue(uint32_t now);
+
+    /**
+     * @brief Number of buffered samples
+     */
+    uint8_t getCount() const { return _count; }
+
+    /**
+     * @brief Write buffered samples as one JSON message
+     * @param buffer Destination buffer
+     * @param size Size of destination buffer
+     * @param first Index of the first sample
+     * @param count Number of samples
+     * @return Message length, 0 if it did not fit
+     */
+    size_t format(char* buffer, size_t size, uint8_t first, uint8_t count) const;
+
+    /**
+     * @brief Drop all buffered samples
+     */
+    void clear() { _count = 0; }
+
+private:
+    /**
+     * @struct ChannelSample
+     * @brief One channel of one sample (NAN = no sensor)
+     */
+    struct ChannelSample {
+        float voltage;
+        float current;
+        float power;
+    };
+
+    TelemetryBatchConfig _config;
+    uint32_t _timestamps[TELEMETRY_BATCH_MAX_SAMPLES];
+    ChannelSample _samples[TELEMETRY_BATCH_MAX_SAMPLES][NUM_CHANNELS];
+    uint8_t _count;
+    uint32_t _lastSampleTime;   // millis() the last sample was taken
+    uint32_t _batchStartTime;   // millis() the first buffered sample was taken
+};
+
+// Global instance
+extern TelemetryBatcher telemetryBatcher;
+
+#endif // TELEMETRY_BATCHER_H
@@ -0,0 +1,63 @@
+/**
+ * @file TelemetryPacket.h
+ * @brief Binary Telemetry Wire Format for ESP32 Power Monitor
+ *
+ * Compact alternative to the JSON telemetry, published on the .../telemetry/bin
+ * topics: a fixed header followed by one record per channel, little-endian,
+ * no padding. Values are the INA226 result registers as read; the receiver
+ * scales them:
+ *   voltage (V) = busVoltage * 0.00125
+ *   current (A) = current * currentLSB
+ *   power (W)   = power * currentLSB * 25
+ *
+ * The layout only ever grows at the end; a change that breaks existing
+ * decoders bumps TELEMETRY_PACKET_VERSION.
+ */
+
+#ifndef TELEMETRY_PACKET_H
+#define TELEMETRY_PACKET_H
+
+#include <Arduino.h>
+
+#define TELEMETRY_PACKET_VERSION    1
+#define TELEMETRY_BUS_INVALID       0xFFFF  // busVoltage of a channel without a sensor
+
+// TelemetryPacketHeader::flags
+#define TELEMETRY_FLAG_TIME         0x01    // A TelemetryPacketTime follows the channel records
+
+/**
+ * @struct TelemetryPacketHeader
+ * @brief Start of every binary telemetry message (12 bytes)
+ */
+struct TelemetryPacketHeader {
+    uint8_t version;        // TELEMETRY_PACKET_VERSION
+    uint8_t firstChannel;   // Channel number of the first record (1-based)
+    uint8_t channelCount;   // Records that follow
+    uint8_t flags;          // TELEMETRY_FLAG_*, 0 in older firmware
+    uint32_t timestamp;     // millis() when published
+    float currentLSB;       // A per current count (IEEE 754 single)
+};
+
+/**
+ * @struct TelemetryPacketChannel
+ * @brief Raw sample of one channel (6 bytes)
+ */
+struct TelemetryPacketChannel {
+    uint16_t busVoltage;    // Bus voltage register, TELEMETRY_BUS_INVALID = no sensor
+    int16_t current;        // Current register
+    uint16_t power;         // Power register
+};
+
+/**
+ * @struct TelemetryPacketTime
+ * @brief Sample time, after the last channel record (8 bytes)
+ */
+struct TelemetryPacketTime {
+    uint64_t timeUs;        // Unix time of the sample (us), see TimeBase.h
+};
+
+static_assert(sizeof(TelemetryPacketHeader) == 12, "TelemetryPacketHeader must be 12 bytes");
+static_assert(sizeof(TelemetryPacketChannel) == 6, "TelemetryPacketChannel must be 6 bytes");
+static_assert(sizeof(TelemetryPacketTime) == 8, "TelemetryPacketTime must be 8 bytes");
+
+#endif // TELEMETRY_PACKET_H
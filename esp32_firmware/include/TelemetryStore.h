@@ -0,0 +1,132 @@
+/**
+ * @file TelemetryStore.h
+ * @brief Store-and-forward Telemetry Buffer for ESP32 Power Monitor
+ *
+ * Keeps the telemetry samples taken while the broker is unreachable and
+ * replays them after reconnecting:
+ * - RAM ring first; when it is full the oldest samples spill to the
+ *   "telemstore" flash partition, so short outages cost no flash wear
+ * - Flash ring of fixed-size records (FlashRing, as in EventLog); when it
+ *   is full the oldest sector is erased (oldest data dropped first)
+ * - Replayed flash records are marked by clearing one byte in place (no
+ *   erase), so replay resumes where it stopped after a reboot
+ * - Samples keep their original timestamps (uptime and, once SNTP has
+ *   synced, Unix time to the microsecond) and the raw sensor registers
+ *
+ * Replay is paced by main.cpp: one small message at a time, only while the
+ * outbound telemetry queue is idle.
+ */
+
+#ifndef TELEMETRY_STORE_H
+#define TELEMETRY_STORE_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "FlashRing.h"
+#include "TelemetryPacket.h"
+
+/**
+ * @struct StoredSample
+ * @brief One buffered telemetry sample as stored in RAM and flash
+ */
+struct StoredSample {
+    uint32_t seq;           // Flash sequence number (slot = seq % capacity)
+    uint32_t epoch;         // Unix time (s), 0 = clock was not synced
+    uint32_t epochUs;       // Microseconds within that second
+    uint32_t uptime;        // millis() of the sample
+    float currentLSB;       // A per current count
+    TelemetryPacketChannel channels[NUM_CHANNELS];  // Raw registers, see TelemetryPacket.h
+    uint8_t crc;            // CRC-8 of the preceding bytes
+    uint8_t pending;        // 0xFF = not replayed yet, 0x00 = replayed (cleared in place)
+};
+
+static_assert(sizeof(StoredSample) <= FLASH_RING_MAX_RECORD, "StoredSample too large for FlashRing");
+
+/**
+ * @struct TelemetryStoreStatus
+ * @brief Buffered depth and replay progress
+ */
+struct TelemetryStoreStatus {
+    uint32_t ramPending;    // Samples waiting in RAM
+    uint32_t flashPending;  // Samples waiting in flash
+    uint32_t flashCapacity; // Flash slots (0 = no partition)
+    uint32_t stored;        // Samples buffered since boot
+    uint32_t replayed;      // Samples replayed since boot
+    uint32_t dropped;       // Samples lost because the buffer was full
+};
+
+/**
+ * @class TelemetryStore
+ * @brief RAM + flash FIFO of telemetry samples
+ */
+class TelemetryStore {
+public:
+    TelemetryStore();
+
+    /**
+     * @brief Open the flash partition and find the samples not replayed yet
+     * @return true if the flash partition is usable (RAM works either way)
+     */
+    bool begin();
+
+    /**
+     * @brief Buffer a sample
+     * @param sample Sample (seq, crc and pending are filled in here)
+     */
+    void add(StoredSample sample);
+
+    /**
+     * @brief Number of samples waiting for replay
+     */
+    uint32_t getPending();
+
+    /**
+     * @brief Copy the oldest waiting samples without removing them
+     * @param samples Destination
+     * @param max Capacity of destination
+     * @return Number of samples copied
+     */
+    uint8_t peek(StoredSample samples[], uint8_t max);
+
+    /**
+     * @brief Remove the oldest samples after they were published
+     * @param count Number of samples (as returned by peek)
+     */
+    void consume(uint8_t count);
+
+    /**
+     * @brief Write samples as one replay message
+     * @param buffer Destination buffer
+     * @param size Size of destination buffer
+     * @param samples Samples to write
+     * @param count Number of samples
+     * @param remaining Samples still waiting after these
+     * @return Message length, 0 if it did not fit
+     */
+    static size_t format(char* buffer, size_t size, const StoredSample samples[], uint8_t count,
+                         uint32_t remaining);
+
+    /**
+     * @brief Get buffered depth and replay counters
+     */
+    TelemetryStoreStatus getStatus();
+
+private:
+    FlashRing _ring;
+    uint32_t _replaySeq;        // Oldest flash sample not replayed yet
+
+    StoredSample _ram[STORE_RAM_SAMPLES];
+    uint16_t _ramHead;          // Oldest RAM sample
+    uint16_t _ramCount;
+
+    uint32_t _stored;
+    uint32_t _replayed;
+    uint32_t _dropped;
+
+    bool spill(StoredSample& sample);
+};
+
+// Global instance
+extern TelemetryStore telemetryStore;
+
+#endif // TELEMETRY_STORE_H
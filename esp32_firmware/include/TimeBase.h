@@ -0,0 +1,130 @@
+/**
+ * @file TimeBase.h
+ * @brief Wall-clock Time Base for ESP32 Power Monitor
+ *
+ * Maps the esp_timer microsecond counter (monotonic since boot, the clock
+ * behind millis()) to Unix time, so samples and events can be ordered
+ * across reboots and correlated between devices:
+ * - Anchored by every SNTP sync (callback from the lwIP task, applied in
+ *   loop())
+ * - Oscillator drift estimated from the offset seen at each sync and
+ *   applied between syncs
+ * - Small offsets are slewed in at TIME_SLEW_RATE_PPM, so the mapping stays
+ *   continuous and monotonic; only offsets above TIME_STEP_THRESHOLD step
+ * - Sync quality (state, last offset, drift, age) for status messages
+ *
+ * The mapping is owned by the loop task; convert from there.
+ */
+
+#ifndef TIME_BASE_H
+#define TIME_BASE_H
+
+#include <Arduino.h>
+#include "config.h"
+
+struct timeval;
+
+/**
+ * @enum TimeSyncState
+ * @brief Quality of the wall-clock time
+ */
+enum TimeSyncState : uint8_t {
+    TIME_UNSYNCED,              // No SNTP sync yet: no wall-clock time
+    TIME_SYNCED,                // Synced within TIME_STALE_AFTER intervals
+    TIME_STALE                  // Synced before, free-running on the drift estimate since
+};
+
+/**
+ * @brief Get the name of a sync state (e.g. "synced")
+ */
+const char* timeSyncStateName(TimeSyncState state);
+
+/**
+ * @struct TimeSyncStats
+ * @brief Sync quality
+ */
+struct TimeSyncStats {
+    TimeSyncState state;
+    uint32_t syncs;             // SNTP syncs since boot
+    uint32_t steps;             // Syncs whose offset was too large to slew
+    int32_t lastOffsetUs;       // Server minus local time at the last sync (us)
+    int32_t driftPpb;           // Estimated oscillator error (parts per billion)
+    uint32_t sinceSync;         // Seconds since the last sync (0 if never)
+};
+
+/**
+ * @class TimeBase
+ * @brief SNTP-disciplined mapping from esp_timer to Unix microseconds
+ */
+class TimeBase {
+public:
+    TimeBase();
+
+    /**
+     * @brief Register for SNTP sync notifications (call before configTzTime)
+     */
+    void begin();
+
+    /**
+     * @brief Apply a sync reported since the last call
+     * @return true if the sync state changed (e.g. first sync, gone stale)
+     */
+    bool loop();
+
+    /**
+     * @brief Check whether wall-clock time is available
+     */
+    bool isSynced() const { return _state != TIME_UNSYNCED; }
+
+    /**
+     * @brief Convert an esp_timer_get_time() value to Unix time
+     * @return Microseconds since 1970, 0 if not synced yet
+     */
+    uint64_t toEpochUs(int64_t monoUs) const;
+
+    /**
+     * @brief Convert a millis() value of the last 49 days to Unix time
+     * @return Microseconds since 1970, 0 if not synced yet
+     */
+    uint64_t fromMillis(uint32_t ms) const;
+
+    /**
+     * @brief Current Unix time in microseconds, 0 if not synced yet
+     */
+    uint64_t nowUs() const;
+
+    /**
+     * @brief Get the sync quality
+     */
+    TimeSyncStats getStats() const;
+
+private:
+    TimeSyncState _state;
+
+    // Mapping: epoch = anchorEpoch + elapsed * (1 + drift) + slewed part of _slewUs
+    int64_t _anchorMono;        // esp_timer value of the anchor (us)
+    int64_t _anchorEpoch;       // Unix time at the anchor (us)
+    int32_t _driftPpb;
+    int32_t _slewUs;            // Offset still being absorbed from the anchor on
+
+    int64_t _lastSyncMono;
+    uint32_t _syncs;
+    uint32_t _steps;
+    int32_t _lastOffsetUs;
+
+    // Sync reported by the SNTP callback, not applied yet
+    portMUX_TYPE _lock;
+    bool _pending;
+    int64_t _pendingMono;
+    int64_t _pendingEpoch;
+
+    void applySync(int64_t monoUs, int64_t epochUs);
+    TimeSyncState currentState(int64_t monoUs) const;
+
+    static void onSync(struct timeval* tv);
+};
+
+// Global instance
+extern TimeBase timeBase;
+
+#endif // TIME_BASE_H
@@ -0,0 +1,152 @@
+/**
+ * @file TlsTransport.h
+ * @brief Non-blocking TLS Layer for the MQTT Connection (MQTT_USE_TLS)
+ *
+ * Runs mbedTLS over the client's non-blocking socket, one handshake step
+ * at a time from loop(), so TLS adds no blocking of its own.
+ *
+ * A full handshake (certificate chain, ECDHE) costs hundreds of ms of CPU
+ * and tens of kB of heap; a resumed one skips both. The last session
+ * (ticket or session ID) is therefore kept:
+ * - in RAM for reconnects, and
+ * - serialized in RTC memory, so it survives software resets and deep
+ *   sleep (not power loss)
+ * and offered on the next connection. The server decides whether to
+ * resume; a refused session falls back to a full handshake.
+ *
+ * Handshake time and peak mbedTLS heap are recorded separately for full
+ * and resumed handshakes.
+ */
+
+#ifndef TLS_TRANSPORT_H
+#define TLS_TRANSPORT_H
+
+#include <Arduino.h>
+#include "config.h"
+
+#if MQTT_USE_TLS
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+/**
+ * @enum TlsHandshakeResult
+ * @brief Progress of handshake()
+ */
+enum TlsHandshakeResult : uint8_t {
+    TLS_HANDSHAKE_DONE,         // Session established
+    TLS_HANDSHAKE_PENDING,      // Waiting for the network, call again
+    TLS_HANDSHAKE_FAILED        // See TlsStats::lastError
+};
+
+/**
+ * @struct TlsHandshakeStats
+ * @brief Cost of one kind of handshake (full or resumed)
+ */
+struct TlsHandshakeStats {
+    uint32_t count;             // Completed since boot
+    uint32_t lastMs;            // Duration of the last one (TCP connected -> established)
+    uint32_t averageMs;         // Mean duration
+    uint32_t lastHeap;          // Peak mbedTLS heap of the last one (bytes)
+    uint32_t maxHeap;           // Highest peak seen (bytes)
+};
+
+/**
+ * @struct TlsStats
+ * @brief Handshake counters and session cache state
+ */
+struct TlsStats {
+    TlsHandshakeStats full;
+    TlsHandshakeStats resumed;
+    uint32_t failures;          // Handshakes that failed
+    int32_t lastError;          // mbedTLS error code of the last failure
+    bool sessionCached;         // A session will be offered on the next connection
+    bool sessionFromRtc;        // It was restored from RTC memory after a reset
+};
+
+/**
+ * @class TlsTransport
+ * @brief TLS client session over a connected non-blocking socket
+ */
+class TlsTransport {
+public:
+    TlsTransport();
+
+    /**
+     * @brief Start a handshake on a connected socket
+     * @param socket Non-blocking TCP socket (stays owned by the caller)
+     * @param host Broker host name (SNI and certificate check)
+     * @param port Broker port (with the host, identifies the cached session)
+     * @return false if TLS could not be set up
+     */
+    bool start(int socket, const char* host, uint16_t port);
+
+    /**
+     * @brief Advance the handshake as far as the received data allows
+     */
+    TlsHandshakeResult handshake();
+
+    /**
+     * @brief Encrypt and send
+     * @return Bytes consumed, 0 if the socket is full, < 0 on error
+     */
+    int send(const uint8_t* data, size_t length);
+
+    /**
+     * @brief Receive and decrypt
+     * @return Bytes read, 0 if nothing is available, < 0 if closed or on error
+     */
+    int receive(uint8_t* buffer, size_t size);
+
+    /**
+     * @brief Send close_notify (best effort) and end the session
+     *
+     * Call before closing the socket. Buffers are kept for the next start().
+     */
+    void close();
+
+    /**
+     * @brief Get handshake counters
+     */
+    TlsStats getStats() const;
+
+private:
+    bool _configured;
+    bool _active;               // start() succeeded, close() not called yet
+    int _socket;
+
+    mbedtls_ssl_config _config;
+    mbedtls_x509_crt _ca;
+    mbedtls_ssl_context _ssl;
+
+    // Session offered on the next connection
+    mbedtls_ssl_session _session;
+    bool _haveSession;
+    bool _restored;             // RTC memory checked (first start())
+    uint32_t _sessionKey;       // Hash of the host and port it belongs to
+
+    // Current handshake
+    bool _offered;              // A cached session was offered
+    bool _sawCertificate;       // Server sent its certificate: full handshake
+    int64_t _startUs;
+
+    size_t _writePending;       // Length of a write that returned WANT_WRITE
+
+    TlsStats _stats;
+
+    bool configure();
+    void finishHandshake();
+    void saveSession();
+    void restoreSession(uint32_t key);
+    void dropSession();
+
+    static uint32_t sessionKey(const char* host, uint16_t port);
+
+    static int bioSend(void* context, const unsigned char* data, size_t length);
+    static int bioReceive(void* context, unsigned char* buffer, size_t size);
+    static int random(void* context, unsigned char* output, size_t length);
+};
+
+#endif // MQTT_USE_TLS
+
+#endif // TLS_TRANSPORT_H
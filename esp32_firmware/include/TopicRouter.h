@@ -0,0 +1,87 @@
+/**
+ * @file TopicRouter.h
+ * @brief Inbound MQTT Topic Router for ESP32 Power Monitor
+ *
+ * Maps a received topic to its handler through a table built once at
+ * startup, instead of comparing the topic against every subscription:
+ * - The device prefix ("devices/<id>", set at boot) is checked once; a
+ *   following "/chN" is taken as the channel number
+ * - The rest of the topic (e.g. "/sim/set") is hashed and looked up in an
+ *   open-addressing table; per-channel and device-wide routes with the same
+ *   suffix are separate entries
+ * - Handlers get the payload in place (NUL-terminated, no copy) and decide
+ *   themselves whether it needs JSON parsing
+ */
+
+#ifndef TOPIC_ROUTER_H
+#define TOPIC_ROUTER_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/**
+ * @brief Handles one message
+ * @param channel Channel of a per-channel topic (1..NUM_CHANNELS), 0 otherwise
+ * @param payload NUL-terminated payload
+ * @param length Payload length
+ */
+typedef void (*TopicHandler)(uint8_t channel, const char* payload, size_t length);
+
+/**
+ * @class TopicRouter
+ * @brief Hash table from topic suffix to handler
+ */
+class TopicRouter {
+public:
+    TopicRouter();
+
+    /**
+     * @brief Set the device prefix every routed topic starts with
+     * @param base e.g. "devices/<id>", must stay valid (DeviceIdentity arena)
+     */
+    void setBase(const char* base);
+
+    /**
+     * @brief Register a handler
+     * @param suffix Topic after the device prefix (or after "/chN"), e.g. "/control"
+     * @param perChannel true for devices/<id>/chN<suffix>, false for devices/<id><suffix>
+     * @param handler Function to call
+     * @return true if added (false if the table is full or the route exists)
+     */
+    bool add(const char* suffix, bool perChannel, TopicHandler handler);
+
+    /**
+     * @brief Call the handler of a topic
+     * @param topic Full topic
+     * @param payload NUL-terminated payload
+     * @param length Payload length
+     * @return true if a handler was found
+     */
+    bool dispatch(const char* topic, const char* payload, size_t length);
+
+private:
+    /**
+     * @struct Route
+     * @brief One table entry (suffix == nullptr = free)
+     */
+    struct Route {
+        const char* suffix;
+        uint32_t hash;
+        bool perChannel;
+        TopicHandler handler;
+    };
+
+    Route _routes[TOPIC_ROUTER_SLOTS];
+    uint8_t _count;
+    const char* _base;
+    size_t _baseLength;
+
+    Route* find(const char* suffix, uint32_t hash, bool perChannel);
+
+    static uint32_t hashSuffix(const char* suffix, bool perChannel);
+};
+
+// Global instance
+extern TopicRouter topicRouter;
+
+#endif // TOPIC_ROUTER_H
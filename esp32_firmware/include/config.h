@@ -16,7 +16,15 @@
 // ============================================================================
 // DEVICE IDENTIFICATION
 // ============================================================================
+// The device ID names the MQTT topics (devices/<id>/...) and is the MQTT client ID.
+// Chosen at boot (DeviceIdentity.h), first found wins:
+//   1. NVS, written by the serial command "id set <id>" (provisioning)
+//   2. DEVICE_ID below; leave it "" for one firmware image for every device
+//   3. DEVICE_ID_PREFIX + the 12 hex digits of the factory MAC
 #define DEVICE_ID           "anh_hong_dep_trai_ittn"
+#define DEVICE_ID_PREFIX    "pm-"
+#define DEVICE_ID_MAX_LENGTH 32                     // Letters, digits, '-' and '_' only
+#define DEVICE_NVS_NAMESPACE "device"
 #define DEVICE_NAME         "ESP32 Power Monitor"
 #define FIRMWARE_VERSION    "1.0.0"
 
@@ -32,46 +40,112 @@
 // MQTT CONFIGURATION
 // ============================================================================
 #define MQTT_BROKER         "broker.hivemq.com"     // Địa chỉ MQTT Broker (có thể dùng public broker để test)
+#ifndef MQTT_USE_TLS
+#define MQTT_USE_TLS        0                        // 1 = TLS tới broker (env esp32dev_tls đặt sẵn)
+#endif
+#if MQTT_USE_TLS
+#define MQTT_PORT           8883                     // Port MQTT over TLS
+#else
 #define MQTT_PORT           1883                     // Port MQTT (1883 cho non-SSL, 8883 cho SSL)
+#endif
 #define MQTT_USERNAME       ""                       // Username MQTT (để trống nếu không cần)
 #define MQTT_PASSWORD       ""                       // Password MQTT (để trống nếu không cần)
-#define MQTT_CLIENT_ID      DEVICE_ID
-#define MQTT_RECONNECT_INTERVAL 5000                // Khoảng thời gian thử kết nối lại (ms)
+#define MQTT_RECONNECT_MIN  1000                     // Thời gian chờ kết nối lại đầu tiên (ms), nhân đôi mỗi lần thất bại
+#define MQTT_RECONNECT_MAX  60000                    // Thời gian chờ kết nối lại tối đa (ms), có jitter ngẫu nhiên
 #define MQTT_KEEPALIVE      60                       // Keepalive interval (seconds)
+#define MQTT_BUFFER_SIZE    1024                     // Max MQTT packet / JSON payload size (bytes)
+#define MQTT_TX_BUFFER_SIZE 4096                     // Socket transmit buffer (bytes), holds partial writes
+#define MQTT_DNS_CACHE_TTL  3600000                  // Reuse the resolved broker address for (ms)
+#define MQTT_DNS_TIMEOUT    10000                    // DNS lookup timeout (ms)
+#define MQTT_CONNECT_TIMEOUT 10000                   // TCP connect timeout (ms)
+#define MQTT_HANDSHAKE_TIMEOUT 10000                 // CONNECT -> CONNACK timeout (ms)
+#define MQTT_INFLIGHT_MAX   8                        // QoS 1 messages awaiting PUBACK at once
+#define MQTT_INFLIGHT_BYTES 2048                     // Copies kept for resending (bytes)
+#define MQTT_INFLIGHT_RESENDS 3                      // Reconnect resends before a message is given up
+#define MQTT_ACK_TIMEOUT    10000                    // No PUBACK for this long: connection is dead (ms)
 
-// MQTT Topics Base
-#define MQTT_BASE_TOPIC     "devices/" DEVICE_ID
+// MQTT over TLS (MQTT_USE_TLS = 1). The broker host name must match its certificate.
+// CA that signed the broker certificate, PEM with "\n" line ends; "" = no verification (testing only)
+#define MQTT_TLS_CA_CERT    ""
+#define MQTT_TLS_HANDSHAKE_TIMEOUT 15000             // TCP connected -> TLS established (ms)
+#define MQTT_TLS_SESSION_CACHE 2048                  // RTC memory for the resumable session (bytes)
 
-// MQTT Topics - Telemetry (Publish)
-#define MQTT_TOPIC_TELEMETRY        MQTT_BASE_TOPIC "/telemetry"
-#define MQTT_TOPIC_STATUS           MQTT_BASE_TOPIC "/status"
-#define MQTT_TOPIC_ERROR            MQTT_BASE_TOPIC "/error"
-#define MQTT_TOPIC_HEARTBEAT        MQTT_BASE_TOPIC "/heartbeat"
+// MQTT 5: offered first, 3.1.1 if the broker refuses it (or never answers it)
+#define MQTT_PROTOCOL_V5    1                        // 0 = always 3.1.1
+#define MQTT_TOPIC_ALIAS_MAX 16                      // Topic aliases per connection (QoS 0 topics only)
+#define MQTT_TOPIC_ALIAS_BYTES 1024                  // Room for the aliased topic strings (bytes)
+#define MQTT_TELEMETRY_EXPIRY 30                     // Broker drops undelivered telemetry after (s), 0 = never
+// Payload Format Indicator marks JSON (UTF-8) vs binary on every message (2 B). A MIME
+// Content Type costs another 19-27 B per message, about as much as the alias saves
+#define MQTT_CONTENT_TYPES  0                        // 1 = also send MQTT_CONTENT_TYPE_*
+#define MQTT_CONTENT_TYPE_JSON   "application/json"
+#define MQTT_CONTENT_TYPE_BINARY "application/octet-stream"
 
-// MQTT Topics - Channel 1
-#define MQTT_TOPIC_CH1_TELEMETRY    MQTT_BASE_TOPIC "/ch1/telemetry"
-#define MQTT_TOPIC_CH1_STATUS       MQTT_BASE_TOPIC "/ch1/status"
-#define MQTT_TOPIC_CH1_SWITCH_SET   MQTT_BASE_TOPIC "/ch1/switch/set"
-#define MQTT_TOPIC_CH1_SIM_SET      MQTT_BASE_TOPIC "/ch1/sim/set"
+// MQTT Topics: MQTT_TOPIC_ROOT + device ID + suffix, built once at boot into
+// one arena (DeviceIdentity.h); publish through the DeviceTopic/ChannelTopic handles
+#define MQTT_TOPIC_ROOT             "devices/"
 
-// MQTT Topics - Channel 2
-#define MQTT_TOPIC_CH2_TELEMETRY    MQTT_BASE_TOPIC "/ch2/telemetry"
-#define MQTT_TOPIC_CH2_STATUS       MQTT_BASE_TOPIC "/ch2/status"
-#define MQTT_TOPIC_CH2_SWITCH_SET   MQTT_BASE_TOPIC "/ch2/switch/set"
-#define MQTT_TOPIC_CH2_SIM_SET      MQTT_BASE_TOPIC "/ch2/sim/set"
+// MQTT Topics - Device (suffix after devices/<id>)
+#define MQTT_TOPIC_TELEMETRY        "/telemetry"
+#define MQTT_TOPIC_STATUS           "/status"
+#define MQTT_TOPIC_ERROR            "/error"
+#define MQTT_TOPIC_HEARTBEAT        "/heartbeat"
+#define MQTT_TOPIC_HEARTBEAT_LINK   "/heartbeat/link"     // Heartbeat: broker connection
+#define MQTT_TOPIC_HEARTBEAT_COMMANDS "/heartbeat/commands" // Heartbeat: command paths, queue
+#define MQTT_TOPIC_EVENTS           "/events"
+#define MQTT_TOPIC_SCHEDULE         "/schedule"
+#define MQTT_TOPIC_POWER            "/power"            // Load shedding actions
+#define MQTT_TOPIC_CHANNEL_STATUS   "/channels/status"  // All channels in one message
+#define MQTT_TOPIC_TELEMETRY_BIN    "/telemetry/bin"    // Binary telemetry (TelemetryPacket.h)
+#define MQTT_TOPIC_TELEMETRY_BATCH  "/telemetry/batch"  // Multi-sample telemetry
+#define MQTT_TOPIC_TELEMETRY_REPLAY "/telemetry/replay" // Telemetry buffered during an outage
+#define MQTT_TOPIC_RESPONSE         "/response"         // Replies to commands that carry an "id"
+#define MQTT_TOPIC_SHADOW           "/shadow"           // Full shadow document (retained)
+#define MQTT_TOPIC_SHADOW_DELTA     "/shadow/delta"     // Shadow changes, one per version
+
+// MQTT Topics - Per channel: devices/<id> + MQTT_TOPIC_CH_PREFIX + N + suffix (N = 1..NUM_CHANNELS)
+// e.g. devices/<id>/ch1/telemetry, devices/<id>/ch2/switch/set
+#define MQTT_TOPIC_CH_PREFIX        "/ch"
+#define MQTT_CH_TELEMETRY           "/telemetry"
+#define MQTT_CH_TELEMETRY_BIN       "/telemetry/bin"
+#define MQTT_CH_STATUS              "/status"
+#define MQTT_CH_SWITCH_SET          "/switch/set"
+#define MQTT_CH_SIM_SET             "/sim/set"
+#define MQTT_CH_PWM                 "/pwm"
+#define MQTT_CH_REGULATION          "/regulation"
 
 // MQTT Topics - Control (Subscribe)
-#define MQTT_TOPIC_CONTROL          MQTT_BASE_TOPIC "/control"
+#define MQTT_TOPIC_CONTROL          "/control"
+#define MQTT_TOPIC_SWITCH_SET       "/switch/set"       // Several channels at once
+#define MQTT_TOPIC_SHADOW_DESIRED   "/shadow/desired"   // Desired state, published retained by the backend
+#define MQTT_TOPIC_SHADOW_GET       "/shadow/get"       // Ask for the full shadow document
 
-// Last Will and Testament
-#define MQTT_LWT_TOPIC      MQTT_BASE_TOPIC "/status"
+// Last Will and Testament (sent on the status topic)
 #define MQTT_LWT_MESSAGE    "{\"online\":false}"
 #define MQTT_LWT_QOS        1
 #define MQTT_LWT_RETAIN     true
 
+// ============================================================================
+// TIME CONFIGURATION
+// ============================================================================
+#define NTP_SERVER          "pool.ntp.org"           // SNTP server
+#define NTP_SERVER_2        "time.google.com"        // Fallback SNTP server
+#define TIME_ZONE           "ICT-7"                  // POSIX TZ string (Vietnam, UTC+7)
+#define TIME_SYNC_INTERVAL  900000                   // SNTP poll interval (ms)
+#define TIME_STEP_THRESHOLD 128000                   // Larger offsets are stepped, smaller ones slewed (us)
+#define TIME_SLEW_RATE_PPM  500                      // Rate at which small offsets are absorbed
+#define TIME_MAX_DRIFT_PPM  500                      // Bound of the oscillator drift estimate
+#define TIME_DRIFT_MIN_INTERVAL 60                   // Shortest sync interval used to estimate drift (s)
+#define TIME_STALE_AFTER    3                        // Missed sync intervals before the time is "stale"
+
 // ============================================================================
 // GPIO PIN CONFIGURATION
 // ============================================================================
+// Channels are numbered 1..NUM_CHANNELS. Every per-channel table below
+// (pins, LEDC channels, INA226 addresses) must have NUM_CHANNELS entries.
+#define NUM_CHANNELS        2       // Number of load channels
+#define MAX_CHANNELS        16      // Upper bound supported by the firmware
+
 // I2C Pins
 #define I2C_SDA_PIN         21
 #define I2C_SCL_PIN         22
@@ -84,17 +158,36 @@
 #define MAIN_SWITCH_PIN_2   26      // Main MOSFET control for Channel 2
 #define SIMULATOR_PIN_2     19      // Fault simulator MOSFET for Channel 2
 
-// PWM Configuration for Simulators
+// Per-channel pin tables (index 0 = Channel 1)
+#define MAIN_SWITCH_PINS    { MAIN_SWITCH_PIN_1, MAIN_SWITCH_PIN_2 }
+#define SIMULATOR_PINS      { SIMULATOR_PIN_1, SIMULATOR_PIN_2 }
+
+// PWM Configuration for Simulators (defaults, changeable per channel at runtime)
 #define PWM_FREQUENCY       5000    // PWM frequency in Hz
 #define PWM_RESOLUTION      8       // PWM resolution in bits (0-255)
-#define PWM_CHANNEL_SIM1    0       // LEDC channel for Simulator 1
-#define PWM_CHANNEL_SIM2    1       // LEDC channel for Simulator 2
+#define PWM_MAX_RESOLUTION  20      // Widest LEDC timer (ESP32: 20, S2/S3/C3: 14)
+// LEDC channels 2k and 2k+1 share a timer: use even channels so every
+// simulator gets its own frequency/resolution
+#define PWM_CHANNEL_SIM1    0       // LEDC channel for Simulator 1 (timer 0)
+#define PWM_CHANNEL_SIM2    2       // LEDC channel for Simulator 2 (timer 1)
+#define PWM_CHANNELS_SIM    { PWM_CHANNEL_SIM1, PWM_CHANNEL_SIM2 }
+
+// State restore at boot: 0 = last state, 1 = all OFF, 2 = STATE_DEFAULT_SWITCHES
+#define STATE_RESTORE_POLICY    0
+#define STATE_DEFAULT_SWITCHES  0x0000  // Policy 2: bit N-1 set = channel N ON
+#define STATE_NVS_NAMESPACE     "loadstate"
+#define STATE_NVS_DELAY         2000    // Write state to NVS once stable this long (ms)
+
+// Simulator fades (LEDC hardware fade unit)
+#define FADE_CURVE_SEGMENTS 8       // Linear segments approximating non-linear curves
+#define FADE_MAX_DURATION   60000   // Longest accepted fade (ms)
 
 // ============================================================================
 // INA226 SENSOR CONFIGURATION
 // ============================================================================
 #define INA226_ADDR_CH1     0x40    // I2C address for Channel 1 INA226
 #define INA226_ADDR_CH2     0x41    // I2C address for Channel 2 INA226
+#define INA226_ADDRS        { INA226_ADDR_CH1, INA226_ADDR_CH2 }
 
 // INA226 Shunt Resistor Value
 #define SHUNT_RESISTOR      0.1     // Shunt resistor value in Ohms (R100 = 0.1Ω)
@@ -108,14 +201,116 @@
 // ============================================================================
 // Telemetry Intervals
 #define TELEMETRY_INTERVAL      1000    // Send telemetry every 1 second (ms)
-#define STATUS_INTERVAL         5000    // Send status every 5 seconds (ms)
 #define HEARTBEAT_INTERVAL      30000   // Send heartbeat every 30 seconds (ms)
+#define STATUS_MERGE_WINDOW     100     // State changes this close share one status/shadow publish (ms)
+#define COMMAND_COALESCE_MS     100     // sim/set bursts: apply at most one level per window and channel (ms)
+#define RPC_ID_MAX_LENGTH       40      // Longest command "id" echoed on .../response (as JSON, quotes included)
+
+// Device shadow (DeviceShadow.h): status is published on change and on
+// (re)connect only, as versioned deltas of one document
+#define SHADOW_NVS_NAMESPACE        "shadow"
+#define SHADOW_VERSION_RESERVE      1000    // Versions reserved per NVS write (skipped after a reboot)
+#define SHADOW_SNAPSHOT_INTERVAL    60000   // Refresh the retained document at most this often, if changed (ms)
+
+// Telemetry encoding: 1 = JSON, 2 = binary (.../telemetry/bin), 3 = both
+// (changeable with the telemetry_format command, stored in NVS)
+#define TELEMETRY_FORMAT            1
+#define TELEMETRY_NVS_NAMESPACE     "telemetry"
+
+// Batched telemetry: several samples per message on .../telemetry/batch
+// (changeable with the telemetry_batch command, stored in NVS)
+#define TELEMETRY_BATCH_ENABLED     0       // Off by default
+#define TELEMETRY_BATCH_SAMPLE_MS   100     // Sample every 100 ms (10 Hz)
+#define TELEMETRY_BATCH_SIZE        10      // Samples per message
+#define TELEMETRY_BATCH_MAX_LATENCY 1000    // Publish a partial batch after this long (ms)
+#define TELEMETRY_BATCH_MAX_SAMPLES 50      // Buffer capacity (samples)
+#define TELEMETRY_BATCH_MIN_SAMPLE_MS 20    // Fastest sample rate (about one INA226 conversion)
+
+// Outbound publish scheduler (PublishQueue.h)
+#define PUBLISH_QUEUE_CRITICAL_BYTES    2048    // Ring for error / power messages
+#define PUBLISH_QUEUE_STATUS_BYTES      4096    // Ring for status, heartbeat, command replies
+#define PUBLISH_QUEUE_TELEMETRY_BYTES   4096    // Ring for telemetry
+#define PUBLISH_RATE_BYTES              8192    // Token bucket refill (bytes/s)
+#define PUBLISH_BURST_BYTES             4096    // Token bucket size (bytes)
+#define PUBLISH_OVERHEAD_BYTES          5       // MQTT header bytes counted per message
+#define PUBLISH_MAX_PER_LOOP            8       // Messages sent per loop() pass
+#define PUBLISH_TOPIC_SLOTS             16      // Topics tracked for rate limits
+#define PUBLISH_TELEMETRY_MIN_INTERVAL  200     // Min time between two messages of one telemetry topic (ms)
+#define PUBLISH_STATUS_MIN_INTERVAL     100     // Same for status topics (ms)
+#define PUBLISH_STATUS_MAX_AGE          30000   // Drop queued status older than this (ms)
+#define PUBLISH_TELEMETRY_MAX_AGE       5000    // Drop queued telemetry older than this (ms)
+
+// Inbound topic router (TopicRouter.h)
+#define TOPIC_ROUTER_SLOTS              16      // Hash table size (power of two, more than the routes)
 
 // Safety Thresholds
 #define OVERCURRENT_THRESHOLD   3.5     // Overcurrent threshold in Amps
 #define OVERVOLTAGE_THRESHOLD   14.0    // Overvoltage threshold in Volts
 #define UNDERVOLTAGE_THRESHOLD  10.0    // Undervoltage threshold in Volts
 #define OVERCURRENT_DURATION    100     // Duration before triggering protection (ms)
+#define UNDERVOLTAGE_WARNING_INTERVAL 5000 // Minimum time between undervoltage warnings (ms)
+
+// Protection Task
+// Sampling and limit checks run in their own top-priority FreeRTOS task so
+// that blocking network or serial calls in loop() cannot delay a trip.
+#define SAFETY_SAMPLE_PERIOD_MS 10      // Protection sampling period (ms)
+#define SAFETY_TASK_PRIORITY    (configMAX_PRIORITIES - 1)
+#define SAFETY_TASK_CORE        1       // Same core as loop(), so it always preempts it
+#define SAFETY_TASK_STACK_SIZE  4096    // Stack size in bytes
+#define SAFETY_EVENT_QUEUE_SIZE 16      // Pending events awaiting publication
+#define SAFETY_STALE_SAMPLE_MS  200     // Read the sensor anyway if no conversion was flagged this long
+
+// Power Budget (total power of all channels, enforced by the protection task)
+#define POWER_BUDGET            0.0     // Default budget in Watts (0 = disabled)
+#define POWER_BUDGET_HYSTERESIS 0.10    // Restore only below budget * (1 - hysteresis)
+#define POWER_RESTORE_DELAY     5000    // Time below the restore level per restored channel (ms)
+#define POWER_SHED_SETTLE_SAMPLES 2     // Fresh samples before a dimmed level counts as measured
+#define POWER_PRIORITIES        { 1, 0 }    // Per channel, higher = shed later
+#define POWER_MIN_SIM           { 300, 300 } // Per channel, lowest sim level when dimming (permille)
+#define POWER_NVS_NAMESPACE     "power"
+
+// Closed-loop Regulation (constant current / constant power)
+// PID from each new INA226 conversion (~35 ms with the default config) to
+// the simulator duty; output is the duty as a fraction of full scale.
+#define REG_KP_CURRENT          0.2     // Per A of error
+#define REG_KI_CURRENT          2.0     // Per A*s
+#define REG_KD_CURRENT          0.0     // Per A/s
+#define REG_KP_POWER            0.02    // Per W of error
+#define REG_KI_POWER            0.2     // Per W*s
+#define REG_KD_POWER            0.0     // Per W/s
+#define REG_MAX_SLEW            2.0     // Max output change per second (full scale = 1)
+#define REG_D_FILTER            0.3     // Derivative low-pass weight of a new sample (0-1]
+#define REG_SETTLE_BAND         0.02    // Settled within this fraction of the setpoint...
+#define REG_SETTLE_FLOOR        0.01    // ...or this absolute error (A or W), whichever is larger
+#define REG_SETTLE_HOLD         500     // Time inside the band before counting as settled (ms)
+#define REG_ERROR_AVG_WEIGHT    0.05    // Weight of a new sample in the RMS error average
+
+// Event Log (flash ring in the "eventlog" partition, see partitions.csv)
+#define EVENT_LOG_PARTITION_LABEL   "eventlog"
+#define EVENT_LOG_PARTITION_SUBTYPE 0x40    // Custom data subtype
+#define EVENT_LOG_SECTOR_SIZE       4096    // Flash erase unit (bytes)
+#define EVENT_LOG_PAGE_SIZE         5       // Max records per MQTT page (must fit MQTT_BUFFER_SIZE)
+
+// Store-and-forward telemetry (RAM ring spilling to the "telemstore" partition)
+#define STORE_PARTITION_LABEL       "telemstore"
+#define STORE_PARTITION_SUBTYPE     0x41    // Custom data subtype
+#define STORE_SECTOR_SIZE           4096    // Flash erase unit (bytes)
+#define STORE_RAM_SAMPLES           120     // Samples kept in RAM before spilling (2 min at 1 Hz)
+#define STORE_REPLAY_INTERVAL       200     // Time between two replay messages (ms)
+#define STORE_REPLAY_BATCH          8       // Max samples per replay message
+
+// Switching Schedules (stored in NVS, evaluated in local time)
+#define SCHEDULE_MAX_RULES          8       // Rules per channel
+#define SCHEDULE_NVS_NAMESPACE      "schedule"
+#define SCHEDULE_MAX_CLOCK_STEP     120     // Larger clock jumps re-plan instead of firing (s)
+
+// Serializer Benchmark ("bench" serial command)
+// Set to 1 by the esp32dev_bench environment, which also wraps the allocator
+#ifndef BENCH_COUNT_HEAP
+#define BENCH_COUNT_HEAP            0
+#endif
+#define BENCH_DEFAULT_ITERATIONS    1000
+#define BENCH_MAX_ITERATIONS        20000
 
 // Channel Names (for display purposes)
 #define CHANNEL_1_NAME          "Đèn 1"
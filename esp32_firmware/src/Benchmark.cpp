@@ -0,0 +1,230 @@
+/**
+ * @file Benchmark.cpp
+ * @brief Implementation of On-target Serializer Benchmark
+ */
+
+#include "Benchmark.h"
+#include "MQTTManager.h"
+#include <ArduinoJson.h>
+
+#if BENCH_COUNT_HEAP
+// Allocator wrappers, linked in with -Wl,--wrap=<fn> (env:esp32dev_bench).
+// Only calls made by the benchmarking task are counted.
+static volatile uint32_t s_heapOps = 0;
+static TaskHandle_t s_countTask = nullptr;
+
+static inline void countHeapOp() {
+    if (s_countTask != nullptr && xTaskGetCurrentTaskHandle() == s_countTask) s_heapOps++;
+}
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size) {
+    countHeapOp();
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    countHeapOp();
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    countHeapOp();
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void* ptr) {
+    if (ptr != nullptr) countHeapOp();
+    __real_free(ptr);
+}
+}
+#endif
+
+/**
+ * @brief Result of one benchmarked path
+ */
+struct BenchResult {
+    size_t bytes;           // Message length
+    uint32_t avgCycles;     // Average CPU cycles per message
+    uint32_t minCycles;     // Best case CPU cycles per message
+    uint32_t heapOps;       // Heap operations per message (rounded up)
+};
+
+// Fixed sample input, typical magnitudes for a 12 V lamp (extra channels read 0)
+static const uint8_t kSamples = (NUM_CHANNELS > 2) ? NUM_CHANNELS : 2;
+static const float kVoltage[kSamples] = { 12.051f, 11.987f };
+static const float kCurrent[kSamples] = { 1.2346f, 0.5671f };
+static const float kPower[kSamples] = { 14.878f, 6.798f };
+static const uint32_t kTimestamp = 123456789;
+static const uint64_t kTimeUs = 1700000000123456ULL;
+static const INA226Raw kRaw = { 9641, 2469, 595 };    // 12.051 V, 1.2346 A at 0.5 mA LSB
+static const float kCurrentLSB = 0.0005f;
+
+/**
+ * @brief Previous per-channel path: StaticJsonDocument + String numbers
+ */
+static size_t legacyTelemetry(char* buffer, size_t size) {
+    StaticJsonDocument<256> doc;
+
+    doc["channel"] = 1;
+    doc["voltage"] = serialized(String(kVoltage[0], 3));
+    doc["current"] = serialized(String(kCurrent[0], 4));
+    doc["power"] = serialized(String(kPower[0], 3));
+    doc["timestamp"] = kTimestamp;
+    doc["time_us"] = kTimeUs;
+
+    return serializeJson(doc, buffer, size);
+}
+
+/**
+ * @brief Previous combined path: StaticJsonDocument + String numbers
+ */
+static size_t legacyAllTelemetry(char* buffer, size_t size) {
+    StaticJsonDocument<JSON_OBJECT_SIZE(NUM_CHANNELS + 3) + NUM_CHANNELS * (JSON_OBJECT_SIZE(3) + 32)> doc;
+
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        char key[8];
+        snprintf(key, sizeof(key), "ch%u", i + 1);
+
+        JsonObject ch = doc.createNestedObject(key);
+        ch["voltage"] = serialized(String(kVoltage[i], 3));
+        ch["current"] = serialized(String(kCurrent[i], 4));
+        ch["power"] = serialized(String(kPower[i], 3));
+    }
+
+    doc["timestamp"] = kTimestamp;
+    doc["time_us"] = kTimeUs;
+    doc["device_id"] = deviceIdentity.id();
+
+    return serializeJson(doc, buffer, size);
+}
+
+static size_t fixedTelemetry(char* buffer, size_t size) {
+    return MQTTManager::formatTelemetry(buffer, size, 1, kVoltage[0], kCurrent[0],
+                                        kPower[0], kTimestamp, kTimeUs);
+}
+
+static size_t fixedAllTelemetry(char* buffer, size_t size) {
+    return MQTTManager::formatAllTelemetry(buffer, size, kVoltage, kCurrent, kPower,
+                                           NUM_CHANNELS, kTimestamp, kTimeUs);
+}
+
+static BenchResult measure(size_t (*serialize)(char*, size_t), char* buffer, size_t size,
+                           uint32_t iterations) {
+    BenchResult result = {};
+    uint64_t totalCycles = 0;
+    result.minCycles = UINT32_MAX;
+
+#if BENCH_COUNT_HEAP
+    s_heapOps = 0;
+    s_countTask = xTaskGetCurrentTaskHandle();
+#endif
+
+    for (uint32_t n = 0; n < iterations; n++) {
+        uint32_t start = ESP.getCycleCount();
+        result.bytes = serialize(buffer, size);
+        uint32_t cycles = ESP.getCycleCount() - start;
+
+        totalCycles += cycles;
+        if (cycles < result.minCycles) result.minCycles = cycles;
+    }
+
+#if BENCH_COUNT_HEAP
+    s_countTask = nullptr;
+    result.heapOps = (s_heapOps + iterations - 1) / iterations;
+#endif
+
+    result.avgCycles = totalCycles / iterations;
+    return result;
+}
+
+static void printResult(const char* name, const BenchResult& result) {
+#if BENCH_COUNT_HEAP
+    DEBUG_PRINTF("  %-7s %5u B  %7u cycles avg  %7u min  %3u heap ops\n", name,
+                 (unsigned)result.bytes, result.avgCycles, result.minCycles, result.heapOps);
+#else
+    DEBUG_PRINTF("  %-7s %5u B  %7u cycles avg  %7u min  heap ops: n/a\n", name,
+                 (unsigned)result.bytes, result.avgCycles, result.minCycles);
+#endif
+}
+
+static void compare(const char* title, size_t (*legacy)(char*, size_t),
+                    size_t (*fixed)(char*, size_t), uint32_t iterations) {
+    static char legacyOut[MQTT_BUFFER_SIZE];
+    static char fixedOut[MQTT_BUFFER_SIZE];
+
+    BenchResult before = measure(legacy, legacyOut, sizeof(legacyOut), iterations);
+    BenchResult after = measure(fixed, fixedOut, sizeof(fixedOut), iterations);
+
+    DEBUG_PRINTF("%s (%s output)\n", title, strcmp(legacyOut, fixedOut) == 0 ? "identical" : "DIFFERENT");
+    printResult("legacy", before);
+    printResult("fixed", after);
+    if (strcmp(legacyOut, fixedOut) != 0) {
+        DEBUG_PRINTF("  legacy: %s\n  fixed:  %s\n", legacyOut, fixedOut);
+    }
+}
+
+void runTelemetryBenchmark(uint32_t iterations) {
+    if (iterations == 0) iterations = 1;
+
+    DEBUG_PRINTF("\n--- Telemetry serializer benchmark (%u iterations, %u MHz) ---\n",
+                 iterations, ESP.getCpuFreqMHz());
+    compare("Channel telemetry", legacyTelemetry, fixedTelemetry, iterations);
+    compare("Combined telemetry", legacyAllTelemetry, fixedAllTelemetry, iterations);
+#if !BENCH_COUNT_HEAP
+    DEBUG_PRINTLN("Heap operations are counted in the esp32dev_bench build only");
+#endif
+}
+
+/**
+ * @brief Print the wire size of one message as 3.1.1 and as MQTT 5
+ */
+static void printPublishSize(const char* name, TopicHandle topic, size_t length) {
+    const char* topicName = deviceIdentity.topic(topic);
+    size_t topicLength = strlen(topicName);
+    const PublishRule& rule = PublishQueue::ruleFor(topicName);
+    MqttPublishProperties properties = MQTTManager::publishProperties(rule);
+    uint16_t alias = rule.qos == 0 ? 1 : 0;     // Only QoS 0 topics are aliased
+
+    size_t v311 = MqttClient::publishSize(topicLength, length, rule.qos, 4, nullptr, 0, false);
+    size_t first = MqttClient::publishSize(topicLength, length, rule.qos, 5, &properties, alias, false);
+    size_t aliased = MqttClient::publishSize(topicLength, length, rule.qos, 5, &properties, alias, alias != 0);
+    // The same with a Content Type, whether MQTT_CONTENT_TYPES sends one or not
+    properties.contentType = rule.binary ? MQTT_CONTENT_TYPE_BINARY : MQTT_CONTENT_TYPE_JSON;
+    size_t typed = MqttClient::publishSize(topicLength, length, rule.qos, 5, &properties, alias, alias != 0);
+
+    DEBUG_PRINTF("  %-15s %3u+%3u B  %4u B  %4u B  %4u B (%d%%)  %4u B\n", name,
+                 (unsigned)topicLength, (unsigned)length, (unsigned)v311, (unsigned)first,
+                 (unsigned)aliased, (int)(((int32_t)aliased - (int32_t)v311) * 100 / (int32_t)v311),
+                 (unsigned)typed);
+}
+
+void runPublishSizeBenchmark() {
+    static char json[MQTT_BUFFER_SIZE];
+    static uint8_t binary[64];
+    bool valid = true;
+
+    DEBUG_PRINTLN("\n--- Bytes per PUBLISH (topic+payload, 3.1.1, MQTT 5 first, MQTT 5 aliased, "
+                  "aliased with Content Type) ---");
+    printPublishSize("ch1 telemetry", channelTopic(1, CH_TOPIC_TELEMETRY), fixedTelemetry(json, sizeof(json)));
+    printPublishSize("ch1 binary", channelTopic(1, CH_TOPIC_TELEMETRY_BIN),
+                     MQTTManager::formatTelemetryBinary(binary, sizeof(binary), 1, &kRaw, &valid, 1,
+                                                        kCurrentLSB, kTimestamp, kTimeUs));
+    printPublishSize("all telemetry", TOPIC_TELEMETRY, fixedAllTelemetry(json, sizeof(json)));
+
+    // The same comparison over everything sent since boot
+    MqttClientStats stats = mqtt.getClientStats();
+    if (stats.published == 0) {
+        DEBUG_PRINTLN("Nothing published yet");
+        return;
+    }
+    DEBUG_PRINTF("Sent since boot (MQTT %s): %u messages, %u B/msg, as 3.1.1 %u B/msg, %u aliases\n",
+                 stats.protocol == 5 ? "5" : "3.1.1", stats.published,
+                 stats.publishBytes / stats.published, stats.publishBytesV311 / stats.published,
+                 stats.aliases);
+}
@@ -0,0 +1,72 @@
+/**
+ * @file CommandCoalescer.cpp
+ * @brief Implementation of Inbound Command Coalescing
+ */
+
+#include "CommandCoalescer.h"
+#include "LoadController.h"
+#include "Regulator.h"
+
+// Global instance
+CommandCoalescer commandCoalescer;
+
+CommandCoalescer::CommandCoalescer() {
+    memset(_slots, 0, sizeof(_slots));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+bool CommandCoalescer::submitSimulator(uint8_t channel, SimulatorUnit unit, uint32_t value, uint32_t now) {
+    if (!LoadController::isValidChannel(channel)) return false;
+    Slot& slot = _slots[channel - 1];
+    _stats.received++;
+
+    // Quiet channel: no reason to wait
+    if (!slot.pending && now - slot.lastApplied >= COMMAND_COALESCE_MS) {
+        apply(channel, unit, value, now);
+        return true;
+    }
+
+    if (slot.pending) _stats.coalesced++;
+    slot.pending = true;
+    slot.unit = unit;
+    slot.value = value;
+    return false;
+}
+
+void CommandCoalescer::loop(uint32_t now) {
+    for (uint8_t ch = 1; ch <= NUM_CHANNELS; ch++) {
+        Slot& slot = _slots[ch - 1];
+        if (slot.pending && now - slot.lastApplied >= COMMAND_COALESCE_MS) {
+            slot.pending = false;
+            apply(ch, slot.unit, slot.value, now);
+        }
+    }
+}
+
+void CommandCoalescer::cancel(uint8_t channel) {
+    if (!LoadController::isValidChannel(channel)) return;
+    Slot& slot = _slots[channel - 1];
+    if (slot.pending) {
+        slot.pending = false;
+        _stats.coalesced++;
+    }
+}
+
+void CommandCoalescer::apply(uint8_t channel, SimulatorUnit unit, uint32_t value, uint32_t now) {
+    regulator.stop(channel);  // An explicit level ends closed-loop control
+
+    switch (unit) {
+        case SIM_UNIT_PERCENT:
+            loadController.setSimulator(channel, value > 100 ? 100 : value);
+            break;
+        case SIM_UNIT_PERMILLE:
+            loadController.setSimulatorPermille(channel, value > 1000 ? 1000 : value);
+            break;
+        case SIM_UNIT_DUTY:
+            loadController.setSimulatorDuty(channel, value);
+            break;
+    }
+
+    _slots[channel - 1].lastApplied = now;
+    _stats.applied++;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file CommandRpc.cpp
+ * @brief Implementation of Command Responses with Correlation IDs
+ */
+
+#include "CommandRpc.h"
+#include "LoadController.h"
+#include "MQTTManager.h"
+#include <esp_timer.h>
+
+// Global instance
+CommandRpc commandRpc;
+
+static const char* const kResultNames[RPC_RESULT_COUNT] = {
+    "ok", "accepted", "rejected", "invalid", "unknown"
+};
+
+const char* rpcResultName(RpcResult result) {
+    return result < RPC_RESULT_COUNT ? kResultNames[result] : "unknown";
+}
+
+CommandRpc::CommandRpc() {
+    _open = false;
+    _id[0] = '\0';
+    _command[0] = '\0';
+    _channel = 0;
+    _receivedUs = 0;
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void CommandRpc::received() {
+    _open = false;
+    _receivedUs = esp_timer_get_time();
+}
+
+bool CommandRpc::open(JsonVariantConst doc, const char* command, uint8_t channel) {
+    JsonVariantConst id = doc["id"];
+    if (id.isNull()) return false;
+
+    // Kept as JSON text so the backend gets back exactly what it sent
+    if ((!id.is<const char*>() && !id.is<long long>()) || measureJson(id) > RPC_ID_MAX_LENGTH) {
+        _stats.badIds++;
+        DEBUG_PRINTLN("RPC: id must be a string or integer, response skipped");
+        return false;
+    }
+    serializeJson(id, _id, sizeof(_id));
+
+    snprintf(_command, sizeof(_command), "%s", command);
+    _channel = channel;
+    _open = true;
+    _stats.requests++;
+    return true;
+}
+
+void CommandRpc::reply(RpcResult result, const char* error, const char* message) {
+    if (!_open) return;
+    _open = false;
+
+    uint32_t latencyUs = (uint32_t)(esp_timer_get_time() - _receivedUs);
+    _stats.results[result]++;
+    _stats.lastUs = latencyUs;
+    _stats.averageUs = (uint32_t)(((uint64_t)_stats.averageUs * (_stats.requests - 1) + latencyUs) /
+                                  _stats.requests);
+    if (latencyUs > _stats.maxUs) _stats.maxUs = latencyUs;
+
+    StaticJsonDocument<JSON_OBJECT_SIZE(12) + JSON_OBJECT_SIZE(5)> doc;
+    doc["id"] = serialized((const char*)_id);
+    doc["command"] = (const char*)_command;
+    doc["result"] = rpcResultName(result);
+    if (error != nullptr) doc["error"] = error;
+    if (message != nullptr) doc["message"] = message;
+
+    // State after handling, as the status topics would report it
+    JsonObject state = doc.createNestedObject("state");
+    ChannelState ch;
+    if (_channel != 0 && loadController.getChannelState(_channel, ch)) {
+        doc["channel"] = _channel;
+        state["switch"] = ch.mainSwitch;
+        state["simulator"] = ch.simValue;
+        state["permille"] = ch.simPermille;
+        state["fading"] = ch.fading;
+        state["fault"] = (uint8_t)ch.faultCode;
+    } else {
+        uint16_t switches = 0, faults = 0;
+        for (uint8_t c = 1; c <= NUM_CHANNELS; c++) {
+            if (loadController.getSwitchState(c)) switches |= (1U << (c - 1));
+            if (loadController.getFaultCode(c) != FAULT_NONE) faults |= (1U << (c - 1));
+        }
+        state["switches"] = switches;
+        state["faults"] = faults;
+    }
+    doc["latency_us"] = latencyUs;
+
+    if (!mqtt.publishResponse(doc)) {
+        _stats.failed++;
+    }
+}
+
+void CommandRpc::finish() {
+    reply(RPC_OK);
+}
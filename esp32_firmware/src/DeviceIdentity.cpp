@@ -0,0 +1,139 @@
+/**
+ * @file DeviceIdentity.cpp
+ * @brief Implementation of Runtime Device Identity and MQTT Topic Table
+ */
+
+#include "DeviceIdentity.h"
+#include <Preferences.h>
+
+// Global instance
+DeviceIdentity deviceIdentity;
+
+static const char* const kSourceNames[] = { "nvs", "config", "mac" };
+
+const char* deviceIdSourceName(DeviceIdSource source) {
+    return source <= DEVICE_ID_FROM_MAC ? kSourceNames[source] : "unknown";
+}
+
+// Suffixes in DeviceTopic / ChannelTopic order
+static constexpr const char* kDeviceSuffixes[DEVICE_TOPIC_COUNT] = {
+    MQTT_TOPIC_TELEMETRY, MQTT_TOPIC_TELEMETRY_BIN, MQTT_TOPIC_TELEMETRY_BATCH,
+    MQTT_TOPIC_TELEMETRY_REPLAY, MQTT_TOPIC_STATUS, MQTT_TOPIC_CHANNEL_STATUS, MQTT_TOPIC_ERROR,
+    MQTT_TOPIC_POWER, MQTT_TOPIC_HEARTBEAT, MQTT_TOPIC_HEARTBEAT_LINK, MQTT_TOPIC_HEARTBEAT_COMMANDS,
+    MQTT_TOPIC_EVENTS, MQTT_TOPIC_SCHEDULE, MQTT_TOPIC_RESPONSE, MQTT_TOPIC_SHADOW, MQTT_TOPIC_SHADOW_DELTA, MQTT_TOPIC_CONTROL,
+    MQTT_TOPIC_SWITCH_SET, MQTT_TOPIC_SHADOW_DESIRED, MQTT_TOPIC_SHADOW_GET
+};
+
+static constexpr const char* kChannelSuffixes[CHANNEL_TOPIC_COUNT] = {
+    MQTT_CH_TELEMETRY, MQTT_CH_TELEMETRY_BIN, MQTT_CH_STATUS, MQTT_CH_PWM, MQTT_CH_REGULATION,
+    MQTT_CH_SWITCH_SET, MQTT_CH_SIM_SET
+};
+
+// Arena size for the longest possible ID, worked out at compile time
+static constexpr size_t textLength(const char* s) {
+    return *s ? 1 + textLength(s + 1) : 0;
+}
+
+static constexpr size_t totalLength(const char* const* list, size_t count) {
+    return count == 0 ? 0 : textLength(list[0]) + totalLength(list + 1, count - 1);
+}
+
+static constexpr size_t kBaseMax = sizeof(MQTT_TOPIC_ROOT) - 1 + DEVICE_ID_MAX_LENGTH;
+static constexpr size_t kChannelPrefixMax = sizeof(MQTT_TOPIC_CH_PREFIX) - 1 + 3;  // "/ch" + up to 3 digits
+
+static constexpr size_t kArenaSize =
+    (DEVICE_ID_MAX_LENGTH + 1) + (kBaseMax + 1) +
+    DEVICE_TOPIC_COUNT * (kBaseMax + 1) + totalLength(kDeviceSuffixes, DEVICE_TOPIC_COUNT) +
+    NUM_CHANNELS * (CHANNEL_TOPIC_COUNT * (kBaseMax + kChannelPrefixMax + 1) +
+                    totalLength(kChannelSuffixes, CHANNEL_TOPIC_COUNT));
+
+static_assert(kArenaSize <= UINT16_MAX, "topic offsets are 16 bit");
+static_assert(sizeof(DEVICE_ID_PREFIX) - 1 + 12 <= DEVICE_ID_MAX_LENGTH, "MAC-derived ID too long");
+
+// Every string the identity hands out lives here
+static char s_arena[kArenaSize];
+
+DeviceIdentity::DeviceIdentity() {
+    _id = "";
+    _base = "";
+    _source = DEVICE_ID_FROM_CONFIG;
+    memset(_offsets, 0, sizeof(_offsets));
+    _used = 0;
+}
+
+void DeviceIdentity::begin() {
+    char id[DEVICE_ID_MAX_LENGTH + 1];
+    id[0] = '\0';
+
+    Preferences prefs;
+    prefs.begin(DEVICE_NVS_NAMESPACE, true);
+    size_t length = prefs.isKey("id") ? prefs.getString("id", id, sizeof(id)) : 0;
+    prefs.end();
+
+    if (length > 0 && isValidId(id)) {
+        _source = DEVICE_ID_FROM_NVS;
+    } else if (isValidId(DEVICE_ID)) {
+        strcpy(id, DEVICE_ID);
+        _source = DEVICE_ID_FROM_CONFIG;
+    } else {
+        // Factory MAC, byte 0 first (as printed on the module)
+        uint64_t mac = ESP.getEfuseMac();
+        snprintf(id, sizeof(id), "%s%02x%02x%02x%02x%02x%02x", DEVICE_ID_PREFIX,
+                 (uint8_t)mac, (uint8_t)(mac >> 8), (uint8_t)(mac >> 16),
+                 (uint8_t)(mac >> 24), (uint8_t)(mac >> 32), (uint8_t)(mac >> 40));
+        _source = DEVICE_ID_FROM_MAC;
+    }
+
+    _used = 0;
+    _id = append(id);
+    _base = append(MQTT_TOPIC_ROOT, _id);
+
+    for (uint8_t t = 0; t < DEVICE_TOPIC_COUNT; t++) {
+        _offsets[t] = append(_base, kDeviceSuffixes[t]) - s_arena;
+    }
+    for (uint8_t ch = 1; ch <= NUM_CHANNELS; ch++) {
+        char prefix[kChannelPrefixMax + 1];
+        snprintf(prefix, sizeof(prefix), MQTT_TOPIC_CH_PREFIX "%u", ch);
+        for (uint8_t k = 0; k < CHANNEL_TOPIC_COUNT; k++) {
+            _offsets[channelTopic(ch, (ChannelTopic)k)] = append(_base, prefix, kChannelSuffixes[k]) - s_arena;
+        }
+    }
+
+    DEBUG_PRINTF("Topics: %u built, %u/%u B arena\n", TOPIC_HANDLE_COUNT, _used, kArenaSize);
+}
+
+const char* DeviceIdentity::topic(TopicHandle handle) const {
+    return handle < TOPIC_HANDLE_COUNT ? s_arena + _offsets[handle] : "";
+}
+
+bool DeviceIdentity::setId(const char* id) {
+    bool erase = id == nullptr || id[0] == '\0';
+    if (!erase && !isValidId(id)) return false;
+
+    Preferences prefs;
+    if (!prefs.begin(DEVICE_NVS_NAMESPACE, false)) return false;
+    bool ok = erase ? (!prefs.isKey("id") || prefs.remove("id")) : prefs.putString("id", id) == strlen(id);
+    prefs.end();
+    return ok;
+}
+
+bool DeviceIdentity::isValidId(const char* id) {
+    // No MQTT separators or wildcards ('/', '+', '#'), nothing a backend
+    // would need to escape
+    size_t length = 0;
+    for (const char* p = id; *p != '\0'; p++, length++) {
+        char c = *p;
+        bool allowed = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                       (c >= '0' && c <= '9') || c == '-' || c == '_';
+        if (!allowed || length >= DEVICE_ID_MAX_LENGTH) return false;
+    }
+    return length > 0;
+}
+
+const char* DeviceIdentity::append(const char* a, const char* b, const char* c) {
+    // Sized for the longest valid ID in every topic: cannot overflow
+    char* start = s_arena + _used;
+    int written = snprintf(start, kArenaSize - _used, "%s%s%s", a, b, c);
+    _used += written + 1;
+    return start;
+}
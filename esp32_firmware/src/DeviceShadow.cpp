@@ -0,0 +1,286 @@
+/**
+ * @file DeviceShadow.cpp
+ * @brief Implementation of the Versioned Device Shadow
+ */
+
+#include "DeviceShadow.h"
+#include "MQTTManager.h"
+#include "CommandCoalescer.h"
+#include "Regulator.h"
+#include <Preferences.h>
+
+// Global instance
+DeviceShadow deviceShadow;
+
+// Desired fields of a channel (Desired::fields)
+enum : uint8_t {
+    SHADOW_FIELD_SWITCH = 0x01,
+    SHADOW_FIELD_SIMULATOR = 0x02
+};
+
+// Whole document: version, reported and desired with every field, plus the
+// common fields; channel keys ("chN") are copied into the pool
+static const size_t kDocumentSize =
+    JSON_OBJECT_SIZE(8) + 2 * JSON_OBJECT_SIZE(NUM_CHANNELS + 1) +
+    2 * NUM_CHANNELS * JSON_OBJECT_SIZE(3) + 2 * NUM_CHANNELS * 8;
+
+DeviceShadow::DeviceShadow() {
+    memset(_reported, 0, sizeof(_reported));
+    memset(_desired, 0, sizeof(_desired));
+    _reportedValid = false;
+    _published = false;
+    _desiredChanged = false;
+    _version = 0;
+    _versionLimit = 0;
+    _desiredVersion = 0;
+    _documentVersion = 0;
+    _lastDocument = 0;
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void DeviceShadow::begin() {
+    Preferences prefs;
+    prefs.begin(SHADOW_NVS_NAMESPACE, true);
+    // Start after every version an earlier boot may have used
+    _version = prefs.getUInt("version", 0);
+    _desiredVersion = prefs.getUInt("desired", 0);
+    // Fields of that version that were still pending when the device went down
+    if (prefs.getBytesLength("pending") == sizeof(_desired)) {
+        prefs.getBytes("pending", _desired, sizeof(_desired));
+    }
+    prefs.end();
+    _versionLimit = _version;
+
+    DEBUG_PRINTF("Shadow: version %u, desired version %u (pending 0x%04X)\n",
+                 _version, _desiredVersion, getStats().pendingMask);
+}
+
+void DeviceShadow::onConnected() {
+    _published = false;
+    if (reconcile()) _desiredChanged = true;
+    publishDocument();
+}
+
+void DeviceShadow::update() {
+    // Until the session's full document is out there is nothing to diff against
+    if (!_published || !mqtt.isConnected()) return;
+
+    if (reconcile()) _desiredChanged = true;
+
+    Reported now[NUM_CHANNELS];
+    readReported(now);
+
+    StaticJsonDocument<kDocumentSize> doc;
+    JsonObject reported = doc.createNestedObject("reported");
+    bool changed = false;
+
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        const Reported& was = _reported[i];
+        const Reported& is = now[i];
+        if (memcmp(&was, &is, sizeof(Reported)) == 0) continue;
+
+        char key[8];
+        snprintf(key, sizeof(key), "ch%u", i + 1);
+        JsonObject ch = reported.createNestedObject(key);
+        if (is.switchOn != was.switchOn) ch["switch"] = is.switchOn;
+        if (is.simulator != was.simulator) ch["simulator"] = is.simulator;
+        if (is.fault != was.fault) ch["fault"] = (uint8_t)is.fault;
+        changed = true;
+    }
+
+    if (!changed && !_desiredChanged) return;
+
+    if (_desiredChanged) addDesired(doc.as<JsonObject>());
+    nextVersion();
+    doc["version"] = _version;
+
+    memcpy(_reported, now, sizeof(_reported));
+    _desiredChanged = false;
+    _stats.deltas++;
+    mqtt.publishShadow(doc, false);
+}
+
+void DeviceShadow::loop(uint32_t now) {
+    // Deltas carry every change; the retained copy only has to catch up
+    // eventually for subscribers that start from it
+    if (_published && _documentVersion != _version && now - _lastDocument >= SHADOW_SNAPSHOT_INTERVAL) {
+        publishDocument();
+    }
+}
+
+void DeviceShadow::publishDocument() {
+    if (!mqtt.isConnected()) return;
+
+    Reported now[NUM_CHANNELS];
+    readReported(now);
+    if (!_reportedValid || memcmp(now, _reported, sizeof(_reported)) != 0 || _desiredChanged) {
+        nextVersion();
+    }
+
+    StaticJsonDocument<kDocumentSize> doc;
+    doc["version"] = _version;
+    JsonObject reported = doc.createNestedObject("reported");
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        char key[8];
+        snprintf(key, sizeof(key), "ch%u", i + 1);
+        JsonObject ch = reported.createNestedObject(key);
+        ch["switch"] = now[i].switchOn;
+        ch["simulator"] = now[i].simulator;
+        ch["fault"] = (uint8_t)now[i].fault;
+    }
+    addDesired(doc.as<JsonObject>());
+
+    memcpy(_reported, now, sizeof(_reported));
+    _reportedValid = true;
+    _published = true;
+    _desiredChanged = false;
+    _documentVersion = _version;
+    _lastDocument = millis();
+    _stats.documents++;
+    mqtt.publishShadow(doc, true);
+}
+
+RpcResult DeviceShadow::applyDesired(JsonVariantConst doc) {
+    uint32_t version = doc["version"] | 0UL;
+    if (version == 0) return RPC_INVALID;
+
+    // Retained copy redelivered on reconnect (also after a reboot: its
+    // pending fields were restored from NVS), or an out-of-order update
+    if (version <= _desiredVersion) {
+        _stats.staleDesired++;
+        return RPC_OK;
+    }
+
+    // Validate everything before changing anything
+    Desired desired[NUM_CHANNELS];
+    memset(desired, 0, sizeof(desired));
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        char key[8];
+        snprintf(key, sizeof(key), "ch%u", i + 1);
+        JsonVariantConst entry = doc[key];
+        if (entry.isNull()) continue;
+
+        JsonVariantConst state = entry["switch"];
+        if (!state.isNull()) {
+            if (!state.is<bool>()) return RPC_INVALID;
+            desired[i].fields |= SHADOW_FIELD_SWITCH;
+            desired[i].switchOn = state.as<bool>();
+        }
+        JsonVariantConst level = entry["simulator"];
+        if (!level.isNull()) {
+            int value = level | -1;
+            if (value < 0 || value > 100) return RPC_INVALID;
+            desired[i].fields |= SHADOW_FIELD_SIMULATOR;
+            desired[i].simulator = value;
+        }
+    }
+
+    // A newer desired state replaces whatever was still pending
+    memcpy(_desired, desired, sizeof(_desired));
+    _desiredVersion = version;
+    saveDesired();
+    _stats.desiredUpdates++;
+    _desiredChanged = true;
+    DEBUG_PRINTF("Shadow: desired version %u\n", version);
+
+    reconcile();
+    update();
+
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if (_desired[i].fields != 0) return RPC_REJECTED;
+    }
+    return RPC_OK;
+}
+
+ShadowStats DeviceShadow::getStats() const {
+    ShadowStats stats = _stats;
+    stats.version = _version;
+    stats.desiredVersion = _desiredVersion;
+    stats.pendingMask = 0;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if (_desired[i].fields != 0) stats.pendingMask |= (1U << i);
+    }
+    return stats;
+}
+
+bool DeviceShadow::reconcile() {
+    bool changed = false;
+
+    for (uint8_t ch = 1; ch <= NUM_CHANNELS; ch++) {
+        Desired& desired = _desired[ch - 1];
+        if (desired.fields == 0) continue;
+
+        ChannelState state;
+        if (!loadController.getChannelState(ch, state)) continue;
+
+        if (desired.fields & SHADOW_FIELD_SWITCH) {
+            // Refused while faulted or disabled: stays pending
+            if (state.mainSwitch == desired.switchOn || loadController.setSwitch(ch, desired.switchOn)) {
+                desired.fields &= ~SHADOW_FIELD_SWITCH;
+                changed = true;
+            }
+        }
+        if (desired.fields & SHADOW_FIELD_SIMULATOR) {
+            if (state.simValue != desired.simulator) {
+                // Same as an explicit sim/set: the level wins over a fade or regulation
+                commandCoalescer.cancel(ch);
+                regulator.stop(ch);
+            }
+            if (state.simValue == desired.simulator || loadController.setSimulator(ch, desired.simulator)) {
+                desired.fields &= ~SHADOW_FIELD_SIMULATOR;
+                changed = true;
+            }
+        }
+    }
+    if (changed) saveDesired();
+    return changed;
+}
+
+void DeviceShadow::readReported(Reported reported[]) const {
+    memset(reported, 0, NUM_CHANNELS * sizeof(Reported));
+    for (uint8_t ch = 1; ch <= NUM_CHANNELS; ch++) {
+        ChannelState state;
+        if (!loadController.getChannelState(ch, state)) continue;
+        reported[ch - 1].switchOn = state.mainSwitch;
+        reported[ch - 1].simulator = state.simValue;
+        reported[ch - 1].fault = state.faultCode;
+    }
+}
+
+void DeviceShadow::nextVersion() {
+    _version++;
+    if (_version >= _versionLimit) {
+        // Reserve the next block before using it, so a reboot never reuses a version
+        _versionLimit = _version + SHADOW_VERSION_RESERVE;
+        saveVersions();
+    }
+}
+
+void DeviceShadow::saveVersions() {
+    Preferences prefs;
+    prefs.begin(SHADOW_NVS_NAMESPACE, false);
+    prefs.putUInt("version", _versionLimit);
+    prefs.end();
+}
+
+void DeviceShadow::saveDesired() {
+    Preferences prefs;
+    prefs.begin(SHADOW_NVS_NAMESPACE, false);
+    prefs.putUInt("desired", _desiredVersion);
+    prefs.putBytes("pending", _desired, sizeof(_desired));
+    prefs.end();
+}
+
+void DeviceShadow::addDesired(JsonObject parent) const {
+    JsonObject desired = parent.createNestedObject("desired");
+    desired["version"] = _desiredVersion;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if (_desired[i].fields == 0) continue;
+
+        char key[8];
+        snprintf(key, sizeof(key), "ch%u", i + 1);
+        JsonObject ch = desired.createNestedObject(key);
+        if (_desired[i].fields & SHADOW_FIELD_SWITCH) ch["switch"] = _desired[i].switchOn;
+        if (_desired[i].fields & SHADOW_FIELD_SIMULATOR) ch["simulator"] = _desired[i].simulator;
+    }
+}
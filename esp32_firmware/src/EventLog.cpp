@@ -0,0 +1,51 @@
+/**
+ * @file EventLog.cpp
+ * @brief Implementation of Persistent Event Log
+ */
+
+#include "EventLog.h"
+#include <stddef.h>
+
+// Global instance
+EventLog eventLog;
+
+static const char* const kEventTypeNames[EVENT_TYPE_COUNT] = {
+    "UNKNOWN", "REBOOT", "TRIP", "WARNING", "FAULT_CLEAR", "CONFIG", "SHED"
+};
+
+const char* eventTypeName(uint8_t type) {
+    return (type < EVENT_TYPE_COUNT) ? kEventTypeNames[type] : kEventTypeNames[0];
+}
+
+EventLog::EventLog()
+    : _ring("Event log", sizeof(EventRecord), offsetof(EventRecord, crc), EVENT_LOG_SECTOR_SIZE) {
+}
+
+bool EventLog::begin() {
+    const esp_partition_t* partition = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)EVENT_LOG_PARTITION_SUBTYPE,
+        EVENT_LOG_PARTITION_LABEL);
+    if (partition == nullptr) {
+        DEBUG_PRINTLN("Event log partition not found - check partitions.csv");
+        return false;
+    }
+    if (!_ring.begin(partition)) return false;
+
+    DEBUG_PRINTF("Event log: %u slots, records %u..%u\n",
+                 _ring.getCapacity(), _ring.getOldestSeq(), _ring.getNextSeq());
+    return true;
+}
+
+bool EventLog::append(EventType type, uint8_t channel, uint8_t code, float value) {
+    EventRecord record;
+    record.timestamp = millis();
+    record.value = value;
+    record.type = type;
+    record.channel = channel;
+    record.code = code;
+    return _ring.append(&record);   // Fills in seq and crc
+}
+
+bool EventLog::read(uint32_t seq, EventRecord& record) {
+    return _ring.read(seq, &record);
+}
@@ -0,0 +1,165 @@
+/**
+ * @file FlashRing.cpp
+ * @brief Implementation of Append-only Flash Record Ring
+ */
+
+#include "FlashRing.h"
+
+static const uint32_t kErasedSeq = 0xFFFFFFFF;
+
+FlashRing::FlashRing(const char* name, size_t recordSize, size_t crcOffset, uint32_t sectorSize) {
+    _name = name;
+    _partition = nullptr;
+    _recordSize = recordSize;
+    _crcOffset = crcOffset;
+    _sectorSize = sectorSize;
+    _recordsPerSector = sectorSize / recordSize;
+    _capacity = 0;
+    _nextSeq = 0;
+    _oldestSeq = 0;
+}
+
+bool FlashRing::begin(const esp_partition_t* partition) {
+    if (partition == nullptr || _recordSize > FLASH_RING_MAX_RECORD ||
+        _recordSize < sizeof(uint32_t) || _crcOffset >= _recordSize) {
+        return false;
+    }
+
+    uint32_t sectors = partition->size / _sectorSize;
+    _partition = partition;
+    _capacity = sectors * _recordsPerSector;
+
+    // The first slot of every sector tells us which sectors hold data and
+    // which one was written last (highest sequence number).
+    bool found = false;
+    uint32_t newestSector = 0;
+    uint32_t newestFirstSeq = 0;
+    uint32_t oldestSeq = kErasedSeq;
+    uint32_t record[FLASH_RING_MAX_RECORD / sizeof(uint32_t)];  // Word-aligned for the seq read
+    const uint32_t& seq = record[0];
+
+    for (uint32_t sector = 0; sector < sectors; sector++) {
+        uint32_t slot = sector * _recordsPerSector;
+        if (!readSlot(slot, record) || !isValid(record, slot)) continue;
+
+        if (!found || seq > newestFirstSeq) {
+            newestFirstSeq = seq;
+            newestSector = sector;
+        }
+        if (seq < oldestSeq) oldestSeq = seq;
+        found = true;
+    }
+
+    if (!found) {
+        // Fresh (or foreign) partition: start from a clean slate
+        DEBUG_PRINTF("%s empty - formatting partition\n", _name);
+        esp_partition_erase_range(_partition, 0, _partition->size);
+        _nextSeq = 0;
+        _oldestSeq = 0;
+    } else {
+        // Walk the newest sector to the last intact record
+        _nextSeq = newestFirstSeq + 1;
+        for (uint32_t i = 1; i < _recordsPerSector; i++) {
+            uint32_t slot = newestSector * _recordsPerSector + i;
+            if (!readSlot(slot, record) || !isValid(record, slot) ||
+                seq != newestFirstSeq + i) {
+                break;
+            }
+            _nextSeq = seq + 1;
+        }
+        _oldestSeq = oldestSeq;
+    }
+
+    // Skip slots left half-written by a power loss: they cannot be
+    // rewritten until their sector is erased on the next wrap.
+    while (_nextSeq % _recordsPerSector != 0 && !isErased(_nextSeq % _capacity)) {
+        _nextSeq++;
+    }
+    return true;
+}
+
+bool FlashRing::append(void* record) {
+    if (_partition == nullptr) return false;
+
+    *(uint32_t*)record = _nextSeq;
+    ((uint8_t*)record)[_crcOffset] = crc8((const uint8_t*)record, _crcOffset);
+
+    uint32_t slot = _nextSeq % _capacity;
+
+    // Entering a new sector: erase it, dropping its oldest records
+    if (slot % _recordsPerSector == 0) {
+        esp_err_t err = esp_partition_erase_range(_partition, slotAddress(slot), _sectorSize);
+        if (err != ESP_OK) {
+            DEBUG_PRINTF("%s erase failed: %d\n", _name, err);
+            return false;
+        }
+        if (_nextSeq >= _capacity) {
+            uint32_t firstKept = _nextSeq - _capacity + _recordsPerSector;
+            if (_oldestSeq < firstKept) _oldestSeq = firstKept;
+        }
+    }
+
+    esp_err_t err = esp_partition_write(_partition, slotAddress(slot), record, _recordSize);
+    _nextSeq++;
+
+    if (err != ESP_OK) {
+        DEBUG_PRINTF("%s write failed: %d\n", _name, err);
+        return false;
+    }
+    return true;
+}
+
+bool FlashRing::read(uint32_t seq, void* record) {
+    if (_partition == nullptr) return false;
+    if (seq < _oldestSeq || seq >= _nextSeq) return false;
+
+    uint32_t slot = seq % _capacity;
+    return readSlot(slot, record) && isValid(record, slot) && *(const uint32_t*)record == seq;
+}
+
+bool FlashRing::write(uint32_t seq, size_t offset, const void* data, size_t length) {
+    if (_partition == nullptr || offset + length > _recordSize) return false;
+    if (seq < _oldestSeq || seq >= _nextSeq) return false;
+
+    return esp_partition_write(_partition, slotAddress(seq % _capacity) + offset,
+                               data, length) == ESP_OK;
+}
+
+uint32_t FlashRing::slotAddress(uint32_t slot) {
+    // Records never straddle a sector, so one sector can be erased alone
+    return (slot / _recordsPerSector) * _sectorSize + (slot % _recordsPerSector) * _recordSize;
+}
+
+bool FlashRing::readSlot(uint32_t slot, void* record) {
+    return esp_partition_read(_partition, slotAddress(slot), record, _recordSize) == ESP_OK;
+}
+
+bool FlashRing::isValid(const void* record, uint32_t slot) {
+    uint32_t seq = *(const uint32_t*)record;
+    if (seq == kErasedSeq) return false;
+    if (seq % _capacity != slot) return false;
+    return ((const uint8_t*)record)[_crcOffset] == crc8((const uint8_t*)record, _crcOffset);
+}
+
+bool FlashRing::isErased(uint32_t slot) {
+    uint32_t record[FLASH_RING_MAX_RECORD / sizeof(uint32_t)];
+    if (!readSlot(slot, record)) return false;
+
+    const uint8_t* bytes = (const uint8_t*)record;
+    for (size_t i = 0; i < _recordSize; i++) {
+        if (bytes[i] != 0xFF) return false;
+    }
+    return true;
+}
+
+uint8_t FlashRing::crc8(const uint8_t* data, size_t length) {
+    // CRC-8/MAXIM, polynomial 0x31 (reflected 0x8C)
+    uint8_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : (crc >> 1);
+        }
+    }
+    return crc;
+}
@@ -150,13 +150,18 @@ void INA226::setMode(uint16_t mode) {
 }
 
 bool INA226::readAll(float *voltage, float *current, float *power) {
+    INA226Raw raw;
+    return readAll(voltage, current, power, &raw);
+}
+
+bool INA226::readAll(float *voltage, float *current, float *power, INA226Raw *raw) {
     if (!_initialized) {
         return false;
     }
     
     // Read bus voltage
-    uint16_t vBus = readRegister(INA226_REG_BUS_VOLTAGE);
-    *voltage = vBus * 0.00125;
+    raw->busVoltage = readRegister(INA226_REG_BUS_VOLTAGE);
+    *voltage = raw->busVoltage * INA226_BUS_VOLTAGE_LSB;
     
     if (_currentLSB == 0) {
         // Not calibrated - calculate from shunt voltage
@@ -164,13 +169,15 @@ bool INA226::readAll(float *voltage, float *current, float *power) {
         float shuntVoltage_mV = vShunt * 0.0025;
         *current = (shuntVoltage_mV / 1000.0) / _shuntResistor;
         *power = (*voltage) * (*current);
+        raw->current = 0;
+        raw->power = 0;
     } else {
         // Calibrated - read from registers
-        int16_t cur = (int16_t)readRegister(INA226_REG_CURRENT);
-        *current = cur * _currentLSB;
+        raw->current = (int16_t)readRegister(INA226_REG_CURRENT);
+        *current = raw->current * _currentLSB;
         
-        uint16_t pwr = readRegister(INA226_REG_POWER);
-        *power = pwr * _powerLSB;
+        raw->power = readRegister(INA226_REG_POWER);
+        *power = raw->power * _powerLSB;
     }
     
     // Ensure non-negative values (measurement noise can cause small negatives)
@@ -180,6 +187,13 @@ bool INA226::readAll(float *voltage, float *current, float *power) {
     return true;
 }
 
+bool INA226::conversionReady() {
+    if (!_initialized) {
+        return false;
+    }
+    return (readRegister(INA226_REG_MASK_ENABLE) & INA226_MASK_CVRF) != 0;
+}
+
 void INA226::writeRegister(uint8_t reg, uint16_t value) {
     _wire->beginTransmission(_address);
     _wire->write(reg);
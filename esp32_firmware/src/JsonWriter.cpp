@@ -0,0 +1,139 @@
+/**
+ * @file JsonWriter.cpp
+ * @brief Implementation of Allocation-free JSON Writer
+ */
+
+#include "JsonWriter.h"
+
+static const uint32_t kPow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+JsonWriter::JsonWriter(char* buffer, size_t size) {
+    _buffer = buffer;
+    _size = size;
+    _length = 0;
+    _overflow = (size == 0);
+    _needComma = false;
+}
+
+JsonWriter& JsonWriter::beginObject(const char* key) {
+    putKey(key);
+    putChar('{');
+    _needComma = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::endObject() {
+    putChar('}');
+    _needComma = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::beginArray(const char* key) {
+    putKey(key);
+    putChar('[');
+    _needComma = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::endArray() {
+    putChar(']');
+    _needComma = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::add(const char* key, uint32_t value) {
+    putKey(key);
+    putUInt(value);
+    _needComma = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::addUInt64(const char* key, uint64_t value) {
+    putKey(key);
+    char digits[20];
+    uint8_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) putChar(digits[--count]);
+    _needComma = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::add(const char* key, const char* value) {
+    putKey(key);
+    putChar('"');
+    putRaw(value);
+    putChar('"');
+    _needComma = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::addFixed(const char* key, float value, uint8_t decimals) {
+    if (decimals > 6) decimals = 6;
+    putKey(key);
+    _needComma = true;
+
+    float scaled = fabsf(value) * kPow10[decimals] + 0.5f;
+    if (!(scaled < 4294967040.0f)) {  // NaN, inf, or past the largest float below 2^32
+        putRaw("null");
+        return *this;
+    }
+
+    uint32_t fixed = (uint32_t)scaled;
+    if (value < 0 && fixed != 0) putChar('-');
+    putUInt(fixed / kPow10[decimals]);
+    if (decimals > 0) {
+        putChar('.');
+        putUInt(fixed % kPow10[decimals], decimals);
+    }
+    return *this;
+}
+
+double JsonWriter::fixed(float value, uint8_t decimals) {
+    if (decimals > 6) decimals = 6;
+    return round((double)value * kPow10[decimals]) / kPow10[decimals];
+}
+
+size_t JsonWriter::finish() {
+    if (_overflow || _length >= _size) {
+        if (_size > 0) _buffer[0] = '\0';
+        return 0;
+    }
+    _buffer[_length] = '\0';
+    return _length;
+}
+
+void JsonWriter::putChar(char c) {
+    // Keep one byte for the terminating NUL
+    if (_length + 1 >= _size) {
+        _overflow = true;
+        return;
+    }
+    _buffer[_length++] = c;
+}
+
+void JsonWriter::putRaw(const char* text) {
+    while (*text) putChar(*text++);
+}
+
+void JsonWriter::putKey(const char* key) {
+    if (_needComma) putChar(',');
+    if (key == nullptr) return;  // Array element
+    putChar('"');
+    putRaw(key);
+    putChar('"');
+    putChar(':');
+}
+
+void JsonWriter::putUInt(uint32_t value, uint8_t minDigits) {
+    char digits[10];
+    uint8_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (count < minDigits && count < sizeof(digits)) digits[count++] = '0';
+    while (count > 0) putChar(digits[--count]);
+}
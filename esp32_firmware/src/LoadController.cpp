@@ -4,230 +4,867 @@
  */
 
 #include "LoadController.h"
+#include <Preferences.h>
+#include <esp_attr.h>
+#include <esp_rom_crc.h>
+#include <soc/gpio_struct.h>
 
 // Global instance
 LoadController loadController;
 
+// Per-channel hardware tables (index 0 = Channel 1)
+static const uint8_t kMainSwitchPins[] = MAIN_SWITCH_PINS;
+static const uint8_t kSimulatorPins[] = SIMULATOR_PINS;
+static const uint8_t kPWMChannels[] = PWM_CHANNELS_SIM;
+
+static_assert(sizeof(kMainSwitchPins) == NUM_CHANNELS, "MAIN_SWITCH_PINS needs NUM_CHANNELS entries");
+static_assert(sizeof(kSimulatorPins) == NUM_CHANNELS, "SIMULATOR_PINS needs NUM_CHANNELS entries");
+static_assert(sizeof(kPWMChannels) == NUM_CHANNELS, "PWM_CHANNELS_SIM needs NUM_CHANNELS entries");
+
+// Keeps the register writes of setSwitches() back to back
+static portMUX_TYPE gpioMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Guards _fadeDoneMask against the LEDC fade-end interrupt
+static portMUX_TYPE fadeMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char* const kRestorePolicyNames[RESTORE_POLICY_COUNT] = {
+    "last", "off", "default"
+};
+
+/**
+ * @brief Output state as saved in RTC memory and NVS
+ */
+struct PersistedState {
+    uint32_t magic;
+    uint16_t channelCount;
+    uint16_t switchMask;            // bit N-1 = channel N ON
+    struct {
+        float faultValue;
+        uint32_t pwmFrequency;
+        uint16_t simPermille;
+        uint8_t pwmResolution;
+        uint8_t faultCode;
+    } channels[NUM_CHANNELS];
+    uint32_t crc;                   // CRC-32 of everything above
+};
+
+static const uint32_t kStateMagic = 0x4C445354;  // "LDST"
+
+// Survives software resets, watchdog and brownout resets; garbage after power-on
+RTC_NOINIT_ATTR static PersistedState rtcState;
+
+static uint32_t stateCrc(const PersistedState& state) {
+    return esp_rom_crc32_le(0, (const uint8_t*)&state, offsetof(PersistedState, crc));
+}
+
+static bool isValidState(const PersistedState& state) {
+    return state.magic == kStateMagic && state.channelCount == NUM_CHANNELS &&
+           state.crc == stateCrc(state);
+}
+
+static const char* const kFadeCurveNames[FADE_CURVE_COUNT] = {
+    "linear", "ease_in", "ease_out", "ease_in_out"
+};
+
+// Arduino LEDC channel number -> IDF speed mode / channel
+static ledc_mode_t ledcMode(uint8_t pwmChannel) {
+#ifdef SOC_LEDC_SUPPORT_HS_MODE
+    return (pwmChannel < SOC_LEDC_CHANNEL_NUM) ? LEDC_HIGH_SPEED_MODE : LEDC_LOW_SPEED_MODE;
+#else
+    return LEDC_LOW_SPEED_MODE;
+#endif
+}
+
+static ledc_channel_t ledcChannel(uint8_t pwmChannel) {
+    return (ledc_channel_t)(pwmChannel % SOC_LEDC_CHANNEL_NUM);
+}
+
+// Timer the Arduino core binds to an LEDC channel (channels 2k, 2k+1 share)
+static ledc_timer_t ledcTimer(uint8_t pwmChannel) {
+    return (ledc_timer_t)((pwmChannel / 2) % 4);
+}
+
+// LEDC timer clock divider: 10.8 fixed point, integer part 1..1023
+static uint32_t ledcDivider(uint32_t frequency, uint8_t resolution) {
+    return (uint32_t)(((uint64_t)APB_CLK_FREQ << 8) / ((uint64_t)frequency << resolution));
+}
+static const uint32_t kMinDivider = 1 << 8;
+static const uint32_t kMaxDivider = (1 << 18) - 1;
+
+// Fault messages and value units, indexed by FaultCode
+static const char* const kFaultMessages[FAULT_CODE_COUNT] = {
+    "None",
+    "Overcurrent",
+    "Overvoltage",
+    "Undervoltage",
+    "Manual shutdown"
+};
+
+static const char* const kFaultUnits[FAULT_CODE_COUNT] = {
+    "", "A", "V", "V", ""
+};
+
+const char* faultCodeMessage(FaultCode code) {
+    return (code < FAULT_CODE_COUNT) ? kFaultMessages[code] : "Unknown";
+}
+
+const char* faultCodeUnit(FaultCode code) {
+    return (code < FAULT_CODE_COUNT) ? kFaultUnits[code] : "";
+}
+
+const char* restorePolicyName(RestorePolicy policy) {
+    return (policy < RESTORE_POLICY_COUNT) ? kRestorePolicyNames[policy] : "unknown";
+}
+
+bool parseRestorePolicy(const char* name, RestorePolicy& policy) {
+    if (name == nullptr) return false;
+    for (uint8_t i = 0; i < RESTORE_POLICY_COUNT; i++) {
+        if (strcmp(name, kRestorePolicyNames[i]) == 0) {
+            policy = (RestorePolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parseFadeCurve(const char* name, FadeCurve& curve) {
+    if (name == nullptr) {
+        curve = FADE_LINEAR;
+        return true;
+    }
+    for (uint8_t i = 0; i < FADE_CURVE_COUNT; i++) {
+        if (strcmp(name, kFadeCurveNames[i]) == 0) {
+            curve = (FadeCurve)i;
+            return true;
+        }
+    }
+    return false;
+}
+
 LoadController::LoadController() {
-    // Initialize channel 1 state
-    _channel1.mainSwitch = false;
-    _channel1.simValue = 100;      // Default: full conduction (normal operation)
-    _channel1.simPWM = 255;
-    _channel1.fault = false;
-    _channel1.faultReason = "";
-    _channel1.lastFaultTime = 0;
-    
-    // Initialize channel 2 state
-    _channel2.mainSwitch = false;
-    _channel2.simValue = 100;
-    _channel2.simPWM = 255;
-    _channel2.fault = false;
-    _channel2.faultReason = "";
-    _channel2.lastFaultTime = 0;
-    
-    _channel1Enabled = true;
-    _channel2Enabled = true;
-    _channel1Changed = false;
-    _channel2Changed = false;
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        _channels[i].mainSwitch = false;
+        _channels[i].simValue = 100;      // Default: full conduction (normal operation)
+        _channels[i].simPermille = 1000;
+        _channels[i].simDuty = permilleToDuty(1000, PWM_RESOLUTION);
+        _channels[i].pwmFrequency = PWM_FREQUENCY;
+        _channels[i].pwmResolution = PWM_RESOLUTION;
+        _channels[i].faultCode = FAULT_NONE;
+        _channels[i].faultValue = 0;
+        _channels[i].lastFaultTime = 0;
+        _channels[i].fading = false;
+    }
+    memset(_fades, 0, sizeof(_fades));
+    _fadeDoneMask = 0;
+
+    _enabledMask = allChannelsMask();
+    _changedMask = 0;
+    _defaultMask = STATE_DEFAULT_SWITCHES;
+    _restorePolicy = (RestorePolicy)STATE_RESTORE_POLICY;
+    _restoreSource = "none";
+    _statePending = false;
+    _stateChangedAt = 0;
+    _mutex = nullptr;
 }
 
 void LoadController::begin() {
     DEBUG_PRINTLN("Initializing Load Controller...");
-    
-    // Configure main switch pins as outputs
-    pinMode(MAIN_SWITCH_PIN_1, OUTPUT);
-    pinMode(MAIN_SWITCH_PIN_2, OUTPUT);
-    
-    // Initialize main switches to OFF
-    digitalWrite(MAIN_SWITCH_PIN_1, LOW);
-    digitalWrite(MAIN_SWITCH_PIN_2, LOW);
-    
-    // Configure PWM for simulators using LEDC
-    // Channel 1 simulator
-    ledcSetup(PWM_CHANNEL_SIM1, PWM_FREQUENCY, PWM_RESOLUTION);
-    ledcAttachPin(SIMULATOR_PIN_1, PWM_CHANNEL_SIM1);
-    ledcWrite(PWM_CHANNEL_SIM1, 255);  // Full conduction (normal)
-    
-    // Channel 2 simulator
-    ledcSetup(PWM_CHANNEL_SIM2, PWM_FREQUENCY, PWM_RESOLUTION);
-    ledcAttachPin(SIMULATOR_PIN_2, PWM_CHANNEL_SIM2);
-    ledcWrite(PWM_CHANNEL_SIM2, 255);  // Full conduction (normal)
-    
+
+    _mutex = xSemaphoreCreateRecursiveMutexStatic(&_mutexBuffer);
+
+    // Decide the boot state before any pin is driven, so a channel that was
+    // ON does not blink OFF across a reset
+    restoreState();
+
+    for (uint8_t channel = 1; channel <= NUM_CHANNELS; channel++) {
+        uint8_t i = channel - 1;
+        ChannelState* ch = &_channels[i];
+
+        // Configure main switch pin as output with the restored state
+        pinMode(kMainSwitchPins[i], OUTPUT);
+        applyMainSwitch(channel);
+
+        // Configure PWM for simulator using LEDC
+        ledcSetup(kPWMChannels[i], ch->pwmFrequency, ch->pwmResolution);
+        ledcAttachPin(kSimulatorPins[i], kPWMChannels[i]);
+        applySimulator(channel);
+    }
+
+    // Simulators sharing an LEDC timer cannot get separate PWM settings
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        for (uint8_t j = i + 1; j < NUM_CHANNELS; j++) {
+            if (ledcMode(kPWMChannels[i]) == ledcMode(kPWMChannels[j]) &&
+                ledcTimer(kPWMChannels[i]) == ledcTimer(kPWMChannels[j])) {
+                DEBUG_PRINTF("Warning: CH%d and CH%d share an LEDC timer\n", i + 1, j + 1);
+            }
+        }
+    }
+
+    // Hardware fade unit: completion is reported per channel by interrupt
+    ledc_fade_func_install(0);
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        ledc_cbs_t callbacks = { .fade_cb = onFadeEnd };
+        ledc_cb_register(ledcMode(kPWMChannels[i]), ledcChannel(kPWMChannels[i]),
+                         &callbacks, (void*)(uintptr_t)i);
+    }
+
     DEBUG_PRINTLN("Load Controller initialized");
-    DEBUG_PRINTF("  CH1: Main=%d, Sim=%d\n", MAIN_SWITCH_PIN_1, SIMULATOR_PIN_1);
-    DEBUG_PRINTF("  CH2: Main=%d, Sim=%d\n", MAIN_SWITCH_PIN_2, SIMULATOR_PIN_2);
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        DEBUG_PRINTF("  CH%d: Main=%d, Sim=%d\n", i + 1, kMainSwitchPins[i], kSimulatorPins[i]);
+    }
 }
 
 bool LoadController::setSwitch(uint8_t channel, bool state) {
-    ChannelState* ch = getChannelState(channel);
-    if (ch == nullptr) return false;
-    
+    if (!isValidChannel(channel)) return false;
+    ChannelState* ch = &_channels[channel - 1];
+
+    lock();
+
     // Check if channel is enabled
-    if ((channel == 1 && !_channel1Enabled) || (channel == 2 && !_channel2Enabled)) {
+    if (!(_enabledMask & (1U << (channel - 1)))) {
+        unlock();
         DEBUG_PRINTF("Channel %d is disabled\n", channel);
         return false;
     }
-    
+
     // Check for fault condition
-    if (ch->fault && state) {
-        DEBUG_PRINTF("Cannot turn ON channel %d - fault present: %s\n", 
-                    channel, ch->faultReason.c_str());
+    if (ch->faultCode != FAULT_NONE && state) {
+        FaultCode code = ch->faultCode;
+        unlock();
+        DEBUG_PRINTF("Cannot turn ON channel %d - fault present: %s\n",
+                    channel, faultCodeMessage(code));
         return false;
     }
-    
+
     ch->mainSwitch = state;
     applyMainSwitch(channel);
-    
-    // Set state changed flag
-    if (channel == 1) _channel1Changed = true;
-    else _channel2Changed = true;
-    
+    markChanged(channel);
+
+    unlock();
+
     DEBUG_PRINTF("Channel %d switch set to %s\n", channel, state ? "ON" : "OFF");
     return true;
 }
 
+bool LoadController::setSwitches(uint16_t mask, uint16_t states, uint16_t* rejected) {
+    mask &= allChannelsMask();
+    states &= mask;
+
+    lock();
+
+    // Validate every channel before touching any output
+    uint16_t bad = mask & ~_enabledMask;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if ((states & (1U << i)) && _channels[i].faultCode != FAULT_NONE) {
+            bad |= (1U << i);
+        }
+    }
+    if (rejected != nullptr) *rejected = bad;
+
+    if (bad != 0 || mask == 0) {
+        unlock();
+        DEBUG_PRINTF("Multi-switch rejected: mask=0x%04X bad=0x%04X\n", mask, bad);
+        return false;
+    }
+
+    // Collect pin bits for the GPIO W1TS/W1TC registers (pins 32+ live in
+    // the second bank)
+    uint32_t set0 = 0, clear0 = 0, set1 = 0, clear1 = 0;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if (!(mask & (1U << i))) continue;
+
+        bool on = states & (1U << i);
+        uint8_t pin = kMainSwitchPins[i];
+        if (pin < 32) {
+            (on ? set0 : clear0) |= (1UL << pin);
+        } else {
+            (on ? set1 : clear1) |= (1UL << (pin - 32));
+        }
+
+        _channels[i].mainSwitch = on;
+        markChanged(i + 1);
+    }
+
+    // One write per register: every channel in a bank switches on the same
+    // clock edge, with no task switch in between
+    portENTER_CRITICAL(&gpioMux);
+    if (clear0) GPIO.out_w1tc = clear0;
+    if (set0) GPIO.out_w1ts = set0;
+    if (clear1) GPIO.out1_w1tc.val = clear1;
+    if (set1) GPIO.out1_w1ts.val = set1;
+    portEXIT_CRITICAL(&gpioMux);
+
+    unlock();
+
+    DEBUG_PRINTF("Multi-switch: mask=0x%04X states=0x%04X\n", mask, states);
+    return true;
+}
+
 bool LoadController::getSwitchState(uint8_t channel) {
-    ChannelState* ch = getChannelState(channel);
-    return (ch != nullptr) ? ch->mainSwitch : false;
+    if (!isValidChannel(channel)) return false;
+
+    lock();
+    bool state = _channels[channel - 1].mainSwitch;
+    unlock();
+    return state;
 }
 
 bool LoadController::toggleSwitch(uint8_t channel) {
+    lock();
     bool currentState = getSwitchState(channel);
     setSwitch(channel, !currentState);
+    unlock();
     return !currentState;
 }
 
 bool LoadController::setSimulator(uint8_t channel, uint8_t value) {
-    ChannelState* ch = getChannelState(channel);
-    if (ch == nullptr) return false;
-    
     // Clamp value to 0-100
     if (value > 100) value = 100;
-    
-    ch->simValue = value;
-    ch->simPWM = percentToPWM(value);
-    applySimulator(channel);
-    
-    // Set state changed flag
-    if (channel == 1) _channel1Changed = true;
-    else _channel2Changed = true;
-    
-    DEBUG_PRINTF("Channel %d simulator set to %d%% (PWM=%d)\n", channel, value, ch->simPWM);
+    return setSimulatorPermille(channel, value * 10);
+}
+
+bool LoadController::setSimulatorPermille(uint8_t channel, uint16_t permille) {
+    if (!isValidChannel(channel)) return false;
+    ChannelState* ch = &_channels[channel - 1];
+
+    if (permille > 1000) permille = 1000;
+
+    lock();
+    stopFade(channel);
+    storeSimulator(channel, permille, permilleToDuty(permille, ch->pwmResolution));
+    uint32_t duty = ch->simDuty;
+    unlock();
+
+    DEBUG_PRINTF("Channel %d simulator set to %u.%u%% (duty=%u)\n",
+                 channel, permille / 10, permille % 10, duty);
+    return true;
+}
+
+bool LoadController::setSimulatorDuty(uint8_t channel, uint32_t duty) {
+    if (!isValidChannel(channel)) return false;
+    ChannelState* ch = &_channels[channel - 1];
+
+    lock();
+    uint8_t resolution = ch->pwmResolution;
+    if (duty > (1UL << resolution)) duty = 1UL << resolution;
+
+    stopFade(channel);
+    storeSimulator(channel, dutyToPermille(duty, resolution), duty);
+    unlock();
+
+    DEBUG_PRINTF("Channel %d simulator duty set to %u/%lu\n", channel, duty, 1UL << resolution);
+    return true;
+}
+
+bool LoadController::driveSimulatorDuty(uint8_t channel, uint32_t duty) {
+    if (!isValidChannel(channel)) return false;
+    ChannelState* ch = &_channels[channel - 1];
+
+    lock();
+    uint8_t resolution = ch->pwmResolution;
+    if (duty > (1UL << resolution)) duty = 1UL << resolution;
+
+    stopFade(channel);
+    if (duty != ch->simDuty) {
+        uint16_t permille = dutyToPermille(duty, resolution);
+        ch->simPermille = permille;
+        ch->simValue = (permille + 5) / 10;
+        ch->simDuty = duty;
+        applySimulator(channel);
+    }
+    unlock();
     return true;
 }
 
+bool LoadController::setPWMConfig(uint8_t channel, uint32_t frequency, uint8_t resolution) {
+    if (!isValidChannel(channel)) return false;
+    uint8_t i = channel - 1;
+    ChannelState* ch = &_channels[i];
+
+    uint8_t maxResolution = maxPWMResolution(frequency);
+    if (resolution == 0) resolution = maxResolution;
+    if (maxResolution == 0 || resolution > maxResolution) return false;
+
+    uint32_t divider = ledcDivider(frequency, resolution);
+    if (divider < kMinDivider || divider > kMaxDivider) return false;
+
+    // Changing the timer would also retune any simulator sharing it
+    for (uint8_t j = 0; j < NUM_CHANNELS; j++) {
+        if (j != i && ledcMode(kPWMChannels[j]) == ledcMode(kPWMChannels[i]) &&
+            ledcTimer(kPWMChannels[j]) == ledcTimer(kPWMChannels[i])) {
+            return false;
+        }
+    }
+
+    ledc_mode_t mode = ledcMode(kPWMChannels[i]);
+    ledc_timer_t timer = ledcTimer(kPWMChannels[i]);
+    ledc_channel_t ledc = ledcChannel(kPWMChannels[i]);
+
+    lock();
+    stopFade(channel);
+
+    // Keep the output level: rescale the duty to the new counter width
+    uint32_t duty = (uint32_t)(((uint64_t)ch->simDuty << resolution) >> ch->pwmResolution);
+
+    // The output holds its level while the timer is paused; the new period
+    // and duty both start with the first cycle after resume
+    ledc_timer_pause(mode, timer);
+    ledc_timer_set(mode, timer, divider, (ledc_timer_bit_t)resolution, LEDC_APB_CLK);
+    ledc_set_duty(mode, ledc, duty);
+    ledc_update_duty(mode, ledc);
+    ledc_timer_rst(mode, timer);
+    ledc_timer_resume(mode, timer);
+
+    ch->pwmFrequency = frequency;
+    ch->pwmResolution = resolution;
+    ch->simDuty = duty;
+    markChanged(channel);
+    unlock();
+
+    DEBUG_PRINTF("Channel %d PWM: %u Hz, %u bit (duty=%u)\n", channel, frequency, resolution, duty);
+    return true;
+}
+
+uint8_t LoadController::maxPWMResolution(uint32_t frequency) {
+    if (frequency == 0) return 0;
+
+    // The timer counts 2^bits ticks of (APB clock / divider) per period
+    uint8_t bits = 0;
+    while (bits < PWM_MAX_RESOLUTION && ledcDivider(frequency, bits + 1) >= kMinDivider) {
+        bits++;
+    }
+    return bits;
+}
+
 uint8_t LoadController::getSimulatorValue(uint8_t channel) {
-    ChannelState* ch = getChannelState(channel);
-    return (ch != nullptr) ? ch->simValue : 0;
+    if (!isValidChannel(channel)) return 0;
+
+    lock();
+    uint8_t value = _channels[channel - 1].simValue;
+    unlock();
+    return value;
 }
 
-void LoadController::emergencyShutdown(uint8_t channel, const char* reason) {
-    ChannelState* ch = getChannelState(channel);
-    if (ch == nullptr) return;
-    
-    DEBUG_PRINTF("EMERGENCY SHUTDOWN - Channel %d: %s\n", channel, reason);
-    
+bool LoadController::fadeSimulator(uint8_t channel, uint8_t value, uint32_t durationMs,
+                                   FadeCurve curve) {
+    if (!isValidChannel(channel) || curve >= FADE_CURVE_COUNT ||
+        durationMs > FADE_MAX_DURATION) {
+        return false;
+    }
+    ChannelState* ch = &_channels[channel - 1];
+    FadeState* fade = &_fades[channel - 1];
+
+    if (value > 100) value = 100;
+
+    lock();
+    stopFade(channel);  // A new fade starts from wherever the old one got to
+
+    uint32_t target = permilleToDuty(value * 10, ch->pwmResolution);
+    if (durationMs == 0 || target == ch->simDuty) {
+        bool ok = setSimulator(channel, value);
+        unlock();
+        return ok;
+    }
+
+    fade->startDuty = ch->simDuty;
+    fade->targetDuty = target;
+    fade->targetPermille = value * 10;
+    fade->curve = curve;
+    fade->segment = 0;
+    fade->segments = (curve == FADE_LINEAR) ? 1 : FADE_CURVE_SEGMENTS;
+    fade->segmentMs = max(durationMs / fade->segments, (uint32_t)1);
+
+    ch->fading = startFadeSegment(channel);
+    markChanged(channel);
+    bool started = ch->fading;
+    unlock();
+
+    DEBUG_PRINTF("Channel %d simulator fade to %d%% over %lu ms (%s): %s\n", channel, value,
+                 (unsigned long)durationMs, kFadeCurveNames[curve], started ? "started" : "failed");
+    return started;
+}
+
+bool LoadController::isFading(uint8_t channel) {
+    if (!isValidChannel(channel)) return false;
+
+    lock();
+    bool fading = _channels[channel - 1].fading;
+    unlock();
+    return fading;
+}
+
+void LoadController::loop() {
+    // NVS copy trails the RTC mirror until the state has settled
+    if (_statePending && millis() - _stateChangedAt >= STATE_NVS_DELAY) {
+        flushState();
+    }
+
+    if (_fadeDoneMask == 0) return;
+
+    portENTER_CRITICAL(&fadeMux);
+    uint16_t done = _fadeDoneMask;
+    _fadeDoneMask = 0;
+    portEXIT_CRITICAL(&fadeMux);
+
+    lock();
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        ChannelState* ch = &_channels[i];
+        if (!(done & (1U << i)) || !ch->fading) continue;
+
+        // Shaped curve: chain the next linear segment
+        if (startFadeSegment(i + 1)) continue;
+
+        // Fade finished: commit the target so status reports it
+        ch->fading = false;
+        storeSimulator(i + 1, _fades[i].targetPermille, _fades[i].targetDuty);
+        DEBUG_PRINTF("Channel %d simulator fade done (%d%%)\n", i + 1, ch->simValue);
+    }
+    unlock();
+}
+
+void LoadController::emergencyShutdown(uint8_t channel, FaultCode code, float value) {
+    if (!isValidChannel(channel)) return;
+    ChannelState* ch = &_channels[channel - 1];
+
     // Immediately turn off the main switch
+    lock();
     ch->mainSwitch = false;
-    ch->fault = true;
-    ch->faultReason = reason;
-    ch->lastFaultTime = millis();
-    
     applyMainSwitch(channel);
-    
-    // Set state changed flag
-    if (channel == 1) _channel1Changed = true;
-    else _channel2Changed = true;
+
+    ch->faultCode = code;
+    ch->faultValue = value;
+    ch->lastFaultTime = millis();
+    markChanged(channel);
+    unlock();
+
+    DEBUG_PRINTF("EMERGENCY SHUTDOWN - Channel %d: %s (%.2f%s)\n",
+                 channel, faultCodeMessage(code), value, faultCodeUnit(code));
 }
 
-void LoadController::emergencyShutdownAll(const char* reason) {
-    emergencyShutdown(1, reason);
-    emergencyShutdown(2, reason);
+void LoadController::emergencyShutdownAll(FaultCode code, float value) {
+    for (uint8_t channel = 1; channel <= NUM_CHANNELS; channel++) {
+        emergencyShutdown(channel, code, value);
+    }
 }
 
 void LoadController::clearFault(uint8_t channel) {
-    ChannelState* ch = getChannelState(channel);
-    if (ch == nullptr) return;
-    
-    ch->fault = false;
-    ch->faultReason = "";
-    
-    // Set state changed flag
-    if (channel == 1) _channel1Changed = true;
-    else _channel2Changed = true;
-    
+    if (!isValidChannel(channel)) return;
+    ChannelState* ch = &_channels[channel - 1];
+
+    lock();
+    ch->faultCode = FAULT_NONE;
+    ch->faultValue = 0;
+    markChanged(channel);
+    unlock();
+
     DEBUG_PRINTF("Fault cleared for channel %d\n", channel);
 }
 
 bool LoadController::hasFault(uint8_t channel) {
-    ChannelState* ch = getChannelState(channel);
-    return (ch != nullptr) ? ch->fault : true;
+    return !isValidChannel(channel) || getFaultCode(channel) != FAULT_NONE;
+}
+
+FaultCode LoadController::getFaultCode(uint8_t channel) {
+    if (!isValidChannel(channel)) return FAULT_NONE;
+
+    lock();
+    FaultCode code = _channels[channel - 1].faultCode;
+    unlock();
+    return code;
 }
 
-String LoadController::getFaultReason(uint8_t channel) {
-    ChannelState* ch = getChannelState(channel);
-    return (ch != nullptr) ? ch->faultReason : "Invalid channel";
+const char* LoadController::getFaultReason(uint8_t channel) {
+    if (!isValidChannel(channel)) return "Invalid channel";
+    return faultCodeMessage(getFaultCode(channel));
 }
 
-ChannelState* LoadController::getChannelState(uint8_t channel) {
-    if (channel == 1) return &_channel1;
-    if (channel == 2) return &_channel2;
-    return nullptr;
+size_t LoadController::formatFaultReason(uint8_t channel, char* buffer, size_t size) {
+    ChannelState state;
+    if (!getChannelState(channel, state)) {
+        return snprintf(buffer, size, "Invalid channel");
+    }
+    if (state.faultCode == FAULT_NONE || faultCodeUnit(state.faultCode)[0] == '\0') {
+        return snprintf(buffer, size, "%s", faultCodeMessage(state.faultCode));
+    }
+    return snprintf(buffer, size, "%s: %.2f%s", faultCodeMessage(state.faultCode),
+                    state.faultValue, faultCodeUnit(state.faultCode));
+}
+
+bool LoadController::getChannelState(uint8_t channel, ChannelState& state) {
+    if (!isValidChannel(channel)) return false;
+
+    lock();
+    state = _channels[channel - 1];
+    unlock();
+    return true;
 }
 
 void LoadController::setChannelEnabled(uint8_t channel, bool enabled) {
-    if (channel == 1) {
-        _channel1Enabled = enabled;
-        if (!enabled) setSwitch(1, false);
-    } else if (channel == 2) {
-        _channel2Enabled = enabled;
-        if (!enabled) setSwitch(2, false);
+    if (!isValidChannel(channel)) return;
+
+    lock();
+    if (enabled) {
+        _enabledMask |= (1U << (channel - 1));
+    } else {
+        setSwitch(channel, false);
+        _enabledMask &= ~(1U << (channel - 1));
     }
+    unlock();
+}
+
+bool LoadController::isChannelEnabled(uint8_t channel) {
+    if (!isValidChannel(channel)) return false;
+
+    lock();
+    bool enabled = _enabledMask & (1U << (channel - 1));
+    unlock();
+    return enabled;
 }
 
 bool LoadController::hasStateChanged(uint8_t channel) {
-    if (channel == 1) return _channel1Changed;
-    if (channel == 2) return _channel2Changed;
-    return false;
+    if (!isValidChannel(channel)) return false;
+    return getChangedMask() & (1U << (channel - 1));
 }
 
 void LoadController::clearStateChanged(uint8_t channel) {
-    if (channel == 1) _channel1Changed = false;
-    else if (channel == 2) _channel2Changed = false;
+    if (!isValidChannel(channel)) return;
+
+    lock();
+    _changedMask &= ~(1U << (channel - 1));
+    unlock();
 }
 
-uint8_t LoadController::getMainSwitchPin(uint8_t channel) {
-    return (channel == 1) ? MAIN_SWITCH_PIN_1 : MAIN_SWITCH_PIN_2;
+uint16_t LoadController::getChangedMask() {
+    lock();
+    uint16_t mask = _changedMask;
+    unlock();
+    return mask;
 }
 
-uint8_t LoadController::getSimulatorPin(uint8_t channel) {
-    return (channel == 1) ? SIMULATOR_PIN_1 : SIMULATOR_PIN_2;
+void LoadController::lock() {
+    if (_mutex != nullptr) xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
 }
 
-uint8_t LoadController::getPWMChannel(uint8_t channel) {
-    return (channel == 1) ? PWM_CHANNEL_SIM1 : PWM_CHANNEL_SIM2;
+void LoadController::unlock() {
+    if (_mutex != nullptr) xSemaphoreGiveRecursive(_mutex);
 }
 
-void LoadController::applyMainSwitch(uint8_t channel) {
-    uint8_t pin = getMainSwitchPin(channel);
-    ChannelState* ch = getChannelState(channel);
-    
-    if (ch != nullptr) {
-        digitalWrite(pin, ch->mainSwitch ? HIGH : LOW);
+void LoadController::markChanged(uint8_t channel) {
+    _changedMask |= (1U << (channel - 1));
+    saveState();
+}
+
+bool LoadController::setRestorePolicy(RestorePolicy policy, uint16_t defaultMask) {
+    if (policy >= RESTORE_POLICY_COUNT) return false;
+
+    Preferences prefs;
+    if (!prefs.begin(STATE_NVS_NAMESPACE, false)) return false;
+    prefs.putUChar("policy", policy);
+    prefs.putUShort("defaults", defaultMask & allChannelsMask());
+    prefs.end();
+
+    lock();
+    _restorePolicy = policy;
+    _defaultMask = defaultMask & allChannelsMask();
+    unlock();
+
+    DEBUG_PRINTF("Restore policy: %s (defaults 0x%04X)\n", restorePolicyName(policy), _defaultMask);
+    return true;
+}
+
+void LoadController::restoreState() {
+    Preferences prefs;
+    prefs.begin(STATE_NVS_NAMESPACE, true);
+    uint8_t policy = prefs.getUChar("policy", STATE_RESTORE_POLICY);
+    _restorePolicy = (policy < RESTORE_POLICY_COUNT) ? (RestorePolicy)policy : RESTORE_ALL_OFF;
+    _defaultMask = prefs.getUShort("defaults", STATE_DEFAULT_SWITCHES) & allChannelsMask();
+
+    // RTC memory first (valid after any reset but power-on), NVS as fallback
+    PersistedState saved;
+    bool valid = isValidState(rtcState);
+    if (valid) {
+        saved = rtcState;
+        _restoreSource = "rtc";
+    } else if (prefs.getBytes("state", &saved, sizeof(saved)) == sizeof(saved) &&
+               isValidState(saved)) {
+        valid = true;
+        _restoreSource = "nvs";
+    } else {
+        _restoreSource = "none";
     }
+    prefs.end();
+
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        ChannelState* ch = &_channels[i];
+
+        if (valid) {
+            // Latched faults always survive: a trip must not be undone by a reset
+            uint8_t fault = saved.channels[i].faultCode;
+            ch->faultCode = (fault < FAULT_CODE_COUNT) ? (FaultCode)fault : FAULT_MANUAL;
+            ch->faultValue = saved.channels[i].faultValue;
+
+            uint32_t frequency = saved.channels[i].pwmFrequency;
+            uint8_t resolution = saved.channels[i].pwmResolution;
+            if (resolution >= 1 && resolution <= maxPWMResolution(frequency)) {
+                ch->pwmFrequency = frequency;
+                ch->pwmResolution = resolution;
+            }
+            if (_restorePolicy == RESTORE_LAST && saved.channels[i].simPermille <= 1000) {
+                ch->simPermille = saved.channels[i].simPermille;
+                ch->simValue = (ch->simPermille + 5) / 10;
+            }
+        }
+        ch->simDuty = permilleToDuty(ch->simPermille, ch->pwmResolution);
+
+        bool on = false;
+        if (_restorePolicy == RESTORE_LAST) {
+            on = valid && (saved.switchMask & (1U << i));
+        } else if (_restorePolicy == RESTORE_DEFAULT) {
+            on = _defaultMask & (1U << i);
+        }
+        ch->mainSwitch = on && ch->faultCode == FAULT_NONE;
+    }
+
+    // Report everything once the network is up, and refresh the mirror
+    _changedMask = allChannelsMask();
+    saveState();
+
+    DEBUG_PRINTF("State restore: policy=%s source=%s\n",
+                 restorePolicyName(_restorePolicy), _restoreSource);
+}
+
+void LoadController::saveState() {
+    rtcState.magic = kStateMagic;
+    rtcState.channelCount = NUM_CHANNELS;
+    rtcState.switchMask = 0;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        const ChannelState* ch = &_channels[i];
+        if (ch->mainSwitch) rtcState.switchMask |= (1U << i);
+        rtcState.channels[i].faultValue = ch->faultValue;
+        rtcState.channels[i].pwmFrequency = ch->pwmFrequency;
+        rtcState.channels[i].simPermille = ch->simPermille;
+        rtcState.channels[i].pwmResolution = ch->pwmResolution;
+        rtcState.channels[i].faultCode = ch->faultCode;
+    }
+    rtcState.crc = stateCrc(rtcState);
+
+    _statePending = true;
+    _stateChangedAt = millis();
+}
+
+void LoadController::flushState() {
+    lock();
+    PersistedState copy = rtcState;
+    _statePending = false;
+    unlock();
+
+    Preferences prefs;
+    if (prefs.begin(STATE_NVS_NAMESPACE, false)) {
+        prefs.putBytes("state", &copy, sizeof(copy));
+        prefs.end();
+    }
+}
+
+void LoadController::applyMainSwitch(uint8_t channel) {
+    uint8_t i = channel - 1;
+    digitalWrite(kMainSwitchPins[i], _channels[i].mainSwitch ? HIGH : LOW);
 }
 
 void LoadController::applySimulator(uint8_t channel) {
-    uint8_t pwmChannel = getPWMChannel(channel);
-    ChannelState* ch = getChannelState(channel);
-    
-    if (ch != nullptr) {
-        ledcWrite(pwmChannel, ch->simPWM);
+    uint8_t i = channel - 1;
+    ledc_mode_t mode = ledcMode(kPWMChannels[i]);
+    ledc_channel_t ledc = ledcChannel(kPWMChannels[i]);
+    ledc_set_duty(mode, ledc, _channels[i].simDuty);
+    ledc_update_duty(mode, ledc);
+}
+
+void LoadController::storeSimulator(uint8_t channel, uint16_t permille, uint32_t duty) {
+    ChannelState* ch = &_channels[channel - 1];
+    ch->simPermille = permille;
+    ch->simValue = (permille + 5) / 10;
+    ch->simDuty = duty;
+    applySimulator(channel);
+    markChanged(channel);
+}
+
+bool LoadController::startFadeSegment(uint8_t channel) {
+    uint8_t i = channel - 1;
+    ChannelState* ch = &_channels[i];
+    FadeState* fade = &_fades[i];
+
+    // Merge segments that would not move the duty into the next one
+    uint32_t duty = ch->simDuty;
+    uint32_t durationMs = 0;
+    while (fade->segment < fade->segments && duty == ch->simDuty) {
+        fade->segment++;
+        durationMs += fade->segmentMs;
+        duty = fadeDuty(*fade, fade->segment);
+    }
+    if (duty == ch->simDuty) return false;  // Nothing left to do
+
+    ledc_mode_t mode = ledcMode(kPWMChannels[i]);
+    ledc_channel_t ledc = ledcChannel(kPWMChannels[i]);
+    if (ledc_set_fade_with_time(mode, ledc, duty, durationMs) != ESP_OK ||
+        ledc_fade_start(mode, ledc, LEDC_FADE_NO_WAIT) != ESP_OK) {
+        DEBUG_PRINTF("Channel %d LEDC fade rejected\n", channel);
+        return false;
+    }
+
+    ch->simDuty = duty;  // Duty this segment is heading to
+    return true;
+}
+
+void LoadController::stopFade(uint8_t channel) {
+    uint8_t i = channel - 1;
+    ChannelState* ch = &_channels[i];
+    if (!ch->fading) return;
+
+    ledc_mode_t mode = ledcMode(kPWMChannels[i]);
+    ledc_channel_t ledc = ledcChannel(kPWMChannels[i]);
+    ledc_fade_stop(mode, ledc);
+
+    portENTER_CRITICAL(&fadeMux);
+    _fadeDoneMask &= ~(1U << i);
+    portEXIT_CRITICAL(&fadeMux);
+
+    ch->fading = false;
+    uint32_t duty = ledc_get_duty(mode, ledc);
+    ch->simDuty = duty;
+    ch->simPermille = dutyToPermille(duty, ch->pwmResolution);
+    ch->simValue = (ch->simPermille + 5) / 10;
+    markChanged(channel);
+}
+
+bool IRAM_ATTR LoadController::onFadeEnd(const ledc_cb_param_t* param, void* arg) {
+    if (param->event == LEDC_FADE_END_EVT) {
+        uint8_t i = (uint8_t)(uintptr_t)arg;
+        portENTER_CRITICAL_ISR(&fadeMux);
+        loadController._fadeDoneMask |= (1U << i);
+        portEXIT_CRITICAL_ISR(&fadeMux);
     }
+    return false;  // No task woken
+}
+
+uint32_t LoadController::fadeDuty(const FadeState& fade, uint8_t segment) {
+    if (segment >= fade.segments) return fade.targetDuty;
+
+    float t = (float)segment / fade.segments;
+    float s;
+    switch (fade.curve) {
+        case FADE_EASE_IN:     s = t * t; break;
+        case FADE_EASE_OUT:    s = t * (2.0f - t); break;
+        case FADE_EASE_IN_OUT: s = t * t * (3.0f - 2.0f * t); break;
+        default:               s = t; break;
+    }
+    float delta = (float)fade.targetDuty - (float)fade.startDuty;
+    return (uint32_t)lroundf(fade.startDuty + delta * s);
+}
+
+uint32_t LoadController::permilleToDuty(uint16_t permille, uint8_t resolution) {
+    // 1000 permille = 2^resolution: LEDC keeps the output high all period
+    return (uint32_t)(((uint64_t)permille << resolution) + 500) / 1000;
 }
 
-uint8_t LoadController::percentToPWM(uint8_t percent) {
-    // Convert percentage (0-100) to PWM value (0-255)
-    // 100% = fully ON (255), 0% = fully OFF (0)
-    return map(percent, 0, 100, 0, 255);
+uint16_t LoadController::dutyToPermille(uint32_t duty, uint8_t resolution) {
+    return (uint16_t)(((uint64_t)duty * 1000 + (1UL << (resolution - 1))) >> resolution);
 }
@@ -4,6 +4,9 @@
  */
 
 #include "MQTTManager.h"
+#include "JsonWriter.h"
+#include "TimeBase.h"
+#include <Preferences.h>
 
 // Static instance pointer for callback
 static MQTTManager* _instance = nullptr;
@@ -11,21 +14,56 @@ static MQTTManager* _instance = nullptr;
 // Global instance
 MQTTManager mqtt;
 
+static const char* const kTelemetryFormatNames[] = { "", "json", "binary", "both" };
+
+/**
+ * @brief Add the send time: uptime and, once SNTP synced, Unix time
+ */
+static void stampJson(JsonDocument& doc) {
+    doc["timestamp"] = millis();
+    uint64_t timeUs = timeBase.nowUs();
+    if (timeUs != 0) doc["time_us"] = timeUs;
+}
+
+const char* telemetryFormatName(TelemetryFormat format) {
+    return (format >= TELEMETRY_FORMAT_JSON && format <= TELEMETRY_FORMAT_BOTH)
+               ? kTelemetryFormatNames[format] : "unknown";
+}
+
+bool parseTelemetryFormat(const char* name, TelemetryFormat& format) {
+    for (uint8_t i = TELEMETRY_FORMAT_JSON; i <= TELEMETRY_FORMAT_BOTH; i++) {
+        if (strcmp(name, kTelemetryFormatNames[i]) == 0) {
+            format = (TelemetryFormat)i;
+            return true;
+        }
+    }
+    return false;
+}
+
 MQTTManager::MQTTManager() {
-    _mqttClient = nullptr;
     _userCallback = nullptr;
     _lastError[0] = '\0';
-    _lastReconnectAttempt = 0;
+    _online = false;
+    _telemetryFormat = (TelemetryFormat)TELEMETRY_FORMAT;
     _instance = this;
 }
 
-bool MQTTManager::begin(WiFiClient& wifiClient) {
-    _mqttClient = new PubSubClient(wifiClient);
-    
-    _mqttClient->setServer(MQTT_BROKER, MQTT_PORT);
-    _mqttClient->setKeepAlive(MQTT_KEEPALIVE);
-    _mqttClient->setCallback(mqttCallback);
-    _mqttClient->setBufferSize(1024);  // Increase buffer for JSON messages
+bool MQTTManager::begin() {
+    _client.setServer(MQTT_BROKER, MQTT_PORT);
+    _client.setIdentity(deviceIdentity.id(),
+                        strlen(MQTT_USERNAME) > 0 ? MQTT_USERNAME : nullptr,
+                        strlen(MQTT_USERNAME) > 0 ? MQTT_PASSWORD : nullptr,
+                        MQTT_KEEPALIVE);
+    _client.setWill(deviceIdentity.topic(TOPIC_STATUS), MQTT_LWT_MESSAGE, MQTT_LWT_QOS, MQTT_LWT_RETAIN);
+    _client.setCallback(mqttCallback);
+    
+    Preferences prefs;
+    prefs.begin(TELEMETRY_NVS_NAMESPACE, true);
+    uint8_t format = prefs.getUChar("format", _telemetryFormat);
+    prefs.end();
+    if (format >= TELEMETRY_FORMAT_JSON && format <= TELEMETRY_FORMAT_BOTH) {
+        _telemetryFormat = (TelemetryFormat)format;
+    }
     
     DEBUG_PRINTLN("MQTT Manager initialized");
     DEBUG_PRINTF("Broker: %s:%d\n", MQTT_BROKER, MQTT_PORT);
@@ -34,43 +72,36 @@ bool MQTTManager::begin(WiFiClient& wifiClient) {
 }
 
 bool MQTTManager::connect() {
-    if (_mqttClient == nullptr) {
-        setError("MQTT client not initialized");
-        return false;
-    }
-    
-    if (_mqttClient->connected()) {
-        return true;
-    }
-    
-    DEBUG_PRINTLN("Connecting to MQTT broker...");
-    
-    bool connected = false;
-    
-    // Try to connect with LWT (Last Will and Testament)
-    if (strlen(MQTT_USERNAME) > 0) {
-        connected = _mqttClient->connect(
-            MQTT_CLIENT_ID,
-            MQTT_USERNAME,
-            MQTT_PASSWORD,
-            MQTT_LWT_TOPIC,
-            MQTT_LWT_QOS,
-            MQTT_LWT_RETAIN,
-            MQTT_LWT_MESSAGE
-        );
-    } else {
-        connected = _mqttClient->connect(
-            MQTT_CLIENT_ID,
-            nullptr,
-            nullptr,
-            MQTT_LWT_TOPIC,
-            MQTT_LWT_QOS,
-            MQTT_LWT_RETAIN,
-            MQTT_LWT_MESSAGE
-        );
+    // Only starts the attempt; loop() carries it through without blocking
+    _client.start(millis());
+    return _client.connected();
+}
+
+bool MQTTManager::isConnected() {
+    return _client.connected();
+}
+
+void MQTTManager::loop() {
+    uint32_t now = millis();
+    
+    // Keep retrying after a drop, as before (the client handles the backoff)
+    if (_client.getState() == MQTT_STATE_IDLE) _client.start(now);
+    _client.loop(now, WiFi.status() == WL_CONNECTED);
+    
+    if (!_client.connected()) {
+        if (_online) {
+            _online = false;
+            MqttClientStats stats = _client.getStats();
+            char errorMsg[64];
+            snprintf(errorMsg, sizeof(errorMsg), "MQTT connection lost, rc=%d", stats.lastError);
+            setError(errorMsg);
+            DEBUG_PRINTLN(errorMsg);
+        }
+        return;
     }
     
-    if (connected) {
+    if (!_online) {
+        _online = true;
         DEBUG_PRINTLN("Connected to MQTT broker!");
         
         // Publish online status
@@ -78,67 +109,42 @@ bool MQTTManager::connect() {
         
         // Subscribe to control topics
         subscribeToControlTopics();
-        
-        return true;
-    } else {
-        int state = _mqttClient->state();
-        char errorMsg[64];
-        snprintf(errorMsg, sizeof(errorMsg), "MQTT connection failed, rc=%d", state);
-        setError(errorMsg);
-        DEBUG_PRINTLN(errorMsg);
-        return false;
     }
-}
-
-bool MQTTManager::isConnected() {
-    return _mqttClient != nullptr && _mqttClient->connected();
-}
-
-void MQTTManager::loop() {
-    if (_mqttClient == nullptr) return;
     
-    if (!_mqttClient->connected()) {
-        unsigned long now = millis();
-        if (now - _lastReconnectAttempt > MQTT_RECONNECT_INTERVAL) {
-            _lastReconnectAttempt = now;
-            connect();
-        }
-    } else {
-        _mqttClient->loop();
-    }
+    _queue.drain(now, sendQueued);
 }
 
 void MQTTManager::disconnect() {
-    if (_mqttClient != nullptr && _mqttClient->connected()) {
+    if (_client.connected()) {
         publishDeviceStatus(false);
-        _mqttClient->disconnect();
+        _queue.drain(millis(), sendQueued, true);
     }
+    _client.disconnect();
+    _online = false;
 }
 
 void MQTTManager::setCallback(MQTTMessageCallback callback) {
     _userCallback = callback;
 }
 
-void MQTTManager::mqttCallback(char* topic, byte* payload, unsigned int length) {
+MqttClientStats MQTTManager::getClientStats() {
+    return _client.getStats();
+}
+
+void MQTTManager::mqttCallback(const char* topic, const char* payload, size_t length) {
     if (_instance == nullptr || _instance->_userCallback == nullptr) return;
     
-    // Create null-terminated string from payload
-    char* message = new char[length + 1];
-    memcpy(message, payload, length);
-    message[length] = '\0';
-    
-    DEBUG_PRINTF("MQTT Received [%s]: %s\n", topic, message);
+    // The client hands over a NUL-terminated payload, no copy needed
+    DEBUG_PRINTF("MQTT Received [%s]: %s\n", topic, payload);
     
     // Call user callback
-    _instance->_userCallback(topic, message);
-    
-    delete[] message;
+    _instance->_userCallback(topic, payload, length);
 }
 
 bool MQTTManager::subscribe(const char* topic) {
     if (!isConnected()) return false;
     
-    bool success = _mqttClient->subscribe(topic);
+    bool success = _client.subscribe(topic);
     if (success) {
         DEBUG_PRINTF("Subscribed to: %s\n", topic);
     } else {
@@ -147,94 +153,309 @@ bool MQTTManager::subscribe(const char* topic) {
     return success;
 }
 
-bool MQTTManager::publish(const char* topic, const char* payload, bool retained) {
-    if (!isConnected()) return false;
+bool MQTTManager::publish(TopicHandle topic, const char* payload, bool retained) {
+    return publish(topic, payload, strlen(payload), retained);
+}
+
+bool MQTTManager::publish(TopicHandle topic, const char* payload, size_t length, bool retained) {
+    // Topics are prebuilt at boot: nothing to format here
+    const char* name = deviceIdentity.topic(topic);
+    if (!isConnected() && PublishQueue::ruleFor(name).priority != PUBLISH_CRITICAL) return false;
     
-    bool success = _mqttClient->publish(topic, payload, retained);
-    if (!success) {
-        DEBUG_PRINTF("Failed to publish to: %s\n", topic);
+    return _queue.enqueue(name, (const uint8_t*)payload, length, retained, millis());
+}
+
+PublishSendResult MQTTManager::sendQueued(const char* topic, const uint8_t* payload, size_t length,
+                                          bool retained, const PublishRule& rule) {
+    if (_instance == nullptr) return PUBLISH_FAILED;
+    
+    MqttPublishProperties properties = publishProperties(rule);
+    switch (_instance->_client.publish(topic, payload, length, retained, rule.qos, &properties)) {
+        case MQTT_SEND_OK:
+            return PUBLISH_SENT;
+        case MQTT_SEND_BUSY:
+            return PUBLISH_BUSY;
+        default:
+            DEBUG_PRINTF("Failed to publish to: %s\n", topic);
+            return PUBLISH_FAILED;
     }
-    return success;
 }
 
-bool MQTTManager::publishJson(const char* topic, JsonDocument& doc, bool retained) {
-    char buffer[512];
-    size_t len = serializeJson(doc, buffer, sizeof(buffer));
-    return publish(topic, buffer, retained);
+MqttPublishProperties MQTTManager::publishProperties(const PublishRule& rule) {
+    MqttPublishProperties properties;
+    properties.expiry = rule.expiry;
+    properties.utf8 = !rule.binary;
+#if MQTT_CONTENT_TYPES
+    properties.contentType = rule.binary ? MQTT_CONTENT_TYPE_BINARY : MQTT_CONTENT_TYPE_JSON;
+#else
+    properties.contentType = nullptr;
+#endif
+    return properties;
 }
 
-bool MQTTManager::publishTelemetry(uint8_t channel, float voltage, float current, float power) {
-    StaticJsonDocument<256> doc;
+bool MQTTManager::publishJson(TopicHandle topic, JsonDocument& doc, bool retained) {
+    // serializeJson() stops at the end of the buffer without an error: a
+    // message that does not fit would go out as invalid JSON
+    size_t needed = measureJson(doc);
+    if (needed >= sizeof(_txBuffer)) {
+        DEBUG_PRINTF("Message for %s too large (%u B) - not sent\n",
+                     deviceIdentity.topic(topic), (unsigned)needed);
+        return false;
+    }
     
-    doc["channel"] = channel;
-    doc["voltage"] = serialized(String(voltage, 3));
-    doc["current"] = serialized(String(current, 4));
-    doc["power"] = serialized(String(power, 3));
-    doc["timestamp"] = millis();
+    // The queue copies the message, so the transmit buffer is free again on return
+    size_t len = serializeJson(doc, _txBuffer, sizeof(_txBuffer));
+    return publish(topic, _txBuffer, len, retained);
+}
+
+size_t MQTTManager::formatTelemetry(char* buffer, size_t size, uint8_t channel, float voltage,
+                                    float current, float power, uint32_t timestamp,
+                                    uint64_t timeUs) {
+    JsonWriter json(buffer, size);
+    json.beginObject()
+        .add("channel", channel)
+        .addFixed("voltage", voltage, 3)
+        .addFixed("current", current, 4)
+        .addFixed("power", power, 3)
+        .add("timestamp", timestamp);
+    if (timeUs != 0) json.addUInt64("time_us", timeUs);
+    json.endObject();
+    return json.finish();
+}
+
+size_t MQTTManager::formatAllTelemetry(char* buffer, size_t size, const float voltage[],
+                                       const float current[], const float power[],
+                                       uint8_t count, uint32_t timestamp, uint64_t timeUs) {
+    JsonWriter json(buffer, size);
+    json.beginObject();
+    for (uint8_t i = 0; i < count; i++) {
+        // "chN" without snprintf (N <= MAX_CHANNELS, at most two digits)
+        uint8_t n = i + 1;
+        char key[5] = { 'c', 'h', (char)('0' + n % 10), '\0', '\0' };
+        if (n >= 10) {
+            key[2] = '0' + n / 10;
+            key[3] = '0' + n % 10;
+        }
+        json.beginObject(key)
+            .addFixed("voltage", voltage[i], 3)
+            .addFixed("current", current[i], 4)
+            .addFixed("power", power[i], 3)
+            .endObject();
+    }
+    json.add("timestamp", timestamp);
+    if (timeUs != 0) json.addUInt64("time_us", timeUs);
+    json.add("device_id", deviceIdentity.id())
+        .endObject();
+    return json.finish();
+}
+
+bool MQTTManager::publishTelemetry(uint8_t channel, float voltage, float current, float power,
+                                   uint64_t timeUs) {
+    size_t length = formatTelemetry(_txBuffer, sizeof(_txBuffer), channel,
+                                    voltage, current, power, millis(), timeUs);
+    if (length == 0) return false;
     
-    const char* topic = (channel == 1) ? MQTT_TOPIC_CH1_TELEMETRY : MQTT_TOPIC_CH2_TELEMETRY;
-    return publishJson(topic, doc);
+    return publish(channelTopic(channel, CH_TOPIC_TELEMETRY), _txBuffer, length, false);
 }
 
-bool MQTTManager::publishAllTelemetry(float voltage1, float current1, float power1,
-                                       float voltage2, float current2, float power2) {
-    StaticJsonDocument<512> doc;
+bool MQTTManager::publishAllTelemetry(const float voltage[], const float current[],
+                                       const float power[], uint8_t count, uint64_t timeUs) {
+    size_t length = formatAllTelemetry(_txBuffer, sizeof(_txBuffer), voltage, current, power,
+                                       count, millis(), timeUs);
+    if (length == 0) return false;
     
-    JsonObject ch1 = doc.createNestedObject("ch1");
-    ch1["voltage"] = serialized(String(voltage1, 3));
-    ch1["current"] = serialized(String(current1, 4));
-    ch1["power"] = serialized(String(power1, 3));
+    return publish(TOPIC_TELEMETRY, _txBuffer, length, false);
+}
+
+size_t MQTTManager::formatTelemetryBinary(uint8_t* buffer, size_t size, uint8_t firstChannel,
+                                          const INA226Raw raw[], const bool valid[], uint8_t count,
+                                          float currentLSB, uint32_t timestamp, uint64_t timeUs) {
+    size_t length = sizeof(TelemetryPacketHeader) + count * sizeof(TelemetryPacketChannel);
+    if (timeUs != 0) length += sizeof(TelemetryPacketTime);
+    if (length > size) return 0;
+    
+    // Both records are naturally aligned and the ESP32 is little-endian,
+    // so the structs are the wire format
+    TelemetryPacketHeader header;
+    header.version = TELEMETRY_PACKET_VERSION;
+    header.firstChannel = firstChannel;
+    header.channelCount = count;
+    header.flags = (timeUs != 0) ? TELEMETRY_FLAG_TIME : 0;
+    header.timestamp = timestamp;
+    header.currentLSB = currentLSB;
+    memcpy(buffer, &header, sizeof(header));
+    
+    uint8_t* out = buffer + sizeof(header);
+    for (uint8_t i = 0; i < count; i++) {
+        TelemetryPacketChannel record;
+        record.busVoltage = valid[i] ? raw[i].busVoltage : TELEMETRY_BUS_INVALID;
+        record.current = valid[i] ? raw[i].current : 0;
+        record.power = valid[i] ? raw[i].power : 0;
+        memcpy(out, &record, sizeof(record));
+        out += sizeof(record);
+    }
     
-    JsonObject ch2 = doc.createNestedObject("ch2");
-    ch2["voltage"] = serialized(String(voltage2, 3));
-    ch2["current"] = serialized(String(current2, 4));
-    ch2["power"] = serialized(String(power2, 3));
+    if (timeUs != 0) {
+        TelemetryPacketTime time;
+        time.timeUs = timeUs;
+        memcpy(out, &time, sizeof(time));
+    }
+    return length;
+}
+
+bool MQTTManager::publishTelemetryBinary(uint8_t channel, const INA226Raw& raw, bool valid,
+                                         float currentLSB, uint64_t timeUs) {
+    uint8_t* buffer = (uint8_t*)_txBuffer;
+    size_t length = formatTelemetryBinary(buffer, sizeof(_txBuffer), channel, &raw, &valid, 1,
+                                          currentLSB, millis(), timeUs);
+    if (length == 0) return false;
+    
+    return publish(channelTopic(channel, CH_TOPIC_TELEMETRY_BIN), _txBuffer, length, false);
+}
+
+bool MQTTManager::publishAllTelemetryBinary(const INA226Raw raw[], const bool valid[], uint8_t count,
+                                            float currentLSB, uint64_t timeUs) {
+    uint8_t* buffer = (uint8_t*)_txBuffer;
+    size_t length = formatTelemetryBinary(buffer, sizeof(_txBuffer), 1, raw, valid, count,
+                                          currentLSB, millis(), timeUs);
+    if (length == 0) return false;
+    
+    return publish(TOPIC_TELEMETRY_BIN, _txBuffer, length, false);
+}
+
+bool MQTTManager::publishTelemetryBatch(const TelemetryBatcher& batcher) {
+    uint8_t total = batcher.getCount();
+    uint8_t first = 0;
+    bool ok = true;
+    
+    while (first < total) {
+        // Halve the slice until it fits; one sample always does
+        uint8_t count = total - first;
+        size_t length = batcher.format(_txBuffer, sizeof(_txBuffer), first, count);
+        while (length == 0 && count > 1) {
+            count = (count + 1) / 2;
+            length = batcher.format(_txBuffer, sizeof(_txBuffer), first, count);
+        }
+        if (length == 0) return false;
+        
+        ok = publish(TOPIC_TELEMETRY_BATCH, _txBuffer, length, false) && ok;
+        first += count;
+    }
+    return ok;
+}
+
+uint8_t MQTTManager::publishTelemetryReplay(const StoredSample samples[], uint8_t count,
+                                            uint32_t remaining) {
+    size_t length = 0;
+    while (count > 0) {
+        length = TelemetryStore::format(_txBuffer, sizeof(_txBuffer), samples, count,
+                                        remaining);
+        if (length > 0) break;
+        remaining += count - count / 2;
+        count /= 2;
+    }
+    if (count == 0) return 0;
     
-    doc["timestamp"] = millis();
-    doc["device_id"] = DEVICE_ID;
+    return publish(TOPIC_TELEMETRY_REPLAY, _txBuffer, length, false) ? count : 0;
+}
+
+bool MQTTManager::setTelemetryFormat(TelemetryFormat format) {
+    if (format < TELEMETRY_FORMAT_JSON || format > TELEMETRY_FORMAT_BOTH) return false;
+    
+    _telemetryFormat = format;
     
-    return publishJson(MQTT_TOPIC_TELEMETRY, doc);
+    Preferences prefs;
+    prefs.begin(TELEMETRY_NVS_NAMESPACE, false);
+    prefs.putUChar("format", format);
+    prefs.end();
+    
+    DEBUG_PRINTF("Telemetry format: %s\n", telemetryFormatName(format));
+    return true;
 }
 
-bool MQTTManager::publishChannelStatus(uint8_t channel, bool switchState, uint8_t simValue) {
+bool MQTTManager::publishChannelStatus(uint8_t channel, bool switchState, uint8_t simValue,
+                                       bool fading) {
     StaticJsonDocument<256> doc;
     
     doc["channel"] = channel;
     doc["switch"] = switchState ? "ON" : "OFF";
     doc["switch_state"] = switchState;
     doc["simulator"] = simValue;
-    doc["timestamp"] = millis();
+    doc["fading"] = fading;
+    stampJson(doc);
+    
+    return publishJson(channelTopic(channel, CH_TOPIC_STATUS), doc, true);  // Retained
+}
+
+bool MQTTManager::publishPWMConfig(uint8_t channel, uint32_t frequency, uint8_t resolution,
+                                   uint32_t duty, uint16_t permille) {
+    StaticJsonDocument<JSON_OBJECT_SIZE(8)> doc;
     
-    const char* topic = (channel == 1) ? MQTT_TOPIC_CH1_STATUS : MQTT_TOPIC_CH2_STATUS;
-    return publishJson(topic, doc, true);  // Retained
+    doc["channel"] = channel;
+    doc["frequency"] = frequency;
+    doc["resolution"] = resolution;
+    doc["max_duty"] = 1UL << resolution;
+    doc["duty"] = duty;
+    doc["permille"] = permille;
+    stampJson(doc);
+    
+    return publishJson(channelTopic(channel, CH_TOPIC_PWM), doc, true);  // Retained
+}
+
+bool MQTTManager::publishAllStatus(const bool switchState[], const uint8_t simValue[],
+                                   uint8_t count, uint16_t changedMask, uint16_t fadingMask) {
+    StaticJsonDocument<JSON_OBJECT_SIZE(NUM_CHANNELS + 4) + NUM_CHANNELS * JSON_OBJECT_SIZE(2)> doc;
+    
+    for (uint8_t i = 0; i < count; i++) {
+        char key[8];
+        snprintf(key, sizeof(key), "ch%u", i + 1);
+        
+        JsonObject ch = doc.createNestedObject(key);
+        ch["switch"] = switchState[i] ? "ON" : "OFF";
+        ch["simulator"] = simValue[i];
+    }
+    
+    doc["changed"] = changedMask;
+    doc["fading"] = fadingMask;
+    stampJson(doc);
+    
+    return publishJson(TOPIC_CHANNEL_STATUS, doc, true);  // Retained
 }
 
 bool MQTTManager::publishDeviceStatus(bool online) {
-    StaticJsonDocument<256> doc;
+    StaticJsonDocument<384> doc;
     
     doc["online"] = online;
-    doc["device_id"] = DEVICE_ID;
+    doc["device_id"] = deviceIdentity.id();
     doc["device_name"] = DEVICE_NAME;
     doc["firmware"] = FIRMWARE_VERSION;
-    doc["timestamp"] = millis();
+    stampJson(doc);
     
     if (online) {
         doc["ip"] = WiFi.localIP().toString();
         doc["rssi"] = WiFi.RSSI();
     }
     
-    return publishJson(MQTT_TOPIC_STATUS, doc, true);  // Retained
+    // Quality of the time_us stamps in this device's messages
+    TimeSyncStats sync = timeBase.getStats();
+    JsonObject time = doc.createNestedObject("time");
+    time["sync"] = timeSyncStateName(sync.state);
+    time["offset_us"] = sync.lastOffsetUs;
+    time["drift_ppb"] = sync.driftPpb;
+    time["since_sync"] = sync.sinceSync;
+    
+    return publishJson(TOPIC_STATUS, doc, true);  // Retained
 }
 
 bool MQTTManager::publishError(uint8_t channel, const char* errorType, const char* message, float value) {
     StaticJsonDocument<384> doc;
     
-    doc["device_id"] = DEVICE_ID;
+    doc["device_id"] = deviceIdentity.id();
     doc["channel"] = channel;
     doc["error_type"] = errorType;
     doc["message"] = message;
     doc["value"] = value;
-    doc["timestamp"] = millis();
+    stampJson(doc);
     
     // Add severity based on error type
     if (strcmp(errorType, "OVERCURRENT") == 0 || strcmp(errorType, "OVERVOLTAGE") == 0) {
@@ -248,34 +469,74 @@ bool MQTTManager::publishError(uint8_t channel, const char* errorType, const cha
         doc["action"] = "NONE";
     }
     
-    return publishJson(MQTT_TOPIC_ERROR, doc);
+    return publishJson(TOPIC_ERROR, doc);
 }
 
-bool MQTTManager::publishHeartbeat(unsigned long uptime, uint32_t freeHeap) {
-    StaticJsonDocument<256> doc;
+bool MQTTManager::publishPowerEvent(uint8_t channel, const char* action, uint16_t level,
+                                    float totalPower, float budget) {
+    StaticJsonDocument<JSON_OBJECT_SIZE(8) + 32> doc;
     
-    doc["device_id"] = DEVICE_ID;
+    doc["channel"] = channel;
+    doc["action"] = action;
+    doc["sim_permille"] = level;
+    doc["total_power"] = JsonWriter::fixed(totalPower, 2);
+    doc["budget"] = budget;
+    doc["device_id"] = deviceIdentity.id();
+    stampJson(doc);
+    
+    return publishJson(TOPIC_POWER, doc);
+}
+
+bool MQTTManager::publishHeartbeat(DeviceTopic section, unsigned long uptime, uint32_t freeHeap,
+                                   JsonDocument& doc) {
+    doc["device_id"] = deviceIdentity.id();
     doc["uptime"] = uptime;
     doc["free_heap"] = freeHeap;
     doc["wifi_rssi"] = WiFi.RSSI();
-    doc["timestamp"] = millis();
+    stampJson(doc);
+    
+    // ArduinoJson drops members that do not fit without an error: say so
+    // instead of publishing a heartbeat with sections missing
+    if (doc.overflowed()) {
+        DEBUG_PRINTF("Heartbeat truncated (%u B used) - enlarge its document\n", (unsigned)doc.memoryUsage());
+    }
+    
+    return publishJson(section, doc);
+}
+
+bool MQTTManager::publishShadow(JsonDocument& doc, bool full) {
+    doc["device_id"] = deviceIdentity.id();
+    stampJson(doc);
     
-    return publishJson(MQTT_TOPIC_HEARTBEAT, doc);
+    // The full document is retained: a new subscriber starts from it
+    return full ? publishJson(TOPIC_SHADOW, doc, true) : publishJson(TOPIC_SHADOW_DELTA, doc);
+}
+
+bool MQTTManager::publishResponse(JsonDocument& doc) {
+    doc["device_id"] = deviceIdentity.id();
+    stampJson(doc);
+    
+    return publishJson(TOPIC_RESPONSE, doc);
 }
 
 bool MQTTManager::subscribeToControlTopics() {
     bool success = true;
     
-    // Subscribe to channel 1 control topics
-    success &= subscribe(MQTT_TOPIC_CH1_SWITCH_SET);
-    success &= subscribe(MQTT_TOPIC_CH1_SIM_SET);
+    // Subscribe to per-channel control topics
+    for (uint8_t channel = 1; channel <= NUM_CHANNELS; channel++) {
+        success &= subscribe(deviceIdentity.topic(channelTopic(channel, CH_TOPIC_SWITCH_SET)));
+        success &= subscribe(deviceIdentity.topic(channelTopic(channel, CH_TOPIC_SIM_SET)));
+    }
     
-    // Subscribe to channel 2 control topics
-    success &= subscribe(MQTT_TOPIC_CH2_SWITCH_SET);
-    success &= subscribe(MQTT_TOPIC_CH2_SIM_SET);
+    // Subscribe to multi-channel switch topic
+    success &= subscribe(deviceIdentity.topic(TOPIC_SWITCH_SET));
     
     // Subscribe to general control topic
-    success &= subscribe(MQTT_TOPIC_CONTROL);
+    success &= subscribe(deviceIdentity.topic(TOPIC_CONTROL));
+    
+    // Shadow: the retained desired state arrives right after subscribing
+    success &= subscribe(deviceIdentity.topic(TOPIC_SHADOW_DESIRED));
+    success &= subscribe(deviceIdentity.topic(TOPIC_SHADOW_GET));
     
     return success;
 }
@@ -0,0 +1,1107 @@
+/**
+ * @file MqttClient.cpp
+ * @brief Implementation of Non-blocking MQTT 5 / 3.1.1 Client
+ */
+
+#include "MqttClient.h"
+#include <lwip/sockets.h>
+#include <lwip/dns.h>
+#include <esp_system.h>
+
+// Control packet types (first byte of the fixed header)
+#define MQTT_PACKET_CONNECT     0x10
+#define MQTT_PACKET_CONNACK     0x20
+#define MQTT_PACKET_PUBLISH     0x30
+#define MQTT_PACKET_PUBACK      0x40
+#define MQTT_PACKET_SUBSCRIBE   0x82    // Reserved flags 0010
+#define MQTT_PACKET_SUBACK      0x90
+#define MQTT_PACKET_PINGREQ     0xC0
+#define MQTT_PACKET_PINGRESP    0xD0
+#define MQTT_PACKET_DISCONNECT  0xE0
+
+// CONNECT flags
+#define MQTT_CONNECT_CLEAN      0x02
+#define MQTT_CONNECT_WILL       0x04
+#define MQTT_CONNECT_WILL_RETAIN 0x20
+#define MQTT_CONNECT_PASSWORD   0x40
+#define MQTT_CONNECT_USERNAME   0x80
+
+// MQTT 5 properties the client writes or reads
+#define MQTT_PROP_PAYLOAD_FORMAT        0x01
+#define MQTT_PROP_MESSAGE_EXPIRY        0x02
+#define MQTT_PROP_CONTENT_TYPE          0x03
+#define MQTT_PROP_SERVER_KEEP_ALIVE     0x13
+#define MQTT_PROP_RECEIVE_MAXIMUM       0x21
+#define MQTT_PROP_TOPIC_ALIAS_MAXIMUM   0x22
+#define MQTT_PROP_TOPIC_ALIAS           0x23
+#define MQTT_PROP_MAXIMUM_QOS           0x24
+#define MQTT_PROP_RETAIN_AVAILABLE      0x25
+#define MQTT_PROP_MAXIMUM_PACKET_SIZE   0x27
+
+// CONNACK codes meaning "not this protocol level" (3.1.1 return code, MQTT 5 reason code)
+#define MQTT_CONNACK_BAD_PROTOCOL       0x01
+#define MQTT_REASON_BAD_PROTOCOL        0x84
+#define MQTT_REASON_ERROR               0x80    // MQTT 5 reason codes from here on are failures
+
+// CONNECT properties: Maximum Packet Size, so the broker never sends what _rx cannot hold
+#define MQTT_CONNECT_PROPERTIES         5
+
+static_assert(MQTT_TOPIC_ALIAS_MAX <= 255, "alias count is 8 bit");
+static_assert(MQTT_TOPIC_ALIAS_BYTES <= UINT16_MAX, "alias topic offsets are 16 bit");
+
+static const char* const kStateNames[] = {
+    "idle", "backoff", "resolving", "connecting", "tls", "handshake", "connected"
+};
+
+const char* mqttStateName(MqttState state) {
+    return state <= MQTT_STATE_CONNECTED ? kStateNames[state] : "unknown";
+}
+
+static void putShort(uint8_t*& p, uint16_t value) {
+    *p++ = value >> 8;
+    *p++ = value & 0xFF;
+}
+
+static void putString(uint8_t*& p, const char* s, size_t length) {
+    putShort(p, length);
+    memcpy(p, s, length);
+    p += length;
+}
+
+static void putLong(uint8_t*& p, uint32_t value) {
+    putShort(p, value >> 16);
+    putShort(p, value & 0xFFFF);
+}
+
+static void putVarInt(uint8_t*& p, size_t value) {
+    do {
+        uint8_t b = value % 128;
+        value /= 128;
+        if (value > 0) b |= 0x80;
+        *p++ = b;
+    } while (value > 0);
+}
+
+static size_t varIntSize(size_t value) {
+    return value < 128 ? 1 : value < 16384 ? 2 : value < 2097152 ? 3 : 4;
+}
+
+static bool getVarInt(const uint8_t*& p, const uint8_t* end, uint32_t& value) {
+    value = 0;
+    for (uint8_t shift = 0; shift < 28; shift += 7) {
+        if (p >= end) return false;
+        uint8_t b = *p++;
+        value |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Step over the value of an MQTT 5 property
+ * @return false if the identifier is unknown or the value is cut off
+ */
+static bool skipProperty(uint8_t id, const uint8_t*& p, const uint8_t* end) {
+    size_t size;
+    switch (id) {
+        case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+            size = 1;
+            break;
+        case 0x13: case 0x21: case 0x22: case 0x23:
+            size = 2;
+            break;
+        case 0x02: case 0x11: case 0x18: case 0x27:
+            size = 4;
+            break;
+        case 0x0B: {
+            uint32_t value;
+            return getVarInt(p, end, value);
+        }
+        case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+            // String or binary data: 2-byte length prefix
+            if (end - p < 2) return false;
+            size = 2 + ((p[0] << 8) | p[1]);
+            break;
+        case 0x26:
+            // User property: two strings
+            return skipProperty(MQTT_PROP_CONTENT_TYPE, p, end) && skipProperty(MQTT_PROP_CONTENT_TYPE, p, end);
+        default:
+            return false;
+    }
+    if ((size_t)(end - p) < size) return false;
+    p += size;
+    return true;
+}
+
+/**
+ * @brief Skip a properties block (length + properties) the client does not use
+ */
+static bool skipProperties(const uint8_t*& p, const uint8_t* end) {
+    uint32_t size;
+    if (!getVarInt(p, end, size) || size > (uint32_t)(end - p)) return false;
+    p += size;
+    return true;
+}
+
+static size_t propertiesSize(const MqttPublishProperties* properties, uint16_t alias) {
+    size_t size = alias != 0 ? 3 : 0;
+    if (properties == nullptr) return size;
+    if (properties->utf8) size += 2;
+    if (properties->expiry != 0) size += 5;
+    if (properties->contentType != nullptr) size += 3 + strlen(properties->contentType);
+    return size;
+}
+
+static void putProperties(uint8_t*& p, size_t size, const MqttPublishProperties* properties, uint16_t alias) {
+    putVarInt(p, size);
+    if (properties != nullptr) {
+        if (properties->utf8) {
+            *p++ = MQTT_PROP_PAYLOAD_FORMAT;
+            *p++ = 1;
+        }
+        if (properties->expiry != 0) {
+            *p++ = MQTT_PROP_MESSAGE_EXPIRY;
+            putLong(p, properties->expiry);
+        }
+        if (properties->contentType != nullptr) {
+            *p++ = MQTT_PROP_CONTENT_TYPE;
+            putString(p, properties->contentType, strlen(properties->contentType));
+        }
+    }
+    if (alias != 0) {
+        *p++ = MQTT_PROP_TOPIC_ALIAS;
+        putShort(p, alias);
+    }
+}
+
+/**
+ * @brief Remaining length of a PUBLISH (everything after the fixed header)
+ */
+static size_t publishRemaining(size_t topicLength, size_t length, uint8_t qos, bool v5,
+                               size_t propertiesLength, bool aliasKnown) {
+    size_t remaining = 2 + (aliasKnown ? 0 : topicLength) + (qos > 0 ? 2 : 0) + length;
+    if (v5) remaining += varIntSize(propertiesLength) + propertiesLength;
+    return remaining;
+}
+
+// FNV-1a
+static uint32_t hashTopic(const char* topic, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)topic[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool isSet(const char* s) {
+    return s != nullptr && s[0] != '\0';
+}
+
+MqttClient::MqttClient() {
+    _host = nullptr;
+    _port = 0;
+    _clientId = "";
+    _username = nullptr;
+    _password = nullptr;
+    _keepAlive = 0;
+    _willTopic = nullptr;
+    _willMessage = nullptr;
+    _willQos = 0;
+    _willRetain = false;
+    _callback = nullptr;
+
+    _state = MQTT_STATE_IDLE;
+    _socket = -1;
+    _now = 0;
+    _stateSince = 0;
+    _backoff = 0;
+    _retryAt = 0;
+    _lastTx = 0;
+    _lastRx = 0;
+    _pingOutstanding = false;
+    _nextPacketId = 1;
+
+    _protocol = MQTT_PROTOCOL_V5 ? 5 : 4;
+    _v5Refused = false;
+    _inFlightLimit = MQTT_INFLIGHT_MAX;
+    _maxPacket = 0;
+    _sessionKeepAlive = 0;
+    _maxQos = 1;
+    _retainAvailable = true;
+
+    _address = 0;
+    _addressTime = 0;
+    _refreshAddress = false;
+    _dnsDone = false;
+    _dnsResult = 0;
+
+    _txLength = 0;
+    _rxHeader = 0;
+    _rxRemaining = 0;
+    _rxReceived = 0;
+    _rxLengthBytes = 0;
+    _rxStage = 0;
+
+    _inFlightCount = 0;
+    _inFlightUsed = 0;
+    _rttSmoothed = 0;
+
+    _aliasCount = 0;
+    _aliasLimit = 0;
+    _aliasTopicsUsed = 0;
+
+    memset(&_stats, 0, sizeof(_stats));
+    _stats.protocol = _protocol;
+}
+
+void MqttClient::setServer(const char* host, uint16_t port) {
+    _host = host;
+    _port = port;
+    _address = 0;
+}
+
+void MqttClient::setIdentity(const char* clientId, const char* username, const char* password,
+                             uint16_t keepAlive) {
+    _clientId = clientId;
+    _username = username;
+    _password = password;
+    _keepAlive = keepAlive;
+}
+
+void MqttClient::setWill(const char* topic, const char* message, uint8_t qos, bool retain) {
+    _willTopic = topic;
+    _willMessage = message;
+    _willQos = qos;
+    _willRetain = retain;
+}
+
+void MqttClient::start(uint32_t now) {
+    if (_state != MQTT_STATE_IDLE) return;
+    _now = now;
+    _retryAt = now;     // First attempt right away
+    _stats.backoffMs = 0;
+    enterState(MQTT_STATE_BACKOFF);
+}
+
+void MqttClient::loop(uint32_t now, bool networkUp) {
+    _now = now;
+
+    switch (_state) {
+        case MQTT_STATE_IDLE:
+            return;
+
+        case MQTT_STATE_BACKOFF:
+            if (!networkUp || (int32_t)(now - _retryAt) < 0) return;
+            _stats.attempts++;
+            beginResolve();
+            return;
+
+        case MQTT_STATE_RESOLVING:
+            if (_dnsDone || now - _stateSince > MQTT_DNS_TIMEOUT) finishResolve();
+            return;
+
+        case MQTT_STATE_CONNECTING:
+            pollConnect();
+            return;
+
+        case MQTT_STATE_TLS:
+            if (!networkUp) {
+                fail(MQTT_ERR_CLOSED);
+                return;
+            }
+            pollTls();
+            return;
+
+        case MQTT_STATE_HANDSHAKE:
+        case MQTT_STATE_CONNECTED:
+            break;
+    }
+
+    if (!networkUp) {
+        fail(MQTT_ERR_CLOSED);
+        return;
+    }
+    if (!flushTx() || !receive()) return;
+
+    if (_state == MQTT_STATE_HANDSHAKE) {
+        if (now - _stateSince > MQTT_HANDSHAKE_TIMEOUT) fail(MQTT_ERR_TIMEOUT);
+        return;
+    }
+
+    // A connection that keeps dropping right after CONNACK (e.g. another
+    // device using the same client ID) keeps backing off; the delay only
+    // starts over once the connection has proven stable
+    if (_backoff != 0 && now - _stateSince >= MQTT_RECONNECT_MAX) _backoff = 0;
+
+    // TCP does not lose data: an ack this late means the link is dead, and
+    // the reconnect resends the window
+    if (_inFlightCount > 0 && now - _inFlight[0].sentAt > MQTT_ACK_TIMEOUT) {
+        fail(MQTT_ERR_ACK_TIMEOUT);
+        return;
+    }
+
+    if (_sessionKeepAlive == 0) return;
+    uint32_t interval = (uint32_t)_sessionKeepAlive * 1000;
+
+    if (now - _lastRx > interval + interval / 2) {
+        fail(MQTT_ERR_KEEPALIVE);
+        return;
+    }
+    if (!_pingOutstanding && (now - _lastTx >= interval || now - _lastRx >= interval)) {
+        if (reservePacket(MQTT_PACKET_PINGREQ, 0) != nullptr) {
+            _pingOutstanding = true;
+            flushTx();
+        }
+    }
+}
+
+MqttSendResult MqttClient::publish(const char* topic, const uint8_t* payload, size_t length,
+                                   bool retained, uint8_t qos, const MqttPublishProperties* properties) {
+    if (_state != MQTT_STATE_CONNECTED) return MQTT_SEND_FAILED;
+    // Downgrade to what the broker accepts (MQTT 5 CONNACK); sending more is
+    // a protocol error that would cost the connection
+    if (qos > _maxQos) qos = _maxQos;
+    if (!_retainAvailable) retained = false;
+
+    size_t topicLength = strlen(topic);
+    bool v5 = _protocol == 5;
+
+    // Aliases only for QoS 0: a QoS 1 copy may be resent on a later
+    // connection, where the aliases start over
+    uint16_t alias = 0;
+    bool aliasKnown = false;
+    uint32_t hash = 0;
+    if (v5 && qos == 0 && _aliasLimit > 0) {
+        hash = hashTopic(topic, topicLength);
+        alias = findAlias(topic, topicLength, hash, aliasKnown);
+    }
+
+    size_t propertiesLength = v5 ? propertiesSize(properties, alias) : 0;
+    size_t remaining = publishRemaining(topicLength, length, qos, v5, propertiesLength, aliasKnown);
+    size_t total = 1 + varIntSize(remaining) + remaining;
+    if (total > MQTT_TX_BUFFER_SIZE || (qos > 0 && total > MQTT_INFLIGHT_BYTES) ||
+        (_maxPacket != 0 && total > _maxPacket)) {
+        return MQTT_SEND_FAILED;
+    }
+
+    // QoS 1 keeps a copy until the PUBACK, so it needs room in the window
+    if (qos > 0 && (_inFlightCount >= _inFlightLimit ||
+                    _inFlightUsed + total > MQTT_INFLIGHT_BYTES)) {
+        return MQTT_SEND_BUSY;
+    }
+
+    uint8_t* packet = _tx + _txLength;
+    uint8_t* p = reservePacket(MQTT_PACKET_PUBLISH | qos << 1 | (retained ? 0x01 : 0x00), remaining);
+    if (p == nullptr) return MQTT_SEND_BUSY;
+
+    putString(p, topic, aliasKnown ? 0 : topicLength);
+    uint16_t packetId = 0;
+    if (qos > 0) {
+        packetId = nextPacketId();
+        putShort(p, packetId);
+    }
+    if (v5) putProperties(p, propertiesLength, properties, alias);
+    memcpy(p, payload, length);
+
+    // The broker learns the alias from this packet; only now is it taken
+    if (alias != 0 && !aliasKnown) {
+        TopicAlias& entry = _aliases[_aliasCount++];
+        entry.hash = hash;
+        entry.offset = _aliasTopicsUsed;
+        entry.length = topicLength;
+        memcpy(_aliasTopics + _aliasTopicsUsed, topic, topicLength);
+        _aliasTopicsUsed += topicLength;
+        _stats.aliases = _aliasCount;
+    }
+
+    _stats.published++;
+    _stats.publishBytes += total;
+    _stats.publishBytesV311 += publishSize(topicLength, length, qos, 4, nullptr, 0, false);
+
+    if (qos > 0) {
+        memcpy(_inFlightData + _inFlightUsed, packet, total);
+        _inFlightUsed += total;
+
+        InFlight& entry = _inFlight[_inFlightCount++];
+        entry.packetId = packetId;
+        entry.length = total;
+        entry.sentAt = _now;
+        entry.resends = 0;
+        entry.protocol = _protocol;
+    }
+
+    // Hand it to the socket now; whatever does not fit waits for loop().
+    // A QoS 1 message lost with the connection is resent after reconnecting
+    if (!flushTx() && qos == 0) return MQTT_SEND_FAILED;
+    return MQTT_SEND_OK;
+}
+
+bool MqttClient::subscribe(const char* topic, uint8_t qos) {
+    if (_state != MQTT_STATE_CONNECTED) return false;
+
+    size_t topicLength = strlen(topic);
+    bool v5 = _protocol == 5;
+    uint8_t* p = reservePacket(MQTT_PACKET_SUBSCRIBE, 2 + (v5 ? 1 : 0) + 2 + topicLength + 1);
+    if (p == nullptr) return false;
+
+    putShort(p, nextPacketId());
+    if (v5) *p++ = 0;           // No properties
+    putString(p, topic, topicLength);
+    *p = qos > 1 ? 1 : qos;     // MQTT 5 subscription options: maximum QoS in the same bits
+
+    return flushTx();
+}
+
+void MqttClient::disconnect() {
+    if (_state == MQTT_STATE_CONNECTED && reservePacket(MQTT_PACKET_DISCONNECT, 0) != nullptr) {
+        flushTx();
+    }
+    closeSocket();
+    enterState(MQTT_STATE_IDLE);
+}
+
+MqttClientStats MqttClient::getStats() {
+    _stats.txQueued = _txLength;
+    _stats.inFlight = _inFlightCount;
+    return _stats;
+}
+
+size_t MqttClient::publishSize(size_t topicLength, size_t length, uint8_t qos, uint8_t protocol,
+                               const MqttPublishProperties* properties, uint16_t alias, bool aliasKnown) {
+    bool v5 = protocol == 5;
+    size_t remaining = publishRemaining(topicLength, length, qos, v5,
+                                        v5 ? propertiesSize(properties, alias) : 0, v5 && aliasKnown);
+    return 1 + varIntSize(remaining) + remaining;
+}
+
+void MqttClient::enterState(MqttState state) {
+    _state = state;
+    _stateSince = _now;
+}
+
+void MqttClient::fail(int16_t error) {
+    DEBUG_PRINTF("MQTT %s failed (%d)\n", mqttStateName(_state), error);
+
+#if MQTT_PROTOCOL_V5
+    // No CONNACK at all: some 3.1.1 brokers just close on an unknown protocol
+    // level, so the next attempt offers the other one. Whichever level
+    // connects is kept
+    if (_state == MQTT_STATE_HANDSHAKE && error < 0 && !_v5Refused) {
+        _protocol = _protocol == 5 ? 4 : 5;
+    }
+#endif
+
+    if (_state == MQTT_STATE_CONNECTING) _refreshAddress = true;
+    closeSocket();
+    _stats.lastError = error;
+
+    // Exponential backoff with "equal jitter": half of the delay is fixed,
+    // the other half random, so retries spread out but never bunch at zero
+    _backoff = _backoff == 0 ? MQTT_RECONNECT_MIN : _backoff * 2;
+    if (_backoff > MQTT_RECONNECT_MAX) _backoff = MQTT_RECONNECT_MAX;
+
+    uint32_t delay = _backoff / 2 + esp_random() % (_backoff / 2 + 1);
+    _retryAt = _now + delay;
+    _stats.backoffMs = delay;
+    enterState(MQTT_STATE_BACKOFF);
+
+    DEBUG_PRINTF("MQTT retry in %u ms\n", delay);
+}
+
+void MqttClient::beginResolve() {
+    enterState(MQTT_STATE_RESOLVING);
+
+    // Dotted address: nothing to resolve
+    struct in_addr literal;
+    if (inet_pton(AF_INET, _host, &literal) == 1) {
+        _address = literal.s_addr;
+        beginConnect();
+        return;
+    }
+
+    if (_address != 0 && !_refreshAddress && _now - _addressTime < MQTT_DNS_CACHE_TTL) {
+        _stats.dnsCacheHits++;
+        beginConnect();
+        return;
+    }
+
+    _dnsDone = false;
+    _dnsResult = 0;
+
+    // Answers from the lwIP cache come back at once, others via dnsFound()
+    ip_addr_t result;
+    err_t err = dns_gethostbyname(_host, &result, dnsFound, this);
+    if (err == ERR_OK) {
+        _dnsResult = result.u_addr.ip4.addr;
+        _dnsDone = true;
+        finishResolve();
+    } else if (err != ERR_INPROGRESS) {
+        _dnsDone = true;    // Failed, _dnsResult stays 0
+    }
+}
+
+void MqttClient::finishResolve() {
+    if (_dnsDone && _dnsResult != 0) {
+        _address = _dnsResult;
+        _addressTime = _now;
+        _refreshAddress = false;
+    } else if (_address != 0) {
+        // Resolver down or slow: the last known address is still our best guess
+        DEBUG_PRINTLN("MQTT DNS lookup failed - using cached address");
+        _stats.dnsCacheHits++;
+    } else {
+        fail(MQTT_ERR_DNS);
+        return;
+    }
+    beginConnect();
+}
+
+void MqttClient::dnsFound(const char* name, const struct ip_addr* address, void* arg) {
+    // Runs in the TCP/IP task: only hand the result over
+    MqttClient* self = (MqttClient*)arg;
+    self->_dnsResult = address != nullptr ? address->u_addr.ip4.addr : 0;
+    self->_dnsDone = true;
+}
+
+void MqttClient::beginConnect() {
+    _socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (_socket < 0) {
+        fail(MQTT_ERR_SOCKET);
+        return;
+    }
+
+    fcntl(_socket, F_SETFL, fcntl(_socket, F_GETFL, 0) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(_port);
+    addr.sin_addr.s_addr = _address;
+
+    char ip[16];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    DEBUG_PRINTF("MQTT connecting to %s (%s):%u\n", _host, ip, _port);
+
+    enterState(MQTT_STATE_CONNECTING);
+    if (connect(_socket, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        beginSession();
+    } else if (errno != EINPROGRESS) {
+        fail(MQTT_ERR_CONNECT);
+    }
+}
+
+void MqttClient::pollConnect() {
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(_socket, &writable);
+    struct timeval timeout = { 0, 0 };
+
+    int ready = select(_socket + 1, nullptr, &writable, nullptr, &timeout);
+    if (ready < 0) {
+        fail(MQTT_ERR_CONNECT);
+        return;
+    }
+    if (ready == 0) {
+        if (_now - _stateSince > MQTT_CONNECT_TIMEOUT) fail(MQTT_ERR_TIMEOUT);
+        return;
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(_socket, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+        fail(MQTT_ERR_CONNECT);
+        return;
+    }
+    beginSession();
+}
+
+void MqttClient::beginSession() {
+#if MQTT_USE_TLS
+    enterState(MQTT_STATE_TLS);
+    if (!_tls.start(_socket, _host, _port)) {
+        fail(MQTT_ERR_TLS);
+        return;
+    }
+    pollTls();
+#else
+    sendConnect();
+#endif
+}
+
+void MqttClient::pollTls() {
+#if MQTT_USE_TLS
+    switch (_tls.handshake()) {
+        case TLS_HANDSHAKE_DONE:
+            sendConnect();
+            return;
+        case TLS_HANDSHAKE_FAILED:
+            fail(MQTT_ERR_TLS);
+            return;
+        case TLS_HANDSHAKE_PENDING:
+            if (_now - _stateSince > MQTT_TLS_HANDSHAKE_TIMEOUT) fail(MQTT_ERR_TIMEOUT);
+            return;
+    }
+#endif
+}
+
+void MqttClient::sendConnect() {
+    size_t clientIdLength = strlen(_clientId);
+    bool will = isSet(_willTopic) && _willMessage != nullptr;
+    bool username = isSet(_username);
+    bool password = username && isSet(_password);
+
+    bool v5 = _protocol == 5;
+
+    size_t remaining = 10 + 2 + clientIdLength;
+    if (v5) remaining += 1 + MQTT_CONNECT_PROPERTIES;
+    if (will) remaining += (v5 ? 1 : 0) + 2 + strlen(_willTopic) + 2 + strlen(_willMessage);
+    if (username) remaining += 2 + strlen(_username);
+    if (password) remaining += 2 + strlen(_password);
+
+    uint8_t flags = MQTT_CONNECT_CLEAN;
+    if (will) {
+        flags |= MQTT_CONNECT_WILL | (_willQos & 0x03) << 3;
+        if (_willRetain) flags |= MQTT_CONNECT_WILL_RETAIN;
+    }
+    if (username) flags |= MQTT_CONNECT_USERNAME;
+    if (password) flags |= MQTT_CONNECT_PASSWORD;
+
+    _txLength = 0;
+    uint8_t* p = reservePacket(MQTT_PACKET_CONNECT, remaining);
+    if (p == nullptr) {
+        fail(MQTT_ERR_PROTOCOL);
+        return;
+    }
+
+    putString(p, "MQTT", 4);
+    *p++ = _protocol;           // Protocol level: 4 = 3.1.1, 5 = MQTT 5
+    *p++ = flags;               // Clean session / MQTT 5 clean start (session expiry 0)
+    putShort(p, _keepAlive);
+    if (v5) {
+        *p++ = MQTT_CONNECT_PROPERTIES;
+        *p++ = MQTT_PROP_MAXIMUM_PACKET_SIZE;
+        putLong(p, MQTT_BUFFER_SIZE);
+    }
+    putString(p, _clientId, clientIdLength);
+    if (will) {
+        if (v5) *p++ = 0;       // No will properties
+        putString(p, _willTopic, strlen(_willTopic));
+        putString(p, _willMessage, strlen(_willMessage));
+    }
+    if (username) putString(p, _username, strlen(_username));
+    if (password) putString(p, _password, strlen(_password));
+
+    _lastRx = _now;
+    _pingOutstanding = false;
+    enterState(MQTT_STATE_HANDSHAKE);
+    flushTx();
+}
+
+void MqttClient::closeSocket() {
+    if (_socket >= 0) {
+#if MQTT_USE_TLS
+        _tls.close();
+#endif
+        close(_socket);
+        _socket = -1;
+    }
+    _txLength = 0;
+    _rxStage = 0;
+    _pingOutstanding = false;
+}
+
+ssize_t MqttClient::transportSend(const uint8_t* data, size_t length) {
+    // > 0 bytes taken, 0 = socket full, < 0 = connection lost
+#if MQTT_USE_TLS
+    return _tls.send(data, length);
+#else
+    ssize_t n = send(_socket, data, length, MSG_DONTWAIT);
+    if (n > 0) return n;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
+#endif
+}
+
+ssize_t MqttClient::transportReceive(uint8_t* buffer, size_t size) {
+    // > 0 bytes read, 0 = nothing yet, < 0 = connection closed
+#if MQTT_USE_TLS
+    return _tls.receive(buffer, size);
+#else
+    ssize_t n = recv(_socket, buffer, size, MSG_DONTWAIT);
+    if (n > 0) return n;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
+#endif
+}
+
+uint8_t* MqttClient::reservePacket(uint8_t header, size_t remaining) {
+    uint8_t lengthBytes[4];
+    size_t count = encodeLength(lengthBytes, remaining);
+    if (_txLength + 1 + count + remaining > MQTT_TX_BUFFER_SIZE) return nullptr;
+
+    uint8_t* p = _tx + _txLength;
+    *p++ = header;
+    memcpy(p, lengthBytes, count);
+    p += count;
+    _txLength += 1 + count + remaining;
+    return p;
+}
+
+bool MqttClient::flushTx() {
+    if (_socket < 0) return false;
+
+    size_t sent = 0;
+    while (sent < _txLength) {
+        ssize_t n = transportSend(_tx + sent, _txLength - sent);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n == 0) break;
+        fail(MQTT_ERR_CLOSED);
+        return false;
+    }
+
+    if (sent > 0) {
+        memmove(_tx, _tx + sent, _txLength - sent);
+        _txLength -= sent;
+        _lastTx = _now;
+    }
+    return true;
+}
+
+bool MqttClient::receive() {
+    uint8_t chunk[256];
+
+    while (true) {
+        ssize_t n = transportReceive(chunk, sizeof(chunk));
+        if (n == 0) return true;
+        if (n < 0) {
+            fail(MQTT_ERR_CLOSED);
+            return false;
+        }
+        _lastRx = _now;
+
+        for (ssize_t i = 0; i < n; ) {
+            uint8_t b = chunk[i];
+            if (_rxStage == 0) {
+                _rxHeader = b;
+                _rxRemaining = 0;
+                _rxLengthBytes = 0;
+                _rxStage = 1;
+                i++;
+            } else if (_rxStage == 1) {
+                _rxRemaining |= (uint32_t)(b & 0x7F) << (7 * _rxLengthBytes++);
+                i++;
+                if (b & 0x80) {
+                    if (_rxLengthBytes == 4) {
+                        fail(MQTT_ERR_PROTOCOL);
+                        return false;
+                    }
+                    continue;
+                }
+                _rxReceived = 0;
+                _rxStage = 2;
+            } else {
+                // Body: copy what fits, skip the rest of an oversized packet
+                size_t take = _rxRemaining - _rxReceived;
+                if (take > (size_t)(n - i)) take = n - i;
+                if (_rxReceived < MQTT_BUFFER_SIZE) {
+                    size_t room = MQTT_BUFFER_SIZE - _rxReceived;
+                    memcpy(_rx + _rxReceived, chunk + i, take < room ? take : room);
+                }
+                _rxReceived += take;
+                i += take;
+            }
+
+            if (_rxStage == 2 && _rxReceived == _rxRemaining) {
+                _rxStage = 0;
+                if (_rxRemaining > MQTT_BUFFER_SIZE) {
+                    DEBUG_PRINTF("MQTT packet too large (%u bytes) - dropped\n", _rxRemaining);
+                    continue;
+                }
+                handlePacket();
+                if (_socket < 0) return false;  // Refused, or callback disconnected
+            }
+        }
+    }
+}
+
+void MqttClient::handlePacket() {
+    uint8_t type = _rxHeader & 0xF0;
+    uint32_t length = _rxRemaining;
+
+    switch (type) {
+        case MQTT_PACKET_CONNACK:
+            if (_state != MQTT_STATE_HANDSHAKE || length < 2) {
+                fail(MQTT_ERR_PROTOCOL);
+                return;
+            }
+            if (_rx[1] != 0) {
+                uint8_t code = _rx[1];
+                if (_protocol == 5 && (code == MQTT_CONNACK_BAD_PROTOCOL || code == MQTT_REASON_BAD_PROTOCOL)) {
+                    // Broker without MQTT 5: 3.1.1 from now on, and right away
+                    DEBUG_PRINTLN("MQTT 5 refused by broker - using 3.1.1");
+                    _protocol = 4;
+                    _v5Refused = true;
+                    uint32_t backoff = _backoff;
+                    fail(code);
+                    _backoff = backoff;
+                    _retryAt = _now;
+                    _stats.backoffMs = 0;
+                    return;
+                }
+                // 3.1.1 return code 1-5 = refused (protocol, id, unavailable, auth);
+                // MQTT 5 reason code >= 0x80
+                fail(code);
+                return;
+            }
+            if (!readConnack(length)) {
+                fail(MQTT_ERR_PROTOCOL);
+                return;
+            }
+            enterState(MQTT_STATE_CONNECTED);
+            _stats.connects++;
+            _stats.lastError = MQTT_ERR_NONE;
+            DEBUG_PRINTF("MQTT session established (%s)\n", _protocol == 5 ? "MQTT 5" : "3.1.1");
+            resendInFlight();
+            return;
+
+        case MQTT_PACKET_PUBLISH: {
+            uint8_t qos = (_rxHeader >> 1) & 0x03;
+            if (length < 2) return;
+            uint16_t topicLength = (_rx[0] << 8) | _rx[1];
+            uint32_t offset = 2 + topicLength + (qos > 0 ? 2 : 0);
+            if (offset > length) return;
+
+            // MQTT 5 properties: none are used (the broker gets no Topic
+            // Alias Maximum, so it always sends the full topic)
+            if (_protocol == 5) {
+                const uint8_t* p = _rx + offset;
+                if (!skipProperties(p, _rx + length)) return;
+                offset = p - _rx;
+            }
+
+            if (qos == 1) {
+                uint8_t* p = reservePacket(MQTT_PACKET_PUBACK, 2);
+                if (p != nullptr) {
+                    memcpy(p, _rx + 2 + topicLength, 2);
+                    flushTx();
+                }
+            }
+
+            // Move the topic over its length prefix to make room for the NUL;
+            // the payload NUL goes into the spare byte after the buffer
+            memmove(_rx, _rx + 2, topicLength);
+            _rx[topicLength] = '\0';
+            _rx[length] = '\0';
+
+            if (_callback != nullptr) {
+                _callback((const char*)_rx, (const char*)_rx + offset, length - offset);
+            }
+            return;
+        }
+
+        case MQTT_PACKET_PUBACK:
+            if (length < 2) return;
+            // MQTT 5 may add a reason code; the message is done either way
+            if (length >= 3 && _rx[2] >= MQTT_REASON_ERROR) {
+                DEBUG_PRINTF("MQTT message refused by broker (0x%02x)\n", _rx[2]);
+                _stats.refused++;
+            }
+            acknowledge((_rx[0] << 8) | _rx[1]);
+            return;
+
+        case MQTT_PACKET_SUBACK: {
+            // Packet ID, MQTT 5 properties, then the return/reason code
+            const uint8_t* p = _rx + 2;
+            const uint8_t* end = _rx + length;
+            if (_protocol == 5 && !skipProperties(p, end)) return;
+            if (p < end && *p >= MQTT_REASON_ERROR) {
+                DEBUG_PRINTLN("MQTT subscription refused by broker");
+            }
+            return;
+        }
+
+        case MQTT_PACKET_DISCONNECT:
+            // MQTT 5 brokers say why before closing
+            DEBUG_PRINTF("MQTT disconnected by broker (0x%02x)\n", length >= 1 ? _rx[0] : 0);
+            fail(MQTT_ERR_CLOSED);
+            return;
+
+        case MQTT_PACKET_PINGRESP:
+            _pingOutstanding = false;
+            return;
+
+        default:
+            return;
+    }
+}
+
+void MqttClient::acknowledge(uint16_t packetId) {
+    uint16_t offset = 0;
+    for (uint8_t i = 0; i < _inFlightCount; i++) {
+        const InFlight& entry = _inFlight[i];
+        if (entry.packetId != packetId) {
+            offset += entry.length;
+            continue;
+        }
+
+        // Only first transmissions are timed: the ack of a resent message
+        // cannot be matched to one particular send
+        if (entry.resends == 0) {
+            uint32_t rtt = _now - entry.sentAt;
+            if (rtt > 0xFFFF) rtt = 0xFFFF;
+            _stats.rttLast = rtt;
+            if (rtt > _stats.rttMax) _stats.rttMax = rtt;
+
+            // Moving average with gain 1/8, like TCP's SRTT
+            _rttSmoothed = _rttSmoothed == 0 ? rtt << 3 : _rttSmoothed - (_rttSmoothed >> 3) + rtt;
+            _stats.rttAverage = _rttSmoothed >> 3;
+        }
+
+        uint16_t entryLength = entry.length;
+        memmove(_inFlightData + offset, _inFlightData + offset + entryLength,
+                _inFlightUsed - offset - entryLength);
+        _inFlightUsed -= entryLength;
+        memmove(&_inFlight[i], &_inFlight[i + 1], (_inFlightCount - i - 1) * sizeof(InFlight));
+        _inFlightCount--;
+        _stats.acked++;
+        return;
+    }
+}
+
+void MqttClient::resendInFlight() {
+    uint16_t offset = 0;
+    uint16_t keptUsed = 0;
+    uint8_t kept = 0;
+
+    for (uint8_t i = 0; i < _inFlightCount; i++) {
+        InFlight entry = _inFlight[i];
+        uint8_t* packet = _inFlightData + offset;
+        offset += entry.length;
+
+        // A packet encoded for the other protocol level cannot be resent as
+        // is, nor a QoS 1 packet to a broker that now only takes QoS 0
+        if (entry.protocol != _protocol || _maxQos == 0 || entry.resends >= MQTT_INFLIGHT_RESENDS ||
+            _txLength + entry.length > MQTT_TX_BUFFER_SIZE) {
+            DEBUG_PRINTF("MQTT message %u not acknowledged - given up\n", entry.packetId);
+            _stats.expired++;
+            continue;
+        }
+
+        packet[0] |= 0x08;      // DUP: the broker may have seen it already
+        if (!_retainAvailable) packet[0] &= ~0x01;
+        memcpy(_tx + _txLength, packet, entry.length);
+        _txLength += entry.length;
+
+        entry.resends++;
+        entry.sentAt = _now;
+        memmove(_inFlightData + keptUsed, packet, entry.length);
+        keptUsed += entry.length;
+        _inFlight[kept++] = entry;
+        _stats.resent++;
+    }
+
+    _inFlightCount = kept;
+    _inFlightUsed = keptUsed;
+    if (kept > 0) {
+        DEBUG_PRINTF("MQTT resending %u unacknowledged messages\n", kept);
+        flushTx();
+    }
+}
+
+bool MqttClient::readConnack(uint32_t length) {
+    // Limits of this session; 3.1.1 has none of them
+    _inFlightLimit = MQTT_INFLIGHT_MAX;
+    _maxPacket = 0;
+    _sessionKeepAlive = _keepAlive;
+    _maxQos = 1;
+    _retainAvailable = true;
+    _aliasCount = 0;
+    _aliasTopicsUsed = 0;
+    _aliasLimit = 0;
+    _stats.protocol = _protocol;
+    _stats.aliases = 0;
+    _stats.aliasMax = 0;
+    if (_protocol != 5) return true;
+
+    const uint8_t* p = _rx + 2;
+    const uint8_t* end = _rx + length;
+    uint32_t size;
+    if (!getVarInt(p, end, size) || size > (uint32_t)(end - p)) return false;
+    end = p + size;
+
+    while (p < end) {
+        uint8_t id = *p++;
+        const uint8_t* value = p;
+        if (!skipProperty(id, p, end)) return false;
+
+        switch (id) {
+            case MQTT_PROP_RECEIVE_MAXIMUM: {
+                uint16_t receiveMax = (value[0] << 8) | value[1];
+                if (receiveMax != 0 && receiveMax < _inFlightLimit) _inFlightLimit = receiveMax;
+                break;
+            }
+            case MQTT_PROP_TOPIC_ALIAS_MAXIMUM: {
+                uint16_t aliasMax = (value[0] << 8) | value[1];
+                _stats.aliasMax = aliasMax;
+                _aliasLimit = aliasMax < MQTT_TOPIC_ALIAS_MAX ? aliasMax : MQTT_TOPIC_ALIAS_MAX;
+                break;
+            }
+            case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+                _maxPacket = (uint32_t)value[0] << 24 | (uint32_t)value[1] << 16 | value[2] << 8 | value[3];
+                break;
+            case MQTT_PROP_SERVER_KEEP_ALIVE:
+                // Replaces the keep-alive we asked for in CONNECT
+                _sessionKeepAlive = (value[0] << 8) | value[1];
+                break;
+            case MQTT_PROP_MAXIMUM_QOS:
+                if (value[0] < _maxQos) _maxQos = value[0];
+                break;
+            case MQTT_PROP_RETAIN_AVAILABLE:
+                _retainAvailable = value[0] != 0;
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+uint16_t MqttClient::findAlias(const char* topic, size_t topicLength, uint32_t hash, bool& known) {
+    for (uint8_t i = 0; i < _aliasCount; i++) {
+        const TopicAlias& entry = _aliases[i];
+        if (entry.hash == hash && entry.length == topicLength &&
+            memcmp(_aliasTopics + entry.offset, topic, topicLength) == 0) {
+            known = true;
+            return i + 1;
+        }
+    }
+
+    // Next free alias; once they run out, further topics are always sent in full
+    known = false;
+    if (_aliasCount >= _aliasLimit || _aliasTopicsUsed + topicLength > MQTT_TOPIC_ALIAS_BYTES) return 0;
+    return _aliasCount + 1;
+}
+
+uint16_t MqttClient::nextPacketId() {
+    uint16_t packetId = _nextPacketId++;
+    if (_nextPacketId == 0) _nextPacketId = 1;
+    return packetId;
+}
+
+size_t MqttClient::encodeLength(uint8_t* out, size_t length) {
+    size_t count = 0;
+    do {
+        uint8_t b = length % 128;
+        length /= 128;
+        if (length > 0) b |= 0x80;
+        out[count++] = b;
+    } while (length > 0 && count < 4);
+    return count;
+}
@@ -0,0 +1,355 @@
+/**
+ * @file PublishQueue.cpp
+ * @brief Implementation of Outbound Publish Scheduler
+ */
+
+#include "PublishQueue.h"
+
+static_assert(PUBLISH_BURST_BYTES >= MQTT_BUFFER_SIZE, "PUBLISH_BURST_BYTES must fit the largest message");
+
+// Record flags
+#define RECORD_RETAINED     0x01
+#define RECORD_DEAD         0x02    // Sent, superseded or dropped; space freed once it reaches the head
+#define RECORD_PAD          0x04    // Filler up to the end of the ring
+
+/**
+ * @brief Start of every queued record, followed by the topic (NUL-terminated)
+ *        and the payload, padded to 4 bytes
+ */
+struct PublishQueue::RecordHeader {
+    uint16_t size;              // Total record size
+    uint16_t topicLength;       // Without NUL
+    uint16_t length;            // Payload length
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t enqueuedAt;        // millis()
+    uint32_t hash;              // hashTopic(topic)
+};
+
+// Checked in this order; the first topic ending that matches wins
+// Batches and replays keep no expiry: they are the history a backend fills gaps from
+static const PublishRule kRules[] = {
+    { "/error",           PUBLISH_CRITICAL,  0,                              false, 1, 0,                     false },
+    { "/power",           PUBLISH_CRITICAL,  0,                              false, 1, 0,                     false },
+    { "/response",        PUBLISH_STATUS,    0,                              false, 1, 0,                     false },
+    { "/shadow/delta",    PUBLISH_STATUS,    0,                              false, 1, 0,                     false },
+    { "/shadow",          PUBLISH_STATUS,    0,                              true,  1, 0,                     false },
+    { "/telemetry/batch", PUBLISH_TELEMETRY, 0,                              false, 0, 0,                     false },
+    { "/telemetry/replay", PUBLISH_TELEMETRY, 0,                             false, 0, 0,                     false },
+    { "/telemetry/bin",   PUBLISH_TELEMETRY, PUBLISH_TELEMETRY_MIN_INTERVAL, true,  0, MQTT_TELEMETRY_EXPIRY, true  },
+    { "/telemetry",       PUBLISH_TELEMETRY, PUBLISH_TELEMETRY_MIN_INTERVAL, true,  0, MQTT_TELEMETRY_EXPIRY, false },
+    { "/status",          PUBLISH_STATUS,    PUBLISH_STATUS_MIN_INTERVAL,    true,  1, 0,                     false },
+    { "/heartbeat/link",  PUBLISH_STATUS,    0,                              true,  0, 0,                     false },
+    { "/heartbeat/commands", PUBLISH_STATUS, 0,                              true,  0, 0,                     false },
+    { "/heartbeat",       PUBLISH_STATUS,    0,                              true,  0, 0,                     false },
+    { "/regulation",      PUBLISH_STATUS,    0,                              true,  0, 0,                     false },
+};
+static const PublishRule kDefaultRule = { "", PUBLISH_STATUS, 0, false, 0, 0, false };
+
+// Oldest age a message may be sent at (ms), 0 = no limit
+static const uint32_t kMaxAge[PUBLISH_PRIORITY_COUNT] = {
+    0, PUBLISH_STATUS_MAX_AGE, PUBLISH_TELEMETRY_MAX_AGE
+};
+
+static const char* const kPriorityNames[PUBLISH_PRIORITY_COUNT] = { "critical", "status", "telemetry" };
+
+const char* publishPriorityName(PublishPriority priority) {
+    return priority < PUBLISH_PRIORITY_COUNT ? kPriorityNames[priority] : "unknown";
+}
+
+PublishQueue::PublishQueue() {
+    uint8_t* data[PUBLISH_PRIORITY_COUNT] = {
+        (uint8_t*)_criticalData, (uint8_t*)_statusData, (uint8_t*)_telemetryData
+    };
+    const uint16_t capacity[PUBLISH_PRIORITY_COUNT] = {
+        sizeof(_criticalData), sizeof(_statusData), sizeof(_telemetryData)
+    };
+
+    for (uint8_t p = 0; p < PUBLISH_PRIORITY_COUNT; p++) {
+        Ring& ring = _rings[p];
+        ring.data = data[p];
+        ring.capacity = capacity[p];
+        ring.head = 0;
+        ring.tail = 0;
+        ring.used = 0;
+        memset(&ring.stats, 0, sizeof(ring.stats));
+        ring.stats.capacity = capacity[p];
+    }
+    memset(_clocks, 0, sizeof(_clocks));
+    _tokens = PUBLISH_BURST_BYTES;
+    _lastRefill = 0;
+}
+
+const PublishRule& PublishQueue::ruleFor(const char* topic) {
+    size_t topicLength = strlen(topic);
+    for (const PublishRule& rule : kRules) {
+        size_t suffixLength = strlen(rule.suffix);
+        if (topicLength >= suffixLength &&
+            strcmp(topic + topicLength - suffixLength, rule.suffix) == 0) {
+            return rule;
+        }
+    }
+    return kDefaultRule;
+}
+
+uint32_t PublishQueue::hashTopic(const char* topic) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*topic) {
+        hash ^= (uint8_t)*topic++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool PublishQueue::enqueue(const char* topic, const uint8_t* payload, size_t length, bool retained,
+                           uint32_t now) {
+    const PublishRule& rule = ruleFor(topic);
+    Ring& ring = _rings[rule.priority];
+    size_t topicLength = strlen(topic);
+    uint32_t hash = hashTopic(topic);
+
+    if (rule.latestOnly) supersede(ring, topic, hash);
+
+    while (!append(ring, topic, topicLength, payload, length, retained, hash, now)) {
+        // Telemetry makes room by dropping its oldest samples; other classes
+        // keep what they have queued
+        if (rule.priority != PUBLISH_TELEMETRY || ring.stats.depth == 0) {
+            ring.stats.droppedFull++;
+            return false;
+        }
+
+        uint16_t pos = ring.head, remaining = ring.used, offset;
+        RecordHeader header;
+        while (nextRecord(ring, pos, remaining, offset, header)) {
+            if (header.flags & RECORD_DEAD) continue;
+            kill(ring, offset, header);
+            ring.stats.droppedFull++;
+            break;
+        }
+    }
+    return true;
+}
+
+bool PublishQueue::append(Ring& ring, const char* topic, size_t topicLength, const uint8_t* payload,
+                          size_t length, bool retained, uint32_t hash, uint32_t now) {
+    size_t need = (sizeof(RecordHeader) + topicLength + 1 + length + 3) & ~(size_t)3;
+    if (need > ring.capacity) return false;
+
+    trimHead(ring);
+    if (need > (size_t)(ring.capacity - ring.used)) return false;
+
+    if (ring.tail >= ring.head) {
+        // Free space is [tail, end) and [0, head)
+        uint16_t toEnd = ring.capacity - ring.tail;
+        if (toEnd < need) {
+            if (ring.head < need) return false;
+
+            if (toEnd >= sizeof(RecordHeader)) {
+                RecordHeader pad = {};
+                pad.size = toEnd;
+                pad.flags = RECORD_PAD;
+                memcpy(ring.data + ring.tail, &pad, sizeof(pad));
+            }
+            ring.used += toEnd;
+            ring.tail = 0;
+        }
+    }
+
+    RecordHeader header = {};
+    header.size = need;
+    header.topicLength = topicLength;
+    header.length = length;
+    header.flags = retained ? RECORD_RETAINED : 0;
+    header.enqueuedAt = now;
+    header.hash = hash;
+
+    uint8_t* out = ring.data + ring.tail;
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), topic, topicLength + 1);
+    memcpy(out + sizeof(header) + topicLength + 1, payload, length);
+
+    ring.tail += need;
+    if (ring.tail == ring.capacity) ring.tail = 0;
+    ring.used += need;
+    ring.stats.depth++;
+    ring.stats.bytes = ring.used;
+    return true;
+}
+
+bool PublishQueue::nextRecord(const Ring& ring, uint16_t& pos, uint16_t& remaining, uint16_t& offset,
+                              RecordHeader& header) {
+    while (remaining > 0) {
+        uint16_t toEnd = ring.capacity - pos;
+        if (toEnd < sizeof(RecordHeader)) {
+            // Too short for a record: wrap padding without a header
+            remaining -= toEnd;
+            pos = 0;
+            continue;
+        }
+
+        memcpy(&header, ring.data + pos, sizeof(header));
+        offset = pos;
+        remaining -= header.size;
+        pos += header.size;
+        if (pos == ring.capacity) pos = 0;
+
+        if (!(header.flags & RECORD_PAD)) return true;
+    }
+    return false;
+}
+
+void PublishQueue::kill(Ring& ring, uint16_t offset, RecordHeader& header) {
+    header.flags |= RECORD_DEAD;
+    memcpy(ring.data + offset, &header, sizeof(header));
+    ring.stats.depth--;
+}
+
+void PublishQueue::supersede(Ring& ring, const char* topic, uint32_t hash) {
+    uint16_t pos = ring.head, remaining = ring.used, offset;
+    RecordHeader header;
+    while (nextRecord(ring, pos, remaining, offset, header)) {
+        if (header.flags & RECORD_DEAD) continue;
+        if (header.hash != hash) continue;
+        if (strcmp((const char*)(ring.data + offset + sizeof(RecordHeader)), topic) != 0) continue;
+
+        kill(ring, offset, header);
+        ring.stats.superseded++;
+    }
+}
+
+void PublishQueue::trimHead(Ring& ring) {
+    while (ring.used > 0) {
+        uint16_t toEnd = ring.capacity - ring.head;
+        if (toEnd < sizeof(RecordHeader)) {
+            ring.used -= toEnd;
+            ring.head = 0;
+            continue;
+        }
+
+        RecordHeader header;
+        memcpy(&header, ring.data + ring.head, sizeof(header));
+        if (!(header.flags & (RECORD_DEAD | RECORD_PAD))) break;
+
+        ring.used -= header.size;
+        ring.head += header.size;
+        if (ring.head == ring.capacity) ring.head = 0;
+    }
+
+    if (ring.used == 0) {
+        ring.head = 0;
+        ring.tail = 0;
+    }
+    ring.stats.bytes = ring.used;
+}
+
+void PublishQueue::refill(uint32_t now) {
+    uint32_t elapsed = now - _lastRefill;
+    if (elapsed == 0) return;
+    _lastRefill = now;
+
+    int64_t tokens = _tokens + (int64_t)elapsed * PUBLISH_RATE_BYTES / 1000;
+    _tokens = (tokens > PUBLISH_BURST_BYTES) ? PUBLISH_BURST_BYTES : (int32_t)tokens;
+}
+
+bool PublishQueue::rateLimited(uint32_t hash, uint16_t minInterval, uint32_t now) {
+    if (minInterval == 0) return false;
+
+    for (const TopicClock& clock : _clocks) {
+        if (clock.hash == hash) return now - clock.lastSent < minInterval;
+    }
+    return false;
+}
+
+void PublishQueue::markSent(uint32_t hash, uint32_t now) {
+    // Reuse the topic's slot, otherwise the one unused the longest
+    TopicClock* slot = &_clocks[0];
+    for (TopicClock& clock : _clocks) {
+        if (clock.hash == hash) {
+            slot = &clock;
+            break;
+        }
+        if (now - clock.lastSent > now - slot->lastSent) slot = &clock;
+    }
+    slot->hash = hash;
+    slot->lastSent = now;
+}
+
+uint8_t PublishQueue::drain(uint32_t now, PublishSendFn send, bool ignoreBudget) {
+    refill(now);
+    uint8_t sent = 0;
+
+    for (uint8_t p = 0; p < PUBLISH_PRIORITY_COUNT; p++) {
+        Ring& ring = _rings[p];
+        uint16_t pos = ring.head, remaining = ring.used, offset;
+        RecordHeader header;
+        bool stop = false;
+
+        while (!stop && nextRecord(ring, pos, remaining, offset, header)) {
+            if (header.flags & RECORD_DEAD) continue;
+
+            const char* topic = (const char*)(ring.data + offset + sizeof(RecordHeader));
+            const uint8_t* payload = (const uint8_t*)topic + header.topicLength + 1;
+
+            if (kMaxAge[p] != 0 && now - header.enqueuedAt > kMaxAge[p]) {
+                kill(ring, offset, header);
+                ring.stats.droppedStale++;
+                continue;
+            }
+
+            const PublishRule& rule = ruleFor(topic);
+            if (!ignoreBudget && rateLimited(header.hash, rule.minInterval, now)) continue;
+
+            // Lower classes wait for tokens; critical messages go out regardless
+            int32_t cost = header.topicLength + header.length + PUBLISH_OVERHEAD_BYTES;
+            if (!ignoreBudget && p != PUBLISH_CRITICAL && _tokens < cost) {
+                trimHead(ring);
+                return sent;
+            }
+
+            PublishSendResult result = send(topic, payload, header.length, header.flags & RECORD_RETAINED,
+                                            rule);
+            if (result == PUBLISH_BUSY) {
+                // Socket backed up: retry this message first on the next loop
+                trimHead(ring);
+                return sent;
+            }
+            if (result == PUBLISH_FAILED) {
+                ring.stats.failed++;
+                // Critical messages are retried (after a reconnect); others are dropped.
+                // Either way the client is not taking data now
+                if (p != PUBLISH_CRITICAL) kill(ring, offset, header);
+                trimHead(ring);
+                return sent;
+            }
+
+            kill(ring, offset, header);
+            ring.stats.sent++;
+            _tokens -= cost;
+            if (_tokens < -PUBLISH_BURST_BYTES) _tokens = -PUBLISH_BURST_BYTES;
+            if (rule.minInterval != 0) markSent(header.hash, now);
+
+            sent++;
+            if (!ignoreBudget && sent >= PUBLISH_MAX_PER_LOOP) stop = true;
+        }
+
+        trimHead(ring);
+        if (stop) break;
+    }
+    return sent;
+}
+
+void PublishQueue::clear() {
+    for (Ring& ring : _rings) {
+        ring.head = 0;
+        ring.tail = 0;
+        ring.used = 0;
+        ring.stats.depth = 0;
+        ring.stats.bytes = 0;
+    }
+}
+
+PublishClassStats PublishQueue::getStats(PublishPriority priority) {
+    if (priority >= PUBLISH_PRIORITY_COUNT) return PublishClassStats();
+    return _rings[priority].stats;
+}
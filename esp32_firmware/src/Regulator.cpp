@@ -0,0 +1,264 @@
+/**
+ * @file Regulator.cpp
+ * @brief Implementation of Closed-loop Current / Power Regulation
+ */
+
+#include "Regulator.h"
+#include "LoadController.h"
+#include "SafetyMonitor.h"
+
+// Global instance
+Regulator regulator;
+
+static const char* const kRegulationModeNames[REGULATION_MODE_COUNT] = {
+    "off", "current", "power"
+};
+
+const char* regulationModeName(RegulationMode mode) {
+    return (mode < REGULATION_MODE_COUNT) ? kRegulationModeNames[mode] : "unknown";
+}
+
+bool parseRegulationMode(const char* name, RegulationMode& mode) {
+    for (uint8_t i = 0; i < REGULATION_MODE_COUNT; i++) {
+        if (strcmp(name, kRegulationModeNames[i]) == 0) {
+            mode = (RegulationMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+Regulator::Regulator() {
+    memset(_config, 0, sizeof(_config));
+    memset(_state, 0, sizeof(_state));
+    memset(_status, 0, sizeof(_status));
+    memset(_changedUs, 0, sizeof(_changedUs));
+    memset(_inBandSinceUs, 0, sizeof(_inBandSinceUs));
+    memset(_errorMeanSquare, 0, sizeof(_errorMeanSquare));
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        _stepDirection[i] = 1;
+    }
+    _lock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+bool Regulator::start(uint8_t channel, RegulationMode mode, float setpoint,
+                      const RegulatorGains* gains) {
+    if (!LoadController::isValidChannel(channel) || mode >= REGULATION_MODE_COUNT) return false;
+    if (mode == REGULATION_OFF) {
+        stop(channel);
+        return true;
+    }
+    if (!isfinite(setpoint) || setpoint < 0) return false;
+    if (mode == REGULATION_CURRENT && setpoint >= OVERCURRENT_THRESHOLD) return false;
+    if (gains != nullptr &&
+        (!(gains->kp >= 0) || !(gains->ki >= 0) || !(gains->kd >= 0) || !(gains->maxSlew > 0))) {
+        return false;
+    }
+
+    LoopConfig* config = &_config[channel - 1];
+
+    portENTER_CRITICAL(&_lock);
+    if (gains != nullptr) {
+        config->gains = *gains;
+    } else if (config->mode != mode) {
+        config->gains = defaultGains(mode);
+    }
+    config->mode = mode;
+    config->setpoint = setpoint;
+    config->generation++;
+    RegulatorGains applied = config->gains;
+    portEXIT_CRITICAL(&_lock);
+
+    DEBUG_PRINTF("Channel %d regulation: %s %.3f (kp=%.3f ki=%.3f kd=%.3f slew=%.2f/s)\n",
+                 channel, regulationModeName(mode), setpoint,
+                 applied.kp, applied.ki, applied.kd, applied.maxSlew);
+    return true;
+}
+
+void Regulator::stop(uint8_t channel) {
+    if (!LoadController::isValidChannel(channel)) return;
+
+    portENTER_CRITICAL(&_lock);
+    bool wasOn = _config[channel - 1].mode != REGULATION_OFF;
+    _config[channel - 1].mode = REGULATION_OFF;
+    _config[channel - 1].generation++;
+    portEXIT_CRITICAL(&_lock);
+
+    if (wasOn) DEBUG_PRINTF("Channel %d regulation: off\n", channel);
+}
+
+RegulationMode Regulator::getMode(uint8_t channel) {
+    if (!LoadController::isValidChannel(channel)) return REGULATION_OFF;
+
+    portENTER_CRITICAL(&_lock);
+    RegulationMode mode = _config[channel - 1].mode;
+    portEXIT_CRITICAL(&_lock);
+    return mode;
+}
+
+bool Regulator::getStatus(uint8_t channel, RegulatorStatus& status) {
+    if (!LoadController::isValidChannel(channel)) return false;
+    uint8_t i = channel - 1;
+
+    portENTER_CRITICAL(&_lock);
+    status = _status[i];
+    status.mode = _config[i].mode;
+    status.setpoint = _config[i].setpoint;
+    status.gains = _config[i].gains;
+    if (status.mode == REGULATION_OFF) status.active = false;
+    portEXIT_CRITICAL(&_lock);
+    return true;
+}
+
+RegulatorGains Regulator::defaultGains(RegulationMode mode) {
+    RegulatorGains gains;
+    if (mode == REGULATION_POWER) {
+        gains.kp = REG_KP_POWER;
+        gains.ki = REG_KI_POWER;
+        gains.kd = REG_KD_POWER;
+    } else {
+        gains.kp = REG_KP_CURRENT;
+        gains.ki = REG_KI_CURRENT;
+        gains.kd = REG_KD_CURRENT;
+    }
+    gains.maxSlew = REG_MAX_SLEW;
+    return gains;
+}
+
+void Regulator::update(uint16_t freshMask) {
+    int64_t nowUs = esp_timer_get_time();
+
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        portENTER_CRITICAL(&_lock);
+        LoopConfig config = _config[i];
+        portEXIT_CRITICAL(&_lock);
+
+        if (config.mode == REGULATION_OFF) {
+            _state[i].active = false;
+            _state[i].generation = config.generation;
+            continue;
+        }
+        // The INA226 averages over a whole conversion: acting between
+        // conversions would only integrate the same sample again
+        if (!(freshMask & (1U << i))) continue;
+
+        step(i + 1, config, nowUs);
+    }
+}
+
+void Regulator::step(uint8_t channel, const LoopConfig& config, int64_t nowUs) {
+    uint8_t i = channel - 1;
+    LoopState* s = &_state[i];
+
+    SensorData data;
+    ChannelState ch;
+    safetyMonitor.getSensorData(channel, data);
+    loadController.getChannelState(channel, ch);
+
+    float measured = (config.mode == REGULATION_CURRENT) ? data.current : data.power;
+    float fullScale = (float)(1UL << ch.pwmResolution);
+
+    if (s->generation != config.generation) {
+        // New setpoint: restart the metrics, keep the integrator (bumpless)
+        s->generation = config.generation;
+        _changedUs[i] = nowUs;
+        _inBandSinceUs[i] = 0;
+        _stepDirection[i] = (config.setpoint >= measured) ? 1.0f : -1.0f;
+
+        portENTER_CRITICAL(&_lock);
+        _status[i].settled = false;
+        _status[i].settlingMs = 0;
+        _status[i].overshoot = 0;
+        _status[i].samples = 0;
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    if (!data.valid || !ch.mainSwitch || ch.faultCode != FAULT_NONE) {
+        s->active = false;
+        setInactive(channel);
+        return;
+    }
+
+    if (!s->active) {
+        // (Re)start from the present duty so the output does not jump
+        s->active = true;
+        s->output = ch.simDuty / fullScale;
+        s->integral = s->output;
+        s->lastMeasured = measured;
+        s->dFiltered = 0;
+        s->lastSampleUs = nowUs;
+        updateMetrics(channel, config.setpoint, measured, nowUs);
+        return;
+    }
+
+    float dt = (nowUs - s->lastSampleUs) / 1e6f;
+    s->lastSampleUs = nowUs;
+    if (dt <= 0) return;
+
+    const RegulatorGains& gains = config.gains;
+    float error = config.setpoint - measured;
+
+    // Derivative on the measurement: a setpoint step does not kick the output
+    float rate = (measured - s->lastMeasured) / dt;
+    s->lastMeasured = measured;
+    s->dFiltered += REG_D_FILTER * (rate - s->dFiltered);
+
+    float integral = s->integral + gains.ki * error * dt;
+    float wanted = gains.kp * error + integral - gains.kd * s->dFiltered;
+
+    float maxStep = gains.maxSlew * dt;
+    float output = constrain(wanted, 0.0f, 1.0f);
+    output = constrain(output, s->output - maxStep, s->output + maxStep);
+
+    // Anti-windup: only integrate while the output can follow the error
+    bool limitedUp = output < wanted && error > 0;
+    bool limitedDown = output > wanted && error < 0;
+    if (!limitedUp && !limitedDown) {
+        s->integral = constrain(integral, 0.0f, 1.0f);
+    }
+
+    s->output = output;
+    loadController.driveSimulatorDuty(channel, (uint32_t)(output * fullScale + 0.5f));
+    updateMetrics(channel, config.setpoint, measured, nowUs);
+}
+
+void Regulator::updateMetrics(uint8_t channel, float setpoint, float measured, int64_t nowUs) {
+    uint8_t i = channel - 1;
+    float error = setpoint - measured;
+    float band = max(setpoint * (float)REG_SETTLE_BAND, (float)REG_SETTLE_FLOOR);
+
+    if (fabsf(error) > band) {
+        _inBandSinceUs[i] = 0;
+    } else if (_inBandSinceUs[i] == 0) {
+        _inBandSinceUs[i] = nowUs;
+    }
+    bool settled = _inBandSinceUs[i] != 0 &&
+                   nowUs - _inBandSinceUs[i] >= (int64_t)REG_SETTLE_HOLD * 1000;
+
+    portENTER_CRITICAL(&_lock);
+    RegulatorStatus* st = &_status[i];
+    if (st->samples == 0) {
+        _errorMeanSquare[i] = error * error;
+    } else {
+        _errorMeanSquare[i] += REG_ERROR_AVG_WEIGHT * (error * error - _errorMeanSquare[i]);
+    }
+    st->samples++;
+    st->active = true;
+    st->measured = measured;
+    st->error = error;
+    st->errorRms = sqrtf(_errorMeanSquare[i]);
+    st->overshoot = max(st->overshoot, (measured - setpoint) * _stepDirection[i]);
+    st->output = (uint16_t)(_state[i].output * 1000 + 0.5f);
+    st->settled = settled;
+    if (settled && st->settlingMs == 0) {
+        // Measured to the last entry into the band, not to the end of the hold
+        st->settlingMs = max((uint32_t)((_inBandSinceUs[i] - _changedUs[i]) / 1000), (uint32_t)1);
+    }
+    portEXIT_CRITICAL(&_lock);
+}
+
+void Regulator::setInactive(uint8_t channel) {
+    portENTER_CRITICAL(&_lock);
+    _status[channel - 1].active = false;
+    portEXIT_CRITICAL(&_lock);
+}
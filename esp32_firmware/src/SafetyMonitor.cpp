@@ -0,0 +1,469 @@
+/**
+ * @file SafetyMonitor.cpp
+ * @brief Implementation of Fixed-rate Protection Module
+ */
+
+#include "SafetyMonitor.h"
+#include "LoadController.h"
+#include "Regulator.h"
+#include <Preferences.h>
+
+// Global instance
+SafetyMonitor safetyMonitor;
+
+SafetyMonitor::SafetyMonitor() {
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        _sensors[i] = nullptr;
+        _data[i].voltage = 0;
+        _data[i].current = 0;
+        _data[i].power = 0;
+        _data[i].valid = false;
+        _data[i].lastReadTime = 0;
+        _data[i].readTimeUs = 0;
+        memset(&_data[i].raw, 0, sizeof(_data[i].raw));
+        _injectedCurrent[i] = NAN;
+        _overcurrentDetected[i] = false;
+        _overcurrentStartTime[i] = 0;
+        _lastUndervoltageWarning[i] = 0;
+    }
+    memset(&_stats, 0, sizeof(_stats));
+
+    static const uint8_t priorities[] = POWER_PRIORITIES;
+    static const uint16_t minSim[] = POWER_MIN_SIM;
+    static_assert(sizeof(priorities) == NUM_CHANNELS, "POWER_PRIORITIES needs NUM_CHANNELS entries");
+    static_assert(sizeof(minSim) == NUM_CHANNELS * sizeof(uint16_t), "POWER_MIN_SIM needs NUM_CHANNELS entries");
+
+    _budget.watts = POWER_BUDGET;
+    _budget.hysteresis = POWER_BUDGET_HYSTERESIS;
+    memcpy(_budget.priority, priorities, sizeof(priorities));
+    memcpy(_budget.minPermille, minSim, sizeof(minSim));
+    memset(_shed, 0, sizeof(_shed));
+    _totalPower = 0;
+    _budgetOkSince = 0;
+    _lock = portMUX_INITIALIZER_UNLOCKED;
+    _busMutex = nullptr;
+    _events = nullptr;
+    _task = nullptr;
+}
+
+bool SafetyMonitor::begin(INA226* sensors[]) {
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        _sensors[i] = sensors[i];
+        _data[i].valid = (sensors[i] != nullptr);
+    }
+
+    loadBudget();
+
+    _busMutex = xSemaphoreCreateMutex();
+    _events = xQueueCreate(SAFETY_EVENT_QUEUE_SIZE, sizeof(SafetyEvent));
+    if (_busMutex == nullptr || _events == nullptr) {
+        DEBUG_PRINTLN("Safety Monitor: out of memory");
+        return false;
+    }
+
+    BaseType_t rc = xTaskCreatePinnedToCore(taskEntry, "safety", SAFETY_TASK_STACK_SIZE,
+                                            this, SAFETY_TASK_PRIORITY, &_task,
+                                            SAFETY_TASK_CORE);
+    if (rc != pdPASS) {
+        DEBUG_PRINTLN("Safety Monitor: failed to start task");
+        return false;
+    }
+
+    DEBUG_PRINTF("Safety Monitor started: period=%d ms, priority=%d, core=%d\n",
+                 SAFETY_SAMPLE_PERIOD_MS, SAFETY_TASK_PRIORITY, SAFETY_TASK_CORE);
+    return true;
+}
+
+bool SafetyMonitor::getSensorData(uint8_t channel, SensorData& data) {
+    if (channel < 1 || channel > NUM_CHANNELS) return false;
+
+    portENTER_CRITICAL(&_lock);
+    data = _data[channel - 1];
+    portEXIT_CRITICAL(&_lock);
+    return true;
+}
+
+bool SafetyMonitor::pollEvent(SafetyEvent& event) {
+    if (_events == nullptr) return false;
+    return xQueueReceive(_events, &event, 0) == pdTRUE;
+}
+
+SafetyStats SafetyMonitor::getStats() {
+    portENTER_CRITICAL(&_lock);
+    SafetyStats stats = _stats;
+    portEXIT_CRITICAL(&_lock);
+    return stats;
+}
+
+void SafetyMonitor::injectCurrent(uint8_t channel, float current) {
+    if (channel < 1 || channel > NUM_CHANNELS) return;
+
+    portENTER_CRITICAL(&_lock);
+    _injectedCurrent[channel - 1] = current;
+    portEXIT_CRITICAL(&_lock);
+}
+
+void SafetyMonitor::setPowerBudget(float watts, float hysteresis) {
+    if (watts < 0) watts = 0;
+    hysteresis = constrain(hysteresis, 0.0f, 0.5f);
+
+    portENTER_CRITICAL(&_lock);
+    _budget.watts = watts;
+    _budget.hysteresis = hysteresis;
+    portEXIT_CRITICAL(&_lock);
+
+    Preferences prefs;
+    prefs.begin(POWER_NVS_NAMESPACE, false);
+    prefs.putFloat("budget", watts);
+    prefs.putFloat("hyst", hysteresis);
+    prefs.end();
+
+    DEBUG_PRINTF("Power budget: %.1f W (hysteresis %.0f%%)\n", watts, hysteresis * 100);
+}
+
+bool SafetyMonitor::setChannelBudget(uint8_t channel, uint8_t priority, uint16_t minPermille) {
+    if (channel < 1 || channel > NUM_CHANNELS) return false;
+    if (minPermille > 1000) minPermille = 1000;
+
+    portENTER_CRITICAL(&_lock);
+    _budget.priority[channel - 1] = priority;
+    _budget.minPermille[channel - 1] = minPermille;
+    PowerBudget budget = _budget;
+    portEXIT_CRITICAL(&_lock);
+
+    Preferences prefs;
+    prefs.begin(POWER_NVS_NAMESPACE, false);
+    prefs.putBytes("prio", budget.priority, sizeof(budget.priority));
+    prefs.putBytes("min", budget.minPermille, sizeof(budget.minPermille));
+    prefs.end();
+    return true;
+}
+
+PowerBudgetStatus SafetyMonitor::getBudgetStatus() {
+    PowerBudgetStatus status;
+
+    portENTER_CRITICAL(&_lock);
+    status.budget = _budget.watts;
+    status.hysteresis = _budget.hysteresis;
+    status.totalPower = _totalPower;
+    status.shedMask = 0;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if (_shed[i].dimmed || _shed[i].off) status.shedMask |= (1U << i);
+        status.priority[i] = _budget.priority[i];
+        status.minPermille[i] = _budget.minPermille[i];
+    }
+    portEXIT_CRITICAL(&_lock);
+    return status;
+}
+
+void SafetyMonitor::loadBudget() {
+    Preferences prefs;
+    prefs.begin(POWER_NVS_NAMESPACE, true);
+    _budget.watts = prefs.getFloat("budget", _budget.watts);
+    _budget.hysteresis = prefs.getFloat("hyst", _budget.hysteresis);
+    if (prefs.getBytesLength("prio") == sizeof(_budget.priority)) {
+        prefs.getBytes("prio", _budget.priority, sizeof(_budget.priority));
+    }
+    if (prefs.getBytesLength("min") == sizeof(_budget.minPermille)) {
+        prefs.getBytes("min", _budget.minPermille, sizeof(_budget.minPermille));
+    }
+    prefs.end();
+}
+
+void SafetyMonitor::lockBus() {
+    if (_busMutex != nullptr) xSemaphoreTake(_busMutex, portMAX_DELAY);
+}
+
+void SafetyMonitor::unlockBus() {
+    if (_busMutex != nullptr) xSemaphoreGive(_busMutex);
+}
+
+void SafetyMonitor::taskEntry(void* arg) {
+    static_cast<SafetyMonitor*>(arg)->run();
+}
+
+void SafetyMonitor::run() {
+    const TickType_t periodTicks = pdMS_TO_TICKS(SAFETY_SAMPLE_PERIOD_MS);
+    const int64_t periodUs = (int64_t)SAFETY_SAMPLE_PERIOD_MS * 1000;
+
+    TickType_t lastWake = xTaskGetTickCount();
+    int64_t expectedUs = esp_timer_get_time();
+
+    for (;;) {
+        vTaskDelayUntil(&lastWake, periodTicks);
+        expectedUs += periodUs;
+
+        int64_t startUs = esp_timer_get_time();
+        int64_t latencyUs = startUs - expectedUs;
+        if (latencyUs < 0) latencyUs = 0;
+
+        // A cycle that starts a full period late has missed at least one
+        // deadline: count the skipped slots and resynchronize instead of
+        // running a burst of catch-up cycles.
+        uint32_t missed = 0;
+        if (latencyUs >= periodUs) {
+            missed = latencyUs / periodUs;
+            expectedUs += (int64_t)missed * periodUs;
+            lastWake = xTaskGetTickCount();
+        }
+
+        uint16_t fresh = sampleSensors();
+        checkLimits();
+        enforceBudget(fresh);
+        regulator.update(fresh);
+
+        uint32_t execUs = (uint32_t)(esp_timer_get_time() - startUs);
+
+        portENTER_CRITICAL(&_lock);
+        _stats.cycles++;
+        _stats.missedDeadlines += missed;
+        if ((uint32_t)latencyUs > _stats.maxLatencyUs) _stats.maxLatencyUs = latencyUs;
+        if (execUs > _stats.maxExecUs) _stats.maxExecUs = execUs;
+        portEXIT_CRITICAL(&_lock);
+    }
+}
+
+uint16_t SafetyMonitor::sampleSensors() {
+    uint16_t fresh = 0;
+
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        if (_sensors[i] == nullptr) continue;
+
+        // Result registers only change once per conversion (~35 ms with the
+        // default averaging); in between, one flag read replaces three.
+        // A sensor that stops flagging is read anyway, as before.
+        float voltage = 0, current = 0, power = 0;
+        INA226Raw raw = {};
+        bool ok = true;
+        xSemaphoreTake(_busMutex, portMAX_DELAY);
+        bool ready = _sensors[i]->conversionReady() ||
+                     millis() - _data[i].lastReadTime >= SAFETY_STALE_SAMPLE_MS;
+        if (ready) ok = _sensors[i]->readAll(&voltage, &current, &power, &raw);
+        xSemaphoreGive(_busMutex);
+
+        if (!ready) continue;
+        fresh |= (1U << i);
+
+        portENTER_CRITICAL(&_lock);
+        if (!isnan(_injectedCurrent[i])) {
+            current = _injectedCurrent[i];
+            power = voltage * current;
+
+            // Keep the raw registers consistent with the injected values
+            float lsb = _sensors[i]->getCurrentLSB();
+            if (lsb > 0) {
+                raw.current = (int16_t)constrain(current / lsb, -32768.0f, 32767.0f);
+                raw.power = (uint16_t)constrain(power / (lsb * INA226_POWER_LSB_FACTOR), 0.0f, 65535.0f);
+            }
+        }
+        _data[i].voltage = voltage;
+        _data[i].current = current;
+        _data[i].power = power;
+        _data[i].raw = raw;
+        _data[i].valid = ok;
+        _data[i].readTimeUs = esp_timer_get_time();
+        _data[i].lastReadTime = _data[i].readTimeUs / 1000;
+        portEXIT_CRITICAL(&_lock);
+    }
+    return fresh;
+}
+
+void SafetyMonitor::checkLimits() {
+    unsigned long currentTime = millis();
+
+    for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+        uint8_t channel = ch + 1;
+        SensorData data;
+        getSensorData(channel, data);
+
+        if (!data.valid) continue;
+        if (!loadController.getSwitchState(channel)) {  // Only check if switch is ON
+            _overcurrentDetected[ch] = false;
+            continue;
+        }
+
+        // Check overcurrent
+        if (data.current > OVERCURRENT_THRESHOLD) {
+            if (!_overcurrentDetected[ch]) {
+                _overcurrentDetected[ch] = true;
+                _overcurrentStartTime[ch] = currentTime;
+            } else if (currentTime - _overcurrentStartTime[ch] > OVERCURRENT_DURATION) {
+                // Overcurrent persisted - trigger emergency shutdown
+                loadController.emergencyShutdown(channel, FAULT_OVERCURRENT, data.current);
+                _overcurrentDetected[ch] = false;
+                raiseEvent(channel, SAFETY_EVENT_OVERCURRENT, data.current);
+                continue;
+            }
+        } else {
+            _overcurrentDetected[ch] = false;
+        }
+
+        // Check overvoltage
+        if (data.voltage > OVERVOLTAGE_THRESHOLD) {
+            loadController.emergencyShutdown(channel, FAULT_OVERVOLTAGE, data.voltage);
+            raiseEvent(channel, SAFETY_EVENT_OVERVOLTAGE, data.voltage);
+            continue;
+        }
+
+        // Check undervoltage (warning only)
+        if (data.voltage > 0 && data.voltage < UNDERVOLTAGE_THRESHOLD) {
+            if (currentTime - _lastUndervoltageWarning[ch] > UNDERVOLTAGE_WARNING_INTERVAL) {
+                _lastUndervoltageWarning[ch] = currentTime;
+                raiseEvent(channel, SAFETY_EVENT_UNDERVOLTAGE, data.voltage);
+            }
+        }
+    }
+}
+
+void SafetyMonitor::enforceBudget(uint16_t fresh) {
+    portENTER_CRITICAL(&_lock);
+    PowerBudget budget = _budget;
+    portEXIT_CRITICAL(&_lock);
+
+    // Power drawn by each switched-on channel in this cycle. The sensors
+    // convert every ~35 ms, so a dimmed channel keeps reporting its old power
+    // for a few cycles: its saving is taken off until a new sample shows it
+    // (the first conversion after the change may still straddle it).
+    float power[NUM_CHANNELS];
+    uint16_t level[NUM_CHANNELS];
+    float total = 0;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        SensorData data;
+        ChannelState state;
+        getSensorData(i + 1, data);
+        loadController.getChannelState(i + 1, state);
+
+        if (_shed[i].settleSamples > 0 && (fresh & (1U << i)) && --_shed[i].settleSamples == 0) {
+            _shed[i].unmeasured = 0;
+        }
+        power[i] = (state.mainSwitch && data.valid && data.power > 0) ? data.power : 0;
+        if (power[i] > 0) power[i] = max(power[i] - _shed[i].unmeasured, 0.0f);
+        level[i] = state.simPermille;
+        total += power[i];
+    }
+
+    portENTER_CRITICAL(&_lock);
+    _totalPower = total;
+    portEXIT_CRITICAL(&_lock);
+
+    if (budget.watts <= 0) return;
+
+    // Shedding order: lowest priority first, ties broken by higher channel
+    uint8_t order[NUM_CHANNELS];
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        uint8_t j = i;
+        while (j > 0 && budget.priority[order[j - 1]] >= budget.priority[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    if (total > budget.watts) {
+        _budgetOkSince = 0;
+        float excess = total - budget.watts;
+
+        // Remove the whole excess in this cycle: dim first, then switch off
+        for (uint8_t k = 0; k < NUM_CHANNELS && excess > 0; k++) {
+            uint8_t i = order[k];
+            uint8_t channel = i + 1;
+            if (power[i] <= 0) continue;
+
+            if (!_shed[i].dimmed && !_shed[i].off) {
+                _shed[i].restorePermille = level[i];
+                _shed[i].shedPower = 0;
+            }
+
+            float remaining = power[i];
+            if (level[i] > budget.minPermille[i]) {
+                // Load power follows the simulator duty: dim just enough
+                float keep = (power[i] - excess) / power[i];
+                uint16_t target = max((uint16_t)(level[i] * max(keep, 0.0f)), budget.minPermille[i]);
+                float saved = power[i] * (1.0f - (float)target / level[i]);
+
+                if (!_shed[i].dimmed) {
+                    RegulatorStatus loop;
+                    regulator.getStatus(channel, loop);
+                    _shed[i].regulation = loop.mode;
+                    _shed[i].setpoint = loop.setpoint;
+                    _shed[i].gains = loop.gains;
+                }
+                regulator.stop(channel);  // Would otherwise win the duty back
+                loadController.setSimulatorPermille(channel, target);
+                _shed[i].shedPermille = target;
+                _shed[i].dimmed = true;
+                _shed[i].shedPower += saved;
+                _shed[i].unmeasured += saved;
+                _shed[i].settleSamples = POWER_SHED_SETTLE_SAMPLES;
+                excess -= saved;
+                remaining -= saved;
+                raiseEvent(channel, SAFETY_EVENT_SHED_DIM, total, target);
+                if (excess <= 0) break;
+            }
+
+            loadController.setSwitch(channel, false);
+            _shed[i].off = true;
+            _shed[i].shedPower += remaining;
+            excess -= remaining;
+            raiseEvent(channel, SAFETY_EVENT_SHED_OFF, total, level[i]);
+        }
+        return;
+    }
+
+    // Restore one channel at a time, most important first, once the total
+    // has stayed low enough that the channel's former load fits again
+    float restoreLevel = budget.watts * (1.0f - budget.hysteresis);
+    if (total >= restoreLevel) {
+        _budgetOkSince = 0;
+        return;
+    }
+
+    unsigned long now = millis();
+    if (_budgetOkSince == 0) {
+        _budgetOkSince = now | 1;
+        return;
+    }
+    if (now - _budgetOkSince < POWER_RESTORE_DELAY) return;
+
+    for (int k = NUM_CHANNELS - 1; k >= 0; k--) {
+        uint8_t i = order[k];
+        if (!_shed[i].dimmed && !_shed[i].off) continue;
+        if (total + _shed[i].shedPower > restoreLevel) return;  // Would overload again
+
+        uint8_t channel = i + 1;
+        // A level set (or a loop started) while shed is left as it is
+        if (_shed[i].dimmed && level[i] == _shed[i].shedPermille &&
+            regulator.getMode(channel) == REGULATION_OFF) {
+            if (_shed[i].regulation != REGULATION_OFF) {
+                regulator.start(channel, _shed[i].regulation, _shed[i].setpoint, &_shed[i].gains);
+            } else {
+                loadController.setSimulatorPermille(channel, _shed[i].restorePermille);
+            }
+        }
+        if (_shed[i].off) loadController.setSwitch(channel, true);  // Refused if faulted meanwhile
+
+        _shed[i].dimmed = false;
+        _shed[i].off = false;
+        _shed[i].unmeasured = 0;
+        _shed[i].settleSamples = 0;
+
+        raiseEvent(channel, SAFETY_EVENT_SHED_RESTORE, total, _shed[i].restorePermille);
+        _budgetOkSince = now | 1;  // Next channel only after another delay
+        return;
+    }
+}
+
+void SafetyMonitor::raiseEvent(uint8_t channel, SafetyEventType type, float value, uint16_t level) {
+    SafetyEvent event;
+    event.channel = channel;
+    event.type = type;
+    event.value = value;
+    event.level = level;
+    event.timestamp = millis();
+
+    if (xQueueSend(_events, &event, 0) != pdTRUE) {
+        portENTER_CRITICAL(&_lock);
+        _stats.droppedEvents++;
+        portEXIT_CRITICAL(&_lock);
+    }
+}
@@ -0,0 +1,310 @@
+/**
+ * @file ScheduleManager.cpp
+ * @brief Implementation of On-device Switching Schedules
+ */
+
+#include "ScheduleManager.h"
+#include "LoadController.h"
+#include "Regulator.h"
+#include <Preferences.h>
+
+// Global instance
+ScheduleManager scheduleManager;
+
+// Anything before 2020-09-13 means SNTP has not set the clock yet
+static const time_t kMinValidTime = 1600000000;
+
+ScheduleManager::ScheduleManager() {
+    memset(_rules, 0, sizeof(_rules));
+    memset(_nextFire, 0, sizeof(_nextFire));
+    memset(_ruleCount, 0, sizeof(_ruleCount));
+    _nextEventAt = 0;
+    _lastCheck = 0;
+}
+
+void ScheduleManager::begin() {
+    Preferences prefs;
+    prefs.begin(SCHEDULE_NVS_NAMESPACE, true);
+
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        char key[8];
+        snprintf(key, sizeof(key), "ch%u", i + 1);
+
+        size_t length = prefs.getBytesLength(key);
+        if (length == 0 || length % sizeof(ScheduleRule) != 0 ||
+            length > sizeof(_rules[i])) {
+            continue;
+        }
+        prefs.getBytes(key, _rules[i], length);
+        _ruleCount[i] = length / sizeof(ScheduleRule);
+        DEBUG_PRINTF("Schedule CH%d: %d rules loaded\n", i + 1, _ruleCount[i]);
+    }
+
+    prefs.end();
+}
+
+void ScheduleManager::loop() {
+    time_t now = time(nullptr);
+    if (now == _lastCheck) return;  // At most one evaluation per second
+
+    time_t previous = _lastCheck;
+    _lastCheck = now;
+    if (!isTimeValid(now)) return;
+
+    // Clock was just set or stepped: plan from here instead of firing
+    // every rule that lies in the skipped interval
+    if (!isTimeValid(previous) || now < previous || now - previous > SCHEDULE_MAX_CLOCK_STEP) {
+        recompute(now);
+        return;
+    }
+
+    if (_nextEventAt == 0 || now < _nextEventAt) return;
+
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        bool modified = false;
+
+        for (uint8_t i = 0; i < _ruleCount[ch]; ) {
+            if (_nextFire[ch][i] == 0 || _nextFire[ch][i] > now) {
+                i++;
+                continue;
+            }
+
+            fire(ch + 1, _rules[ch][i]);
+
+            if (_rules[ch][i].type == SCHEDULE_ONCE) {
+                removeRule(ch + 1, i);  // Spent: free the slot
+                modified = true;
+            } else {
+                _nextFire[ch][i] = computeNextFire(_rules[ch][i], now);
+                i++;
+            }
+        }
+
+        if (modified) save(ch + 1);
+    }
+
+    updateNextEvent();
+}
+
+bool ScheduleManager::setRules(uint8_t channel, const ScheduleRule* rules, uint8_t count) {
+    if (!LoadController::isValidChannel(channel) || count > SCHEDULE_MAX_RULES) return false;
+    uint8_t ch = channel - 1;
+
+    if (count > 0) memcpy(_rules[ch], rules, count * sizeof(ScheduleRule));
+    _ruleCount[ch] = count;
+    save(channel);
+
+    time_t now = time(nullptr);
+    if (isTimeValid(now)) recompute(now);
+
+    DEBUG_PRINTF("Schedule CH%d: %d rules set\n", channel, count);
+    return true;
+}
+
+bool ScheduleManager::setRulesFromJson(uint8_t channel, JsonArrayConst rules) {
+    if (rules.size() > SCHEDULE_MAX_RULES) return false;
+
+    ScheduleRule parsed[SCHEDULE_MAX_RULES];
+    uint8_t count = 0;
+    time_t now = time(nullptr);
+
+    for (JsonObjectConst obj : rules) {
+        if (!parseRule(obj, parsed[count])) return false;
+        // Already in the past (checked once the clock is set)
+        if (parsed[count].type == SCHEDULE_ONCE && isTimeValid(now) &&
+            (time_t)parsed[count].at <= now) {
+            return false;
+        }
+        count++;
+    }
+    return setRules(channel, parsed, count);
+}
+
+void ScheduleManager::rulesToJson(uint8_t channel, JsonArray rules) {
+    if (!LoadController::isValidChannel(channel)) return;
+    uint8_t ch = channel - 1;
+
+    for (uint8_t i = 0; i < _ruleCount[ch]; i++) {
+        const ScheduleRule& rule = _rules[ch][i];
+        JsonObject obj = rules.createNestedObject();
+
+        if (rule.type == SCHEDULE_ONCE) {
+            obj["type"] = "once";
+            obj["at"] = rule.at;
+        } else {
+            char hhmm[6];
+            snprintf(hhmm, sizeof(hhmm), "%02u:%02u", rule.at / 60, rule.at % 60);
+            obj["type"] = (rule.type == SCHEDULE_DAILY) ? "daily" : "weekly";
+            obj["time"] = hhmm;  // Copied by ArduinoJson
+            if (rule.type == SCHEDULE_WEEKLY) {
+                JsonArray days = obj.createNestedArray("days");
+                for (uint8_t d = 0; d < 7; d++) {
+                    if (rule.days & (1 << d)) days.add(d);
+                }
+            }
+        }
+        if (rule.switchState != SCHEDULE_UNCHANGED) obj["switch"] = rule.switchState ? "ON" : "OFF";
+        if (rule.simValue != SCHEDULE_UNCHANGED) obj["sim"] = rule.simValue;
+        if (_nextFire[ch][i] != 0) obj["next"] = (uint32_t)_nextFire[ch][i];
+    }
+}
+
+uint8_t ScheduleManager::getRuleCount(uint8_t channel) {
+    return LoadController::isValidChannel(channel) ? _ruleCount[channel - 1] : 0;
+}
+
+bool ScheduleManager::isTimeValid(time_t now) {
+    return now >= kMinValidTime;
+}
+
+void ScheduleManager::recompute(time_t now) {
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        bool modified = false;
+
+        for (uint8_t i = 0; i < _ruleCount[ch]; ) {
+            // A one-shot rule that passed while the clock was unset (or the
+            // device was off) can never fire: free its slot
+            if (_rules[ch][i].type == SCHEDULE_ONCE && (time_t)_rules[ch][i].at <= now) {
+                removeRule(ch + 1, i);
+                modified = true;
+                continue;
+            }
+            _nextFire[ch][i] = computeNextFire(_rules[ch][i], now);
+            i++;
+        }
+
+        if (modified) save(ch + 1);
+    }
+    updateNextEvent();
+}
+
+void ScheduleManager::updateNextEvent() {
+    _nextEventAt = 0;
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        for (uint8_t i = 0; i < _ruleCount[ch]; i++) {
+            time_t t = _nextFire[ch][i];
+            if (t != 0 && (_nextEventAt == 0 || t < _nextEventAt)) _nextEventAt = t;
+        }
+    }
+}
+
+time_t ScheduleManager::computeNextFire(const ScheduleRule& rule, time_t after) {
+    if (rule.type == SCHEDULE_ONCE) {
+        return ((time_t)rule.at > after) ? (time_t)rule.at : 0;
+    }
+
+    struct tm today;
+    localtime_r(&after, &today);
+
+    // Today plus the next 7 days always contains the next weekly match;
+    // mktime() normalizes the day overflow and handles DST changes
+    for (int d = 0; d <= 7; d++) {
+        struct tm candidate = today;
+        candidate.tm_mday += d;
+        candidate.tm_hour = rule.at / 60;
+        candidate.tm_min = rule.at % 60;
+        candidate.tm_sec = 0;
+        candidate.tm_isdst = -1;
+
+        time_t t = mktime(&candidate);
+        if (t <= after) continue;
+        if (rule.type == SCHEDULE_DAILY || (rule.days & (1 << candidate.tm_wday))) {
+            return t;
+        }
+    }
+    return 0;
+}
+
+void ScheduleManager::fire(uint8_t channel, const ScheduleRule& rule) {
+    DEBUG_PRINTF("Schedule CH%d: switch=%d sim=%d\n", channel, rule.switchState, rule.simValue);
+
+    if (rule.simValue != SCHEDULE_UNCHANGED) {
+        regulator.stop(channel);
+        loadController.setSimulator(channel, rule.simValue);
+    }
+    if (rule.switchState != SCHEDULE_UNCHANGED) {
+        loadController.setSwitch(channel, rule.switchState != 0);
+    }
+}
+
+void ScheduleManager::removeRule(uint8_t channel, uint8_t index) {
+    uint8_t ch = channel - 1;
+    for (uint8_t i = index; i + 1 < _ruleCount[ch]; i++) {
+        _rules[ch][i] = _rules[ch][i + 1];
+        _nextFire[ch][i] = _nextFire[ch][i + 1];
+    }
+    _ruleCount[ch]--;
+}
+
+void ScheduleManager::save(uint8_t channel) {
+    uint8_t ch = channel - 1;
+    char key[8];
+    snprintf(key, sizeof(key), "ch%u", channel);
+
+    Preferences prefs;
+    prefs.begin(SCHEDULE_NVS_NAMESPACE, false);
+    if (_ruleCount[ch] == 0) {
+        prefs.remove(key);
+    } else {
+        prefs.putBytes(key, _rules[ch], _ruleCount[ch] * sizeof(ScheduleRule));
+    }
+    prefs.end();
+}
+
+bool ScheduleManager::parseRule(JsonObjectConst obj, ScheduleRule& rule) {
+    const char* type = obj["type"] | "";
+
+    rule.at = 0;
+    rule.days = 0;
+    rule.switchState = SCHEDULE_UNCHANGED;
+    rule.simValue = SCHEDULE_UNCHANGED;
+
+    if (strcmp(type, "once") == 0) {
+        rule.type = SCHEDULE_ONCE;
+        rule.at = obj["at"] | 0UL;
+        if (!isTimeValid(rule.at)) return false;
+    } else {
+        if (strcmp(type, "daily") == 0) {
+            rule.type = SCHEDULE_DAILY;
+        } else if (strcmp(type, "weekly") == 0) {
+            rule.type = SCHEDULE_WEEKLY;
+        } else {
+            return false;
+        }
+
+        // "HH:MM" local time
+        unsigned hour = 0, minute = 0;
+        const char* hhmm = obj["time"] | "";
+        if (sscanf(hhmm, "%u:%u", &hour, &minute) != 2 || hour > 23 || minute > 59) {
+            return false;
+        }
+        rule.at = hour * 60 + minute;
+
+        if (rule.type == SCHEDULE_WEEKLY) {
+            for (int day : obj["days"].as<JsonArrayConst>()) {
+                if (day >= 0 && day <= 6) rule.days |= (1 << day);
+            }
+            if (rule.days == 0) return false;
+        }
+    }
+
+    // Action: "switch" ("ON"/"OFF"/true/false) and/or "sim" (0-100)
+    JsonVariantConst sw = obj["switch"];
+    if (sw.is<bool>()) {
+        rule.switchState = sw.as<bool>() ? 1 : 0;
+    } else if (!sw.isNull()) {
+        const char* state = sw | "";
+        if (strcmp(state, "ON") == 0) {
+            rule.switchState = 1;
+        } else if (strcmp(state, "OFF") == 0) {
+            rule.switchState = 0;
+        } else {
+            return false;
+        }
+    }
+    if (obj.containsKey("sim")) {
+        rule.simValue = constrain(obj["sim"].as<int>(), 0, 100);
+    }
+
+    return rule.switchState != SCHEDULE_UNCHANGED || rule.simValue != SCHEDULE_UNCHANGED;
+}
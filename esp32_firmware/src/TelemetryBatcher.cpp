@@ -0,0 +1,138 @@
+/**
+ * @file TelemetryBatcher.cpp
+ * @brief Implementation of Batched Multi-sample Telemetry
+ */
+
+#include "TelemetryBatcher.h"
+#include "JsonWriter.h"
+#include "TimeBase.h"
+#include "DeviceIdentity.h"
+#include <Preferences.h>
+
+// Global instance
+TelemetryBatcher telemetryBatcher;
+
+TelemetryBatcher::TelemetryBatcher() {
+    _config.enabled = TELEMETRY_BATCH_ENABLED;
+    _config.size = TELEMETRY_BATCH_SIZE;
+    _config.sampleInterval = TELEMETRY_BATCH_SAMPLE_MS;
+    _config.maxLatency = TELEMETRY_BATCH_MAX_LATENCY;
+    _count = 0;
+    _lastSampleTime = 0;
+    _batchStartTime = 0;
+}
+
+void TelemetryBatcher::begin() {
+    Preferences prefs;
+    prefs.begin(TELEMETRY_NVS_NAMESPACE, true);
+    TelemetryBatchConfig config;
+    config.enabled = prefs.getBool("batch", _config.enabled);
+    config.size = prefs.getUChar("bsize", _config.size);
+    config.sampleInterval = prefs.getUShort("bint", _config.sampleInterval);
+    config.maxLatency = prefs.getUShort("blat", _config.maxLatency);
+    prefs.end();
+
+    if (config.size >= 1 && config.size <= TELEMETRY_BATCH_MAX_SAMPLES &&
+        config.sampleInterval >= TELEMETRY_BATCH_MIN_SAMPLE_MS &&
+        config.maxLatency >= config.sampleInterval) {
+        _config = config;
+    }
+
+    DEBUG_PRINTF("Telemetry batch: %s, %u samples every %u ms, max latency %u ms\n",
+                 _config.enabled ? "on" : "off", _config.size,
+                 _config.sampleInterval, _config.maxLatency);
+}
+
+bool TelemetryBatcher::configure(const TelemetryBatchConfig& config) {
+    if (config.size < 1 || config.size > TELEMETRY_BATCH_MAX_SAMPLES) return false;
+    if (config.sampleInterval < TELEMETRY_BATCH_MIN_SAMPLE_MS) return false;
+    if (config.maxLatency < config.sampleInterval) return false;
+
+    _config = config;
+    _count = 0;
+
+    Preferences prefs;
+    prefs.begin(TELEMETRY_NVS_NAMESPACE, false);
+    prefs.putBool("batch", config.enabled);
+    prefs.putUChar("bsize", config.size);
+    prefs.putUShort("bint", config.sampleInterval);
+    prefs.putUShort("blat", config.maxLatency);
+    prefs.end();
+
+    DEBUG_PRINTF("Telemetry batch: %s, %u samples every %u ms, max latency %u ms\n",
+                 config.enabled ? "on" : "off", config.size,
+                 config.sampleInterval, config.maxLatency);
+    return true;
+}
+
+bool TelemetryBatcher::sampleDue(uint32_t now) {
+    if (!_config.enabled) return false;
+    if (_count >= TELEMETRY_BATCH_MAX_SAMPLES) return false;  // Waiting to be published
+    if (now - _lastSampleTime < _config.sampleInterval) return false;
+
+    _lastSampleTime = now;
+    return true;
+}
+
+void TelemetryBatcher::addSample(uint32_t timestamp, const float voltage[], const float current[],
+                                 const float power[], const bool valid[]) {
+    if (_count >= TELEMETRY_BATCH_MAX_SAMPLES) return;
+    if (_count > 0 && _timestamps[_count - 1] == timestamp) return;  // No new conversion
+
+    if (_count == 0) _batchStartTime = _lastSampleTime;
+
+    _timestamps[_count] = timestamp;
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        ChannelSample& sample = _samples[_count][ch];
+        sample.voltage = valid[ch] ? voltage[ch] : NAN;
+        sample.current = valid[ch] ? current[ch] : NAN;
+        sample.power = valid[ch] ? power[ch] : NAN;
+    }
+    _count++;
+}
+
+bool TelemetryBatcher::batchDue(uint32_t now) {
+    if (_count == 0) return false;
+    return _count >= _config.size || now - _batchStartTime >= _config.maxLatency;
+}
+
+size_t TelemetryBatcher::format(char* buffer, size_t size, uint8_t first, uint8_t count) const {
+    if (first >= _count) return 0;
+    if (count > _count - first) count = _count - first;
+
+    uint32_t base = _timestamps[first];
+
+    JsonWriter json(buffer, size);
+    json.beginObject();
+    json.add("base", base);
+    uint64_t baseUs = timeBase.fromMillis(base);
+    if (baseUs != 0) json.addUInt64("time_us", baseUs);
+    json.add("count", (uint32_t)count);
+
+    json.beginArray("t");
+    for (uint8_t n = first; n < first + count; n++) {
+        json.add(nullptr, _timestamps[n] - base);
+    }
+    json.endArray();
+
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        char key[8];
+        snprintf(key, sizeof(key), "ch%u", ch + 1);
+
+        json.beginObject(key);
+        json.beginArray("v");
+        for (uint8_t n = first; n < first + count; n++) json.addFixed(nullptr, _samples[n][ch].voltage, 3);
+        json.endArray();
+        json.beginArray("i");
+        for (uint8_t n = first; n < first + count; n++) json.addFixed(nullptr, _samples[n][ch].current, 4);
+        json.endArray();
+        json.beginArray("p");
+        for (uint8_t n = first; n < first + count; n++) json.addFixed(nullptr, _samples[n][ch].power, 3);
+        json.endArray();
+        json.endObject();
+    }
+
+    json.add("device_id", deviceIdentity.id());
+    json.endObject();
+    return json.finish();
+}
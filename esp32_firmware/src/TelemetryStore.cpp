@@ -0,0 +1,177 @@
+/**
+ * @file TelemetryStore.cpp
+ * @brief Implementation of Store-and-forward Telemetry Buffer
+ */
+
+#include "TelemetryStore.h"
+#include "INA226.h"
+#include "JsonWriter.h"
+#include "DeviceIdentity.h"
+#include <stddef.h>
+
+// Global instance
+TelemetryStore telemetryStore;
+
+static const uint8_t kPending = 0xFF;
+static const uint8_t kReplayed = 0x00;
+
+TelemetryStore::TelemetryStore()
+    : _ring("Telemetry store", sizeof(StoredSample), offsetof(StoredSample, crc), STORE_SECTOR_SIZE) {
+    _replaySeq = 0;
+    _ramHead = 0;
+    _ramCount = 0;
+    _stored = 0;
+    _replayed = 0;
+    _dropped = 0;
+}
+
+bool TelemetryStore::begin() {
+    const esp_partition_t* partition = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)STORE_PARTITION_SUBTYPE,
+        STORE_PARTITION_LABEL);
+    if (partition == nullptr) {
+        DEBUG_PRINTLN("Telemetry store partition not found - buffering in RAM only");
+        return false;
+    }
+    if (!_ring.begin(partition)) return false;
+
+    // Replay goes in order, so replayed records are a prefix of the ring
+    uint32_t low = _ring.getOldestSeq(), high = _ring.getNextSeq();
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        StoredSample sample;
+        if (_ring.read(mid, &sample) && sample.pending == kReplayed) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    _replaySeq = low;
+
+    DEBUG_PRINTF("Telemetry store: %u slots, %u samples waiting for replay\n",
+                 _ring.getCapacity(), _ring.getNextSeq() - _replaySeq);
+    return true;
+}
+
+void TelemetryStore::add(StoredSample sample) {
+    sample.pending = kPending;
+    _stored++;
+
+    // RAM full: move its oldest sample to flash
+    if (_ramCount == STORE_RAM_SAMPLES) {
+        if (!spill(_ram[_ramHead])) _dropped++;
+        _ramHead = (_ramHead + 1) % STORE_RAM_SAMPLES;
+        _ramCount--;
+    }
+
+    _ram[(_ramHead + _ramCount) % STORE_RAM_SAMPLES] = sample;
+    _ramCount++;
+}
+
+bool TelemetryStore::spill(StoredSample& sample) {
+    if (!_ring.isOpen()) return false;
+
+    sample.pending = kPending;
+    bool written = _ring.append(&sample);   // Fills in seq and crc
+
+    // Entering a sector erased its oldest samples, replayed or not
+    if (_replaySeq < _ring.getOldestSeq()) {
+        _dropped += _ring.getOldestSeq() - _replaySeq;
+        _replaySeq = _ring.getOldestSeq();
+    }
+    return written;
+}
+
+uint32_t TelemetryStore::getPending() {
+    return (_ring.getNextSeq() - _replaySeq) + _ramCount;
+}
+
+uint8_t TelemetryStore::peek(StoredSample samples[], uint8_t max) {
+    uint8_t count = 0;
+
+    // Flash holds the older samples
+    if (_ring.isOpen()) {
+        uint32_t nextSeq = _ring.getNextSeq();
+        StoredSample sample;
+        while (_replaySeq < nextSeq && !_ring.read(_replaySeq, &sample)) {
+            _replaySeq++;   // Unreadable (half-written before a power loss)
+            _dropped++;
+        }
+        for (uint32_t seq = _replaySeq; seq < nextSeq && count < max; seq++) {
+            if (!_ring.read(seq, &samples[count])) return count;
+            count++;
+        }
+        if (_replaySeq + count < nextSeq) return count;
+    }
+
+    for (uint16_t i = 0; i < _ramCount && count < max; i++) {
+        samples[count++] = _ram[(_ramHead + i) % STORE_RAM_SAMPLES];
+    }
+    return count;
+}
+
+void TelemetryStore::consume(uint8_t count) {
+    _replayed += count;
+
+    // Clear the pending byte in place: 1 -> 0 bits need no erase
+    while (count > 0 && _ring.isOpen() && _replaySeq < _ring.getNextSeq()) {
+        _ring.write(_replaySeq, offsetof(StoredSample, pending), &kReplayed, sizeof(kReplayed));
+        _replaySeq++;
+        count--;
+    }
+
+    if (count > _ramCount) count = _ramCount;
+    _ramHead = (_ramHead + count) % STORE_RAM_SAMPLES;
+    _ramCount -= count;
+}
+
+size_t TelemetryStore::format(char* buffer, size_t size, const StoredSample samples[], uint8_t count,
+                              uint32_t remaining) {
+    JsonWriter json(buffer, size);
+    json.beginObject();
+    json.add("count", (uint32_t)count);
+    json.add("remaining", remaining);
+    json.beginArray("samples");
+
+    for (uint8_t n = 0; n < count; n++) {
+        const StoredSample& sample = samples[n];
+        json.beginObject();
+        json.add("timestamp", sample.uptime);
+        json.add("epoch", sample.epoch);
+        if (sample.epoch != 0) {
+            json.addUInt64("time_us", (uint64_t)sample.epoch * 1000000 + sample.epochUs);
+        }
+
+        for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+            const TelemetryPacketChannel& raw = sample.channels[ch];
+            bool valid = raw.busVoltage != TELEMETRY_BUS_INVALID;
+
+            char key[8];
+            snprintf(key, sizeof(key), "ch%u", ch + 1);
+
+            // [voltage, current, power], same precision as live telemetry
+            json.beginArray(key);
+            json.addFixed(nullptr, valid ? raw.busVoltage * INA226_BUS_VOLTAGE_LSB : NAN, 3);
+            json.addFixed(nullptr, valid ? raw.current * sample.currentLSB : NAN, 4);
+            json.addFixed(nullptr, valid ? raw.power * sample.currentLSB * INA226_POWER_LSB_FACTOR : NAN, 3);
+            json.endArray();
+        }
+        json.endObject();
+    }
+
+    json.endArray();
+    json.add("device_id", deviceIdentity.id());
+    json.endObject();
+    return json.finish();
+}
+
+TelemetryStoreStatus TelemetryStore::getStatus() {
+    TelemetryStoreStatus status;
+    status.ramPending = _ramCount;
+    status.flashPending = _ring.getNextSeq() - _replaySeq;
+    status.flashCapacity = _ring.getCapacity();
+    status.stored = _stored;
+    status.replayed = _replayed;
+    status.dropped = _dropped;
+    return status;
+}
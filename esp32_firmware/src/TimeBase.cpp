@@ -0,0 +1,162 @@
+/**
+ * @file TimeBase.cpp
+ * @brief Implementation of Wall-clock Time Base
+ */
+
+#include "TimeBase.h"
+#include <esp_timer.h>
+#include <esp_sntp.h>
+#include <sys/time.h>
+
+// Global instance
+TimeBase timeBase;
+
+static const char* const kStateNames[] = { "unsynced", "synced", "stale" };
+
+const char* timeSyncStateName(TimeSyncState state) {
+    return state <= TIME_STALE ? kStateNames[state] : "unknown";
+}
+
+TimeBase::TimeBase() {
+    _state = TIME_UNSYNCED;
+    _anchorMono = 0;
+    _anchorEpoch = 0;
+    _driftPpb = 0;
+    _slewUs = 0;
+    _lastSyncMono = 0;
+    _syncs = 0;
+    _steps = 0;
+    _lastOffsetUs = 0;
+    _lock = portMUX_INITIALIZER_UNLOCKED;
+    _pending = false;
+    _pendingMono = 0;
+    _pendingEpoch = 0;
+}
+
+void TimeBase::begin() {
+    sntp_set_time_sync_notification_cb(onSync);
+    sntp_set_sync_interval(TIME_SYNC_INTERVAL);
+}
+
+void TimeBase::onSync(struct timeval* tv) {
+    // Runs in the lwIP task right after SNTP set the system clock: take the
+    // clock and the counter together, the mapping is updated in loop()
+    (void)tv;
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    int64_t mono = esp_timer_get_time();
+
+    portENTER_CRITICAL(&timeBase._lock);
+    timeBase._pendingMono = mono;
+    timeBase._pendingEpoch = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    timeBase._pending = true;
+    portEXIT_CRITICAL(&timeBase._lock);
+}
+
+bool TimeBase::loop() {
+    bool pending;
+    int64_t mono = 0, epoch = 0;
+
+    portENTER_CRITICAL(&_lock);
+    pending = _pending;
+    if (pending) {
+        mono = _pendingMono;
+        epoch = _pendingEpoch;
+        _pending = false;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (pending) applySync(mono, epoch);
+
+    TimeSyncState state = currentState(esp_timer_get_time());
+    if (state == _state) return false;
+
+    DEBUG_PRINTF("Time: %s -> %s\n", timeSyncStateName(_state), timeSyncStateName(state));
+    _state = state;
+    return true;
+}
+
+void TimeBase::applySync(int64_t monoUs, int64_t epochUs) {
+    _syncs++;
+
+    if (_syncs == 1) {
+        _anchorMono = monoUs;
+        _anchorEpoch = epochUs;
+        _lastSyncMono = monoUs;
+        _lastOffsetUs = 0;
+        DEBUG_PRINTLN("Time: first SNTP sync");
+        return;
+    }
+
+    int64_t predicted = (int64_t)toEpochUs(monoUs);
+    int64_t offset = epochUs - predicted;
+    _lastOffsetUs = (int32_t)constrain(offset, (int64_t)INT32_MIN, (int64_t)INT32_MAX);
+
+    if (offset > TIME_STEP_THRESHOLD || offset < -TIME_STEP_THRESHOLD) {
+        // Clock set from elsewhere or a bad server: restart from the new time,
+        // the interval tells nothing about the oscillator
+        _steps++;
+        _anchorMono = monoUs;
+        _anchorEpoch = epochUs;
+        _slewUs = 0;
+        _lastSyncMono = monoUs;
+        DEBUG_PRINTF("Time: stepped by %lld us\n", (long long)offset);
+        return;
+    }
+
+    // Offset accumulated since the last sync is the residual rate error;
+    // fold a quarter of it into the estimate to average out network jitter
+    int64_t interval = monoUs - _lastSyncMono;
+    if (interval >= (int64_t)TIME_DRIFT_MIN_INTERVAL * 1000000) {
+        int64_t drift = _driftPpb + offset * 1000000000 / interval / 4;
+        const int64_t limit = (int64_t)TIME_MAX_DRIFT_PPM * 1000;
+        _driftPpb = (int32_t)constrain(drift, -limit, limit);
+    }
+
+    // Continue from the predicted time and absorb the offset gradually
+    _anchorMono = monoUs;
+    _anchorEpoch = predicted;
+    _slewUs = (int32_t)offset;
+    _lastSyncMono = monoUs;
+}
+
+uint64_t TimeBase::toEpochUs(int64_t monoUs) const {
+    if (_syncs == 0) return 0;
+
+    int64_t elapsed = monoUs - _anchorMono;
+    int64_t epoch = _anchorEpoch + elapsed + elapsed * _driftPpb / 1000000000;
+
+    if (elapsed > 0 && _slewUs != 0) {
+        int64_t slewed = elapsed * TIME_SLEW_RATE_PPM / 1000000;
+        epoch += (_slewUs > 0) ? min(slewed, (int64_t)_slewUs) : max(-slewed, (int64_t)_slewUs);
+    }
+    return epoch > 0 ? (uint64_t)epoch : 0;
+}
+
+uint64_t TimeBase::fromMillis(uint32_t ms) const {
+    // millis() is esp_timer_get_time() / 1000: rebuild the full counter
+    int64_t nowMs = esp_timer_get_time() / 1000;
+    uint32_t age = (uint32_t)nowMs - ms;
+    return toEpochUs((nowMs - age) * 1000);
+}
+
+uint64_t TimeBase::nowUs() const {
+    return toEpochUs(esp_timer_get_time());
+}
+
+TimeSyncState TimeBase::currentState(int64_t monoUs) const {
+    if (_syncs == 0) return TIME_UNSYNCED;
+    int64_t staleAfter = (int64_t)TIME_SYNC_INTERVAL * 1000 * TIME_STALE_AFTER;
+    return (monoUs - _lastSyncMono > staleAfter) ? TIME_STALE : TIME_SYNCED;
+}
+
+TimeSyncStats TimeBase::getStats() const {
+    TimeSyncStats stats;
+    stats.state = _state;
+    stats.syncs = _syncs;
+    stats.steps = _steps;
+    stats.lastOffsetUs = _lastOffsetUs;
+    stats.driftPpb = _driftPpb;
+    stats.sinceSync = _syncs ? (uint32_t)((esp_timer_get_time() - _lastSyncMono) / 1000000) : 0;
+    return stats;
+}
@@ -0,0 +1,381 @@
+/**
+ * @file TlsTransport.cpp
+ * @brief Implementation of Non-blocking TLS Layer
+ */
+
+#include "TlsTransport.h"
+
+#if MQTT_USE_TLS
+
+#include <lwip/sockets.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <esp_rom_crc.h>
+#include <mbedtls/platform.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/error.h>
+
+#if defined(MBEDTLS_PLATFORM_MEMORY) && !defined(MBEDTLS_PLATFORM_CALLOC_MACRO)
+#define TLS_COUNT_HEAP 1
+#else
+#define TLS_COUNT_HEAP 0
+#endif
+
+#if TLS_COUNT_HEAP
+// mbedTLS allocator hooks: same internal heap as the default, plus a tally
+// of what the handshaking task holds. Only that task is counted.
+static TaskHandle_t s_countTask = nullptr;
+static size_t s_heapUsed = 0;
+static size_t s_heapPeak = 0;
+
+static inline bool counting() {
+    return s_countTask != nullptr && xTaskGetCurrentTaskHandle() == s_countTask;
+}
+
+static void* countingCalloc(size_t count, size_t size) {
+    void* p = heap_caps_calloc(count, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (p != nullptr && counting()) {
+        s_heapUsed += heap_caps_get_allocated_size(p);
+        if (s_heapUsed > s_heapPeak) s_heapPeak = s_heapUsed;
+    }
+    return p;
+}
+
+static void countingFree(void* p) {
+    if (p == nullptr) return;
+    if (counting()) {
+        // Blocks from before the handshake (e.g. the last session) are freed too
+        size_t size = heap_caps_get_allocated_size(p);
+        s_heapUsed = size < s_heapUsed ? s_heapUsed - size : 0;
+    }
+    heap_caps_free(p);
+}
+
+static void startHeapCount() {
+    s_heapUsed = 0;
+    s_heapPeak = 0;
+    s_countTask = xTaskGetCurrentTaskHandle();
+}
+
+static size_t stopHeapCount() {
+    s_countTask = nullptr;
+    return s_heapPeak;
+}
+#else
+// Allocator fixed at build time: lowest free heap seen between steps instead
+static size_t s_heapBase = 0;
+static size_t s_heapLowest = 0;
+
+static void startHeapCount() {
+    s_heapBase = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    s_heapLowest = s_heapBase;
+}
+
+static void sampleHeap() {
+    size_t free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (free < s_heapLowest) s_heapLowest = free;
+}
+
+static size_t stopHeapCount() {
+    sampleHeap();
+    return s_heapBase - s_heapLowest;
+}
+#endif
+
+/**
+ * @brief Serialized session as saved in RTC memory
+ */
+struct PersistedSession {
+    uint32_t magic;
+    uint32_t key;               // Host and port hash
+    uint32_t length;
+    uint32_t crc;               // CRC-32 of data[0..length)
+    uint8_t data[MQTT_TLS_SESSION_CACHE];
+};
+
+static const uint32_t kSessionMagic = 0x544C5353;  // "TLSS"
+
+// Survives software resets and deep sleep; garbage after power-on
+RTC_NOINIT_ATTR static PersistedSession rtcSession;
+
+TlsTransport::TlsTransport() {
+    _configured = false;
+    _active = false;
+    _socket = -1;
+    _haveSession = false;
+    _restored = false;
+    _sessionKey = 0;
+    _offered = false;
+    _sawCertificate = false;
+    _startUs = 0;
+    _writePending = 0;
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+bool TlsTransport::configure() {
+    mbedtls_ssl_config_init(&_config);
+    mbedtls_x509_crt_init(&_ca);
+    mbedtls_ssl_init(&_ssl);
+    mbedtls_ssl_session_init(&_session);
+
+#if TLS_COUNT_HEAP
+    mbedtls_platform_set_calloc_free(countingCalloc, countingFree);
+#endif
+
+    int ret = mbedtls_ssl_config_defaults(&_config, MBEDTLS_SSL_IS_CLIENT,
+                                          MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret != 0) {
+        DEBUG_PRINTF("TLS config failed (-0x%04x)\n", -ret);
+        _stats.lastError = ret;
+        return false;
+    }
+
+    static const char caCert[] = MQTT_TLS_CA_CERT;
+    if (caCert[0] != '\0') {
+        ret = mbedtls_x509_crt_parse(&_ca, (const unsigned char*)caCert, sizeof(caCert));
+        if (ret != 0) {
+            DEBUG_PRINTF("TLS CA certificate invalid (-0x%04x)\n", -ret);
+            _stats.lastError = ret;
+            return false;
+        }
+        mbedtls_ssl_conf_ca_chain(&_config, &_ca, nullptr);
+        mbedtls_ssl_conf_authmode(&_config, MBEDTLS_SSL_VERIFY_REQUIRED);
+    } else {
+        DEBUG_PRINTLN("TLS: no CA certificate - broker is NOT verified");
+        mbedtls_ssl_conf_authmode(&_config, MBEDTLS_SSL_VERIFY_NONE);
+    }
+
+    mbedtls_ssl_conf_rng(&_config, random, nullptr);
+    mbedtls_ssl_conf_session_tickets(&_config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+    ret = mbedtls_ssl_setup(&_ssl, &_config);
+    if (ret != 0) {
+        DEBUG_PRINTF("TLS setup failed (-0x%04x)\n", -ret);
+        _stats.lastError = ret;
+        return false;
+    }
+
+    _configured = true;
+    return true;
+}
+
+bool TlsTransport::start(int socket, const char* host, uint16_t port) {
+    if (!_configured && !configure()) return false;
+
+    uint32_t key = sessionKey(host, port);
+    if (!_restored) {
+        _restored = true;
+        restoreSession(key);
+    }
+    if (_haveSession && _sessionKey != key) dropSession();   // Broker changed
+    _sessionKey = key;
+
+    // The context is reused: record buffers stay allocated between connections
+    int ret = mbedtls_ssl_session_reset(&_ssl);
+    if (ret == 0) ret = mbedtls_ssl_set_hostname(&_ssl, host);
+    if (ret != 0) {
+        DEBUG_PRINTF("TLS reset failed (-0x%04x)\n", -ret);
+        _stats.lastError = ret;
+        return false;
+    }
+
+    _socket = socket;
+    mbedtls_ssl_set_bio(&_ssl, this, bioSend, bioReceive, nullptr);
+
+    _offered = _haveSession && mbedtls_ssl_set_session(&_ssl, &_session) == 0;
+    _sawCertificate = false;
+    _writePending = 0;
+    _active = true;
+    _startUs = esp_timer_get_time();
+    startHeapCount();
+    return true;
+}
+
+TlsHandshakeResult TlsTransport::handshake() {
+    int ret = 0;
+    while (_ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        ret = mbedtls_ssl_handshake_step(&_ssl);
+
+        // The client only waits for a certificate when the server did not
+        // accept the offered session
+        if (_ssl.state == MBEDTLS_SSL_SERVER_CERTIFICATE) _sawCertificate = true;
+#if !TLS_COUNT_HEAP
+        sampleHeap();
+#endif
+        if (ret != 0) break;
+    }
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return TLS_HANDSHAKE_PENDING;
+    }
+
+    if (ret != 0) {
+        stopHeapCount();
+        _stats.failures++;
+        _stats.lastError = ret;
+
+        char reason[96];
+        mbedtls_strerror(ret, reason, sizeof(reason));
+        DEBUG_PRINTF("TLS handshake failed (-0x%04x): %s\n", -ret, reason);
+        uint32_t flags = mbedtls_ssl_get_verify_result(&_ssl);
+        if (flags != 0 && flags != (uint32_t)-1) DEBUG_PRINTF("TLS verify flags 0x%x\n", flags);
+
+        // A session the server chokes on would fail every attempt
+        if (_offered) dropSession();
+        return TLS_HANDSHAKE_FAILED;
+    }
+
+    finishHandshake();
+    return TLS_HANDSHAKE_DONE;
+}
+
+void TlsTransport::finishHandshake() {
+    uint32_t heap = stopHeapCount();
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - _startUs) / 1000);
+
+    TlsHandshakeStats& kind = _sawCertificate ? _stats.full : _stats.resumed;
+    kind.count++;
+    kind.lastMs = ms;
+    kind.averageMs = (uint32_t)(((uint64_t)kind.averageMs * (kind.count - 1) + ms) / kind.count);
+    kind.lastHeap = heap;
+    if (heap > kind.maxHeap) kind.maxHeap = heap;
+
+    DEBUG_PRINTF("TLS %s handshake: %u ms, %u B heap%s\n",
+                 _sawCertificate ? "full" : "resumed", ms, heap,
+                 _offered && _sawCertificate ? " (session refused)" : "");
+
+    saveSession();
+}
+
+int TlsTransport::send(const uint8_t* data, size_t length) {
+    // After WANT_WRITE the record is already encrypted: mbedTLS must be
+    // called again with the same data (the caller keeps it at the front)
+    if (_writePending != 0) length = _writePending;
+
+    int ret = mbedtls_ssl_write(&_ssl, data, length);
+    if (ret > 0) {
+        _writePending = 0;
+        return ret;
+    }
+    if (ret == MBEDTLS_ERR_SSL_WANT_WRITE || ret == MBEDTLS_ERR_SSL_WANT_READ) {
+        _writePending = length;
+        return 0;
+    }
+    _stats.lastError = ret;
+    return ret < 0 ? ret : -1;
+}
+
+int TlsTransport::receive(uint8_t* buffer, size_t size) {
+    int ret = mbedtls_ssl_read(&_ssl, buffer, size);
+    if (ret > 0) return ret;
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) return 0;
+
+    // 0: connection closed without close_notify
+    if (ret != 0 && ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) _stats.lastError = ret;
+    return -1;
+}
+
+void TlsTransport::close() {
+    if (!_active) return;
+    if (_ssl.state == MBEDTLS_SSL_HANDSHAKE_OVER) {
+        mbedtls_ssl_close_notify(&_ssl);    // One attempt, the socket is closed next
+    } else {
+        stopHeapCount();                     // Abandoned mid-handshake (timeout)
+    }
+    _active = false;
+    _socket = -1;
+}
+
+TlsStats TlsTransport::getStats() const {
+    TlsStats stats = _stats;
+    stats.sessionCached = _haveSession;
+    return stats;
+}
+
+void TlsTransport::saveSession() {
+    // Session ID or ticket the server handed out; replaces the previous one
+    if (mbedtls_ssl_get_session(&_ssl, &_session) != 0) {
+        dropSession();
+        return;
+    }
+    _haveSession = true;
+    _stats.sessionFromRtc = false;
+
+    size_t length = 0;
+    int ret = mbedtls_ssl_session_save(&_session, rtcSession.data, sizeof(rtcSession.data), &length);
+    if (ret != 0) {
+        // Kept in RAM for reconnects, not across resets
+        DEBUG_PRINTF("TLS session not saved to RTC (-0x%04x, %u B needed)\n", -ret, length);
+        rtcSession.magic = 0;
+        return;
+    }
+    rtcSession.key = _sessionKey;
+    rtcSession.length = length;
+    rtcSession.crc = esp_rom_crc32_le(0, rtcSession.data, length);
+    rtcSession.magic = kSessionMagic;
+}
+
+void TlsTransport::restoreSession(uint32_t key) {
+    _sessionKey = key;
+    if (rtcSession.magic != kSessionMagic || rtcSession.key != key ||
+        rtcSession.length == 0 || rtcSession.length > sizeof(rtcSession.data) ||
+        rtcSession.crc != esp_rom_crc32_le(0, rtcSession.data, rtcSession.length)) {
+        return;
+    }
+
+    if (mbedtls_ssl_session_load(&_session, rtcSession.data, rtcSession.length) != 0) {
+        // Saved by a firmware built with other mbedTLS options
+        mbedtls_ssl_session_free(&_session);
+        mbedtls_ssl_session_init(&_session);
+        rtcSession.magic = 0;
+        return;
+    }
+    _haveSession = true;
+    _stats.sessionFromRtc = true;
+    DEBUG_PRINTF("TLS session restored from RTC memory (%u B)\n", rtcSession.length);
+}
+
+void TlsTransport::dropSession() {
+    mbedtls_ssl_session_free(&_session);
+    mbedtls_ssl_session_init(&_session);
+    _haveSession = false;
+    _stats.sessionFromRtc = false;
+    rtcSession.magic = 0;
+}
+
+uint32_t TlsTransport::sessionKey(const char* host, uint16_t port) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char* p = host; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    hash = (hash ^ (port >> 8)) * 16777619u;
+    hash = (hash ^ (port & 0xFF)) * 16777619u;
+    return hash;
+}
+
+int TlsTransport::bioSend(void* context, const unsigned char* data, size_t length) {
+    TlsTransport* self = (TlsTransport*)context;
+    ssize_t n = ::send(self->_socket, data, length, MSG_DONTWAIT);
+    if (n >= 0) return n;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return MBEDTLS_ERR_SSL_WANT_WRITE;
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+int TlsTransport::bioReceive(void* context, unsigned char* buffer, size_t size) {
+    TlsTransport* self = (TlsTransport*)context;
+    ssize_t n = ::recv(self->_socket, buffer, size, MSG_DONTWAIT);
+    if (n >= 0) return n;   // 0 = closed by the peer
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return MBEDTLS_ERR_SSL_WANT_READ;
+    return errno == ECONNRESET ? MBEDTLS_ERR_NET_CONN_RESET : MBEDTLS_ERR_NET_RECV_FAILED;
+}
+
+int TlsTransport::random(void* context, unsigned char* output, size_t length) {
+    (void)context;
+    esp_fill_random(output, length);    // Hardware RNG, seeded by the radio
+    return 0;
+}
+
+#endif // MQTT_USE_TLS
@@ -0,0 +1,90 @@
+/**
+ * @file TopicRouter.cpp
+ * @brief Implementation of Inbound MQTT Topic Router
+ */
+
+#include "TopicRouter.h"
+
+// Global instance
+TopicRouter topicRouter;
+
+static const char kChannelPrefix[] = MQTT_TOPIC_CH_PREFIX;
+
+TopicRouter::TopicRouter() {
+    memset(_routes, 0, sizeof(_routes));
+    _count = 0;
+    _base = "";
+    _baseLength = 0;
+}
+
+void TopicRouter::setBase(const char* base) {
+    _base = base;
+    _baseLength = strlen(base);
+}
+
+bool TopicRouter::add(const char* suffix, bool perChannel, TopicHandler handler) {
+    // Keep one slot free so a lookup always ends on an empty slot
+    if (_count >= TOPIC_ROUTER_SLOTS - 1) return false;
+
+    uint32_t hash = hashSuffix(suffix, perChannel);
+    Route* route = find(suffix, hash, perChannel);
+    if (route->suffix != nullptr) return false;
+
+    route->suffix = suffix;
+    route->hash = hash;
+    route->perChannel = perChannel;
+    route->handler = handler;
+    _count++;
+    return true;
+}
+
+bool TopicRouter::dispatch(const char* topic, const char* payload, size_t length) {
+    if (_baseLength == 0 || strncmp(topic, _base, _baseLength) != 0) return false;
+    const char* suffix = topic + _baseLength;
+
+    // devices/<id>/chN/...: take the channel number off the front
+    uint8_t channel = 0;
+    if (strncmp(suffix, kChannelPrefix, sizeof(kChannelPrefix) - 1) == 0) {
+        const char* digits = suffix + sizeof(kChannelPrefix) - 1;
+        uint16_t value = 0;
+        const char* p = digits;
+        while (*p >= '0' && *p <= '9' && p - digits < 3) {
+            value = value * 10 + (*p++ - '0');
+        }
+        if (p != digits) {
+            if (value < 1 || value > NUM_CHANNELS) return false;
+            channel = value;
+            suffix = p;
+        }
+    }
+
+    bool perChannel = channel != 0;
+    Route* route = find(suffix, hashSuffix(suffix, perChannel), perChannel);
+    if (route->suffix == nullptr) return false;
+
+    route->handler(channel, payload, length);
+    return true;
+}
+
+TopicRouter::Route* TopicRouter::find(const char* suffix, uint32_t hash, bool perChannel) {
+    // Linear probing; the table is never full, so this ends on a match or a free slot
+    uint32_t slot = hash & (TOPIC_ROUTER_SLOTS - 1);
+    while (true) {
+        Route& route = _routes[slot];
+        if (route.suffix == nullptr) return &route;
+        if (route.hash == hash && route.perChannel == perChannel && strcmp(route.suffix, suffix) == 0) {
+            return &route;
+        }
+        slot = (slot + 1) & (TOPIC_ROUTER_SLOTS - 1);
+    }
+}
+
+uint32_t TopicRouter::hashSuffix(const char* suffix, bool perChannel) {
+    // FNV-1a, seeded differently for per-channel routes
+    uint32_t hash = perChannel ? 0x811C9DC5u ^ 0xFF : 0x811C9DC5u;
+    while (*suffix) {
+        hash ^= (uint8_t)*suffix++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
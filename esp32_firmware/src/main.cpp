@@ -8,6 +8,7 @@
  * - INA226 sensor reading
  * - MOSFET control
  * - Safety protection
+ * - Closed-loop current / power regulation
  * 
  * @author IoT Project
  * @version 1.0.0
@@ -17,43 +18,53 @@
 #include <WiFi.h>
 #include <Wire.h>
 #include <ArduinoJson.h>
+#include <esp_system.h>
 
 #include "config.h"
 #include "INA226.h"
 #include "MQTTManager.h"
 #include "LoadController.h"
+#include "SafetyMonitor.h"
+#include "EventLog.h"
+#include "ScheduleManager.h"
+#include "Regulator.h"
+#include "Benchmark.h"
+#include "TelemetryBatcher.h"
+#include "TelemetryStore.h"
+#include "TopicRouter.h"
+#include "CommandCoalescer.h"
+#include "CommandRpc.h"
+#include "DeviceShadow.h"
+#include "TimeBase.h"
+#include "DeviceIdentity.h"
+#include "JsonWriter.h"
 
 // ============================================================================
 // GLOBAL OBJECTS
 // ============================================================================
 
-// WiFi client
-WiFiClient wifiClient;
+// INA226 sensors (index 0 = Channel 1)
+INA226 ina226[NUM_CHANNELS] = INA226_ADDRS;
+static const uint8_t ina226Addresses[] = INA226_ADDRS;
 
-// INA226 sensors
-INA226 ina226_ch1(INA226_ADDR_CH1);
-INA226 ina226_ch2(INA226_ADDR_CH2);
+// Sensors handed to the protection task (nullptr = not found)
+INA226* sensors[NUM_CHANNELS] = {};
 
-// Sensor data storage
-struct SensorData {
-    float voltage;
-    float current;
-    float power;
-    bool valid;
-    unsigned long lastReadTime;
-};
-
-SensorData sensorData[2];  // Index 0 = Channel 1, Index 1 = Channel 2
+// Latest sensor snapshot, refreshed from the protection task
+SensorData sensorData[NUM_CHANNELS];  // Index 0 = Channel 1, Index 1 = Channel 2
 
 // Timing variables
 unsigned long lastTelemetryTime = 0;
 unsigned long lastStatusTime = 0;
 unsigned long lastHeartbeatTime = 0;
+unsigned long lastReplayTime = 0;
 unsigned long startTime = 0;
 
-// Overcurrent detection
-unsigned long overcurrentStartTime[2] = {0, 0};
-bool overcurrentDetected[2] = {false, false};
+// Broker sessions seen (MqttClientStats::connects): a new one gets the full state
+uint32_t lastConnects = 0;
+
+// First event log record of this boot (older records have another boot's millis())
+uint32_t bootEventSeq = 0;
 
 // ============================================================================
 // FUNCTION PROTOTYPES
@@ -62,27 +73,54 @@ bool overcurrentDetected[2] = {false, false};
 void setupWiFi();
 void setupSensors();
 void setupMQTT();
-void handleMQTTMessage(const char* topic, const char* payload);
+void handleMQTTMessage(const char* topic, const char* payload, size_t length);
+void handleSwitchSet(uint8_t channel, const char* payload, size_t length);
+void handleSimSet(uint8_t channel, const char* payload, size_t length);
+void handleMultiSwitchSet(uint8_t channel, const char* payload, size_t length);
+void handleControl(uint8_t channel, const char* payload, size_t length);
+void handleShadowDesired(uint8_t channel, const char* payload, size_t length);
+void handleShadowGet(uint8_t channel, const char* payload, size_t length);
+void rejectCommand(uint8_t channel, const char* errorType, const char* message,
+                   RpcResult result = RPC_INVALID, float value = 0);
 void readSensors();
-void checkSafetyLimits();
+void publishSafetyEvents();
 void publishTelemetry();
-void publishStatus();
+void sampleTelemetryBatch();
+void storeTelemetry();
+void replayTelemetry();
+void publishStatus(bool full = false);
 void publishHeartbeat();
 void handleSerialCommands();
+void clearChannelFault(uint8_t channel);
+void publishEventLogPage(uint32_t from, uint8_t count);
+void publishSchedule(uint8_t channel);
+bool parseSwitchStates(JsonVariantConst doc, uint16_t& mask, uint16_t& states);
+void handleMultiSwitch(JsonVariantConst doc);
+void handleFade(JsonVariantConst doc, bool ramp);
+void publishPWMConfig(uint8_t channel);
+void handleRegulate(JsonVariantConst doc);
+void publishRegulation(uint8_t channel);
 
 // ============================================================================
 // SETUP
 // ============================================================================
 
 void setup() {
+    // Restore the outputs first: lamps that were ON before a reset come back
+    // within milliseconds instead of waiting for the backend
+    loadController.begin();
+    
     // Initialize serial for debugging
     Serial.begin(DEBUG_SERIAL_BAUD);
     delay(1000);
     
+    // Device ID and every topic derived from it, before anything publishes
+    deviceIdentity.begin();
+    
     DEBUG_PRINTLN("\n\n========================================");
     DEBUG_PRINTLN("  ESP32 Power Monitor & Control System");
     DEBUG_PRINTF("  Firmware Version: %s\n", FIRMWARE_VERSION);
-    DEBUG_PRINTF("  Device ID: %s\n", DEVICE_ID);
+    DEBUG_PRINTF("  Device ID: %s (%s)\n", deviceIdentity.id(), deviceIdSourceName(deviceIdentity.getSource()));
     DEBUG_PRINTLN("========================================\n");
     
     startTime = millis();
@@ -92,12 +130,29 @@ void setup() {
     Wire.begin(I2C_SDA_PIN, I2C_SCL_PIN);
     Wire.setClock(400000);  // 400kHz I2C
     
-    // Initialize load controller (MOSFETs)
-    loadController.begin();
+    // Open the persistent event log and record this boot
+    eventLog.begin();
+    bootEventSeq = eventLog.getNextSeq();
+    eventLog.append(EVENT_REBOOT, 0, esp_reset_reason());
+    
+    // Find telemetry buffered before the reboot that was never replayed
+    telemetryStore.begin();
+    
+    // Load switching schedules (they start firing once SNTP sets the clock)
+    scheduleManager.begin();
+    
+    // Load batched telemetry settings
+    telemetryBatcher.begin();
+    
+    // Shadow versions continue where the last boot stopped
+    deviceShadow.begin();
     
     // Initialize sensors
     setupSensors();
     
+    // Start fixed-rate protection before any blocking network setup
+    safetyMonitor.begin(sensors);
+    
     // Connect to WiFi
     setupWiFi();
     
@@ -119,28 +174,59 @@ void loop() {
     // Handle MQTT
     mqtt.loop();
     
-    // Read sensors periodically
-    static unsigned long lastSensorRead = 0;
-    if (currentTime - lastSensorRead >= 100) {  // Read every 100ms
-        lastSensorRead = currentTime;
-        readSensors();
-        checkSafetyLimits();
+    // Apply SNTP syncs; the retained status carries the sync quality
+    if (timeBase.loop() && mqtt.isConnected()) {
+        mqtt.publishDeviceStatus(true);
     }
     
+    // Sampling and protection run in the safety task; here we only pick up
+    // the latest samples and publish whatever the task raised
+    readSensors();
+    publishSafetyEvents();
+    
+    // Chain / finish simulator fades signalled by the LEDC interrupt
+    loadController.loop();
+    
+    // Fire due schedule rules (no-op until the next event is due)
+    scheduleManager.loop();
+    
+    // Apply the last simulator level of each finished command burst
+    commandCoalescer.loop(currentTime);
+    
     // Publish telemetry
     if (currentTime - lastTelemetryTime >= TELEMETRY_INTERVAL) {
         lastTelemetryTime = currentTime;
         publishTelemetry();
     }
     
-    // Publish status (if changed or periodically)
-    if (currentTime - lastStatusTime >= STATUS_INTERVAL ||
-        loadController.hasStateChanged(1) || loadController.hasStateChanged(2)) {
+    // Replay telemetry buffered during a broker outage, a little at a time
+    if (currentTime - lastReplayTime >= STORE_REPLAY_INTERVAL) {
+        lastReplayTime = currentTime;
+        replayTelemetry();
+    }
+    
+    // Collect high-rate samples and publish them as one message per batch
+    if (telemetryBatcher.sampleDue(currentTime)) {
+        sampleTelemetryBatch();
+    }
+    if (telemetryBatcher.batchDue(currentTime)) {
+        if (mqtt.isConnected()) mqtt.publishTelemetryBatch(telemetryBatcher);
+        telemetryBatcher.clear();
+    }
+    
+    // A new broker session gets the full state once; after that only
+    // changes are published, and changes close together share one publish
+    uint32_t connects = mqtt.getClientStats().connects;
+    if (connects != lastConnects && mqtt.isConnected()) {
+        lastConnects = connects;
+        lastStatusTime = currentTime;
+        deviceShadow.onConnected();
+        publishStatus(true);
+    } else if (loadController.getChangedMask() != 0 && currentTime - lastStatusTime >= STATUS_MERGE_WINDOW) {
         lastStatusTime = currentTime;
         publishStatus();
-        loadController.clearStateChanged(1);
-        loadController.clearStateChanged(2);
     }
+    deviceShadow.loop(currentTime);
     
     // Publish heartbeat
     if (currentTime - lastHeartbeatTime >= HEARTBEAT_INTERVAL) {
@@ -166,6 +252,11 @@ void setupWiFi() {
     WiFi.mode(WIFI_STA);
     WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
     
+    // SNTP runs in the background and keeps the clock set for schedules;
+    // every sync also disciplines the time base of the sample timestamps
+    timeBase.begin();
+    configTzTime(TIME_ZONE, NTP_SERVER, NTP_SERVER_2);
+    
     unsigned long startAttempt = millis();
     
     while (WiFi.status() != WL_CONNECTED) {
@@ -192,26 +283,15 @@ void setupWiFi() {
 void setupSensors() {
     DEBUG_PRINTLN("Initializing INA226 sensors...");
     
-    // Initialize Channel 1 INA226
-    if (ina226_ch1.begin(&Wire)) {
-        DEBUG_PRINTF("INA226 Channel 1 found at 0x%02X\n", INA226_ADDR_CH1);
-        ina226_ch1.calibrate(SHUNT_RESISTOR, MAX_EXPECTED_CURRENT);
-        ina226_ch1.setAveraging(INA226_AVG_16);
-        sensorData[0].valid = true;
-    } else {
-        DEBUG_PRINTF("INA226 Channel 1 NOT found at 0x%02X!\n", INA226_ADDR_CH1);
-        sensorData[0].valid = false;
-    }
-    
-    // Initialize Channel 2 INA226
-    if (ina226_ch2.begin(&Wire)) {
-        DEBUG_PRINTF("INA226 Channel 2 found at 0x%02X\n", INA226_ADDR_CH2);
-        ina226_ch2.calibrate(SHUNT_RESISTOR, MAX_EXPECTED_CURRENT);
-        ina226_ch2.setAveraging(INA226_AVG_16);
-        sensorData[1].valid = true;
-    } else {
-        DEBUG_PRINTF("INA226 Channel 2 NOT found at 0x%02X!\n", INA226_ADDR_CH2);
-        sensorData[1].valid = false;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if (ina226[i].begin(&Wire)) {
+            DEBUG_PRINTF("INA226 Channel %d found at 0x%02X\n", i + 1, ina226Addresses[i]);
+            ina226[i].calibrate(SHUNT_RESISTOR, MAX_EXPECTED_CURRENT);
+            ina226[i].setAveraging(INA226_AVG_16);
+            sensors[i] = &ina226[i];
+        } else {
+            DEBUG_PRINTF("INA226 Channel %d NOT found at 0x%02X!\n", i + 1, ina226Addresses[i]);
+        }
     }
 }
 
@@ -222,9 +302,18 @@ void setupSensors() {
 void setupMQTT() {
     DEBUG_PRINTLN("Setting up MQTT...");
     
-    mqtt.begin(wifiClient);
+    mqtt.begin();
     mqtt.setCallback(handleMQTTMessage);
     
+    // Inbound routes: per-channel suffixes, then device-wide topics
+    topicRouter.setBase(deviceIdentity.baseTopic());
+    topicRouter.add(MQTT_CH_SWITCH_SET, true, handleSwitchSet);
+    topicRouter.add(MQTT_CH_SIM_SET, true, handleSimSet);
+    topicRouter.add(MQTT_TOPIC_SWITCH_SET, false, handleMultiSwitchSet);
+    topicRouter.add(MQTT_TOPIC_CONTROL, false, handleControl);
+    topicRouter.add(MQTT_TOPIC_SHADOW_DESIRED, false, handleShadowDesired);
+    topicRouter.add(MQTT_TOPIC_SHADOW_GET, false, handleShadowGet);
+    
     if (WiFi.status() == WL_CONNECTED) {
         mqtt.connect();
     }
@@ -234,156 +323,570 @@ void setupMQTT() {
 // MQTT MESSAGE HANDLER
 // ============================================================================
 
-void handleMQTTMessage(const char* topic, const char* payload) {
-    DEBUG_PRINTF("Processing MQTT message: %s = %s\n", topic, payload);
+void handleMQTTMessage(const char* topic, const char* payload, size_t length) {
+    commandRpc.received();
+    if (!topicRouter.dispatch(topic, payload, length)) {
+        DEBUG_PRINTF("No handler for topic: %s\n", topic);
+    }
+    
+    // Commands with an "id" that were not refused are answered here
+    commandRpc.finish();
+}
+
+/**
+ * @brief Report a refused command on .../error and, if it has an id, .../response
+ */
+void rejectCommand(uint8_t channel, const char* errorType, const char* message,
+                   RpcResult result, float value) {
+    mqtt.publishError(channel, errorType, message, value);
+    commandRpc.reply(result, errorType, message);
+}
+
+/**
+ * @brief .../chN/switch/set: "ON", "OFF", "1", "0", "TOGGLE" or {"state": true}
+ */
+void handleSwitchSet(uint8_t channel, const char* payload, size_t length) {
+    // Plain commands need no JSON parsing
+    if (strcmp(payload, "ON") == 0 || strcmp(payload, "1") == 0) {
+        loadController.setSwitch(channel, true);
+        return;
+    }
+    if (strcmp(payload, "OFF") == 0 || strcmp(payload, "0") == 0) {
+        loadController.setSwitch(channel, false);
+        return;
+    }
+    if (strcmp(payload, "TOGGLE") == 0) {
+        loadController.toggleSwitch(channel);
+        return;
+    }
+    
+    if (payload[0] != '{') return;
+    StaticJsonDocument<128> doc;
+    if (deserializeJson(doc, payload, length)) return;
+    commandRpc.open(doc.as<JsonVariantConst>(), "switch", channel);
+    
+    JsonVariantConst state = doc["state"];
+    if (!state.is<bool>()) {
+        commandRpc.reply(RPC_INVALID, "INVALID_SWITCH_SET", "state must be true or false");
+    } else if (!loadController.setSwitch(channel, state.as<bool>())) {
+        FaultCode code = loadController.getFaultCode(channel);
+        commandRpc.reply(RPC_REJECTED, "SWITCH_REJECTED",
+                         code != FAULT_NONE ? faultCodeMessage(code) : "Channel disabled");
+    }
+}
+
+/**
+ * @brief .../chN/sim/set: percent as plain text, or {"value"|"permille"|"duty": N}
+ */
+void handleSimSet(uint8_t channel, const char* payload, size_t length) {
+    // Slider drags send bursts: only the latest level of a window is applied
+    if (payload[0] != '{') {
+        commandCoalescer.submitSimulator(channel, SIM_UNIT_PERCENT, constrain(atoi(payload), 0, 100), millis());
+        return;
+    }
+    
+    StaticJsonDocument<160> doc;
+    if (deserializeJson(doc, payload, length)) return;
+    commandRpc.open(doc.as<JsonVariantConst>(), "sim", channel);
+    
+    bool applied;
+    if (doc.containsKey("permille")) {
+        applied = commandCoalescer.submitSimulator(channel, SIM_UNIT_PERMILLE,
+                                                   constrain(doc["permille"].as<int>(), 0, 1000), millis());
+    } else if (doc.containsKey("duty")) {
+        applied = commandCoalescer.submitSimulator(channel, SIM_UNIT_DUTY, doc["duty"].as<uint32_t>(), millis());
+    } else {
+        applied = commandCoalescer.submitSimulator(channel, SIM_UNIT_PERCENT,
+                                                   constrain(doc["value"] | 0, 0, 100), millis());
+    }
+    
+    // Inside a coalescing window: a newer command may still replace this one
+    if (!applied) commandRpc.reply(RPC_ACCEPTED);
+}
+
+/**
+ * @brief .../switch/set: several channels at once (see parseSwitchStates)
+ */
+void handleMultiSwitchSet(uint8_t, const char* payload, size_t length) {
+    StaticJsonDocument<512> doc;
+    if (deserializeJson(doc, payload, length)) return;
+    commandRpc.open(doc.as<JsonVariantConst>(), "switch_multi");
+    handleMultiSwitch(doc.as<JsonVariantConst>());
+}
+
+/**
+ * @brief Apply a desired state from the backend (see DeviceShadow.h)
+ *
+ *   {"version": 7, "ch1": {"switch": true, "simulator": 40}}
+ */
+void handleShadowDesired(uint8_t, const char* payload, size_t length) {
+    // An empty payload only clears the retained message on the broker
+    if (length == 0) return;
     
-    // Parse JSON payload if present
     StaticJsonDocument<256> doc;
-    DeserializationError error = deserializeJson(doc, payload);
-    
-    // Channel 1 Switch Control
-    if (strcmp(topic, MQTT_TOPIC_CH1_SWITCH_SET) == 0) {
-        if (strcmp(payload, "ON") == 0 || strcmp(payload, "1") == 0 || 
-            (doc.containsKey("state") && doc["state"] == true)) {
-            loadController.setSwitch(1, true);
-        } else if (strcmp(payload, "OFF") == 0 || strcmp(payload, "0") == 0 ||
-                   (doc.containsKey("state") && doc["state"] == false)) {
-            loadController.setSwitch(1, false);
-        } else if (strcmp(payload, "TOGGLE") == 0) {
-            loadController.toggleSwitch(1);
-        }
-    }
-    // Channel 2 Switch Control
-    else if (strcmp(topic, MQTT_TOPIC_CH2_SWITCH_SET) == 0) {
-        if (strcmp(payload, "ON") == 0 || strcmp(payload, "1") == 0 ||
-            (doc.containsKey("state") && doc["state"] == true)) {
-            loadController.setSwitch(2, true);
-        } else if (strcmp(payload, "OFF") == 0 || strcmp(payload, "0") == 0 ||
-                   (doc.containsKey("state") && doc["state"] == false)) {
-            loadController.setSwitch(2, false);
-        } else if (strcmp(payload, "TOGGLE") == 0) {
-            loadController.toggleSwitch(2);
-        }
-    }
-    // Channel 1 Simulator Control
-    else if (strcmp(topic, MQTT_TOPIC_CH1_SIM_SET) == 0) {
-        int value = atoi(payload);
-        if (doc.containsKey("value")) {
-            value = doc["value"];
-        }
-        loadController.setSimulator(1, constrain(value, 0, 100));
-    }
-    // Channel 2 Simulator Control
-    else if (strcmp(topic, MQTT_TOPIC_CH2_SIM_SET) == 0) {
-        int value = atoi(payload);
-        if (doc.containsKey("value")) {
-            value = doc["value"];
-        }
-        loadController.setSimulator(2, constrain(value, 0, 100));
-    }
-    // General Control
-    else if (strcmp(topic, MQTT_TOPIC_CONTROL) == 0) {
-        if (!error && doc.containsKey("command")) {
-            const char* command = doc["command"];
-            
-            if (strcmp(command, "reset") == 0) {
-                DEBUG_PRINTLN("Reset command received");
-                ESP.restart();
-            }
-            else if (strcmp(command, "clear_fault") == 0) {
-                int channel = doc["channel"] | 0;
-                if (channel == 1 || channel == 2) {
-                    loadController.clearFault(channel);
-                } else {
-                    loadController.clearFault(1);
-                    loadController.clearFault(2);
-                }
+    if (deserializeJson(doc, payload, length)) {
+        mqtt.publishError(0, "INVALID_SHADOW", "Malformed desired state");
+        return;
+    }
+    commandRpc.open(doc.as<JsonVariantConst>(), "shadow_desired");
+    
+    RpcResult result = deviceShadow.applyDesired(doc.as<JsonVariantConst>());
+    if (result == RPC_INVALID) {
+        rejectCommand(0, "INVALID_SHADOW", "Desired state needs a version and valid channel fields");
+    } else if (result == RPC_REJECTED) {
+        commandRpc.reply(RPC_REJECTED, "SHADOW_PENDING", "Some fields stay pending (fault or disabled channel)");
+    }
+}
+
+void handleShadowGet(uint8_t, const char*, size_t) {
+    deviceShadow.publishDocument();
+}
+
+/**
+ * @brief .../control: {"command": ..., ...}
+ */
+void handleControl(uint8_t, const char* payload, size_t length) {
+    // Sized for a full schedule upload
+    StaticJsonDocument<MQTT_BUFFER_SIZE> doc;
+    if (deserializeJson(doc, payload, length) || !doc.containsKey("command")) return;
+    
+    const char* command = doc["command"];
+    commandRpc.open(doc.as<JsonVariantConst>(), command, doc["channel"] | 0);
+    
+    if (strcmp(command, "reset") == 0) {
+        DEBUG_PRINTLN("Reset command received");
+        ESP.restart();
+    }
+    else if (strcmp(command, "clear_fault") == 0) {
+        int channel = doc["channel"] | 0;
+        if (LoadController::isValidChannel(channel)) {
+            clearChannelFault(channel);
+        } else {
+            for (uint8_t ch = 1; ch <= NUM_CHANNELS; ch++) {
+                clearChannelFault(ch);
             }
-            else if (strcmp(command, "status") == 0) {
-                publishStatus();
+        }
+    }
+    else if (strcmp(command, "switch_multi") == 0) {
+        handleMultiSwitch(doc.as<JsonVariantConst>());
+    }
+    else if (strcmp(command, "fade") == 0) {
+        handleFade(doc.as<JsonVariantConst>(), false);
+    }
+    else if (strcmp(command, "ramp") == 0) {
+        handleFade(doc.as<JsonVariantConst>(), true);
+    }
+    else if (strcmp(command, "pwm_config") == 0) {
+        int channel = doc["channel"] | 0;
+        if (loadController.setPWMConfig(channel, doc["frequency"] | 0UL, doc["resolution"] | 0)) {
+            publishPWMConfig(channel);
+        } else {
+            rejectCommand(channel, "INVALID_PWM", "Frequency/resolution not supported");
+        }
+    }
+    else if (strcmp(command, "pwm_get") == 0) {
+        publishPWMConfig(doc["channel"] | 0);
+    }
+    else if (strcmp(command, "regulate") == 0) {
+        handleRegulate(doc.as<JsonVariantConst>());
+    }
+    else if (strcmp(command, "regulation_get") == 0) {
+        publishRegulation(doc["channel"] | 0);
+    }
+    else if (strcmp(command, "restore_policy") == 0) {
+        RestorePolicy policy;
+        if (parseRestorePolicy(doc["policy"], policy) &&
+            loadController.setRestorePolicy(policy, doc["defaults"] | loadController.getDefaultMask())) {
+            eventLog.append(EVENT_CONFIG, 0, CONFIG_ITEM_RESTORE_POLICY, policy);
+            publishHeartbeat();
+        } else {
+            rejectCommand(0, "INVALID_POLICY", "Restore policy rejected");
+        }
+    }
+    else if (strcmp(command, "power_budget") == 0) {
+        // Omitted fields keep their current value
+        PowerBudgetStatus current = safetyMonitor.getBudgetStatus();
+        float budget = doc["budget"] | current.budget;
+        safetyMonitor.setPowerBudget(budget, doc["hysteresis"] | current.hysteresis);
+        eventLog.append(EVENT_CONFIG, 0, CONFIG_ITEM_POWER_BUDGET, budget);
+        
+        for (JsonObjectConst ch : doc["channels"].as<JsonArrayConst>()) {
+            uint8_t channel = ch["channel"] | 0;
+            if (!LoadController::isValidChannel(channel)) continue;
+            uint8_t priority = ch["priority"] | current.priority[channel - 1];
+            uint16_t minPermille = ch["min_sim"] | current.minPermille[channel - 1];
+            if (safetyMonitor.setChannelBudget(channel, priority, minPermille)) {
+                eventLog.append(EVENT_CONFIG, channel, CONFIG_ITEM_POWER_BUDGET, priority);
             }
         }
+        publishHeartbeat();
+    }
+    else if (strcmp(command, "telemetry_format") == 0) {
+        TelemetryFormat format;
+        if (parseTelemetryFormat(doc["format"] | "", format) && mqtt.setTelemetryFormat(format)) {
+            eventLog.append(EVENT_CONFIG, 0, CONFIG_ITEM_TELEMETRY_FORMAT, format);
+            publishHeartbeat();
+        } else {
+            rejectCommand(0, "INVALID_FORMAT", "Telemetry format must be json, binary or both");
+        }
+    }
+    else if (strcmp(command, "telemetry_batch") == 0) {
+        // Omitted fields keep their current value
+        TelemetryBatchConfig config = telemetryBatcher.getConfig();
+        config.enabled = doc["enabled"] | config.enabled;
+        config.size = constrain(doc["size"] | (int)config.size, 0, 255);
+        config.sampleInterval = constrain(doc["interval"] | (int)config.sampleInterval, 0, 65535);
+        config.maxLatency = constrain(doc["max_latency"] | (int)config.maxLatency, 0, 65535);
+        if (telemetryBatcher.configure(config)) {
+            eventLog.append(EVENT_CONFIG, 0, CONFIG_ITEM_TELEMETRY_BATCH,
+                            config.enabled ? config.size : 0);
+            publishHeartbeat();
+        } else {
+            rejectCommand(0, "INVALID_BATCH", "Batch size, interval or max_latency out of range");
+        }
+    }
+    else if (strcmp(command, "log_read") == 0) {
+        uint32_t from = doc["from"] | eventLog.getOldestSeq();
+        uint8_t count = constrain((int)(doc["count"] | EVENT_LOG_PAGE_SIZE), 1, EVENT_LOG_PAGE_SIZE);
+        publishEventLogPage(from, count);
+    }
+    else if (strcmp(command, "schedule_set") == 0) {
+        int channel = doc["channel"] | 0;
+        if (scheduleManager.setRulesFromJson(channel, doc["rules"].as<JsonArrayConst>())) {
+            eventLog.append(EVENT_CONFIG, channel, CONFIG_ITEM_SCHEDULE,
+                            scheduleManager.getRuleCount(channel));
+            publishSchedule(channel);
+        } else {
+            rejectCommand(channel, "INVALID_SCHEDULE", "Schedule rejected");
+        }
+    }
+    else if (strcmp(command, "schedule_clear") == 0) {
+        int channel = doc["channel"] | 0;
+        if (scheduleManager.setRules(channel, nullptr, 0)) {
+            eventLog.append(EVENT_CONFIG, channel, CONFIG_ITEM_SCHEDULE, 0);
+            publishSchedule(channel);
+        } else {
+            commandRpc.reply(RPC_INVALID, "INVALID_SCHEDULE", "Invalid channel");
+        }
+    }
+    else if (strcmp(command, "schedule_get") == 0) {
+        publishSchedule(doc["channel"] | 0);
+    }
+    else if (strcmp(command, "status") == 0) {
+        publishStatus(true);
+    }
+    else {
+        commandRpc.reply(RPC_UNKNOWN, "UNKNOWN_COMMAND", command);
     }
 }
 
+/**
+ * @brief Parse a multi-channel switch payload
+ *
+ * Accepts either a bitmask pair or a list of channel states:
+ *   {"mask": 3, "states": 1}
+ *   {"channels": [{"channel": 1, "state": "ON"}, {"channel": 2, "state": false}]}
+ *
+ * @param doc Parsed payload
+ * @param mask Receives the channels to change (bit N-1 = channel N)
+ * @param states Receives the requested states (bit set = ON)
+ * @return true if the payload is well-formed
+ */
+bool parseSwitchStates(JsonVariantConst doc, uint16_t& mask, uint16_t& states) {
+    mask = 0;
+    states = 0;
+    
+    if (doc.containsKey("mask")) {
+        mask = doc["mask"] | 0;
+        states = doc["states"] | 0;
+        return mask != 0 && (mask & ~LoadController::allChannelsMask()) == 0;
+    }
+    
+    for (JsonObjectConst entry : doc["channels"].as<JsonArrayConst>()) {
+        uint8_t channel = entry["channel"] | 0;
+        if (!LoadController::isValidChannel(channel)) return false;
+        
+        JsonVariantConst state = entry["state"];
+        bool on;
+        if (state.is<bool>()) {
+            on = state.as<bool>();
+        } else if (state.is<const char*>()) {
+            on = strcmp(state.as<const char*>(), "ON") == 0;
+        } else {
+            return false;
+        }
+        
+        mask |= (1U << (channel - 1));
+        if (on) states |= (1U << (channel - 1));
+    }
+    return mask != 0;
+}
+
+void handleMultiSwitch(JsonVariantConst doc) {
+    uint16_t mask, states, rejected = 0;
+    
+    if (!parseSwitchStates(doc, mask, states)) {
+        rejectCommand(0, "INVALID_SWITCH_SET", "Malformed multi-channel switch payload");
+        return;
+    }
+    
+    if (!loadController.setSwitches(mask, states, &rejected)) {
+        char reason[64];
+        snprintf(reason, sizeof(reason), "Disabled or faulted channels: 0x%04X", rejected);
+        rejectCommand(0, "SWITCH_REJECTED", reason, RPC_REJECTED, rejected);
+        return;
+    }
+    
+    // One consolidated update for the whole group
+    publishStatus();
+}
+
+/**
+ * @brief Start a simulator fade from a control command
+ *
+ *   fade: {"channel": 1, "value": 30, "duration": 2000, "curve": "ease_in_out"}
+ *   ramp: {"channel": 1, "value": 30, "rate": 10, "curve": "linear"}  (rate in %/s)
+ *
+ * @param doc Parsed payload
+ * @param ramp true if the speed is given as a rate instead of a duration
+ */
+void handleFade(JsonVariantConst doc, bool ramp) {
+    uint8_t channel = doc["channel"] | 0;
+    int value = constrain((int)(doc["value"] | -1), -1, 100);
+    FadeCurve curve;
+    
+    if (!LoadController::isValidChannel(channel) || value < 0 ||
+        !parseFadeCurve(doc["curve"], curve)) {
+        rejectCommand(channel, "INVALID_FADE", "Fade rejected");
+        return;
+    }
+    
+    commandCoalescer.cancel(channel);
+    regulator.stop(channel);
+    
+    uint32_t duration;
+    if (ramp) {
+        float rate = doc["rate"] | 0.0f;
+        if (rate <= 0) {
+            rejectCommand(channel, "INVALID_FADE", "Ramp rate must be positive");
+            return;
+        }
+        int delta = abs(value - loadController.getSimulatorValue(channel));
+        duration = (uint32_t)(delta * 1000.0f / rate);
+    } else {
+        duration = doc["duration"] | 0UL;
+    }
+    
+    if (!loadController.fadeSimulator(channel, value, duration, curve)) {
+        rejectCommand(channel, "INVALID_FADE", "Fade rejected");
+    }
+}
+
+void publishPWMConfig(uint8_t channel) {
+    ChannelState state;
+    if (!loadController.getChannelState(channel, state)) return;
+    
+    mqtt.publishPWMConfig(channel, state.pwmFrequency, state.pwmResolution,
+                          state.simDuty, state.simPermille);
+}
+
+/**
+ * @brief Start, retune or stop closed-loop regulation from a control command
+ *
+ *   {"channel": 1, "mode": "current", "setpoint": 1.2}
+ *   {"channel": 1, "mode": "power", "setpoint": 10, "kp": 0.02, "ki": 0.2, "kd": 0, "slew": 2}
+ *   {"channel": 1, "mode": "off"}
+ *
+ * Gains left out keep their current value (defaults when the mode changes).
+ *
+ * @param doc Parsed payload
+ */
+void handleRegulate(JsonVariantConst doc) {
+    uint8_t channel = doc["channel"] | 0;
+    RegulationMode mode;
+    
+    if (!LoadController::isValidChannel(channel) || !parseRegulationMode(doc["mode"] | "", mode)) {
+        rejectCommand(channel, "INVALID_REGULATION", "Regulation rejected");
+        return;
+    }
+    
+    RegulatorStatus status;
+    regulator.getStatus(channel, status);
+    RegulatorGains gains = (status.mode == mode) ? status.gains : Regulator::defaultGains(mode);
+    gains.kp = doc["kp"] | gains.kp;
+    gains.ki = doc["ki"] | gains.ki;
+    gains.kd = doc["kd"] | gains.kd;
+    gains.maxSlew = doc["slew"] | gains.maxSlew;
+    
+    commandCoalescer.cancel(channel);
+    if (!regulator.start(channel, mode, doc["setpoint"] | -1.0f, &gains)) {
+        rejectCommand(channel, "INVALID_REGULATION", "Setpoint or gains out of range");
+        return;
+    }
+    publishRegulation(channel);
+}
+
+void publishRegulation(uint8_t channel) {
+    RegulatorStatus status;
+    if (!mqtt.isConnected() || !regulator.getStatus(channel, status)) return;
+    
+    StaticJsonDocument<JSON_OBJECT_SIZE(14) + JSON_OBJECT_SIZE(4)> doc;
+    doc["channel"] = channel;
+    doc["mode"] = regulationModeName(status.mode);
+    if (status.mode != REGULATION_OFF) {
+        doc["active"] = status.active;
+        doc["setpoint"] = status.setpoint;
+        doc["measured"] = JsonWriter::fixed(status.measured, 4);
+        doc["error"] = JsonWriter::fixed(status.error, 4);
+        doc["error_rms"] = JsonWriter::fixed(status.errorRms, 4);
+        doc["overshoot"] = JsonWriter::fixed(status.overshoot, 4);
+        doc["output"] = status.output;
+        doc["settled"] = status.settled;
+        doc["settling_ms"] = status.settlingMs;
+        doc["samples"] = status.samples;
+        JsonObject gains = doc.createNestedObject("gains");
+        gains["kp"] = status.gains.kp;
+        gains["ki"] = status.gains.ki;
+        gains["kd"] = status.gains.kd;
+        gains["slew"] = status.gains.maxSlew;
+    }
+    
+    mqtt.publishJson(channelTopic(channel, CH_TOPIC_REGULATION), doc);
+}
+
 // ============================================================================
 // SENSOR READING
 // ============================================================================
 
 void readSensors() {
-    // Read Channel 1
-    if (sensorData[0].valid) {
-        ina226_ch1.readAll(&sensorData[0].voltage, 
-                          &sensorData[0].current, 
-                          &sensorData[0].power);
-        sensorData[0].lastReadTime = millis();
-    }
-    
-    // Read Channel 2
-    if (sensorData[1].valid) {
-        ina226_ch2.readAll(&sensorData[1].voltage, 
-                          &sensorData[1].current, 
-                          &sensorData[1].power);
-        sensorData[1].lastReadTime = millis();
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        safetyMonitor.getSensorData(ch + 1, sensorData[ch]);
     }
 }
 
 // ============================================================================
-// SAFETY LIMITS CHECK
+// SAFETY EVENTS
 // ============================================================================
 
-void checkSafetyLimits() {
-    unsigned long currentTime = millis();
+void publishSafetyEvents() {
+    SafetyEvent event;
     
-    for (int ch = 0; ch < 2; ch++) {
-        uint8_t channel = ch + 1;
+    while (safetyMonitor.pollEvent(event)) {
+        char reason[64];
         
-        if (!sensorData[ch].valid) continue;
-        if (!loadController.getSwitchState(channel)) continue;  // Only check if switch is ON
-        
-        // Check overcurrent
-        if (sensorData[ch].current > OVERCURRENT_THRESHOLD) {
-            if (!overcurrentDetected[ch]) {
-                overcurrentDetected[ch] = true;
-                overcurrentStartTime[ch] = currentTime;
-            } else if (currentTime - overcurrentStartTime[ch] > OVERCURRENT_DURATION) {
-                // Overcurrent persisted - trigger emergency shutdown
-                char reason[64];
-                snprintf(reason, sizeof(reason), "Overcurrent: %.2fA", sensorData[ch].current);
-                loadController.emergencyShutdown(channel, reason);
-                
-                // Publish error
-                mqtt.publishError(channel, "OVERCURRENT", reason, sensorData[ch].current);
-                
-                DEBUG_PRINTF("⚠️ OVERCURRENT on Channel %d: %.2fA\n", channel, sensorData[ch].current);
+        switch (event.type) {
+            case SAFETY_EVENT_OVERCURRENT:
+                eventLog.append(EVENT_TRIP, event.channel, FAULT_OVERCURRENT, event.value);
+                snprintf(reason, sizeof(reason), "Overcurrent: %.2fA", event.value);
+                mqtt.publishError(event.channel, "OVERCURRENT", reason, event.value);
+                DEBUG_PRINTF("⚠️ OVERCURRENT on Channel %d: %.2fA\n", event.channel, event.value);
+                break;
+            case SAFETY_EVENT_OVERVOLTAGE:
+                eventLog.append(EVENT_TRIP, event.channel, FAULT_OVERVOLTAGE, event.value);
+                snprintf(reason, sizeof(reason), "Overvoltage: %.2fV", event.value);
+                mqtt.publishError(event.channel, "OVERVOLTAGE", reason, event.value);
+                DEBUG_PRINTF("⚠️ OVERVOLTAGE on Channel %d: %.2fV\n", event.channel, event.value);
+                break;
+            case SAFETY_EVENT_UNDERVOLTAGE:
+                eventLog.append(EVENT_WARNING, event.channel, FAULT_UNDERVOLTAGE, event.value);
+                snprintf(reason, sizeof(reason), "Undervoltage: %.2fV", event.value);
+                mqtt.publishError(event.channel, "UNDERVOLTAGE", reason, event.value);
+                DEBUG_PRINTF("⚠️ UNDERVOLTAGE on Channel %d: %.2fV\n", event.channel, event.value);
+                break;
+            case SAFETY_EVENT_SHED_DIM:
+            case SAFETY_EVENT_SHED_OFF:
+            case SAFETY_EVENT_SHED_RESTORE: {
+                static const char* const actions[] = { "dim", "off", "restore" };
+                const char* action = actions[event.type - SAFETY_EVENT_SHED_DIM];
+                eventLog.append(EVENT_SHED, event.channel, event.type, event.value);
+                mqtt.publishPowerEvent(event.channel, action, event.level, event.value,
+                                       safetyMonitor.getBudgetStatus().budget);
+                DEBUG_PRINTF("Load shedding: Channel %d %s (total %.1fW)\n",
+                             event.channel, action, event.value);
+                break;
             }
-        } else {
-            overcurrentDetected[ch] = false;
-        }
-        
-        // Check overvoltage
-        if (sensorData[ch].voltage > OVERVOLTAGE_THRESHOLD) {
-            char reason[64];
-            snprintf(reason, sizeof(reason), "Overvoltage: %.2fV", sensorData[ch].voltage);
-            loadController.emergencyShutdown(channel, reason);
-            mqtt.publishError(channel, "OVERVOLTAGE", reason, sensorData[ch].voltage);
-            
-            DEBUG_PRINTF("⚠️ OVERVOLTAGE on Channel %d: %.2fV\n", channel, sensorData[ch].voltage);
         }
-        
-        // Check undervoltage (warning only)
-        if (sensorData[ch].voltage > 0 && sensorData[ch].voltage < UNDERVOLTAGE_THRESHOLD) {
-            static unsigned long lastUnderVoltageWarning[2] = {0, 0};
-            if (currentTime - lastUnderVoltageWarning[ch] > 5000) {  // Warn every 5 seconds
-                lastUnderVoltageWarning[ch] = currentTime;
-                char reason[64];
-                snprintf(reason, sizeof(reason), "Undervoltage: %.2fV", sensorData[ch].voltage);
-                mqtt.publishError(channel, "UNDERVOLTAGE", reason, sensorData[ch].voltage);
-                
-                DEBUG_PRINTF("⚠️ UNDERVOLTAGE on Channel %d: %.2fV\n", channel, sensorData[ch].voltage);
+    }
+}
+
+// ============================================================================
+// FAULT HANDLING & EVENT LOG
+// ============================================================================
+
+void clearChannelFault(uint8_t channel) {
+    FaultCode code = loadController.getFaultCode(channel);
+    loadController.clearFault(channel);
+    
+    if (code != FAULT_NONE) {
+        eventLog.append(EVENT_FAULT_CLEAR, channel, code);
+    }
+}
+
+// Widest page: longest device ID, "FAULT_CLEAR" / "Manual shutdown", every
+// number at its widest and time_us present in each record
+static constexpr size_t kEventPageJsonMax = 88 + DEVICE_ID_MAX_LENGTH;  // Without records
+static constexpr size_t kEventRecordJsonMax = 157;                      // One record and its comma
+static_assert(kEventPageJsonMax + EVENT_LOG_PAGE_SIZE * kEventRecordJsonMax < MQTT_BUFFER_SIZE,
+              "A full event log page must fit the MQTT transmit buffer");
+
+void publishEventLogPage(uint32_t from, uint8_t count) {
+    if (!mqtt.isConnected()) return;
+    
+    StaticJsonDocument<JSON_OBJECT_SIZE(6) + JSON_ARRAY_SIZE(EVENT_LOG_PAGE_SIZE) +
+                       EVENT_LOG_PAGE_SIZE * JSON_OBJECT_SIZE(8)> doc;
+    
+    uint32_t oldest = eventLog.getOldestSeq();
+    uint32_t latest = eventLog.getNextSeq();
+    if (from < oldest) from = oldest;
+    
+    doc["device_id"] = deviceIdentity.id();
+    doc["oldest"] = oldest;
+    doc["next_seq"] = latest;
+    JsonArray events = doc.createNestedArray("events");
+    
+    uint32_t seq = from;
+    while (seq < latest && events.size() < count) {
+        EventRecord record;
+        if (eventLog.read(seq, record)) {
+            JsonObject e = events.createNestedObject();
+            e["seq"] = record.seq;
+            e["type"] = eventTypeName(record.type);
+            e["channel"] = record.channel;
+            if (record.type == EVENT_TRIP || record.type == EVENT_WARNING ||
+                record.type == EVENT_FAULT_CLEAR) {
+                e["code"] = faultCodeMessage((FaultCode)record.code);
+            } else {
+                e["code"] = record.code;
             }
+            e["value"] = record.value;
+            e["timestamp"] = record.timestamp;
+            
+            // Unix time only for this boot's records: their millis() share
+            // the current time base
+            uint64_t timeUs = (record.seq >= bootEventSeq) ? timeBase.fromMillis(record.timestamp) : 0;
+            if (timeUs != 0) e["time_us"] = timeUs;
         }
+        seq++;
     }
+    
+    // Where the backend should continue paging from
+    doc["next"] = seq;
+    
+    mqtt.publishJson(TOPIC_EVENTS, doc);
+}
+
+void publishSchedule(uint8_t channel) {
+    if (!mqtt.isConnected() || !LoadController::isValidChannel(channel)) return;
+    
+    StaticJsonDocument<JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(SCHEDULE_MAX_RULES) +
+                       SCHEDULE_MAX_RULES * (JSON_OBJECT_SIZE(6) + JSON_ARRAY_SIZE(7) + 8)> doc;
+    
+    doc["channel"] = channel;
+    scheduleManager.rulesToJson(channel, doc.createNestedArray("rules"));
+    doc["next_event"] = (uint32_t)scheduleManager.getNextEventTime();
+    doc["time"] = (uint32_t)time(nullptr);
+    
+    mqtt.publishJson(TOPIC_SCHEDULE, doc);
 }
 
 // ============================================================================
@@ -391,32 +894,300 @@ void checkSafetyLimits() {
 // ============================================================================
 
 void publishTelemetry() {
+    if (!mqtt.isConnected()) {
+        storeTelemetry();
+        return;
+    }
+    
+    TelemetryFormat format = mqtt.getTelemetryFormat();
+    
+    // Stamp with the sensor conversions: per channel, and the newest one
+    // for the combined messages
+    uint64_t timeUs[NUM_CHANNELS];
+    uint64_t newestUs = 0;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        timeUs[i] = timeBase.toEpochUs(sensorData[i].readTimeUs);
+        if (timeUs[i] > newestUs) newestUs = timeUs[i];
+    }
+    
+    if (format & TELEMETRY_FORMAT_JSON) {
+        float voltage[NUM_CHANNELS], current[NUM_CHANNELS], power[NUM_CHANNELS];
+        for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+            voltage[i] = sensorData[i].voltage;
+            current[i] = sensorData[i].current;
+            power[i] = sensorData[i].power;
+        }
+        
+        // Publish combined telemetry
+        mqtt.publishAllTelemetry(voltage, current, power, NUM_CHANNELS, newestUs);
+        
+        // Also publish individual channel telemetry
+        for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+            mqtt.publishTelemetry(i + 1, voltage[i], current[i], power[i], timeUs[i]);
+        }
+    }
+    
+    if (format & TELEMETRY_FORMAT_BINARY) {
+        // Raw registers; all sensors share one calibration
+        INA226Raw raw[NUM_CHANNELS];
+        bool valid[NUM_CHANNELS];
+        float currentLSB = 0;
+        for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+            raw[i] = sensorData[i].raw;
+            valid[i] = sensorData[i].valid;
+            currentLSB = max(currentLSB, ina226[i].getCurrentLSB());
+        }
+        
+        mqtt.publishAllTelemetryBinary(raw, valid, NUM_CHANNELS, currentLSB, newestUs);
+        for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+            mqtt.publishTelemetryBinary(i + 1, raw[i], valid[i], currentLSB, timeUs[i]);
+        }
+    }
+    
+    // Tracking of regulated channels, at the telemetry rate
+    for (uint8_t ch = 1; ch <= NUM_CHANNELS; ch++) {
+        if (regulator.getMode(ch) != REGULATION_OFF) publishRegulation(ch);
+    }
+}
+
+void storeTelemetry() {
+    StoredSample sample;
+    memset(&sample, 0, sizeof(sample));
+    
+    // Time of the newest conversion; epoch stays 0 until SNTP has synced
+    int64_t readTimeUs = esp_timer_get_time();
+    bool anyValid = false;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if (sensorData[i].valid && (!anyValid || sensorData[i].readTimeUs > readTimeUs)) {
+            readTimeUs = sensorData[i].readTimeUs;
+            anyValid = true;
+        }
+    }
+    uint64_t timeUs = timeBase.toEpochUs(readTimeUs);
+    sample.epoch = (uint32_t)(timeUs / 1000000);
+    sample.epochUs = (uint32_t)(timeUs % 1000000);
+    sample.uptime = (uint32_t)(readTimeUs / 1000);
+    
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        const SensorData& data = sensorData[i];
+        sample.channels[i].busVoltage = data.valid ? data.raw.busVoltage : TELEMETRY_BUS_INVALID;
+        sample.channels[i].current = data.valid ? data.raw.current : 0;
+        sample.channels[i].power = data.valid ? data.raw.power : 0;
+        sample.currentLSB = max(sample.currentLSB, ina226[i].getCurrentLSB());
+    }
+    
+    telemetryStore.add(sample);
+}
+
+void replayTelemetry() {
     if (!mqtt.isConnected()) return;
     
-    // Publish combined telemetry
-    mqtt.publishAllTelemetry(
-        sensorData[0].voltage, sensorData[0].current, sensorData[0].power,
-        sensorData[1].voltage, sensorData[1].current, sensorData[1].power
-    );
+    uint32_t pending = telemetryStore.getPending();
+    if (pending == 0) return;
+    
+    // Live traffic first: replay only while no telemetry is waiting to be sent
+    if (mqtt.getPublishStats(PUBLISH_TELEMETRY).depth > 0) return;
     
-    // Also publish individual channel telemetry
-    mqtt.publishTelemetry(1, sensorData[0].voltage, sensorData[0].current, sensorData[0].power);
-    mqtt.publishTelemetry(2, sensorData[1].voltage, sensorData[1].current, sensorData[1].power);
+    StoredSample samples[STORE_REPLAY_BATCH];
+    uint8_t count = telemetryStore.peek(samples, STORE_REPLAY_BATCH);
+    if (count == 0) return;
+    
+    uint8_t sent = mqtt.publishTelemetryReplay(samples, count, pending - count);
+    if (sent > 0) telemetryStore.consume(sent);
 }
 
-void publishStatus() {
+void sampleTelemetryBatch() {
+    float voltage[NUM_CHANNELS], current[NUM_CHANNELS], power[NUM_CHANNELS];
+    bool valid[NUM_CHANNELS];
+    uint32_t timestamp = 0;
+    bool anyValid = false;
+    
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        voltage[i] = sensorData[i].voltage;
+        current[i] = sensorData[i].current;
+        power[i] = sensorData[i].power;
+        valid[i] = sensorData[i].valid;
+        
+        // Stamp with the newest conversion, not with loop() time
+        if (valid[i] && (!anyValid || (int32_t)(sensorData[i].lastReadTime - timestamp) > 0)) {
+            timestamp = sensorData[i].lastReadTime;
+            anyValid = true;
+        }
+    }
+    if (!anyValid) timestamp = millis();
+    
+    telemetryBatcher.addSample(timestamp, voltage, current, power, valid);
+}
+
+void publishStatus(bool full) {
     if (!mqtt.isConnected()) return;
     
-    // Publish channel status
-    mqtt.publishChannelStatus(1, loadController.getSwitchState(1), loadController.getSimulatorValue(1));
-    mqtt.publishChannelStatus(2, loadController.getSwitchState(2), loadController.getSimulatorValue(2));
+    uint16_t changed = loadController.getChangedMask();
+    if (changed == 0 && !full) return;
+    uint16_t fading = 0;
+    bool switchState[NUM_CHANNELS];
+    uint8_t simValue[NUM_CHANNELS];
+    
+    for (uint8_t ch = 1; ch <= NUM_CHANNELS; ch++) {
+        ChannelState state;
+        loadController.getChannelState(ch, state);
+        loadController.clearStateChanged(ch);
+        switchState[ch - 1] = state.mainSwitch;
+        simValue[ch - 1] = state.simValue;
+        if (state.fading) fading |= (1U << (ch - 1));
+    }
+    
+    // All channels in one message, so a group switch shows up as one update
+    mqtt.publishAllStatus(switchState, simValue, NUM_CHANNELS, changed, fading);
+    
+    // Per-channel retained status: only channels that changed, all of them
+    // for a new session or on request
+    for (uint8_t ch = 1; ch <= NUM_CHANNELS; ch++) {
+        if (full || (changed & (1U << (ch - 1)))) {
+            mqtt.publishChannelStatus(ch, switchState[ch - 1], simValue[ch - 1],
+                                      fading & (1U << (ch - 1)));
+        }
+    }
+    
+    // The same changes as one versioned shadow delta
+    deviceShadow.update();
 }
 
 void publishHeartbeat() {
     if (!mqtt.isConnected()) return;
     
     unsigned long uptime = (millis() - startTime) / 1000;
-    mqtt.publishHeartbeat(uptime, ESP.getFreeHeap());
+    
+    // One section per topic so each fits the transmit buffer (MQTT_BUFFER_SIZE).
+    // Filled in place, the largest section (commands) is ~35 members (16 B
+    // each) plus the common fields MQTTManager adds. Static: it is also sent
+    // from command handlers, deep in the loop task's stack
+    static StaticJsonDocument<1024> doc;
+    
+    // Core: configuration, storage, protection and time
+    doc.clear();
+    doc["telemetry_format"] = telemetryFormatName(mqtt.getTelemetryFormat());
+    
+    TelemetryBatchConfig batchConfig = telemetryBatcher.getConfig();
+    JsonObject batch = doc.createNestedObject("batch");
+    batch["enabled"] = batchConfig.enabled;
+    batch["size"] = batchConfig.size;
+    batch["interval"] = batchConfig.sampleInterval;
+    batch["max_latency"] = batchConfig.maxLatency;
+    
+    JsonObject restore = doc.createNestedObject("restore");
+    restore["policy"] = restorePolicyName(loadController.getRestorePolicy());
+    restore["defaults"] = loadController.getDefaultMask();
+    restore["source"] = loadController.getRestoreSource();
+    
+    PowerBudgetStatus budget = safetyMonitor.getBudgetStatus();
+    JsonObject power = doc.createNestedObject("power");
+    power["budget"] = budget.budget;
+    power["total"] = JsonWriter::fixed(budget.totalPower, 2);
+    power["shed"] = budget.shedMask;
+    
+    TelemetryStoreStatus storeStatus = telemetryStore.getStatus();
+    JsonObject store = doc.createNestedObject("store");
+    store["pending"] = storeStatus.ramPending + storeStatus.flashPending;
+    store["ram"] = storeStatus.ramPending;
+    store["flash"] = storeStatus.flashPending;
+    store["replayed"] = storeStatus.replayed;
+    store["dropped"] = storeStatus.dropped;
+    
+    SafetyStats stats = safetyMonitor.getStats();
+    JsonObject safety = doc.createNestedObject("safety");
+    safety["cycles"] = stats.cycles;
+    safety["missed_deadlines"] = stats.missedDeadlines;
+    safety["max_latency_us"] = stats.maxLatencyUs;
+    safety["max_exec_us"] = stats.maxExecUs;
+    safety["dropped_events"] = stats.droppedEvents;
+    
+    TimeSyncStats sync = timeBase.getStats();
+    JsonObject time = doc.createNestedObject("time");
+    time["sync"] = timeSyncStateName(sync.state);
+    time["syncs"] = sync.syncs;
+    time["steps"] = sync.steps;
+    time["offset_us"] = sync.lastOffsetUs;
+    time["drift_ppb"] = sync.driftPpb;
+    time["since_sync"] = sync.sinceSync;
+    
+    mqtt.publishHeartbeat(TOPIC_HEARTBEAT, uptime, ESP.getFreeHeap(), doc);
+    
+    // Broker connection
+    doc.clear();
+    MqttClientStats client = mqtt.getClientStats();
+    JsonObject link = doc.createNestedObject("mqtt");
+    link["attempts"] = client.attempts;
+    link["connects"] = client.connects;
+    link["dns_cache_hits"] = client.dnsCacheHits;
+    link["last_error"] = client.lastError;
+    link["tx_queued"] = client.txQueued;
+    link["inflight"] = client.inFlight;
+    link["resent"] = client.resent;
+    link["expired"] = client.expired;
+    link["rtt_ms"] = client.rttAverage;
+    link["rtt_max_ms"] = client.rttMax;
+    link["protocol"] = client.protocol;
+    link["aliases"] = client.aliases;
+    link["published"] = client.published;
+    if (client.published > 0) {
+        link["msg_bytes"] = client.publishBytes / client.published;
+        link["msg_bytes_v311"] = client.publishBytesV311 / client.published;
+    }
+    
+#if MQTT_USE_TLS
+    TlsStats tlsStats = mqtt.getTlsStats();
+    JsonObject tls = doc.createNestedObject("tls");
+    tls["full"] = tlsStats.full.count;
+    tls["full_ms"] = tlsStats.full.averageMs;
+    tls["full_heap"] = tlsStats.full.maxHeap;
+    tls["resumed"] = tlsStats.resumed.count;
+    tls["resumed_ms"] = tlsStats.resumed.averageMs;
+    tls["resumed_heap"] = tlsStats.resumed.maxHeap;
+    tls["failures"] = tlsStats.failures;
+    tls["last_error"] = tlsStats.lastError;
+    tls["session"] = tlsStats.sessionCached;
+#endif
+    mqtt.publishHeartbeat(TOPIC_HEARTBEAT_LINK, uptime, ESP.getFreeHeap(), doc);
+    
+    // Command paths and the publish queue
+    doc.clear();
+    CoalescerStats commandStats = commandCoalescer.getStats();
+    JsonObject commands = doc.createNestedObject("commands");
+    commands["received"] = commandStats.received;
+    commands["applied"] = commandStats.applied;
+    commands["coalesced"] = commandStats.coalesced;
+    
+    RpcStats rpcStats = commandRpc.getStats();
+    JsonObject rpc = doc.createNestedObject("rpc");
+    rpc["requests"] = rpcStats.requests;
+    rpc["rejected"] = rpcStats.results[RPC_REJECTED];
+    rpc["invalid"] = rpcStats.results[RPC_INVALID] + rpcStats.results[RPC_UNKNOWN];
+    rpc["bad_ids"] = rpcStats.badIds;
+    rpc["failed"] = rpcStats.failed;
+    rpc["latency_us"] = rpcStats.averageUs;
+    rpc["latency_max_us"] = rpcStats.maxUs;
+    
+    ShadowStats shadowStats = deviceShadow.getStats();
+    JsonObject shadow = doc.createNestedObject("shadow");
+    shadow["version"] = shadowStats.version;
+    shadow["desired_version"] = shadowStats.desiredVersion;
+    shadow["pending"] = shadowStats.pendingMask;
+    shadow["deltas"] = shadowStats.deltas;
+    shadow["documents"] = shadowStats.documents;
+    
+    JsonObject queue = doc.createNestedObject("publish");
+    queue["tokens"] = mqtt.getPublishTokens();
+    for (uint8_t p = 0; p < PUBLISH_PRIORITY_COUNT; p++) {
+        PublishClassStats classStats = mqtt.getPublishStats((PublishPriority)p);
+        JsonObject cls = queue.createNestedObject(publishPriorityName((PublishPriority)p));
+        cls["depth"] = classStats.depth;
+        cls["sent"] = classStats.sent;
+        cls["superseded"] = classStats.superseded;
+        cls["dropped"] = classStats.droppedFull + classStats.droppedStale + classStats.failed;
+    }
+    
+    mqtt.publishHeartbeat(TOPIC_HEARTBEAT_COMMANDS, uptime, ESP.getFreeHeap(), doc);
 }
 
 // ============================================================================
@@ -424,9 +1195,27 @@ void publishHeartbeat() {
 // ============================================================================
 
 void handleSerialCommands() {
-    if (!Serial.available()) return;
+    // Accumulate characters without blocking; only a complete line is parsed
+    static char lineBuffer[64];
+    static size_t lineLength = 0;
+    
+    bool lineComplete = false;
+    while (Serial.available()) {
+        char c = Serial.read();
+        if (c == '\n') {
+            lineComplete = true;
+            break;
+        }
+        if (lineLength < sizeof(lineBuffer) - 1) {
+            lineBuffer[lineLength++] = c;
+        }
+    }
+    if (!lineComplete) return;
+    
+    lineBuffer[lineLength] = '\0';
+    lineLength = 0;
     
-    String command = Serial.readStringUntil('\n');
+    String command = lineBuffer;
     command.trim();
     
     if (command == "status") {
@@ -434,71 +1223,325 @@ void handleSerialCommands() {
         DEBUG_PRINTF("WiFi: %s\n", WiFi.isConnected() ? "Connected" : "Disconnected");
         DEBUG_PRINTF("IP: %s\n", WiFi.localIP().toString().c_str());
         DEBUG_PRINTF("MQTT: %s\n", mqtt.isConnected() ? "Connected" : "Disconnected");
+        CoalescerStats commandStats = commandCoalescer.getStats();
+        DEBUG_PRINTF("Sim commands: %u received, %u applied, %u coalesced\n",
+                     commandStats.received, commandStats.applied, commandStats.coalesced);
+        RpcStats rpcStats = commandRpc.getStats();
+        DEBUG_PRINTF("Responses: %u (%u ok, %u accepted, %u rejected, %u invalid), latency %u/%u us avg/max\n",
+                     rpcStats.requests, rpcStats.results[RPC_OK], rpcStats.results[RPC_ACCEPTED],
+                     rpcStats.results[RPC_REJECTED], rpcStats.results[RPC_INVALID] + rpcStats.results[RPC_UNKNOWN],
+                     rpcStats.averageUs, rpcStats.maxUs);
+        ShadowStats shadowStats = deviceShadow.getStats();
+        DEBUG_PRINTF("Shadow: version %u, desired %u (pending 0x%04X), %u deltas, %u documents\n",
+                     shadowStats.version, shadowStats.desiredVersion, shadowStats.pendingMask,
+                     shadowStats.deltas, shadowStats.documents);
         DEBUG_PRINTF("Free Heap: %d bytes\n", ESP.getFreeHeap());
         DEBUG_PRINTF("Uptime: %lu seconds\n", (millis() - startTime) / 1000);
         
-        DEBUG_PRINTLN("\n--- Channel 1 ---");
-        DEBUG_PRINTF("Sensor: %s\n", sensorData[0].valid ? "OK" : "Not Found");
-        DEBUG_PRINTF("Voltage: %.3f V\n", sensorData[0].voltage);
-        DEBUG_PRINTF("Current: %.4f A\n", sensorData[0].current);
-        DEBUG_PRINTF("Power: %.3f W\n", sensorData[0].power);
-        DEBUG_PRINTF("Switch: %s\n", loadController.getSwitchState(1) ? "ON" : "OFF");
-        DEBUG_PRINTF("Simulator: %d%%\n", loadController.getSimulatorValue(1));
-        DEBUG_PRINTF("Fault: %s\n", loadController.hasFault(1) ? loadController.getFaultReason(1).c_str() : "None");
-        
-        DEBUG_PRINTLN("\n--- Channel 2 ---");
-        DEBUG_PRINTF("Sensor: %s\n", sensorData[1].valid ? "OK" : "Not Found");
-        DEBUG_PRINTF("Voltage: %.3f V\n", sensorData[1].voltage);
-        DEBUG_PRINTF("Current: %.4f A\n", sensorData[1].current);
-        DEBUG_PRINTF("Power: %.3f W\n", sensorData[1].power);
-        DEBUG_PRINTF("Switch: %s\n", loadController.getSwitchState(2) ? "ON" : "OFF");
-        DEBUG_PRINTF("Simulator: %d%%\n", loadController.getSimulatorValue(2));
-        DEBUG_PRINTF("Fault: %s\n", loadController.hasFault(2) ? loadController.getFaultReason(2).c_str() : "None");
-    }
-    else if (command == "on1") {
-        loadController.setSwitch(1, true);
-        DEBUG_PRINTLN("Channel 1 ON");
-    }
-    else if (command == "off1") {
-        loadController.setSwitch(1, false);
-        DEBUG_PRINTLN("Channel 1 OFF");
-    }
-    else if (command == "on2") {
-        loadController.setSwitch(2, true);
-        DEBUG_PRINTLN("Channel 2 ON");
-    }
-    else if (command == "off2") {
-        loadController.setSwitch(2, false);
-        DEBUG_PRINTLN("Channel 2 OFF");
-    }
-    else if (command.startsWith("sim1 ")) {
-        int value = command.substring(5).toInt();
-        loadController.setSimulator(1, value);
-        DEBUG_PRINTF("Channel 1 Simulator: %d%%\n", value);
-    }
-    else if (command.startsWith("sim2 ")) {
-        int value = command.substring(5).toInt();
-        loadController.setSimulator(2, value);
-        DEBUG_PRINTF("Channel 2 Simulator: %d%%\n", value);
-    }
-    else if (command == "clear1") {
-        loadController.clearFault(1);
-        DEBUG_PRINTLN("Channel 1 fault cleared");
-    }
-    else if (command == "clear2") {
-        loadController.clearFault(2);
-        DEBUG_PRINTLN("Channel 2 fault cleared");
+        for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+            uint8_t ch = i + 1;
+            char fault[48];
+            loadController.formatFaultReason(ch, fault, sizeof(fault));
+            
+            DEBUG_PRINTF("\n--- Channel %d ---\n", ch);
+            DEBUG_PRINTF("Sensor: %s\n", sensorData[i].valid ? "OK" : "Not Found");
+            DEBUG_PRINTF("Voltage: %.3f V\n", sensorData[i].voltage);
+            DEBUG_PRINTF("Current: %.4f A\n", sensorData[i].current);
+            DEBUG_PRINTF("Power: %.3f W\n", sensorData[i].power);
+            DEBUG_PRINTF("Switch: %s\n", loadController.getSwitchState(ch) ? "ON" : "OFF");
+            DEBUG_PRINTF("Simulator: %d%%\n", loadController.getSimulatorValue(ch));
+            ChannelState state;
+            loadController.getChannelState(ch, state);
+            DEBUG_PRINTF("PWM: %u Hz, %u bit, duty %u\n", state.pwmFrequency,
+                         state.pwmResolution, state.simDuty);
+            DEBUG_PRINTF("Fault: %s\n", fault);
+        }
+    }
+    else if (command.startsWith("on")) {
+        uint8_t ch = command.substring(2).toInt();
+        loadController.setSwitch(ch, true);
+        DEBUG_PRINTF("Channel %d ON\n", ch);
+    }
+    else if (command.startsWith("off")) {
+        uint8_t ch = command.substring(3).toInt();
+        loadController.setSwitch(ch, false);
+        DEBUG_PRINTF("Channel %d OFF\n", ch);
+    }
+    else if (command.startsWith("sim") && command.indexOf(' ') > 0) {
+        // simN XX
+        int space = command.indexOf(' ');
+        uint8_t ch = command.substring(3, space).toInt();
+        int value = command.substring(space + 1).toInt();
+        commandCoalescer.cancel(ch);
+        regulator.stop(ch);
+        loadController.setSimulator(ch, value);
+        DEBUG_PRINTF("Channel %d Simulator: %d%%\n", ch, value);
+    }
+    else if (command.startsWith("fade") && command.indexOf(' ') > 0) {
+        // fadeN XX MS
+        uint8_t ch = command.substring(4).toInt();
+        unsigned value = 0;
+        unsigned long duration = 0;
+        sscanf(command.c_str() + command.indexOf(' '), "%u %lu", &value, &duration);
+        commandCoalescer.cancel(ch);
+        regulator.stop(ch);
+        loadController.fadeSimulator(ch, value, duration);
+    }
+    else if (command.startsWith("pwm") && command.indexOf(' ') > 0) {
+        // pwmN FREQ [BITS]
+        uint8_t ch = command.substring(3).toInt();
+        unsigned long frequency = 0;
+        unsigned resolution = 0;
+        sscanf(command.c_str() + command.indexOf(' '), "%lu %u", &frequency, &resolution);
+        if (loadController.setPWMConfig(ch, frequency, resolution)) {
+            ChannelState state;
+            loadController.getChannelState(ch, state);
+            DEBUG_PRINTF("Channel %d PWM %lu Hz, %d bit\n", ch, frequency, state.pwmResolution);
+        } else {
+            DEBUG_PRINTF("Not supported (max %d bit at %lu Hz)\n",
+                         LoadController::maxPWMResolution(frequency), frequency);
+        }
+    }
+    else if (command.startsWith("reg")) {
+        // regN current|power X, regN off, reg = show all loops
+        uint8_t ch = command.substring(3).toInt();
+        char name[12] = "";
+        float setpoint = -1;
+        RegulationMode mode;
+        if (ch != 0 && command.indexOf(' ') > 0 &&
+            sscanf(command.c_str() + command.indexOf(' ') + 1, "%11s %f", name, &setpoint) >= 1) {
+            if (!parseRegulationMode(name, mode) || !regulator.start(ch, mode, setpoint)) {
+                DEBUG_PRINTLN("Usage: regN current|power X, regN off");
+            }
+        }
+        for (uint8_t i = 1; i <= NUM_CHANNELS; i++) {
+            RegulatorStatus st;
+            regulator.getStatus(i, st);
+            if (st.mode == REGULATION_OFF) {
+                DEBUG_PRINTF("CH%d: open loop\n", i);
+                continue;
+            }
+            DEBUG_PRINTF("CH%d: %s %.3f %s, measured %.4f, error %.4f (rms %.4f), "
+                         "overshoot %.4f, output %u.%u%%, settled %s (%lu ms)\n",
+                         i, regulationModeName(st.mode), st.setpoint, st.active ? "active" : "paused",
+                         st.measured, st.error, st.errorRms, st.overshoot,
+                         st.output / 10, st.output % 10, st.settled ? "yes" : "no",
+                         (unsigned long)st.settlingMs);
+        }
+    }
+    else if (command.startsWith("multi ")) {
+        // multi MASK STATES (e.g. "multi 0x3 0x1": CH1 ON, CH2 OFF together)
+        char* end = nullptr;
+        uint16_t mask = strtoul(command.c_str() + 6, &end, 0);
+        uint16_t states = strtoul(end, nullptr, 0);
+        uint16_t rejected = 0;
+        if (loadController.setSwitches(mask, states, &rejected)) {
+            DEBUG_PRINTF("Channels 0x%04X set to 0x%04X\n", mask, states & mask);
+        } else {
+            DEBUG_PRINTF("Rejected, bad channels: 0x%04X\n", rejected);
+        }
+    }
+    else if (command.startsWith("clear")) {
+        uint8_t ch = command.substring(5).toInt();
+        clearChannelFault(ch);
+        DEBUG_PRINTF("Channel %d fault cleared\n", ch);
     }
     else if (command == "scan") {
         DEBUG_PRINTLN("I2C Scanning...");
+        safetyMonitor.lockBus();
         for (uint8_t addr = 1; addr < 127; addr++) {
             Wire.beginTransmission(addr);
             if (Wire.endTransmission() == 0) {
                 DEBUG_PRINTF("Found device at 0x%02X\n", addr);
             }
         }
+        safetyMonitor.unlockBus();
         DEBUG_PRINTLN("Scan complete");
     }
+    else if (command == "safety") {
+        SafetyStats stats = safetyMonitor.getStats();
+        DEBUG_PRINTLN("\n--- Protection Task ---");
+        DEBUG_PRINTF("Period: %d ms\n", SAFETY_SAMPLE_PERIOD_MS);
+        DEBUG_PRINTF("Cycles: %u\n", stats.cycles);
+        DEBUG_PRINTF("Missed deadlines: %u\n", stats.missedDeadlines);
+        DEBUG_PRINTF("Max latency: %u us\n", stats.maxLatencyUs);
+        DEBUG_PRINTF("Max exec time: %u us\n", stats.maxExecUs);
+        DEBUG_PRINTF("Dropped events: %u\n", stats.droppedEvents);
+    }
+    else if (command.startsWith("inject") && command.indexOf(' ') > 0) {
+        // Fault injection: override measured current to exercise the trip path
+        // injectN X
+        int space = command.indexOf(' ');
+        uint8_t channel = command.substring(6, space).toInt();
+        String arg = command.substring(space + 1);
+        if (arg == "off") {
+            safetyMonitor.injectCurrent(channel, NAN);
+            DEBUG_PRINTF("Channel %d current injection stopped\n", channel);
+        } else {
+            float current = arg.toFloat();
+            safetyMonitor.injectCurrent(channel, current);
+            DEBUG_PRINTF("Channel %d current injected: %.2fA\n", channel, current);
+        }
+    }
+    else if (command == "log") {
+        DEBUG_PRINTLN("\n--- Event Log ---");
+        uint32_t next = eventLog.getNextSeq();
+        uint32_t from = (next > 10) ? next - 10 : 0;
+        for (uint32_t seq = max(from, eventLog.getOldestSeq()); seq < next; seq++) {
+            EventRecord record;
+            if (!eventLog.read(seq, record)) continue;
+            DEBUG_PRINTF("#%u %lu ms %s ch=%u code=%u value=%.3f\n", record.seq,
+                         (unsigned long)record.timestamp, eventTypeName(record.type),
+                         record.channel, record.code, record.value);
+        }
+    }
+    else if (command.startsWith("budget")) {
+        // budget [W]
+        if (command.length() > 7) {
+            safetyMonitor.setPowerBudget(command.substring(7).toFloat());
+        }
+        PowerBudgetStatus status = safetyMonitor.getBudgetStatus();
+        DEBUG_PRINTF("Power: %.2f W of %.1f W budget, shed mask 0x%04X\n",
+                     status.totalPower, status.budget, status.shedMask);
+    }
+    else if (command.startsWith("restore")) {
+        // restore [last|off|default [MASK]]
+        char name[16] = "";
+        unsigned mask = loadController.getDefaultMask();
+        RestorePolicy policy;
+        if (sscanf(command.c_str() + 7, "%15s %i", name, &mask) >= 1) {
+            if (parseRestorePolicy(name, policy) && loadController.setRestorePolicy(policy, mask)) {
+                eventLog.append(EVENT_CONFIG, 0, CONFIG_ITEM_RESTORE_POLICY, policy);
+            } else {
+                DEBUG_PRINTLN("Usage: restore [last|off|default [MASK]]");
+            }
+        }
+        DEBUG_PRINTF("Restore policy: %s, defaults 0x%04X, booted from: %s\n",
+                     restorePolicyName(loadController.getRestorePolicy()),
+                     loadController.getDefaultMask(), loadController.getRestoreSource());
+    }
+    else if (command.startsWith("telefmt")) {
+        // telefmt [json|binary|both]
+        if (command.length() > 8) {
+            TelemetryFormat format;
+            if (parseTelemetryFormat(command.substring(8).c_str(), format) && mqtt.setTelemetryFormat(format)) {
+                eventLog.append(EVENT_CONFIG, 0, CONFIG_ITEM_TELEMETRY_FORMAT, format);
+            } else {
+                DEBUG_PRINTLN("Usage: telefmt [json|binary|both]");
+            }
+        }
+        DEBUG_PRINTF("Telemetry format: %s\n", telemetryFormatName(mqtt.getTelemetryFormat()));
+    }
+    else if (command.startsWith("batch")) {
+        // batch [off | SIZE [INTERVAL [LATENCY]]]
+        TelemetryBatchConfig config = telemetryBatcher.getConfig();
+        unsigned size = config.size, interval = config.sampleInterval, latency = config.maxLatency;
+        if (command == "batch off") {
+            config.enabled = false;
+            telemetryBatcher.configure(config);
+        } else if (sscanf(command.c_str() + 5, "%u %u %u", &size, &interval, &latency) >= 1) {
+            config.enabled = true;
+            config.size = min(size, 255U);
+            config.sampleInterval = min(interval, 65535U);
+            config.maxLatency = min(latency, 65535U);
+            if (!telemetryBatcher.configure(config)) {
+                DEBUG_PRINTF("Usage: batch [off | SIZE(1-%u) [INTERVAL(>=%u ms) [LATENCY(>=INTERVAL)]]]\n",
+                             TELEMETRY_BATCH_MAX_SAMPLES, TELEMETRY_BATCH_MIN_SAMPLE_MS);
+            }
+        }
+        config = telemetryBatcher.getConfig();
+        DEBUG_PRINTF("Telemetry batch: %s, %u samples every %u ms, max latency %u ms, %u buffered\n",
+                     config.enabled ? "on" : "off", config.size, config.sampleInterval,
+                     config.maxLatency, telemetryBatcher.getCount());
+    }
+    else if (command == "pubq") {
+        DEBUG_PRINTF("\n--- Publish Queue (budget %d B) ---\n", mqtt.getPublishTokens());
+        for (uint8_t p = 0; p < PUBLISH_PRIORITY_COUNT; p++) {
+            PublishClassStats stats = mqtt.getPublishStats((PublishPriority)p);
+            DEBUG_PRINTF("%-9s %2u queued %4u/%u B, sent %u, superseded %u, full %u, stale %u, failed %u\n",
+                         publishPriorityName((PublishPriority)p), stats.depth, stats.bytes, stats.capacity,
+                         stats.sent, stats.superseded, stats.droppedFull, stats.droppedStale, stats.failed);
+        }
+    }
+    else if (command == "mqtt") {
+        MqttClientStats stats = mqtt.getClientStats();
+        DEBUG_PRINTF("MQTT %s: %u attempts, %u connects, %u DNS cache hits, last error %d, "
+                     "backoff %u ms, %u B unsent\n",
+                     mqttStateName(mqtt.getClientState()), stats.attempts, stats.connects,
+                     stats.dnsCacheHits, stats.lastError, stats.backoffMs, stats.txQueued);
+        DEBUG_PRINTF("QoS 1: %u in flight, %u acked, %u resent, %u given up, "
+                     "ack RTT last %u / avg %u / max %u ms\n",
+                     stats.inFlight, stats.acked, stats.resent, stats.expired,
+                     stats.rttLast, stats.rttAverage, stats.rttMax);
+        DEBUG_PRINTF("Protocol %s: %u/%u topic aliases, %u refused by broker, %u published, "
+                     "%u B/msg (as 3.1.1: %u B/msg)\n",
+                     stats.protocol == 5 ? "MQTT 5" : "3.1.1", stats.aliases, stats.aliasMax,
+                     stats.refused, stats.published,
+                     stats.published ? stats.publishBytes / stats.published : 0,
+                     stats.published ? stats.publishBytesV311 / stats.published : 0);
+#if MQTT_USE_TLS
+        TlsStats tls = mqtt.getTlsStats();
+        DEBUG_PRINTF("TLS full: %u, last %u / avg %u ms, heap %u / max %u B\n",
+                     tls.full.count, tls.full.lastMs, tls.full.averageMs,
+                     tls.full.lastHeap, tls.full.maxHeap);
+        DEBUG_PRINTF("TLS resumed: %u, last %u / avg %u ms, heap %u / max %u B\n",
+                     tls.resumed.count, tls.resumed.lastMs, tls.resumed.averageMs,
+                     tls.resumed.lastHeap, tls.resumed.maxHeap);
+        DEBUG_PRINTF("TLS: %u failed (last -0x%04x), session %s\n", tls.failures, -tls.lastError,
+                     !tls.sessionCached ? "none" : tls.sessionFromRtc ? "cached (from RTC)" : "cached");
+#endif
+    }
+    else if (command == "mqtt reconnect") {
+        // Drop and reconnect at once, e.g. to measure a resumed TLS handshake
+        DEBUG_PRINTLN("MQTT reconnecting...");
+        mqtt.disconnect();
+    }
+    else if (command == "time") {
+        TimeSyncStats sync = timeBase.getStats();
+        uint64_t nowUs = timeBase.nowUs();
+        DEBUG_PRINTF("Time %s: %u syncs (%u stepped), last offset %d us, drift %d ppb, "
+                     "last sync %u s ago\n",
+                     timeSyncStateName(sync.state), sync.syncs, sync.steps, sync.lastOffsetUs,
+                     sync.driftPpb, sync.sinceSync);
+        DEBUG_PRINTF("Unix time: %llu.%06llu\n", nowUs / 1000000, nowUs % 1000000);
+    }
+    else if (command == "store") {
+        TelemetryStoreStatus status = telemetryStore.getStatus();
+        DEBUG_PRINTF("Telemetry store: %u waiting (%u RAM, %u/%u flash), %u buffered, %u replayed, %u dropped\n",
+                     status.ramPending + status.flashPending, status.ramPending, status.flashPending,
+                     status.flashCapacity, status.stored, status.replayed, status.dropped);
+    }
+    else if (command.startsWith("bench")) {
+        // bench [N]
+        long iterations = (command.length() > 6) ? command.substring(6).toInt() : BENCH_DEFAULT_ITERATIONS;
+        runTelemetryBenchmark(constrain(iterations, 1L, (long)BENCH_MAX_ITERATIONS));
+        runPublishSizeBenchmark();
+    }
+    else if (command == "id" || command.startsWith("id ")) {
+        // id [set ID | clear]
+        char action[8] = "";
+        char id[DEVICE_ID_MAX_LENGTH + 2] = "";
+        int fields = sscanf(command.c_str() + 2, "%7s %33s", action, id);
+        if (fields >= 1) {
+            bool ok;
+            if (strcmp(action, "set") == 0 && fields == 2) {
+                ok = deviceIdentity.setId(id);
+            } else if (strcmp(action, "clear") == 0) {
+                ok = deviceIdentity.setId(nullptr);
+            } else {
+                ok = false;
+            }
+            if (ok) {
+                DEBUG_PRINTLN("Device ID stored - takes effect after restart");
+            } else {
+                DEBUG_PRINTF("Usage: id [set ID | clear] (ID: 1-%u of a-z A-Z 0-9 - _)\n",
+                             DEVICE_ID_MAX_LENGTH);
+            }
+        }
+        DEBUG_PRINTF("Device ID: %s (%s), topics %s/..., %u B topic arena\n", deviceIdentity.id(),
+                     deviceIdSourceName(deviceIdentity.getSource()), deviceIdentity.baseTopic(),
+                     deviceIdentity.arenaUsed());
+    }
     else if (command == "restart") {
         DEBUG_PRINTLN("Restarting...");
         ESP.restart();
@@ -506,13 +1549,29 @@ void handleSerialCommands() {
     else if (command == "help") {
         DEBUG_PRINTLN("\n--- Available Commands ---");
         DEBUG_PRINTLN("status   - Show system status");
-        DEBUG_PRINTLN("on1/off1 - Turn channel 1 ON/OFF");
-        DEBUG_PRINTLN("on2/off2 - Turn channel 2 ON/OFF");
-        DEBUG_PRINTLN("sim1 XX  - Set channel 1 simulator (0-100)");
-        DEBUG_PRINTLN("sim2 XX  - Set channel 2 simulator (0-100)");
-        DEBUG_PRINTLN("clear1   - Clear channel 1 fault");
-        DEBUG_PRINTLN("clear2   - Clear channel 2 fault");
+        DEBUG_PRINTLN("onN/offN - Turn channel N ON/OFF");
+        DEBUG_PRINTLN("simN XX  - Set channel N simulator (0-100)");
+        DEBUG_PRINTLN("fadeN XX MS - Fade channel N simulator to XX% over MS ms");
+        DEBUG_PRINTLN("pwmN F [B] - Set channel N simulator PWM to F Hz, B bit (0 = max)");
+        DEBUG_PRINTLN("regN M X - Regulate channel N: current A / power W / off");
+        DEBUG_PRINTLN("reg      - Show regulation loops");
+        DEBUG_PRINTLN("multi M S - Switch channels in mask M to states S at once");
+        DEBUG_PRINTLN("clearN   - Clear channel N fault");
         DEBUG_PRINTLN("scan     - Scan I2C bus");
+        DEBUG_PRINTLN("safety   - Show protection task timing");
+        DEBUG_PRINTLN("log      - Show last 10 event log records");
+        DEBUG_PRINTLN("injectN X - Inject X amps on channel N (off = stop)");
+        DEBUG_PRINTLN("budget [W] - Show/set total power budget (0 = off)");
+        DEBUG_PRINTLN("restore [P [M]] - Show/set boot restore policy (last|off|default)");
+        DEBUG_PRINTLN("telefmt [F] - Show/set telemetry format (json|binary|both)");
+        DEBUG_PRINTLN("batch [S [I [L]]] - Batch S samples every I ms, max latency L ms (off = stop)");
+        DEBUG_PRINTLN("pubq     - Show publish queue depth and drop counters");
+        DEBUG_PRINTLN("mqtt     - Show broker connection, protocol and retry counters");
+        DEBUG_PRINTLN("mqtt reconnect - Drop and reopen the broker connection");
+        DEBUG_PRINTLN("time     - Show SNTP sync quality and drift estimate");
+        DEBUG_PRINTLN("store    - Show telemetry buffered during broker outages");
+        DEBUG_PRINTLN("bench [N] - Benchmark telemetry serializers (N messages) and MQTT message sizes");
+        DEBUG_PRINTLN("id [set ID|clear] - Show/provision the device ID (after restart)");
         DEBUG_PRINTLN("restart  - Restart ESP32");
         DEBUG_PRINTLN("help     - Show this help");
     }
@@ -0,0 +1,118 @@
+"""
+Kiểm tra Device ID lúc chạy (DeviceIdentity) qua Serial.
+
+Script điều khiển ESP32 bằng lệnh `id` và `restart`:
+  1. `id`                      -> ID hiện tại từ config (DEVICE_ID) hoặc từ
+                                  MAC (DEVICE_ID_PREFIX + 12 chữ số hex)
+  2. `id set` ID 33 ký tự, ID có '/', '+', '#'
+                               -> bị từ chối (in Usage)
+  3. `id set` ID 32 ký tự, `restart`
+                               -> ID lấy từ NVS, topic devices/<ID>/...
+  4. `id clear`, `restart`     -> về lại ID của bước 1
+Mã thoát 0 = đạt, 1 = lỗi, 2 = không đọc được ID.
+
+Cách dùng: python test_identity.py [COM4]
+"""
+
+import re
+import sys
+import time
+
+import serial
+
+PORT = sys.argv[1] if len(sys.argv) > 1 else 'COM4'
+BAUDRATE = 115200
+MAX_LENGTH = 32             # DEVICE_ID_MAX_LENGTH
+MAC_PREFIX = 'pm-'          # DEVICE_ID_PREFIX
+REPLY_TIMEOUT = 1.5         # Giây chờ output của một lệnh
+BOOT_TIME = 8               # Giây chờ khởi động lại
+
+ID_LINE = r'^Device ID: (\S+) \((\w+)\), topics (\S+)/\.\.\., (\d+) B topic arena'
+
+
+def send(ser, command, timeout=REPLY_TIMEOUT):
+    """Gửi một lệnh, trả về các dòng nhận được"""
+    ser.reset_input_buffer()
+    ser.write((command + '\n').encode())
+    lines = []
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        line = ser.readline().decode('utf-8', errors='ignore').strip()
+        if line:
+            lines.append(line)
+    return lines
+
+
+def read_id(lines):
+    """(id, nguồn, topic gốc) từ output lệnh `id`, None nếu không có"""
+    for line in lines:
+        match = re.search(ID_LINE, line)
+        if match:
+            return match.group(1), match.group(2), match.group(3)
+    return None
+
+
+def restart(ser):
+    send(ser, 'restart', timeout=BOOT_TIME)
+    return read_id(send(ser, 'id'))
+
+
+def main():
+    print(f"Đang kết nối tới {PORT}...")
+    ser = serial.Serial(PORT, BAUDRATE, timeout=0.1)
+    time.sleep(2)  # Đợi ESP32 khởi động
+    failures = []
+
+    try:
+        original = read_id(send(ser, 'id'))
+        if original is None:
+            print("❌ Không đọc được Device ID (lệnh id)")
+            return 2
+        if original[1] == 'nvs':
+            print("ID đang lấy từ NVS - xoá trước để kiểm tra nguồn config/MAC")
+            send(ser, 'id clear')
+            original = restart(ser)
+            if original is None or original[1] == 'nvs':
+                print("❌ Không xoá được ID trong NVS")
+                return 1
+        device_id, source, base = original
+        print(f"✓ ID ban đầu: {device_id} (nguồn {source})")
+        if source == 'mac' and not re.fullmatch(re.escape(MAC_PREFIX) + r'[0-9a-f]{12}', device_id):
+            failures.append(f"ID từ MAC sai dạng: {device_id}")
+        if base != f'devices/{device_id}':
+            failures.append(f"topic gốc {base} không khớp ID")
+
+        for bad in ('x' * (MAX_LENGTH + 1), 'bad/id', 'bad+id', 'bad#id'):
+            if not any(line.startswith('Usage: id') for line in send(ser, f'id set {bad}')):
+                failures.append(f"ID không hợp lệ được chấp nhận: {bad}")
+        if not failures:
+            print("✓ ID quá dài và ID có '/', '+', '#' bị từ chối")
+
+        provisioned = 'Test-ID_' + 'a' * (MAX_LENGTH - 8)
+        if not any('Device ID stored' in line for line in send(ser, f'id set {provisioned}')):
+            failures.append(f"không lưu được ID {MAX_LENGTH} ký tự")
+        current = restart(ser)
+        if current != (provisioned, 'nvs', f'devices/{provisioned}'):
+            failures.append(f"sau restart mong đợi {provisioned} từ NVS, nhận {current}")
+        else:
+            print(f"✓ ID {MAX_LENGTH} ký tự từ NVS sau restart, topic devices/{provisioned}/...")
+
+        send(ser, 'id clear')
+        current = restart(ser)
+        if current is None or current[:2] != (device_id, source):
+            failures.append(f"sau id clear mong đợi {device_id} ({source}), nhận {current}")
+        else:
+            print(f"✓ id clear trả về {device_id} ({source})")
+    finally:
+        ser.close()
+
+    if failures:
+        for failure in failures:
+            print(f"❌ {failure}")
+        return 1
+    print("✅ ĐẠT - Device ID từ NVS/config/MAC hoạt động")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
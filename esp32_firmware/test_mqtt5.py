@@ -0,0 +1,313 @@
+"""
+Kiểm tra MQTT 5 của ESP32 bằng một broker giả lập trên máy tính.
+
+Trước khi chạy: nạp firmware với MQTT_BROKER = IP của máy tính này,
+MQTT_PORT = cổng dưới đây (mặc định 1883) và MQTT_USE_TLS = 0, rồi chạy
+script và reset ESP32. Không cần broker thật (tắt mosquitto nếu đang chiếm
+cổng).
+
+Kết nối 1 - nhận MQTT 5, CONNACK có giới hạn:
+  Topic Alias Maximum 4, Receive Maximum 5, Server Keep Alive 10s,
+  Maximum QoS 0, Retain Available 0
+  -> CONNECT level 5, topic alias được gán rồi dùng lại (topic rỗng),
+     không quá 4 alias, mọi PUBLISH QoS 0 và không có cờ retain,
+     telemetry có Message Expiry, PINGREQ sau ~10s (không phải 60s)
+Kết nối 2 - từ chối MQTT 5 (reason 0x84)
+  -> thử lại ngay bằng 3.1.1, PUBLISH có topic đầy đủ
+
+Mã thoát 0 = đạt, 1 = lỗi.
+
+Cách dùng: python test_mqtt5.py [PORT]
+"""
+
+import socket
+import struct
+import sys
+import time
+
+PORT = int(sys.argv[1]) if len(sys.argv) > 1 else 1883
+ALIAS_MAX = 4
+SERVER_KEEP_ALIVE = 10      # Giây, thay cho MQTT_KEEPALIVE (60s) của thiết bị
+OBSERVE_TIME = 25           # Giây quan sát kết nối 1
+CONNECT_TIMEOUT = 60        # Giây chờ ESP32 kết nối
+
+PROP_MESSAGE_EXPIRY = 0x02
+PROP_TOPIC_ALIAS = 0x23
+
+# Kích thước giá trị của các property MQTT 5 (None = chuỗi/binary có độ dài)
+PROPERTY_SIZES = {
+    0x01: 1, 0x02: 4, 0x03: None, 0x08: None, 0x09: None, 0x11: 4, 0x12: None,
+    0x13: 2, 0x15: None, 0x16: None, 0x17: 1, 0x18: 4, 0x19: 1, 0x1A: None,
+    0x1C: None, 0x1F: None, 0x21: 2, 0x22: 2, 0x23: 2, 0x24: 1, 0x25: 1,
+    0x27: 4, 0x28: 1, 0x29: 1, 0x2A: 1,
+}
+
+
+def read_varint(data, i):
+    value, shift = 0, 0
+    while True:
+        byte = data[i]
+        i += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, i
+
+
+def encode_varint(value):
+    out = b''
+    while True:
+        byte = value % 128
+        value //= 128
+        if value:
+            byte |= 0x80
+        out += bytes([byte])
+        if not value:
+            return out
+
+
+def packet(header, body):
+    return bytes([header]) + encode_varint(len(body)) + body
+
+
+def parse_properties(data, i):
+    """Đọc khối property, trả về ({id: giá trị thô}, vị trí sau khối)"""
+    length, i = read_varint(data, i)
+    end = i + length
+    props = {}
+    while i < end:
+        pid = data[i]
+        i += 1
+        if pid == 0x0B:
+            value, i = read_varint(data, i)
+        elif pid == 0x26:
+            for _ in range(2):
+                i += 2 + struct.unpack('>H', data[i:i + 2])[0]
+            continue
+        else:
+            size = PROPERTY_SIZES[pid]
+            if size is None:
+                size = 2 + struct.unpack('>H', data[i:i + 2])[0]
+            value = data[i:i + size]
+            i += size
+        props[pid] = value
+    return props, end
+
+
+class Connection:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buffer = b''
+
+    def receive(self, timeout):
+        """Một gói (header, body), None nếu hết giờ, False nếu đã đóng"""
+        self.sock.settimeout(timeout)
+        deadline = time.time() + timeout
+        while True:
+            if len(self.buffer) >= 2:
+                try:
+                    length, i = read_varint(self.buffer, 1)
+                    if len(self.buffer) >= i + length:
+                        header, body = self.buffer[0], self.buffer[i:i + length]
+                        self.buffer = self.buffer[i + length:]
+                        return header, body
+                except IndexError:
+                    pass
+            remaining = deadline - time.time()
+            if remaining <= 0:
+                return None
+            self.sock.settimeout(remaining)
+            try:
+                data = self.sock.recv(4096)
+            except socket.timeout:
+                return None
+            if not data:
+                return False
+            self.buffer += data
+
+    def send(self, data):
+        self.sock.sendall(data)
+
+
+def accept(server):
+    server.settimeout(CONNECT_TIMEOUT)
+    sock, address = server.accept()
+    connection = Connection(sock)
+    result = connection.receive(10)
+    if not result or result[0] & 0xF0 != 0x10:
+        raise RuntimeError("không nhận được CONNECT")
+    level = result[1][6]
+    print(f"  CONNECT từ {address[0]}, protocol level {level}")
+    return connection, level
+
+
+def observe_v5(connection, failures):
+    """Kết nối 1: CONNACK có giới hạn, quan sát các gói gửi lên"""
+    props = bytes([0x22, 0, ALIAS_MAX, 0x21, 0, 5, 0x13]) + struct.pack('>H', SERVER_KEEP_ALIVE) + \
+        bytes([0x24, 0, 0x25, 0])
+    connection.send(packet(0x20, bytes([0, 0]) + encode_varint(len(props)) + props))
+    connected_at = time.time()
+
+    aliases = {}
+    reused = set()
+    publishes = 0
+    expiring = 0
+    first_ping = None
+    deadline = connected_at + OBSERVE_TIME
+
+    while time.time() < deadline:
+        result = connection.receive(deadline - time.time())
+        if result is None:
+            break
+        if result is False:
+            failures.append("ESP32 đóng kết nối MQTT 5")
+            return
+        header, body = result
+        kind = header & 0xF0
+
+        if kind == 0x30:
+            qos, retain = (header >> 1) & 0x03, header & 0x01
+            topic_length = struct.unpack('>H', body[:2])[0]
+            topic = body[2:2 + topic_length].decode()
+            i = 2 + topic_length
+            if qos:
+                packet_id = body[i:i + 2]
+                i += 2
+                connection.send(packet(0x40, packet_id))
+            props, i = parse_properties(body, i)
+            publishes += 1
+
+            if qos != 0:
+                failures.append(f"PUBLISH QoS {qos} dù Maximum QoS = 0 ({topic})")
+            if retain:
+                failures.append(f"PUBLISH có cờ retain dù Retain Available = 0 ({topic})")
+
+            alias = props.get(PROP_TOPIC_ALIAS)
+            if alias is not None:
+                alias = struct.unpack('>H', alias)[0]
+                if alias > ALIAS_MAX:
+                    failures.append(f"alias {alias} vượt Topic Alias Maximum {ALIAS_MAX}")
+                if topic:
+                    aliases[alias] = topic
+                elif alias in aliases:
+                    reused.add(aliases[alias])
+                    topic = aliases[alias]
+                else:
+                    failures.append(f"alias {alias} dùng trước khi được gán")
+            elif not topic:
+                failures.append("PUBLISH không có topic lẫn alias")
+
+            if topic.endswith('/telemetry') or topic.endswith('/telemetry/bin'):
+                if PROP_MESSAGE_EXPIRY in props:
+                    expiring += 1
+        elif kind == 0x80:
+            # SUBSCRIBE: một granted QoS 0 cho mỗi filter
+            packet_id = body[:2]
+            props, i = parse_properties(body, 2)
+            filters = 0
+            while i < len(body):
+                i += 2 + struct.unpack('>H', body[i:i + 2])[0] + 1
+                filters += 1
+            connection.send(packet(0x90, packet_id + b'\x00' + bytes(filters)))
+        elif kind == 0xC0:
+            if first_ping is None:
+                first_ping = time.time() - connected_at
+            connection.send(bytes([0xD0, 0]))
+        elif kind == 0xE0:
+            failures.append("ESP32 gửi DISCONNECT")
+            return
+
+    print(f"  {publishes} PUBLISH, alias {sorted(aliases)}, dùng lại alias cho {len(reused)} topic, "
+          f"{expiring} telemetry có Message Expiry")
+    if publishes == 0:
+        failures.append("không có PUBLISH nào")
+    if not reused:
+        failures.append("không có topic nào được gửi lại bằng alias")
+    if expiring == 0:
+        failures.append("telemetry không có Message Expiry")
+    if first_ping is None:
+        failures.append(f"không có PINGREQ trong {OBSERVE_TIME}s (Server Keep Alive {SERVER_KEEP_ALIVE}s)")
+    else:
+        print(f"  PINGREQ đầu tiên sau {first_ping:.1f}s")
+        if first_ping > SERVER_KEEP_ALIVE * 1.5 + 1:
+            failures.append(f"PINGREQ sau {first_ping:.0f}s, Server Keep Alive không được dùng")
+
+
+def observe_fallback(server, failures):
+    """Kết nối 2: từ chối MQTT 5, thiết bị phải thử lại ngay bằng 3.1.1"""
+    connection, level = accept(server)
+    if level != 5:
+        failures.append(f"lần kết nối lại dùng level {level}, mong đợi 5")
+    # CONNACK MQTT 5: reason 0x84 Unsupported Protocol Version, không property
+    connection.send(packet(0x20, bytes([0, 0x84, 0])))
+    refused_at = time.time()
+    connection.sock.close()
+
+    connection, level = accept(server)
+    delay = time.time() - refused_at
+    if level != 4:
+        failures.append(f"sau khi bị từ chối MQTT 5 vẫn dùng level {level}")
+        return
+    print(f"  Chuyển sang 3.1.1 sau {delay:.1f}s")
+    if delay > 5:
+        failures.append(f"chuyển sang 3.1.1 chậm ({delay:.0f}s)")
+    connection.send(packet(0x20, bytes([0, 0])))
+
+    deadline = time.time() + 10
+    while time.time() < deadline:
+        result = connection.receive(deadline - time.time())
+        if not result:
+            break
+        header, body = result
+        if header & 0xF0 == 0x80:
+            filters = 0
+            i = 2
+            while i < len(body):
+                i += 2 + struct.unpack('>H', body[i:i + 2])[0] + 1
+                filters += 1
+            connection.send(packet(0x90, body[:2] + bytes(filters)))
+        elif header & 0xF0 == 0x30:
+            topic_length = struct.unpack('>H', body[:2])[0]
+            if topic_length == 0:
+                failures.append("PUBLISH 3.1.1 không có topic")
+            else:
+                print(f"  PUBLISH 3.1.1: {body[2:2 + topic_length].decode()}")
+            connection.sock.close()
+            return
+    failures.append("không có PUBLISH nào qua 3.1.1")
+    connection.sock.close()
+
+
+def main():
+    server = socket.socket()
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(('0.0.0.0', PORT))
+    server.listen(2)
+    print(f"Broker giả lập đang chờ ESP32 ở cổng {PORT} (reset ESP32 nếu cần)...")
+    failures = []
+
+    try:
+        print("Kết nối 1: MQTT 5 với giới hạn trong CONNACK")
+        connection, level = accept(server)
+        if level != 5:
+            failures.append(f"CONNECT đầu tiên dùng level {level}, mong đợi 5")
+        observe_v5(connection, failures)
+        connection.sock.close()
+
+        print("Kết nối 2: từ chối MQTT 5")
+        observe_fallback(server, failures)
+    except (socket.timeout, RuntimeError) as e:
+        failures.append(f"ESP32 không kết nối: {e}")
+    finally:
+        server.close()
+
+    if failures:
+        for failure in failures:
+            print(f"❌ {failure}")
+        return 1
+    print("✅ ĐẠT - MQTT 5 và chuyển về 3.1.1 hoạt động")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,142 @@
+"""
+Kiểm tra ngắt quá dòng khi không có broker MQTT.
+
+Trước khi chạy: dừng broker (hoặc nạp firmware với MQTT_BROKER trỏ tới một
+địa chỉ không tồn tại) để ESP32 đang thử kết nối lại trong suốt bài kiểm tra.
+
+Script điều khiển ESP32 qua Serial:
+  1. `status`      -> phải thấy "MQTT: Disconnected"
+  2. `on1`, `inject1 5`
+                   -> phải thấy "OVERCURRENT on Channel 1" trong TRIP_TIMEOUT
+  3. `inject1 off`, `status` -> kênh 1 "Switch: OFF", MQTT vẫn Disconnected
+  4. `log`         -> có bản ghi TRIP ch=1 mới
+  5. `safety`      -> "Missed deadlines" không tăng
+Cuối cùng `clear1` để xoá lỗi. Mã thoát 0 = đạt, 1 = lỗi, 2 = sai điều kiện.
+
+Cách dùng: python test_trip_offline.py [COM4]
+"""
+
+import re
+import sys
+import time
+
+import serial
+
+PORT = sys.argv[1] if len(sys.argv) > 1 else 'COM4'
+BAUDRATE = 115200
+CHANNEL = 1
+INJECT_CURRENT = 5.0
+TRIP_TIMEOUT = 1.0      # Giây - task bảo vệ chạy mỗi 10ms, ngắt sau ~100ms
+REPLY_TIMEOUT = 1.5     # Giây chờ hết output của một lệnh
+
+
+def send(ser, command, timeout=REPLY_TIMEOUT, until=None):
+    """Gửi một lệnh, trả về các dòng nhận được (dừng sớm khi khớp `until`)"""
+    ser.reset_input_buffer()
+    ser.write((command + '\n').encode())
+    lines = []
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        line = ser.readline().decode('utf-8', errors='ignore').strip()
+        if not line:
+            continue
+        lines.append(line)
+        if until and re.search(until, line):
+            break
+    return lines
+
+
+def find(lines, pattern):
+    for line in lines:
+        match = re.search(pattern, line)
+        if match:
+            return match
+    return None
+
+
+def channel_section(lines, channel):
+    """Các dòng của mục '--- Channel N ---' trong output `status`"""
+    section = []
+    inside = False
+    for line in lines:
+        if line.startswith('--- Channel'):
+            inside = line == f'--- Channel {channel} ---'
+        elif inside:
+            section.append(line)
+    return section
+
+
+def trip_records(lines, channel):
+    """Số thứ tự các bản ghi TRIP của kênh trong output `log`"""
+    return {int(m.group(1)) for m in
+            (re.search(rf'^#(\d+) \d+ ms TRIP ch={channel} ', l) for l in lines) if m}
+
+
+def missed_deadlines(lines):
+    match = find(lines, r'Missed deadlines: (\d+)')
+    return int(match.group(1)) if match else None
+
+
+def main():
+    print(f"Đang kết nối tới {PORT}...")
+    ser = serial.Serial(PORT, BAUDRATE, timeout=0.1)
+    time.sleep(2)  # Đợi ESP32 khởi động
+    failures = []
+
+    try:
+        status = send(ser, 'status')
+        if not find(status, r'^MQTT: Disconnected'):
+            print("❌ MQTT đang kết nối - hãy dừng broker rồi chạy lại")
+            return 2
+
+        trips_before = trip_records(send(ser, 'log'), CHANNEL)
+        missed_before = missed_deadlines(send(ser, 'safety'))
+        if missed_before is None:
+            print("❌ Không đọc được thống kê task bảo vệ (lệnh safety)")
+            return 2
+
+        send(ser, f'on{CHANNEL}')
+        print(f"✓ Kênh {CHANNEL} bật, MQTT mất kết nối - bơm {INJECT_CURRENT}A")
+        start = time.time()
+        lines = send(ser, f'inject{CHANNEL} {INJECT_CURRENT}', timeout=TRIP_TIMEOUT,
+                     until=rf'OVERCURRENT on Channel {CHANNEL}')
+        elapsed = (time.time() - start) * 1000
+        send(ser, f'inject{CHANNEL} off')
+
+        if find(lines, rf'OVERCURRENT on Channel {CHANNEL}'):
+            print(f"✓ Ngắt quá dòng sau {elapsed:.0f}ms")
+        else:
+            failures.append(f"không ngắt trong {TRIP_TIMEOUT}s")
+
+        status = send(ser, 'status')
+        if not find(channel_section(status, CHANNEL), r'^Switch: OFF'):
+            failures.append(f"kênh {CHANNEL} vẫn bật")
+        if not find(status, r'^MQTT: Disconnected'):
+            failures.append("MQTT đã kết nối lại trong lúc kiểm tra")
+
+        new_trips = trip_records(send(ser, 'log'), CHANNEL) - trips_before
+        if new_trips:
+            print(f"✓ Event log: TRIP #{max(new_trips)}")
+        else:
+            failures.append("không có bản ghi TRIP mới trong event log")
+
+        missed = missed_deadlines(send(ser, 'safety'))
+        if missed is None or missed > missed_before:
+            failures.append(f"task bảo vệ trễ hạn ({missed_before} -> {missed})")
+        else:
+            print("✓ Missed deadlines không đổi")
+
+        send(ser, f'clear{CHANNEL}')
+    finally:
+        ser.close()
+
+    if failures:
+        for failure in failures:
+            print(f"❌ {failure}")
+        return 1
+    print("✅ ĐẠT - ngắt hoạt động khi không có broker")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())